@@ -1,6 +1,6 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
@@ -17,79 +17,292 @@
 // * B_VALID: the buffer data has been read from the disk.
 // * B_DIRTY: the buffer data has been modified
 //     and needs to be written to disk.
+//
+// Each buffer sits on the LRU list of the hash bucket of its
+// (dev, blockno), protected by that bucket's lock, so lookups of
+// different blocks rarely contend.  A miss recycles an unused buffer
+// of its own bucket if it can, and otherwise steals the least
+// recently used one of another bucket.  Only one CPU steals at a
+// time (bcache.lock), which is what makes holding two bucket locks
+// at once safe.
+//
+// NBUF buffers are allocated statically.  While the cache is below
+// NBUFMAX buffers, a miss that would have to evict a cached block
+// instead takes a page from kalloc() and carves it into new buffers;
+// when kalloc() runs out of memory it calls bshrink() to give back
+// a page whose buffers are all idle.
 
 #include "types.h"
 #include "defs.h"
 #include "param.h"
+#include "mmu.h"
 #include "spinlock.h"
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "kstat.h"
 
-struct {
-  struct spinlock lock;
-  struct buf buf[NBUF];
+#define KLOG_SUBSYS KLOG_SS_FS
+#include "klog.h"
+
+#define NBUCKET 13
 
-  // Linked list of all buffers, through prev/next.
+struct bucket {
+  struct spinlock lock;
+  // Buffers of this bucket, through prev/next.
   // head.next is most recently used.
   struct buf head;
+};
+
+#define BPERPAGE (PGSIZE / sizeof(struct buf))
+#define NBUFPAGE ((NBUFMAX - NBUF + BPERPAGE - 1) / BPERPAGE)
+
+struct {
+  struct spinlock lock;   // Serializes stealing, growing, shrinking
+  struct buf buf[NBUF];
+  struct bucket bucket[NBUCKET];
+  struct buf *page[NBUFPAGE];  // Pages of buffers added by bgrow()
+  int npage;
 } bcache;
 
+// Per-CPU counters for kstat(KSTAT_BIO), updated under a bucket
+// lock with interrupts off, so on the CPU they belong to.
+static struct kstat_bcpu bstat[NCPU];
+
+static struct bucket*
+hash(uint dev, uint blockno)
+{
+  return &bcache.bucket[(dev * 31 + blockno) % NBUCKET];
+}
+
+static void
+unlink(struct buf *b)
+{
+  b->next->prev = b->prev;
+  b->prev->next = b->next;
+}
+
+// Put b at the most recently used end of bk.
+static void
+push(struct bucket *bk, struct buf *b)
+{
+  b->next = bk->head.next;
+  b->prev = &bk->head;
+  bk->head.next->prev = b;
+  bk->head.next = b;
+}
+
+// Put b at the least recently used end of bk, to be reused first.
+static void
+pushlru(struct bucket *bk, struct buf *b)
+{
+  b->prev = bk->head.prev;
+  b->next = &bk->head;
+  bk->head.prev->next = b;
+  bk->head.prev = b;
+}
+
+// Add a page of new buffers to bk.  Caller holds bcache.lock and
+// bk->lock.  Returns 0 if the cache is at NBUFMAX or out of memory.
+static int
+bgrow(struct bucket *bk)
+{
+  struct buf *p, *b;
+
+  if(bcache.npage == NBUFPAGE)
+    return 0;
+  if((p = (struct buf*)kalloc_noreclaim()) == 0)
+    return 0;
+  memset(p, 0, PGSIZE);
+  for(b = p; b < p + BPERPAGE; b++){
+    initsleeplock(&b->lock, "buffer");
+    pushlru(bk, b);
+  }
+  bcache.page[bcache.npage++] = p;
+  return 1;
+}
+
+// Free a page of buffers none of which is in use; called by
+// kalloc() when memory runs out.  Returns 0 if there is none.
+int
+bshrink(void)
+{
+  struct bucket *bk;
+  struct buf *p, *b;
+  int i;
+
+  if(bcache.npage == 0)
+    return 0;
+  acquire(&bcache.lock);
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++)
+    acquire(&bk->lock);
+
+  p = 0;
+  for(i = 0; i < bcache.npage && p == 0; i++){
+    p = bcache.page[i];
+    for(b = p; b < p + BPERPAGE; b++)
+      if(b->refcnt != 0 || (b->flags & B_DIRTY)){
+        p = 0;
+        break;
+      }
+  }
+  if(p){
+    for(b = p; b < p + BPERPAGE; b++)
+      unlink(b);
+    bcache.page[i-1] = bcache.page[--bcache.npage];
+  }
+
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++)
+    release(&bk->lock);
+  release(&bcache.lock);
+  if(p == 0)
+    return 0;
+  kfree((char*)p);
+  return 1;
+}
+
 void
 binit(void)
 {
+  struct bucket *bk;
   struct buf *b;
 
-  initlock(&bcache.lock, "bcache");
+  initmcslock(&bcache.lock, "bcache");
 
 //PAGEBREAK!
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
+  // Spread the buffers over the buckets.
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++){
+    initlock(&bk->lock, "bcache.bucket");
+    bk->head.prev = &bk->head;
+    bk->head.next = &bk->head;
+  }
   for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
     initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    push(&bcache.bucket[(b - bcache.buf) % NBUCKET], b);
   }
 }
 
+// Cached buffer for the block in bk, or 0.  Caller holds bk->lock.
+static struct buf*
+lookup(struct bucket *bk, uint dev, uint blockno)
+{
+  struct buf *b;
+
+  for(b = bk->head.next; b != &bk->head; b = b->next)
+    if(b->dev == dev && b->blockno == blockno)
+      return b;
+  return 0;
+}
+
+// Least recently used buffer of bk that nobody holds, or 0.
+// Even if refcnt==0, B_DIRTY indicates a buffer is in use
+// because log.c has modified it but not yet committed it.
+static struct buf*
+victim(struct bucket *bk)
+{
+  struct buf *b;
+
+  for(b = bk->head.prev; b != &bk->head; b = b->prev)
+    if(b->refcnt == 0 && (b->flags & B_DIRTY) == 0)
+      return b;
+  return 0;
+}
+
 // Look through buffer cache for block on device dev.
 // If not found, allocate a buffer.
 // In either case, return locked buffer.
+// For read-ahead (ra set) return 0 instead if the block is already
+// cached or there is no buffer to spare.
 static struct buf*
-bget(uint dev, uint blockno)
+bget(uint dev, uint blockno, int ra)
 {
+  struct bucket *bk, *other;
   struct buf *b;
+  struct kstat_bcpu *st;
+  int waited;
 
-  acquire(&bcache.lock);
+  bk = hash(dev, blockno);
+  waited = bk->lock.locked;
+  acquire(&bk->lock);
+  st = &bstat[cpuid()];
+  if(waited)
+    st->lockwait++;
 
   // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+  if((b = lookup(bk, dev, blockno)) != 0){
+    if(ra){
+      release(&bk->lock);
+      return 0;
     }
+    b->refcnt++;
+    st->hit++;
+    if(b->lock.locked)
+      st->lockwait++;
+    release(&bk->lock);
+    acquiresleep(&b->lock);
+    return b;
   }
 
-  // Not cached; recycle an unused buffer.
-  // Even if refcnt==0, B_DIRTY indicates a buffer is in use
-  // because log.c has modified it but not yet committed it.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0 && (b->flags & B_DIRTY) == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->flags = 0;
-      b->refcnt = 1;
+  // Not cached; recycle an unused buffer of this bucket, unless
+  // that means evicting a block and the cache may still grow.
+  b = victim(bk);
+  if(b == 0 || ((b->flags & B_VALID) && bcache.npage < NBUFPAGE)){
+    // Grow the cache or steal a buffer from another bucket.  Drop
+    // our bucket lock while waiting for bcache.lock, so may have to
+    // look for the block again.
+    release(&bk->lock);
+    acquire(&bcache.lock);
+    acquire(&bk->lock);
+    st = &bstat[cpuid()];
+    if((b = lookup(bk, dev, blockno)) != 0){
+      if(ra){
+        release(&bk->lock);
+        release(&bcache.lock);
+        return 0;
+      }
+      b->refcnt++;
+      st->hit++;
+      release(&bk->lock);
       release(&bcache.lock);
       acquiresleep(&b->lock);
       return b;
     }
+    b = victim(bk);
+    if((b == 0 || (b->flags & B_VALID)) && bgrow(bk))
+      b = victim(bk);
+    if(b == 0){
+      for(other = bcache.bucket; other < bcache.bucket+NBUCKET; other++){
+        if(other == bk)
+          continue;
+        acquire(&other->lock);
+        if((b = victim(other)) != 0)
+          unlink(b);
+        release(&other->lock);
+        if(b){
+          push(bk, b);
+          break;
+        }
+      }
+    }
+    release(&bcache.lock);
+    if(b == 0 && ra){
+      release(&bk->lock);
+      return 0;
+    }
+    if(b == 0)
+      panic("bget: no buffers");
   }
-  panic("bget: no buffers");
+
+  st->miss++;
+  if(b->flags & B_VALID)
+    st->evict++;
+  b->dev = dev;
+  b->blockno = blockno;
+  b->flags = 0;
+  b->refcnt = 1;
+  release(&bk->lock);
+  acquiresleep(&b->lock);
+  return b;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -98,13 +311,54 @@ bread(uint dev, uint blockno)
 {
   struct buf *b;
 
-  b = bget(dev, blockno);
+  b = bget(dev, blockno, 0);
   if((b->flags & B_VALID) == 0) {
+    klog_ev_off(KLOG_DEBUG, KLOG_EV_BREAD, dev, blockno);
     iderw(b);
   }
   return b;
 }
 
+// Start reading the indicated block into the cache without waiting,
+// unless it is already cached.  The buffer stays locked until the
+// read completes, so a bread() of it meanwhile just waits.
+void
+breadahead(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  if((b = bget(dev, blockno, 1)) == 0)
+    return;
+  b->flags |= B_ASYNC;
+  iderw_async(b);
+}
+
+// Called by ideintr() when the read started by breadahead()
+// completes: unlock b and drop the read-ahead's reference.
+void
+bdone(struct buf *b)
+{
+  struct bucket *bk;
+
+  releasesleep(&b->lock);
+  bk = hash(b->dev, b->blockno);
+  acquire(&bk->lock);
+  b->refcnt--;
+  if(b->refcnt == 0){
+    unlink(b);
+    push(bk, b);
+  }
+  release(&bk->lock);
+}
+
+// Return a locked buf for the indicated block without reading it,
+// for a caller that is about to overwrite all of b->data.
+struct buf*
+bgetblk(uint dev, uint blockno)
+{
+  return bget(dev, blockno, 0);
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
@@ -112,32 +366,41 @@ bwrite(struct buf *b)
   if(!holdingsleep(&b->lock))
     panic("bwrite");
   b->flags |= B_DIRTY;
+  klog_ev_off(KLOG_DEBUG, KLOG_EV_BWRITE, b->dev, b->blockno);
   iderw(b);
 }
 
 // Release a locked buffer.
-// Move to the head of the MRU list.
+// Move to the head of its bucket's MRU list.
 void
 brelse(struct buf *b)
 {
+  struct bucket *bk;
+
   if(!holdingsleep(&b->lock))
     panic("brelse");
 
   releasesleep(&b->lock);
 
-  acquire(&bcache.lock);
+  // b cannot change buckets while we hold a reference.
+  bk = hash(b->dev, b->blockno);
+  acquire(&bk->lock);
   b->refcnt--;
   if (b->refcnt == 0) {
     // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    unlink(b);
+    push(bk, b);
   }
   
-  release(&bcache.lock);
+  release(&bk->lock);
+}
+
+// Fill in the buffer cache counters of st.
+void
+bio_stat(struct kstat_bio *st)
+{
+  memmove(st->cpu, bstat, sizeof(bstat));
+  st->nbuf = NBUF + bcache.npage * BPERPAGE;
 }
 //PAGEBREAK!
 // Blank page.
@@ -0,0 +1,59 @@
+// Boot time: how long each step of main() took, and within
+// startothers() each AP's bring-up, with its share of the time
+// from reset until the first process was made.
+//
+// usage: bootstat
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "kstat.h"
+
+// c TSC cycles in microseconds, given khz cycles per ms.
+static uint
+cycles_us(uint64 c, uint khz)
+{
+  uint k;
+
+  k = c >> 10;   // 1024-cycle units keep the product in 32 bits
+  if(c >> 42)
+    return 0xFFFFFFFF;
+  if(k < (1U << 22))
+    return k * 1000 / (khz >> 10);
+  return k / (khz >> 10) * 1000;
+}
+
+int
+main(int argc, char *argv[])
+{
+  static struct kstat_boot st;
+  struct kstat_bphase *p;
+  uint total, us, start;
+  int i;
+
+  if(kstat(KSTAT_BOOT, &st, sizeof(st)) < 0 || st.tsckhz < 1024 ||
+     st.nphase == 0){
+    printf(2, "bootstat: kstat failed\n");
+    exit();
+  }
+
+  // Shares are of the time until the last step of main() ended.
+  total = cycles_us(st.phase[st.nphase-1].end, st.tsckhz);
+  if(total == 0)
+    total = 1;
+
+  printf(1, "phase\t\tstart_us\tus\t%%\n");
+  for(i = 0; i < st.nphase; i++){
+    p = &st.phase[i];
+    start = cycles_us(p->start, st.tsckhz);
+    us = cycles_us(p->end - p->start, st.tsckhz);
+    if(p->cpu >= 0)
+      printf(1, "  cpu%d\t\t%d\t\t%d\t%d\n", p->cpu, start, us,
+             us / (total / 100 + 1));
+    else
+      printf(1, "%s\t%s%d\t\t%d\t%d\n", p->name,
+             strlen(p->name) < 8 ? "\t" : "", start, us,
+             us / (total / 100 + 1));
+  }
+  printf(1, "total\t\t\t\t%d\n", total);
+  exit();
+}
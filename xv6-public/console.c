@@ -111,6 +111,7 @@ panic(char *s)
 
   cli();
   cons.locking = 0;
+  uartsync();
   // use lapiccpunum so that we can call panic from mycpu()
   cprintf("lapicid %d: panic: ", lapicid());
   cprintf(s);
@@ -118,6 +119,8 @@ panic(char *s)
   getcallerpcs(&s, pcs);
   for(i=0; i<10; i++)
     cprintf(" %p", pcs[i]);
+  cprintf("\n");
+  klog_panic();
   panicked = 1; // freeze other CPU
   for(;;)
     ;
@@ -128,17 +131,33 @@ panic(char *s)
 #define CRTPORT 0x3d4
 static ushort *crt = (ushort*)P2V(0xb8000);  // CGA memory
 
-static void
-cgaputc(int c)
+// Cursor position: col + 80*row.
+static int
+cgapos(void)
 {
   int pos;
 
-  // Cursor position: col + 80*row.
   outb(CRTPORT, 14);
   pos = inb(CRTPORT+1) << 8;
   outb(CRTPORT, 15);
   pos |= inb(CRTPORT+1);
+  return pos;
+}
+
+static void
+cgasetpos(int pos)
+{
+  outb(CRTPORT, 14);
+  outb(CRTPORT+1, pos>>8);
+  outb(CRTPORT, 15);
+  outb(CRTPORT+1, pos);
+  crt[pos] = ' ' | 0x0700;
+}
 
+// Put c on the screen at pos; returns the position after it.
+static int
+cgaput(int pos, int c)
+{
   if(c == '\n')
     pos += 80 - pos%80;
   else if(c == BACKSPACE){
@@ -154,12 +173,25 @@ cgaputc(int c)
     pos -= 80;
     memset(crt+pos, 0, sizeof(crt[0])*(24*80 - pos));
   }
+  return pos;
+}
 
-  outb(CRTPORT, 14);
-  outb(CRTPORT+1, pos>>8);
-  outb(CRTPORT, 15);
-  outb(CRTPORT+1, pos);
-  crt[pos] = ' ' | 0x0700;
+static void
+cgaputc(int c)
+{
+  cgasetpos(cgaput(cgapos(), c));
+}
+
+// Put n characters on the screen, moving the cursor once.
+static void
+cgawrite(char *buf, int n)
+{
+  int i, pos;
+
+  pos = cgapos();
+  for(i = 0; i < n; i++)
+    pos = cgaput(pos, buf[i] & 0xff);
+  cgasetpos(pos);
 }
 
 void
@@ -233,8 +265,9 @@ consoleintr(int (*getc)(void))
 }
 
 int
-consoleread(struct inode *ip, char *dst, int n)
+consoleread(struct file *f, char *dst, int n)
 {
+  struct inode *ip = f->ip;
   uint target;
   int c;
 
@@ -243,7 +276,7 @@ consoleread(struct inode *ip, char *dst, int n)
   acquire(&cons.lock);
   while(n > 0){
     while(input.r == input.w){
-      if(myproc()->killed){
+      if(interrupted()){
         release(&cons.lock);
         ilock(ip);
         return -1;
@@ -271,14 +304,19 @@ consoleread(struct inode *ip, char *dst, int n)
 }
 
 int
-consolewrite(struct inode *ip, char *buf, int n)
+consolewrite(struct file *f, char *buf, int n)
 {
-  int i;
+  struct inode *ip = f->ip;
 
   iunlock(ip);
   acquire(&cons.lock);
-  for(i = 0; i < n; i++)
-    consputc(buf[i] & 0xff);
+  if(panicked){
+    cli();
+    for(;;)
+      ;
+  }
+  uartwrite(buf, n);
+  cgawrite(buf, n);
   release(&cons.lock);
   ilock(ip);
 
@@ -2,20 +2,42 @@ struct buf;
 struct context;
 struct file;
 struct inode;
+struct iovec;
 struct pipe;
+struct proghdr;
 struct proc;
 struct rtcdate;
 struct spinlock;
 struct sleeplock;
 struct stat;
 struct superblock;
+struct trapframe;
 struct klog_entry;
+struct klog_query;
+struct klog_rec;
+struct kstat_syscall;
+struct kstat_bio;
+struct kstat_log;
+struct kstat_mem;
+struct kstat_slab;
+struct kstat_lock;
+struct kstat_trace;
+struct kstat_irq;
+struct kstat_sched;
+struct kstat_boot;
+struct kstat_agg;
+struct kstat_proc;
 
 // bio.c
 void            binit(void);
 struct buf*     bread(uint, uint);
+struct buf*     bgetblk(uint, uint);
+void            breadahead(uint, uint);
+void            bdone(struct buf*);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            bio_stat(struct kstat_bio*);
+int             bshrink(void);
 
 // console.c
 void            consoleinit(void);
@@ -32,19 +54,27 @@ void            fileclose(struct file*);
 struct file*    filedup(struct file*);
 void            fileinit(void);
 int             fileread(struct file*, char*, int n);
+int             filereadv(struct file*, struct iovec*, int);
 int             filestat(struct file*, struct stat*);
 int             filewrite(struct file*, char*, int n);
+int             filewritev(struct file*, struct iovec*, int);
+int             filesplice(struct file*, struct file*, int n);
 
 // fs.c
 void            readsb(int dev, struct superblock *sb);
+int             logdisk(int, struct superblock*);
+void            dcache_purge(struct inode*);
+void            dcache_remove(struct inode*, char*);
 int             dirlink(struct inode*, char*, uint);
 struct inode*   dirlookup(struct inode*, char*, uint*);
 struct inode*   ialloc(uint, short);
 struct inode*   idup(struct inode*);
 void            iinit(int dev);
 void            ilock(struct inode*);
+void            ilockshared(struct inode*);
 void            iput(struct inode*);
 void            iunlock(struct inode*);
+void            iunlockshared(struct inode*);
 void            iunlockput(struct inode*);
 void            iupdate(struct inode*);
 int             namecmp(const char*, const char*);
@@ -56,8 +86,11 @@ int             writei(struct inode*, char*, uint, uint);
 
 // ide.c
 void            ideinit(void);
-void            ideintr(void);
+void            ideintr(int);
+int             idedisk(int);
 void            iderw(struct buf*);
+void            iderw_async(struct buf*);
+void            ide_stat(struct kstat_bio*);
 
 // ioapic.c
 void            ioapicenable(int irq, int cpu);
@@ -66,6 +99,13 @@ void            ioapicinit(void);
 
 // kalloc.c
 char*           kalloc(void);
+char*           kallocrun(int);
+char*           kalloc_noreclaim(void);
+int             kreserve(int);
+void            kref_inc(char*);
+int             kref_get(char*);
+void            kalloc_stat(struct kstat_mem*);
+void            kfreerun(char*, int);
 void            kfree(char*);
 void            kinit1(void*, void*);
 void            kinit2(void*, void*);
@@ -73,14 +113,59 @@ void            kinit2(void*, void*);
 // klog.c
 void            klog_init(void);
 void            klog_printf(const char*, ...);
-int             klog_snapshot(struct klog_entry*, int);
+int             klog_snapshot(char*, int);
+int             klog_read(uint*, char*, int);
+int             klog_query(uint*, struct klog_query*, char*, int);
+int             klog_match(struct klog_query*, struct klog_rec*);
+int             klog_wait(uint);
+int             klog_drain(char*, int, int);
+void            klog_rec_entry(struct klog_rec*, struct klog_entry*);
 void            klog_clear(void);
 uint            klog_get_dropped(void);
+int             klog_ctl(int, int);
+uint            klog_nextseq(void);
+void            klog_panic(void);
+uint            klog_kept(void);
+void            klog_tp_stat(struct kstat_trace*);
+void            klog_agg_stat(struct kstat_agg*);
+
+// klogspill.c
+void            klogspill_init(void);
+void            klogspill_flush(void);
+int             klogspill_read(struct file*, char*, int);
+int             klogspill_write(struct file*, char*, int);
+int             klogspill_query(uint*, struct klog_query*, char*, int);
+int             klog_map(struct proc*);
+
+// ioring.c
+void            ioring_init(void);
+int             ioring_setup(void);
+int             ioring_enter(int, int);
+void            ioring_release(struct proc*);
+
+// textcache.c
+void            textinit(void);
+int             textload(pde_t*, struct inode*, struct proghdr*);
+void            textpurge(struct inode*);
+void            text_stat(struct kstat_mem*);
+
+// mmap.c
+int             mmap(struct file*, uint, uint);
+int             munmap(uint, uint);
+int             mmap_fault(struct proc*, uint, int);
+void            mmap_release(struct proc*);
+
+// kprof.c
+void            kprofinit(void);
+void            kprof_tick(struct trapframe*);
+int             kprofread(struct file*, char*, int);
+int             kprofwrite(struct file*, char*, int);
 
 // klogdev.c
 void            klogdev_init(void);
-int             klogdev_read(struct inode*, char*, int);
-int             klogdev_write(struct inode*, char*, int);
+int             klogdev_read(struct file*, char*, int);
+int             klogdev_write(struct file*, char*, int);
+int             klogdrain_read(struct file*, char*, int);
 
 // kbd.c
 void            kbdintr(void);
@@ -91,14 +176,27 @@ int             lapicid(void);
 extern volatile uint*    lapic;
 void            lapiceoi(void);
 void            lapicinit(void);
+void            lapicipi(uchar, int);
 void            lapicstartap(uchar, uint);
 void            microdelay(int);
+void            tscinit(void);
+void            tscsync(void);
+void            tscserve(void);
+uint64          nanotime(void);
+uint            div64(uint64, uint);
+void            lapicperiodic(void);
+void            lapiconeshot(uint);
+extern uint     tsckhz;
 
 // log.c
 void            initlog(int dev);
 void            log_write(struct buf*);
 void            begin_op();
 void            end_op();
+void            log_stat(struct kstat_log*);
+
+// main.c
+void            boot_stat(struct kstat_boot*);
 
 // mp.c
 extern int      ismp;
@@ -111,8 +209,8 @@ void            picinit(void);
 // pipe.c
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
-int             piperead(struct pipe*, char*, int);
-int             pipewrite(struct pipe*, char*, int);
+int             piperead(struct pipe*, struct iovec*, int);
+int             pipewrite(struct pipe*, struct iovec*, int);
 
 //PAGEBREAK: 16
 // proc.c
@@ -121,15 +219,20 @@ void            exit(void);
 int             fork(void);
 int             growproc(int);
 int             kill(int);
+void            interrupt(struct proc*);
+int             interrupted(void);
 struct cpu*     mycpu(void);
 struct proc*    myproc();
 void            pinit(void);
 void            procdump(void);
+void            proc_stat(struct kstat_sched*);
+void            proc_acct(struct kstat_proc*);
 void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
 void            setproc(struct proc*);
 void            sleep(void*, struct spinlock*);
 void            userinit(void);
+struct proc*    kthread_create(char*, void (*)(void*), void*);
 int             wait(void);
 void            wakeup(void*);
 void            yield(void);
@@ -142,16 +245,29 @@ void            acquire(struct spinlock*);
 void            getcallerpcs(void*, uint*);
 int             holding(struct spinlock*);
 void            initlock(struct spinlock*, char*);
+void            initmcslock(struct spinlock*, char*);
 void            release(struct spinlock*);
 void            pushcli(void);
 void            popcli(void);
+int             lockstat_set(int);
+void            lock_stat(struct kstat_lock*);
+void            cli_stat(struct kstat_irq*);
+void            cli_stat_clear(void);
 
 // sleeplock.c
 void            acquiresleep(struct sleeplock*);
 void            releasesleep(struct sleeplock*);
+void            acquiresleepshared(struct sleeplock*);
+void            releasesleepshared(struct sleeplock*);
 int             holdingsleep(struct sleeplock*);
 void            initsleeplock(struct sleeplock*, char*);
 
+// slab.c
+void            slabinit(void);
+void*           kmalloc(uint);
+void            kmfree(void*);
+void            slab_stat(struct kstat_slab*);
+
 // string.c
 int             memcmp(const void*, const void*, uint);
 void*           memmove(void*, const void*, uint);
@@ -168,13 +284,22 @@ int             argstr(int, char**);
 int             fetchint(uint, int*);
 int             fetchstr(uint, char**);
 void            syscall(void);
+int             systrace_set(int);
+uint            kstat_bucket(uint64);
+void            systrace_stat(struct kstat_syscall*);
 
 // timer.c
 void            timerinit(void);
 
 // trap.c
 void            idtinit(void);
+extern int      irqstat_on;
+int             irqstat_set(int);
+void            irq_stat(struct kstat_irq*);
 extern uint     ticks;
+void            tickupdate(void);
+void            tickwait(uint);
+void            tickidle(void);
 void            tvinit(void);
 extern struct spinlock tickslock;
 
@@ -182,6 +307,8 @@ extern struct spinlock tickslock;
 void            uartinit(void);
 void            uartintr(void);
 void            uartputc(int);
+void            uartsync(void);
+void            uartwrite(char*, int);
 
 // vm.c
 void            seginit(void);
@@ -190,6 +317,7 @@ pde_t*          setupkvm(void);
 char*           uva2ka(pde_t*, char*);
 int             allocuvm(pde_t*, uint, uint);
 int             deallocuvm(pde_t*, uint, uint);
+int             mappages(pde_t*, void*, uint, uint, int);
 void            freevm(pde_t*);
 void            inituvm(pde_t*, char*, uint);
 int             loaduvm(pde_t*, char*, struct inode*, uint, uint);
@@ -197,6 +325,14 @@ pde_t*          copyuvm(pde_t*, uint);
 void            switchuvm(struct proc*);
 void            switchkvm(void);
 int             copyout(pde_t*, uint, void*, uint);
+int             copyto(char*, void*, uint);
+int             pagefault(struct proc*, uint, int);
+int             uvmlazy(pde_t*, uint, uint);
+int             mapkernel(pde_t*, uint, void*, uint, int);
+void            unmapkernel(pde_t*, uint, uint);
+int             uvmfault(uint, uint, int);
+int             uvmpin(uint, uint, int, char**, int);
+int             copyin(pde_t*, void*, uint, uint);
 void            clearpteu(pde_t *pgdir, char *uva);
 
 // number of elements in fixed-size array
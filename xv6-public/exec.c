@@ -6,6 +6,7 @@
 #include "defs.h"
 #include "x86.h"
 #include "elf.h"
+#define KLOG_SUBSYS KLOG_SS_EXEC
 #include "klog.h"
 
 int
@@ -24,11 +25,11 @@ exec(char *path, char **argv)
 
   if((ip = namei(path)) == 0){
     end_op();
-    klog_error("exec: file not found %s", path);
+    klog_ev(KLOG_ERROR, KLOG_EV_EXECNOENT, path);
     cprintf("exec: fail\n");
     return -1;
   }
-  ilock(ip);
+  ilockshared(ip);
   pgdir = 0;
 
   // Check ELF header
@@ -51,14 +52,17 @@ exec(char *path, char **argv)
       goto bad;
     if(ph.vaddr + ph.memsz < ph.vaddr)
       goto bad;
-    if((sz = allocuvm(pgdir, sz, ph.vaddr + ph.memsz)) == 0)
+    // Segments go up; pages between them are zeroed, as before.
+    if(ph.vaddr < PGROUNDUP(sz))
       goto bad;
-    if(ph.vaddr % PGSIZE != 0)
+    if(ph.vaddr > sz && allocuvm(pgdir, sz, ph.vaddr) == 0)
       goto bad;
-    if(loaduvm(pgdir, (char*)ph.vaddr, ip, ph.off, ph.filesz) < 0)
+    if(textload(pgdir, ip, &ph) < 0)
       goto bad;
+    sz = ph.vaddr + ph.memsz;
   }
-  iunlockput(ip);
+  iunlockshared(ip);
+  iput(ip);
   end_op();
   ip = 0;
 
@@ -96,6 +100,8 @@ exec(char *path, char **argv)
   safestrcpy(curproc->name, last, sizeof(curproc->name));
 
   // Commit to the user image.
+  ioring_release(curproc);
+  mmap_release(curproc);
   oldpgdir = curproc->pgdir;
   curproc->pgdir = pgdir;
   curproc->sz = sz;
@@ -103,16 +109,19 @@ exec(char *path, char **argv)
   curproc->tf->esp = sp;
   switchuvm(curproc);
   freevm(oldpgdir);
+  kreserve(-curproc->lazy);
+  curproc->lazy = 0;
   
   // Log after name is safely copied
-  klog_info("exec: %s", curproc->name);
+  klog_ev(KLOG_INFO, KLOG_EV_EXEC, curproc->name);
   return 0;
 
  bad:
   if(pgdir)
     freevm(pgdir);
   if(ip){
-    iunlockput(ip);
+    iunlockshared(ip);
+    iput(ip);
     end_op();
   }
   return -1;
@@ -3,3 +3,6 @@
 #define O_RDWR    0x002
 #define O_CREATE  0x200
 #define KLOG      2   // Major number for /dev/klog
+#define KLOGSPILL 3   // Major number for /dev/klogspill
+#define KPROF     4   // Major number for /dev/kprof
+#define KLOGDRAIN 5   // Major number for /dev/klogdrain
@@ -5,21 +5,27 @@
 #include "types.h"
 #include "defs.h"
 #include "param.h"
+#include "mmu.h"
+#include "proc.h"
+#include "stat.h"
 #include "fs.h"
 #include "spinlock.h"
 #include "sleeplock.h"
 #include "file.h"
+#include "uio.h"
 
 struct devsw devsw[NDEV];
+// Open files come from kmalloc(), whose per-CPU magazines make
+// opening and closing O(1) without a global lock; ftable only
+// counts them.  Counts and reference counts change atomically.
 struct {
-  struct spinlock lock;
-  struct file file[NFILE];
+  int nfile;
 } ftable;
 
 void
 fileinit(void)
 {
-  initlock(&ftable.lock, "ftable");
+  // Nothing to set up: there is no table to lock.
 }
 
 // Allocate a file structure.
@@ -28,27 +34,22 @@ filealloc(void)
 {
   struct file *f;
 
-  acquire(&ftable.lock);
-  for(f = ftable.file; f < ftable.file + NFILE; f++){
-    if(f->ref == 0){
-      f->ref = 1;
-      release(&ftable.lock);
-      return f;
-    }
+  if(__sync_add_and_fetch(&ftable.nfile, 1) > NFILE ||
+     (f = kmalloc(sizeof(*f))) == 0){
+    __sync_sub_and_fetch(&ftable.nfile, 1);
+    return 0;
   }
-  release(&ftable.lock);
-  return 0;
+  memset(f, 0, sizeof(*f));
+  f->ref = 1;
+  return f;
 }
 
 // Increment ref count for file f.
 struct file*
 filedup(struct file *f)
 {
-  acquire(&ftable.lock);
-  if(f->ref < 1)
+  if(__sync_fetch_and_add(&f->ref, 1) < 1)
     panic("filedup");
-  f->ref++;
-  release(&ftable.lock);
   return f;
 }
 
@@ -57,18 +58,15 @@ void
 fileclose(struct file *f)
 {
   struct file ff;
+  int ref;
 
-  acquire(&ftable.lock);
-  if(f->ref < 1)
-    panic("fileclose");
-  if(--f->ref > 0){
-    release(&ftable.lock);
+  if((ref = __sync_sub_and_fetch(&f->ref, 1)) > 0)
     return;
-  }
+  if(ref < 0)
+    panic("fileclose");
   ff = *f;
-  f->ref = 0;
-  f->type = FD_NONE;
-  release(&ftable.lock);
+  kmfree(f);
+  __sync_sub_and_fetch(&ftable.nfile, 1);
 
   if(ff.type == FD_PIPE)
     pipeclose(ff.pipe, ff.writable);
@@ -92,24 +90,87 @@ filestat(struct file *f, struct stat *st)
   return -1;
 }
 
+// Read from the device behind f.  The device sees the open
+// file, so it manages f->off itself.  Caller holds f->ip->lock.
+static int
+devread(struct file *f, char *addr, int n)
+{
+  struct inode *ip = f->ip;
+
+  if(ip->major < 0 || ip->major >= NDEV || !devsw[ip->major].read)
+    return -1;
+  return devsw[ip->major].read(f, addr, n);
+}
+
+static int
+devwrite(struct file *f, char *addr, int n)
+{
+  struct inode *ip = f->ip;
+
+  if(ip->major < 0 || ip->major >= NDEV || !devsw[ip->major].write)
+    return -1;
+  return devsw[ip->major].write(f, addr, n);
+}
+
+// Charge n bytes moved, if any, to *acct of the calling process.
+static int
+ioacct(uint64 *acct, int n)
+{
+  if(n > 0)
+    *acct += n;
+  return n;
+}
+
 // Read from file f.
 int
 fileread(struct file *f, char *addr, int n)
 {
-  int r;
+  struct iovec iov;
+
+  iov.base = addr;
+  iov.len = n;
+  return filereadv(f, &iov, 1);
+}
+
+// Read from file f into cnt buffers in turn, stopping at the first
+// one that is not filled, as a read() into it would return short.
+// An inode is locked once for all of them.
+int
+filereadv(struct file *f, struct iovec *iov, int cnt)
+{
+  int i, r, tot, shared;
 
   if(f->readable == 0)
     return -1;
   if(f->type == FD_PIPE)
-    return piperead(f->pipe, addr, n);
-  if(f->type == FD_INODE){
+    return ioacct(&myproc()->rbytes, piperead(f->pipe, iov, cnt));
+  if(f->type != FD_INODE)
+    panic("fileread");
+  // Readers of a file share its lock, unless another process may be
+  // moving f->off too.  Only this process can raise f->ref from 1.
+  // Devices keep their own state under the lock.
+  shared = f->ip->type != T_DEV && f->ref == 1;
+  if(shared)
+    ilockshared(f->ip);
+  else
     ilock(f->ip);
-    if((r = readi(f->ip, addr, f->off, n)) > 0)
+  r = 0;
+  for(i = 0, tot = 0; i < cnt; i++){
+    if(f->ip->type == T_DEV)
+      r = devread(f, iov[i].base, iov[i].len);
+    else if((r = readi(f->ip, iov[i].base, f->off, iov[i].len)) > 0)
       f->off += r;
-    iunlock(f->ip);
-    return r;
+    if(r < 0)
+      break;
+    tot += r;
+    if(r < iov[i].len)
+      break;
   }
-  panic("fileread");
+  if(shared)
+    iunlockshared(f->ip);
+  else
+    iunlock(f->ip);
+  return ioacct(&myproc()->rbytes, tot > 0 || r >= 0 ? tot : -1);
 }
 
 //PAGEBREAK!
@@ -117,41 +178,113 @@ fileread(struct file *f, char *addr, int n)
 int
 filewrite(struct file *f, char *addr, int n)
 {
-  int r;
+  struct iovec iov;
+
+  iov.base = addr;
+  iov.len = n;
+  return filewritev(f, &iov, 1);
+}
+
+// Write cnt buffers to file f in turn.  For an inode, as many
+// buffers as fit go into each log transaction.  A device takes each
+// buffer whole, outside any transaction, and may take less.
+int
+filewritev(struct file *f, struct iovec *iov, int cnt)
+{
+  int i, r, tot, n1, op, done;
 
   if(f->writable == 0)
     return -1;
   if(f->type == FD_PIPE)
-    return pipewrite(f->pipe, addr, n);
+    return ioacct(&myproc()->wbytes, pipewrite(f->pipe, iov, cnt));
+  if(f->type == FD_INODE && f->ip->type == T_DEV){
+    ilock(f->ip);
+    r = 0;
+    for(i = 0, tot = 0; i < cnt; i++){
+      if((r = devwrite(f, iov[i].base, iov[i].len)) < 0)
+        break;
+      tot += r;
+      if(r < iov[i].len)
+        break;
+    }
+    iunlock(f->ip);
+    return ioacct(&myproc()->wbytes, tot > 0 ? tot : r);
+  }
   if(f->type == FD_INODE){
     // write a few blocks at a time to avoid exceeding
     // the maximum log transaction size, including
-    // i-node, indirect block, allocation blocks,
+    // i-node, up to 3 indirect blocks (the doubly-indirect
+    // one and two under it), allocation blocks,
     // and 2 blocks of slop for non-aligned writes.
-    // this really belongs lower down, since writei()
-    // might be writing a device like the console.
-    int max = ((MAXOPBLOCKS-1-1-2) / 2) * 512;
-    int i = 0;
-    while(i < n){
-      int n1 = n - i;
-      if(n1 > max)
-        n1 = max;
-
+    // The buffers land back to back in the file, so the
+    // bound holds for the bytes of all of them together.
+    int max = ((MAXOPBLOCKS-1-3-2) / 2) * 512;
+    r = 0;
+    tot = 0;
+    i = 0;
+    done = 0;   // bytes of iov[i] already written
+    while(i < cnt && r >= 0){
       begin_op();
       ilock(f->ip);
-      if ((r = writei(f->ip, addr + i, f->off, n1)) > 0)
-        f->off += r;
+      for(op = 0; i < cnt && op < max; ){
+        n1 = iov[i].len - done;
+        if(n1 > max - op)
+          n1 = max - op;
+        if((r = writei(f->ip, (char*)iov[i].base + done, f->off, n1)) > 0)
+          f->off += r;
+        if(r < 0)
+          break;
+        if(r != n1)
+          panic("short filewrite");
+        op += r;
+        done += r;
+        if(done == iov[i].len){
+          i++;
+          done = 0;
+        }
+      }
       iunlock(f->ip);
       end_op();
-
-      if(r < 0)
-        break;
-      if(r != n1)
-        panic("short filewrite");
-      i += r;
+      tot += op;
     }
-    return i == n ? n : -1;
+    return ioacct(&myproc()->wbytes, r < 0 ? -1 : tot);
   }
   panic("filewrite");
 }
 
+//PAGEBREAK!
+// Move up to n bytes from file in to file out without passing them
+// through user space: each run is read into a kernel page and
+// written from there.  Stops early when a read comes up short, as
+// a read() would have, so a pipe or /dev/klog source returns what it
+// has rather than blocking for more.  Returns the number of bytes
+// moved, or -1 if nothing was.
+int
+filesplice(struct file *in, struct file *out, int n)
+{
+  char *buf;
+  int r, w, m, tot;
+
+  if(in->readable == 0 || out->writable == 0 || n < 0)
+    return -1;
+  if((buf = kmalloc(PGSIZE)) == 0)
+    return -1;
+  r = 0;
+  for(tot = 0; tot < n; tot += w){
+    m = n - tot;
+    if(m > PGSIZE)
+      m = PGSIZE;
+    if((r = fileread(in, buf, m)) <= 0)
+      break;
+    if((w = filewrite(out, buf, r)) != r){
+      r = -1;
+      break;
+    }
+    if(r < m){
+      tot += w;
+      break;
+    }
+  }
+  kmfree(buf);
+  return tot > 0 ? tot : r;
+}
@@ -14,25 +14,43 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  struct inode *hnext;   // Next in icache hash chain
+  struct inode *fprev;   // Free list, while ref == 0
+  struct inode *fnext;
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
+  uint nextbn;        // block holding the byte after the last read
+  uint raend;         // read-ahead has been started below this block
+  uint allocend;      // writei() allocates ahead up to this block
+  int textcached;     // textcache.c may hold pages of this file
 
   short type;         // copy of disk inode
   short major;
   short minor;
   short nlink;
   uint size;
-  uint addrs[NDIRECT+1];
+  uint addrs[NDIRECT+2];
+
+  // Copy of the indirect block last used by bmap(), which maps file
+  // blocks [mapbase, mapbase+NINDIRECT); mapblk is 0 if none.
+  // Readers holding lock shared update it under maplk.
+  struct spinlock maplk;
+  uint mapblk;
+  uint mapbase;
+  uint map[NINDIRECT];
 };
 
 // table mapping major device number to
-// device functions
+// device functions.  Devices are handed the open file, with
+// f->ip locked, so they can keep per-open state in f->off.
 struct devsw {
-  int (*read)(struct inode*, char*, int);
-  int (*write)(struct inode*, char*, int);
+  int (*read)(struct file*, char*, int);
+  int (*write)(struct file*, char*, int);
 };
 
 extern struct devsw devsw[];
 
 #define CONSOLE 1
 #define KLOG 2
+#define KLOGSPILL 3
+#define KLOGDRAIN 5
@@ -23,6 +23,7 @@
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 static void itrunc(struct inode*);
+static uint ientry(struct inode*, uint, uint, uint, uint);
 // there should be one superblock per disk device, but we run with
 // only one device
 struct superblock sb; 
@@ -38,45 +39,103 @@ readsb(int dev, struct superblock *sb)
   brelse(bp);
 }
 
-// Zero a block.
+// Is disk dev the log disk made along with the file system of sb?
+// Its super block must locate the same klog spill region, and the
+// same log if sb puts the log there.
+int
+logdisk(int dev, struct superblock *sb)
+{
+  struct superblock lsb;
+
+  if(!idedisk(dev))
+    return 0;
+  readsb(dev, &lsb);
+  if(lsb.klogstart != sb->klogstart || lsb.nklog != sb->nklog)
+    return 0;
+  if(sb->logdev == dev &&
+     (lsb.logstart != sb->logstart || lsb.nlog != sb->nlog))
+    return 0;
+  return 1;
+}
+
+// Zero a block.  No need to read what is being overwritten.
 static void
 bzero(int dev, int bno)
 {
   struct buf *bp;
 
-  bp = bread(dev, bno);
+  bp = bgetblk(dev, bno);
   memset(bp->data, 0, BSIZE);
+  bp->flags |= B_VALID;
   log_write(bp);
   brelse(bp);
 }
 
 // Blocks.
 
-// Allocate a zeroed disk block.
-static uint
-balloc(uint dev)
+// Most blocks balloc() hands out at once.
+#define BRUN 8
+
+// Where to look for free blocks when the caller has no better idea:
+// just past the last block allocated.  Like sb, this assumes a
+// single file system device.
+static uint bhint;
+
+// Allocate up to n zeroed disk blocks into out[], looking from
+// block goal onwards and wrapping around.  The blocks are a run of
+// consecutive free ones from the first found, all in one bitmap
+// block, so marking them costs a single log_write.  Returns how
+// many were allocated, at least 1.
+static int
+balloc(uint dev, uint goal, int n, uint *out)
 {
-  int b, bi, m;
+  int b, bi, j, nbmap, got;
   struct buf *bp;
 
-  bp = 0;
-  for(b = 0; b < sb.size; b += BPB){
+  if(goal == 0 || goal >= sb.size)
+    goal = bhint;
+  nbmap = (sb.size + BPB - 1) / BPB;
+  // The extra pass rescans the goal's bitmap block from its start.
+  for(j = 0; j <= nbmap; j++){
+    b = (goal / BPB + j) % nbmap * BPB;
     bp = bread(dev, BBLOCK(b, sb));
-    for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
-      m = 1 << (bi % 8);
-      if((bp->data[bi/8] & m) == 0){  // Is block free?
-        bp->data[bi/8] |= m;  // Mark block in use.
-        log_write(bp);
-        brelse(bp);
-        bzero(dev, b + bi);
-        return b + bi;
+    for(bi = j == 0 ? goal % BPB : 0; bi < BPB && b + bi < sb.size; bi++){
+      if(bi % 8 == 0 && bp->data[bi/8] == 0xff){
+        bi += 7;  // Whole byte in use.
+        continue;
       }
+      if((bp->data[bi/8] & (1 << (bi % 8))) == 0)  // Is block free?
+        break;
+    }
+    got = 0;
+    while(got < n && bi < BPB && b + bi < sb.size &&
+          (bp->data[bi/8] & (1 << (bi % 8))) == 0){
+      bp->data[bi/8] |= 1 << (bi % 8);  // Mark block in use.
+      out[got++] = b + bi++;
+    }
+    if(got > 0){
+      log_write(bp);
+      brelse(bp);
+      for(j = 0; j < got; j++)
+        bzero(dev, out[j]);
+      bhint = out[got-1] + 1;
+      return got;
     }
     brelse(bp);
   }
   panic("balloc: out of blocks");
 }
 
+// Allocate a single block, near goal if possible.
+static uint
+balloc1(uint dev, uint goal)
+{
+  uint b;
+
+  balloc(dev, goal, 1, &b);
+  return b;
+}
+
 // Free a disk block.
 static void
 bfree(int dev, uint b)
@@ -162,20 +221,70 @@ bfree(int dev, uint b)
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
 // dev, and inum.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
+//
+// Entries are found through a hash table on (dev, inum), so iget()
+// does not depend on NINODE.  An entry whose ref drops to 0 keeps
+// its contents and stays in the table, and goes on the tail of a
+// free list; iget() revives it if asked for the same inode before
+// it is recycled from the head.  icache.lock also protects the hash
+// chains and the free list.
+
+#define NIHASH 61
 
 struct {
   struct spinlock lock;
   struct inode inode[NINODE];
+  struct inode *hash[NIHASH];
+  struct inode *freehead;   // Least recently used unreferenced entry
+  struct inode *freetail;
 } icache;
 
+static struct inode**
+ihash(uint dev, uint inum)
+{
+  return &icache.hash[(dev * 31 + inum) % NIHASH];
+}
+
+// Caller holds icache.lock.
+static void
+freeput(struct inode *ip)
+{
+  ip->fnext = 0;
+  ip->fprev = icache.freetail;
+  if(icache.freetail)
+    icache.freetail->fnext = ip;
+  else
+    icache.freehead = ip;
+  icache.freetail = ip;
+}
+
+// Caller holds icache.lock.
+static void
+freeunlink(struct inode *ip)
+{
+  if(ip->fprev)
+    ip->fprev->fnext = ip->fnext;
+  else
+    icache.freehead = ip->fnext;
+  if(ip->fnext)
+    ip->fnext->fprev = ip->fprev;
+  else
+    icache.freetail = ip->fprev;
+}
+
+static void dcinit(void);
+
 void
 iinit(int dev)
 {
   int i = 0;
   
   initlock(&icache.lock, "icache");
+  dcinit();
   for(i = 0; i < NINODE; i++) {
     initsleeplock(&icache.inode[i].lock, "inode");
+    initlock(&icache.inode[i].maplk, "inodemap");
+    freeput(&icache.inode[i]);
   }
 
   readsb(dev, &sb);
@@ -241,31 +350,43 @@ iupdate(struct inode *ip)
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
+  struct inode *ip, **pp;
 
   acquire(&icache.lock);
 
   // Is the inode already cached?
-  empty = 0;
-  for(ip = &icache.inode[0]; ip < &icache.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
+  for(ip = *ihash(dev, inum); ip; ip = ip->hnext){
+    if(ip->dev == dev && ip->inum == inum){
+      if(ip->ref++ == 0)
+        freeunlink(ip);
       release(&icache.lock);
       return ip;
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
   }
 
   // Recycle an inode cache entry.
-  if(empty == 0)
+  if((ip = icache.freehead) == 0)
     panic("iget: no inodes");
+  freeunlink(ip);
+  if(ip->inum != 0){
+    for(pp = ihash(ip->dev, ip->inum); *pp != ip; pp = &(*pp)->hnext)
+      ;
+    *pp = ip->hnext;
+  }
+  // Once the slot is reused, writes to the file purge nothing.
+  if(ip->textcached)
+    textpurge(ip);
 
-  ip = empty;
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  ip->nextbn = 0;
+  ip->raend = 0;
+  ip->mapblk = 0;
+  pp = ihash(dev, inum);
+  ip->hnext = *pp;
+  *pp = ip;
   release(&icache.lock);
 
   return ip;
@@ -311,6 +432,25 @@ ilock(struct inode *ip)
   }
 }
 
+// Lock the given inode shared, to read its contents alongside
+// other readers.  Anything that changes the inode, its contents
+// or its offset in a shared open file needs ilock() instead.
+// Shared holders may race on the read-ahead hints; that costs a
+// read-ahead at worst.
+void
+ilockshared(struct inode *ip)
+{
+  if(ip == 0 || ip->ref < 1)
+    panic("ilockshared");
+
+  // Loading it from disk is a change; our reference keeps it valid.
+  if(ip->valid == 0){
+    ilock(ip);
+    iunlock(ip);
+  }
+  acquiresleepshared(&ip->lock);
+}
+
 // Unlock the given inode.
 void
 iunlock(struct inode *ip)
@@ -321,6 +461,15 @@ iunlock(struct inode *ip)
   releasesleep(&ip->lock);
 }
 
+void
+iunlockshared(struct inode *ip)
+{
+  if(ip == 0 || ip->ref < 1)
+    panic("iunlockshared");
+
+  releasesleepshared(&ip->lock);
+}
+
 // Drop a reference to an in-memory inode.
 // If that was the last reference, the inode cache entry can
 // be recycled.
@@ -338,6 +487,8 @@ iput(struct inode *ip)
     release(&icache.lock);
     if(r == 1){
       // inode has no links and no other references: truncate and free.
+      if(ip->type == T_DIR)
+        dcache_purge(ip);
       itrunc(ip);
       ip->type = 0;
       iupdate(ip);
@@ -347,7 +498,8 @@ iput(struct inode *ip)
   releasesleep(&ip->lock);
 
   acquire(&icache.lock);
-  ip->ref--;
+  if(--ip->ref == 0)
+    freeput(ip);
   release(&icache.lock);
 }
 
@@ -368,37 +520,122 @@ iunlockput(struct inode *ip)
 // listed in block ip->addrs[NDIRECT].
 
 // Return the disk block address of the nth block in inode ip.
-// If there is no such block, bmap allocates one.
+// If there is no such block, bmap allocates one, placed after the
+// file's previous block when possible.  While writei() is extending
+// the file up to block ip->allocend, bmap also allocates the empty
+// block slots that follow bn up to there, in one balloc() call.
 static uint
 bmap(struct inode *ip, uint bn)
 {
-  uint addr, *a;
-  struct buf *bp;
+  uint addr, base, a[BRUN];
+  int i, n;
 
   if(bn < NDIRECT){
-    if((addr = ip->addrs[bn]) == 0)
-      ip->addrs[bn] = addr = balloc(ip->dev);
+    if((addr = ip->addrs[bn]) == 0){
+      for(n = 1; n < BRUN && bn + n < NDIRECT && bn + n < ip->allocend &&
+          ip->addrs[bn + n] == 0; n++)
+        ;
+      n = balloc(ip->dev, bn > 0 && ip->addrs[bn-1] ? ip->addrs[bn-1] + 1 : 0,
+                 n, a);
+      for(i = 0; i < n; i++)
+        ip->addrs[bn + i] = a[i];
+      addr = a[0];
+    }
     return addr;
   }
-  bn -= NDIRECT;
 
-  if(bn < NINDIRECT){
+  // Mapped by the cached indirect block?
+  acquire(&ip->maplk);
+  addr = 0;
+  if(ip->mapblk && bn - ip->mapbase < NINDIRECT)
+    addr = ip->map[bn - ip->mapbase];
+  release(&ip->maplk);
+  if(addr)
+    return addr;
+
+  base = NDIRECT;
+  if(bn - base < NINDIRECT){
     // Load indirect block, allocating if necessary.
     if((addr = ip->addrs[NDIRECT]) == 0)
-      ip->addrs[NDIRECT] = addr = balloc(ip->dev);
-    bp = bread(ip->dev, addr);
-    a = (uint*)bp->data;
-    if((addr = a[bn]) == 0){
-      a[bn] = addr = balloc(ip->dev);
-      log_write(bp);
-    }
-    brelse(bp);
-    return addr;
+      ip->addrs[NDIRECT] = addr = balloc1(ip->dev,
+        ip->addrs[NDIRECT-1] ? ip->addrs[NDIRECT-1] + 1 : 0);
+    return ientry(ip, addr, bn - base, base, bn);
+  }
+  base += NINDIRECT;
+
+  if(bn - base < NDINDIRECT){
+    // Doubly-indirect block, then the indirect block under it.
+    if((addr = ip->addrs[NDIRECT+1]) == 0)
+      ip->addrs[NDIRECT+1] = addr = balloc1(ip->dev, 0);
+    addr = ientry(ip, addr, (bn - base) / NINDIRECT, 0, 0);
+    base += (bn - base) / NINDIRECT * NINDIRECT;
+    return ientry(ip, addr, bn - base, base, bn);
   }
 
   panic("bmap: out of range");
 }
 
+// Return entry i of indirect block addr of ip, allocating a block
+// for it if it is empty, after the previous entry's if possible.
+// If bn is non-zero, entry i maps file block bn and, as in bmap(),
+// the empty entries after it up to ip->allocend are filled too.
+// If base is non-zero, addr maps file blocks from base on; keep a
+// copy of it in ip->map for bmap().
+static uint
+ientry(struct inode *ip, uint addr, uint i, uint base, uint bn)
+{
+  struct buf *bp;
+  uint *a, x, run[BRUN];
+  int j, n;
+
+  bp = bread(ip->dev, addr);
+  a = (uint*)bp->data;
+  if((x = a[i]) == 0){
+    n = 1;
+    if(bn)
+      for(; n < BRUN && i + n < NINDIRECT && bn + n < ip->allocend &&
+          a[i + n] == 0; n++)
+        ;
+    n = balloc(ip->dev, i > 0 && a[i-1] ? a[i-1] + 1 : addr + 1, n, run);
+    for(j = 0; j < n; j++)
+      a[i + j] = run[j];
+    x = run[0];
+    log_write(bp);
+  }
+  if(base){
+    acquire(&ip->maplk);
+    memmove(ip->map, a, sizeof(ip->map));
+    ip->mapblk = addr;
+    ip->mapbase = base;
+    release(&ip->maplk);
+  }
+  brelse(bp);
+  return x;
+}
+
+// Free indirect block addr and the blocks it lists; with depth 2,
+// addr is doubly indirect.
+static void
+ifree(struct inode *ip, uint addr, int depth)
+{
+  struct buf *bp;
+  uint *a;
+  int j;
+
+  bp = bread(ip->dev, addr);
+  a = (uint*)bp->data;
+  for(j = 0; j < NINDIRECT; j++){
+    if(a[j] == 0)
+      continue;
+    if(depth > 1)
+      ifree(ip, a[j], depth - 1);
+    else
+      bfree(ip->dev, a[j]);
+  }
+  brelse(bp);
+  bfree(ip->dev, addr);
+}
+
 // Truncate inode (discard contents).
 // Only called when the inode has no links
 // to it (no directory entries referring to it)
@@ -407,10 +644,10 @@ bmap(struct inode *ip, uint bn)
 static void
 itrunc(struct inode *ip)
 {
-  int i, j;
-  struct buf *bp;
-  uint *a;
+  int i;
 
+  if(ip->textcached)
+    textpurge(ip);
   for(i = 0; i < NDIRECT; i++){
     if(ip->addrs[i]){
       bfree(ip->dev, ip->addrs[i]);
@@ -419,16 +656,14 @@ itrunc(struct inode *ip)
   }
 
   if(ip->addrs[NDIRECT]){
-    bp = bread(ip->dev, ip->addrs[NDIRECT]);
-    a = (uint*)bp->data;
-    for(j = 0; j < NINDIRECT; j++){
-      if(a[j])
-        bfree(ip->dev, a[j]);
-    }
-    brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT]);
+    ifree(ip, ip->addrs[NDIRECT], 1);
     ip->addrs[NDIRECT] = 0;
   }
+  if(ip->addrs[NDIRECT+1]){
+    ifree(ip, ip->addrs[NDIRECT+1], 2);
+    ip->addrs[NDIRECT+1] = 0;
+  }
+  ip->mapblk = 0;
 
   ip->size = 0;
   iupdate(ip);
@@ -446,6 +681,22 @@ stati(struct inode *ip, struct stat *st)
   st->size = ip->size;
 }
 
+// Start reading the NREADAHEAD blocks after ip->nextbn into the
+// buffer cache, skipping those already started.  Caller must hold
+// ip->lock.
+static void
+readahead(struct inode *ip)
+{
+  uint bn, end;
+
+  end = min(ip->nextbn + NREADAHEAD, (ip->size + BSIZE - 1)/BSIZE);
+  bn = ip->raend > ip->nextbn ? ip->raend : ip->nextbn;
+  for(; bn < end; bn++)
+    breadahead(ip->dev, bmap(ip, bn));
+  if(end > ip->raend)
+    ip->raend = end;
+}
+
 //PAGEBREAK!
 // Read data from inode.
 // Caller must hold ip->lock.
@@ -453,25 +704,30 @@ int
 readi(struct inode *ip, char *dst, uint off, uint n)
 {
   uint tot, m;
+  int seq;
   struct buf *bp;
 
-  if(ip->type == T_DEV){
-    if(ip->major < 0 || ip->major >= NDEV || !devsw[ip->major].read)
-      return -1;
-    return devsw[ip->major].read(ip, dst, n);
-  }
+  // Devices are read through their open file; see fileread().
+  if(ip->type == T_DEV)
+    return -1;
 
   if(off > ip->size || off + n < off)
     return -1;
   if(off + n > ip->size)
     n = ip->size - off;
 
+  seq = off/BSIZE == ip->nextbn;
+  if(!seq)
+    ip->raend = 0;
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
     bp = bread(ip->dev, bmap(ip, off/BSIZE));
     m = min(n - tot, BSIZE - off%BSIZE);
     memmove(dst, bp->data + off%BSIZE, m);
     brelse(bp);
   }
+  ip->nextbn = off/BSIZE;
+  if(seq)
+    readahead(ip);
   return n;
 }
 
@@ -484,17 +740,19 @@ writei(struct inode *ip, char *src, uint off, uint n)
   uint tot, m;
   struct buf *bp;
 
-  if(ip->type == T_DEV){
-    if(ip->major < 0 || ip->major >= NDEV || !devsw[ip->major].write)
-      return -1;
-    return devsw[ip->major].write(ip, src, n);
-  }
+  // Devices are written through their open file; see filewrite().
+  if(ip->type == T_DEV)
+    return -1;
 
   if(off > ip->size || off + n < off)
     return -1;
   if(off + n > MAXFILE*BSIZE)
     return -1;
+  if(ip->textcached)
+    textpurge(ip);
 
+  // Let bmap() allocate the blocks this write will fill together.
+  ip->allocend = (off + n + BSIZE - 1) / BSIZE;
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
     bp = bread(ip->dev, bmap(ip, off/BSIZE));
     m = min(n - tot, BSIZE - off%BSIZE);
@@ -502,6 +760,7 @@ writei(struct inode *ip, char *src, uint off, uint n)
     log_write(bp);
     brelse(bp);
   }
+  ip->allocend = 0;
 
   if(n > 0 && off > ip->size){
     ip->size = off;
@@ -519,6 +778,111 @@ namecmp(const char *s, const char *t)
   return strncmp(s, t, DIRSIZ);
 }
 
+// Directory lookup cache.
+//
+// dcache remembers the result of recent dirlookup() scans: for
+// (dev, directory inum, name) the inum of the entry and its byte
+// offset in the directory, or inum 0 if the name is absent.  An
+// entry for directory dp only changes while dp is locked (by
+// dirlookup, dirlink and unlink), so a hit is as good as a scan.
+// Entries are grouped in sets of DCWAYS by hash; a miss replaces
+// the least recently used entry of the set.  dcache.lock protects
+// the table itself.
+
+#define DCWAYS 4
+
+struct dentry {
+  uint dev;
+  uint dir;           // Inum of the directory, 0 if entry unused
+  char name[DIRSIZ];
+  uint inum;          // Inum name refers to, 0 if it does not exist
+  uint off;           // Byte offset of its dirent in dir
+  uint used;          // dcache.clock at last use
+};
+
+struct {
+  struct spinlock lock;
+  uint clock;
+  struct dentry ent[NDCACHE];
+} dcache;
+
+static void
+dcinit(void)
+{
+  initlock(&dcache.lock, "dcache");
+}
+
+static struct dentry*
+dset(uint dev, uint dir, char *name)
+{
+  uint h;
+  int i;
+
+  h = dev * 31 + dir;
+  for(i = 0; i < DIRSIZ && name[i]; i++)
+    h = h * 31 + (uchar)name[i];
+  return &dcache.ent[(h % (NDCACHE / DCWAYS)) * DCWAYS];
+}
+
+// Entry for name in dp, or 0.  Caller holds dcache.lock.
+static struct dentry*
+dfind(struct inode *dp, char *name)
+{
+  struct dentry *d, *set;
+
+  set = dset(dp->dev, dp->inum, name);
+  for(d = set; d < set + DCWAYS; d++)
+    if(d->dir == dp->inum && d->dev == dp->dev &&
+       namecmp(d->name, name) == 0)
+      return d;
+  return 0;
+}
+
+// Record that name in dp refers to inum (0: does not exist), with
+// its dirent at off.  Caller holds dp's lock.
+static void
+dcache_set(struct inode *dp, char *name, uint inum, uint off)
+{
+  struct dentry *d, *set;
+
+  acquire(&dcache.lock);
+  if((d = dfind(dp, name)) == 0){
+    set = dset(dp->dev, dp->inum, name);
+    d = set;
+    for(set++; set < d + DCWAYS; set++)
+      if(set->used < d->used)
+        d = set;
+    d->dev = dp->dev;
+    d->dir = dp->inum;
+    strncpy(d->name, name, DIRSIZ);
+  }
+  d->inum = inum;
+  d->off = off;
+  d->used = ++dcache.clock;
+  release(&dcache.lock);
+}
+
+// Forget every entry of directory dp, which is being freed and
+// whose inum may be reused.
+void
+dcache_purge(struct inode *dp)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  for(d = dcache.ent; d < dcache.ent + NDCACHE; d++)
+    if(d->dir == dp->inum && d->dev == dp->dev)
+      d->dir = 0;
+  release(&dcache.lock);
+}
+
+// Called by unlink after clearing name's dirent in dp.
+void
+dcache_remove(struct inode *dp, char *name)
+{
+  dcache_set(dp, name, 0, 0);
+}
+
 // Look for a directory entry in a directory.
 // If found, set *poff to byte offset of entry.
 struct inode*
@@ -526,10 +890,25 @@ dirlookup(struct inode *dp, char *name, uint *poff)
 {
   uint off, inum;
   struct dirent de;
+  struct dentry *d;
 
   if(dp->type != T_DIR)
     panic("dirlookup not DIR");
 
+  acquire(&dcache.lock);
+  if((d = dfind(dp, name)) != 0){
+    d->used = ++dcache.clock;
+    inum = d->inum;
+    off = d->off;
+    release(&dcache.lock);
+    if(inum == 0)
+      return 0;
+    if(poff)
+      *poff = off;
+    return iget(dp->dev, inum);
+  }
+  release(&dcache.lock);
+
   for(off = 0; off < dp->size; off += sizeof(de)){
     if(readi(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
       panic("dirlookup read");
@@ -540,10 +919,12 @@ dirlookup(struct inode *dp, char *name, uint *poff)
       if(poff)
         *poff = off;
       inum = de.inum;
+      dcache_set(dp, name, inum, off);
       return iget(dp->dev, inum);
     }
   }
 
+  dcache_set(dp, name, 0, 0);
   return 0;
 }
 
@@ -573,6 +954,7 @@ dirlink(struct inode *dp, char *name, uint inum)
   de.inum = inum;
   if(writei(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
     panic("dirlink");
+  dcache_set(dp, name, inum, off);
 
   return 0;
 }
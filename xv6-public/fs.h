@@ -7,7 +7,13 @@
 
 // Disk layout:
 // [ boot block | super block | log | inode blocks |
-//                                          free bit map | data blocks]
+//                          free bit map | klog spill | data blocks]
+//
+// The klog spill region, and the log too, may be on a log disk of
+// their own instead (mkfs -d, -j), kept apart from file system I/O:
+// [ boot block | super block | log | klog spill ]
+// Its super block is all zero but for size and the fields locating
+// the two regions, which match those of the file system's.
 //
 // mkfs computes the super block and builds an initial file system. The
 // super block describes the disk layout:
@@ -19,11 +25,23 @@ struct superblock {
   uint logstart;     // Block number of first log block
   uint inodestart;   // Block number of first inode block
   uint bmapstart;    // Block number of first free map block
+  uint klogstart;    // Block number of the klog spill region
+  uint nklog;        // Blocks in the klog spill region
+  uint logdev;       // Device of the log if not this one, else 0
+  uint klogdev;      // Device of the klog spill region, likewise
 };
 
-#define NDIRECT 12
+// Most blocks one log header can list (see log.c); a log has at
+// most LOGMAX+1 blocks, header included.
+#define LOGMAX (BSIZE / sizeof(int) - 1)
+
+// addrs[] holds NDIRECT data block addresses, then the address of
+// an indirect block of NINDIRECT data block addresses, then that of
+// a doubly-indirect block of NINDIRECT indirect block addresses.
+#define NDIRECT 11
 #define NINDIRECT (BSIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+#define NDINDIRECT (NINDIRECT * NINDIRECT)
+#define MAXFILE (NDIRECT + NINDIRECT + NDINDIRECT)
 
 // On-disk inode structure
 struct dinode {
@@ -32,7 +50,7 @@ struct dinode {
   short minor;          // Minor device number (T_DEV only)
   short nlink;          // Number of links to inode in file system
   uint size;            // Size of file (bytes)
-  uint addrs[NDIRECT+1];   // Data block addresses
+  uint addrs[NDIRECT+2];   // Data block addresses
 };
 
 // Inodes per block.
@@ -1,4 +1,10 @@
-// Simple PIO-based (non-DMA) IDE driver code.
+// Simple IDE driver code: bus-master DMA when the PCI IDE
+// controller supports it, PIO otherwise.
+//
+// Disks 0 and 1 are the master and slave of the primary channel,
+// disk 2 (LOGDEV) the master of the secondary channel.  Each
+// channel has its own queue, lock and interrupt, so requests for
+// the log disk never wait behind those for the file system.
 
 #include "types.h"
 #include "defs.h"
@@ -12,6 +18,7 @@
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "kstat.h"
 
 #define SECTOR_SIZE   512
 #define IDE_BSY       0x80
@@ -23,59 +30,235 @@
 #define IDE_CMD_WRITE 0x30
 #define IDE_CMD_RDMUL 0xc4
 #define IDE_CMD_WRMUL 0xc5
+#define IDE_CMD_RDDMA 0xc8
+#define IDE_CMD_WRDMA 0xca
 
-// idequeue points to the buf now being read/written to the disk.
-// idequeue->qnext points to the next buf to be processed.
-// You must hold idelock while manipulating queue.
+// Bus-master DMA registers of a channel, at bmiba (primary) or
+// bmiba+8 (secondary).
+#define BM_CMD        0
+#define BM_STATUS     2
+#define BM_PRDT       4
+#define BM_START      0x01  // BM_CMD: run
+#define BM_READ       0x08  // BM_CMD: disk to memory
+#define BM_ERR        0x02  // BM_STATUS
+#define BM_IRQ        0x04  // BM_STATUS
 
-static struct spinlock idelock;
-static struct buf *idequeue;
+// With DMA, a run of up to IDE_MAXRUN queued requests for
+// consecutive blocks in the same direction goes to the disk as one
+// command, scattered over the bufs by the PRD table.
+#define IDE_MAXRUN    16
 
-static int havedisk1;
-static void idestart(struct buf*);
+// Physical region descriptor: one piece of a DMA transfer.
+// A piece may not cross a 64KB boundary.
+struct prd {
+  uint addr;
+  ushort len;
+  ushort flags;
+};
+#define PRD_EOT       0x8000  // last descriptor
+
+// One PRD table per channel; each is 256 bytes, so none crosses a
+// 64KB boundary.
+static struct prd prdt[2][IDE_MAXRUN*2] __attribute__((aligned(256)));
+
+// chan[i].queue points to the buf now being read/written to the
+// disk.  queue->qnext points to the next buf to be processed.
+// You must hold the channel's lock while manipulating its queue.
+// Waiting requests are kept in C-SCAN order: ascending block
+// numbers from where the disk head is, then from the lowest block.
+//
+// The service time of each request, from idestart() to ideintr(),
+// is kept for kstat(KSTAT_BIO).  Only the head of a queue is on
+// the disk.
+struct idechan {
+  struct spinlock lock;
+  struct buf *queue;
+  int run;          // Requests at the head of queue on the disk
+  ushort base;      // Command block registers
+  ushort ctl;       // Device control register
+  ushort bm;        // Bus-master registers, or 0 to use PIO
+  int have[2];      // Master and slave present
+  struct prd *prdt;
+  uint64 start_tsc;
+  uint hist[2][KSTAT_NBUCKET];
+  uint req;         // Requests queued
+  uint cmd;         // Commands sent to the disk
+  uint seek;        // Sum of blocks the head moved between commands
+  uint pos;         // Block after the last one transferred
+};
+
+static struct idechan chan[2];
+
+static void idestart(struct idechan*, struct buf*);
+
+// The channel of disk dev, or 0 if there is no such disk.
+static struct idechan*
+idechan(int dev)
+{
+  struct idechan *c;
+
+  if(dev < 0 || dev >= 4)
+    return 0;
+  c = &chan[dev >> 1];
+  return c->have[dev & 1] ? c : 0;
+}
+
+// Is disk dev present?
+int
+idedisk(int dev)
+{
+  return idechan(dev) != 0;
+}
 
 // Wait for IDE disk to become ready.
 static int
-idewait(int checkerr)
+idewait(struct idechan *c, int checkerr)
 {
   int r;
 
-  while(((r = inb(0x1f7)) & (IDE_BSY|IDE_DRDY)) != IDE_DRDY)
+  while(((r = inb(c->base + 7)) & (IDE_BSY|IDE_DRDY)) != IDE_DRDY)
     ;
   if(checkerr && (r & (IDE_DF|IDE_ERR)) != 0)
     return -1;
   return 0;
 }
 
+static uint
+pciread(int dev, int fn, int reg)
+{
+  outl(0xcf8, 0x80000000 | dev<<11 | fn<<8 | reg);
+  return inl(0xcfc);
+}
+
+static void
+pciwrite(int dev, int fn, int reg, uint v)
+{
+  outl(0xcf8, 0x80000000 | dev<<11 | fn<<8 | reg);
+  outl(0xcfc, v);
+}
+
+// Find the bus-master registers of a PCI IDE controller on bus 0
+// and let it master the bus.  Returns 0 if there is none.
+static ushort
+idedmainit(void)
+{
+  int dev, fn;
+  uint class, bar;
+
+  for(dev = 0; dev < 32; dev++){
+    for(fn = 0; fn < 8; fn++){
+      if((pciread(dev, fn, 0) & 0xffff) == 0xffff)
+        continue;
+      class = pciread(dev, fn, 0x08);
+      // Mass storage, IDE, with bus mastering in the prog-if.
+      if((class >> 16) != 0x0101 || (class & 0x8000) == 0)
+        continue;
+      bar = pciread(dev, fn, 0x20);
+      if((bar & 1) == 0 || (bar & 0xfffc) == 0)
+        continue;
+      pciwrite(dev, fn, 0x04, (pciread(dev, fn, 0x04) & 0xffff) | 0x5);
+      return bar & 0xfffc;
+    }
+  }
+  return 0;
+}
+
+// Is drive (0 master, 1 slave) of c present?  An empty channel
+// reads as 0, or as 0xff with nothing on the bus.
+static int
+ideprobe(struct idechan *c, int drive)
+{
+  int i, r;
+
+  outb(c->base + 6, 0xe0 | (drive<<4));
+  for(i=0; i<1000; i++){
+    r = inb(c->base + 7);
+    if(r != 0 && r != 0xff)
+      return 1;
+  }
+  return 0;
+}
+
 void
 ideinit(void)
 {
+  struct idechan *c;
+  ushort bmiba;
   int i;
 
-  initlock(&idelock, "ide");
+  bmiba = idedmainit();
+  for(i = 0; i < 2; i++){
+    c = &chan[i];
+    initlock(&c->lock, i ? "ide1" : "ide");
+    c->base = i ? 0x170 : 0x1f0;
+    c->ctl = i ? 0x376 : 0x3f6;
+    c->bm = bmiba ? bmiba + 8*i : 0;
+    c->prdt = prdt[i];
+  }
+
+  // Disk 0 is the boot disk.
+  c = &chan[0];
+  c->have[0] = 1;
   ioapicenable(IRQ_IDE, ncpu - 1);
-  idewait(0);
+  idewait(c, 0);
+  c->have[1] = ideprobe(c, 1);
+  // Switch back to disk 0.
+  outb(c->base + 6, 0xe0 | (0<<4));
 
-  // Check if disk 1 is present
-  outb(0x1f6, 0xe0 | (1<<4));
-  for(i=0; i<1000; i++){
-    if(inb(0x1f7) != 0){
-      havedisk1 = 1;
-      break;
+  // The log disk, if there is one.  Its interrupts go to another
+  // CPU than the file system's when there are several.
+  c = &chan[1];
+  if((c->have[0] = ideprobe(c, 0)) != 0){
+    ioapicenable(IRQ_IDE+1, ncpu > 1 ? ncpu - 2 : 0);
+    idewait(c, 0);
+  }
+}
+
+// Point c's DMA engine at the data of the n bufs from b on.
+static void
+idedmasetup(struct idechan *c, struct buf *b, int n)
+{
+  struct prd *d;
+  struct buf *q;
+  uint pa, len, piece;
+
+  d = c->prdt;
+  for(q = b; n > 0; n--, q = q->qnext){
+    pa = V2P(q->data);
+    for(len = BSIZE; len > 0; len -= piece, pa += piece){
+      piece = 0x10000 - (pa & 0xffff);
+      if(piece > len)
+        piece = len;
+      d->addr = pa;
+      d->len = piece;
+      d->flags = 0;
+      d++;
     }
   }
+  d[-1].flags = PRD_EOT;
 
-  // Switch back to disk 0.
-  outb(0x1f6, 0xe0 | (0<<4));
+  outl(c->bm + BM_PRDT, V2P(c->prdt));
+  outb(c->bm + BM_CMD, (b->flags & B_DIRTY) ? 0 : BM_READ);
+  outb(c->bm + BM_STATUS, inb(c->bm + BM_STATUS) | BM_ERR | BM_IRQ);
 }
 
-// Start the request for b.  Caller must hold idelock.
+// Start the request for b, and with DMA those queued after it
+// for the blocks that follow.  Caller must hold c->lock.
 static void
-idestart(struct buf *b)
+idestart(struct idechan *c, struct buf *b)
 {
+  struct buf *q;
+  int n;
+
   if(b == 0)
     panic("idestart");
-  if(b->blockno >= FSSIZE)
+  n = 1;
+  if(c->bm)
+    for(q = b->qnext; q && n < IDE_MAXRUN; q = q->qnext, n++)
+      if(q->dev != b->dev || q->blockno != b->blockno + n ||
+         (q->flags & B_DIRTY) != (b->flags & B_DIRTY))
+        break;
+  if(b->blockno + n > FSSIZE)
     panic("incorrect blockno");
   int sector_per_block =  BSIZE/SECTOR_SIZE;
   int sector = b->blockno * sector_per_block;
@@ -84,50 +267,111 @@ idestart(struct buf *b)
 
   if (sector_per_block > 7) panic("idestart");
 
-  idewait(0);
-  outb(0x3f6, 0);  // generate interrupt
-  outb(0x1f2, sector_per_block);  // number of sectors
-  outb(0x1f3, sector & 0xff);
-  outb(0x1f4, (sector >> 8) & 0xff);
-  outb(0x1f5, (sector >> 16) & 0xff);
-  outb(0x1f6, 0xe0 | ((b->dev&1)<<4) | ((sector>>24)&0x0f));
-  if(b->flags & B_DIRTY){
-    outb(0x1f7, write_cmd);
-    outsl(0x1f0, b->data, BSIZE/4);
+  idewait(c, 0);
+  c->run = n;
+  c->cmd++;
+  c->seek += b->blockno > c->pos ? b->blockno - c->pos : c->pos - b->blockno;
+  c->pos = b->blockno + n;
+  c->start_tsc = rdtsc();
+  if(c->bm)
+    idedmasetup(c, b, n);
+  outb(c->ctl, 0);  // generate interrupt
+  outb(c->base + 2, n * sector_per_block);  // number of sectors
+  outb(c->base + 3, sector & 0xff);
+  outb(c->base + 4, (sector >> 8) & 0xff);
+  outb(c->base + 5, (sector >> 16) & 0xff);
+  outb(c->base + 6, 0xe0 | ((b->dev&1)<<4) | ((sector>>24)&0x0f));
+  if(c->bm){
+    outb(c->base + 7, (b->flags & B_DIRTY) ? IDE_CMD_WRDMA : IDE_CMD_RDDMA);
+    outb(c->bm + BM_CMD, inb(c->bm + BM_CMD) | BM_START);
+  } else if(b->flags & B_DIRTY){
+    outb(c->base + 7, write_cmd);
+    outsl(c->base, b->data, BSIZE/4);
   } else {
-    outb(0x1f7, read_cmd);
+    outb(c->base + 7, read_cmd);
   }
 }
 
-// Interrupt handler.
+// Interrupt handler of channel i: 0 for IRQ_IDE, 1 for IRQ_IDE+1.
 void
-ideintr(void)
+ideintr(int i)
 {
+  struct idechan *c;
   struct buf *b;
+  int n;
+  uchar st;
 
-  // First queued buffer is the active request.
-  acquire(&idelock);
+  // The first c->run queued buffers are the active request.
+  c = &chan[i];
+  acquire(&c->lock);
 
-  if((b = idequeue) == 0){
-    release(&idelock);
+  if((b = c->queue) == 0){
+    release(&c->lock);
     return;
   }
-  idequeue = b->qnext;
+  if(c->bm){
+    st = inb(c->bm + BM_STATUS);
+    if((st & BM_IRQ) == 0){
+      release(&c->lock);
+      return;
+    }
+    outb(c->bm + BM_CMD, 0);
+    outb(c->bm + BM_STATUS, st | BM_ERR | BM_IRQ);
+    idewait(c, 0);  // reading the status acknowledges the disk
+  }
+  c->hist[(b->flags & B_DIRTY) != 0][kstat_bucket(rdtsc() - c->start_tsc)]++;
 
-  // Read data if needed.
-  if(!(b->flags & B_DIRTY) && idewait(1) >= 0)
-    insl(0x1f0, b->data, BSIZE/4);
+  for(n = c->run; n > 0; n--){
+    b = c->queue;
+    c->queue = b->qnext;
 
-  // Wake process waiting for this buf.
-  b->flags |= B_VALID;
-  b->flags &= ~B_DIRTY;
-  wakeup(b);
+    // Read data if needed.
+    if(!c->bm && !(b->flags & B_DIRTY) && idewait(c, 1) >= 0)
+      insl(c->base, b->data, BSIZE/4);
+
+    // Wake process waiting for this buf, or finish a read-ahead.
+    b->flags |= B_VALID;
+    b->flags &= ~B_DIRTY;
+    if(b->flags & B_ASYNC){
+      b->flags &= ~B_ASYNC;
+      bdone(b);
+    } else
+      wakeup(b);
+  }
 
   // Start disk on next buf in queue.
-  if(idequeue != 0)
-    idestart(idequeue);
+  if(c->queue != 0)
+    idestart(c, c->queue);
 
-  release(&idelock);
+  release(&c->lock);
+}
+
+// Add b to c's queue, starting the disk if it was idle.
+// Caller must hold c->lock.
+static void
+idequeue_add(struct idechan *c, struct buf *b)
+{
+  struct buf **pp;
+  uint key;
+  int i;
+
+  c->req++;
+
+  // Leave the requests on the disk alone, then insert b in C-SCAN
+  // order: by distance ahead of the head, wrapping around.
+  pp = &c->queue;
+  if(c->queue)
+    for(i = 0; i < c->run; i++)
+      pp = &(*pp)->qnext;
+  key = b->blockno - c->pos;
+  for(; *pp && (*pp)->blockno - c->pos <= key; pp=&(*pp)->qnext)  //DOC:insert-queue
+    ;
+  b->qnext = *pp;
+  *pp = b;
+
+  // Start disk if necessary.
+  if(c->queue == b)
+    idestart(c, b);
 }
 
 //PAGEBREAK!
@@ -137,32 +381,64 @@ ideintr(void)
 void
 iderw(struct buf *b)
 {
-  struct buf **pp;
+  struct idechan *c;
 
   if(!holdingsleep(&b->lock))
     panic("iderw: buf not locked");
   if((b->flags & (B_VALID|B_DIRTY)) == B_VALID)
     panic("iderw: nothing to do");
-  if(b->dev != 0 && !havedisk1)
-    panic("iderw: ide disk 1 not present");
-
-  acquire(&idelock);  //DOC:acquire-lock
+  if((c = idechan(b->dev)) == 0)
+    panic("iderw: ide disk not present");
 
-  // Append b to idequeue.
-  b->qnext = 0;
-  for(pp=&idequeue; *pp; pp=&(*pp)->qnext)  //DOC:insert-queue
-    ;
-  *pp = b;
+  acquire(&c->lock);  //DOC:acquire-lock
 
-  // Start disk if necessary.
-  if(idequeue == b)
-    idestart(b);
+  idequeue_add(c, b);
 
   // Wait for request to finish.
   while((b->flags & (B_VALID|B_DIRTY)) != B_VALID){
-    sleep(b, &idelock);
+    sleep(b, &c->lock);
   }
 
 
-  release(&idelock);
+  release(&c->lock);
+}
+
+// Start reading B_ASYNC buf b from disk and return at once.
+// ideintr() hands b to bdone() when the read completes.
+void
+iderw_async(struct buf *b)
+{
+  struct idechan *c;
+
+  if(!holdingsleep(&b->lock))
+    panic("iderw_async: buf not locked");
+  if(b->flags & (B_VALID|B_DIRTY))
+    panic("iderw_async: not a read");
+  if((c = idechan(b->dev)) == 0)
+    panic("iderw: ide disk not present");
+
+  acquire(&c->lock);
+  idequeue_add(c, b);
+  release(&c->lock);
+}
+
+// Fill in the IDE latency histograms of st, summed over channels.
+void
+ide_stat(struct kstat_bio *st)
+{
+  struct idechan *c;
+  int i, b;
+
+  memset(st->ide, 0, sizeof(st->ide));
+  st->idereq = st->idecmd = st->ideseek = 0;
+  for(c = chan; c < &chan[2]; c++){
+    acquire(&c->lock);
+    for(i = 0; i < 2; i++)
+      for(b = 0; b < KSTAT_NBUCKET; b++)
+        st->ide[i][b] += c->hist[i][b];
+    st->idereq += c->req;
+    st->idecmd += c->cmd;
+    st->ideseek += c->seek;
+    release(&c->lock);
+  }
 }
@@ -0,0 +1,337 @@
+// Asynchronous file I/O.
+//
+// iosetup() maps a struct ioring page (ioring.h) into the calling
+// process at IORINGMAP.  The process queues reads and writes in its
+// submission ring and hands any number over with one ioenter(),
+// which checks each and takes a reference on its file.  NIOWORK
+// kernel threads run them, so a read that blocks (/dev/klog, a
+// pipe) does not hold up a write queued after it, and post the
+// results to the completion ring.  Operations may complete out of
+// order; their data says which is which.
+//
+// A worker is not the process, so ioenter() pins the pages of each
+// buffer (uvmpin) and the worker moves the data through them: the
+// process may sbrk() or fork() meanwhile without the op losing its
+// memory or writing into someone else's.  exit() and exec() call
+// ioring_release(), which aborts the operations in progress and
+// waits for them.
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "ioring.h"
+
+#define NIORING 8     // Rings in the system
+#define NIOWORK 4     // Worker threads
+#define IOPAGES (IORING_MAXLEN / PGSIZE + 1)  // Pages a buffer may span
+
+struct ioop {
+  struct iosqe sqe;   // Copied from the ring, so it cannot change
+  struct file *f;     // Referenced; 0 if the submission was bad
+  char *pg[IOPAGES];  // The buffer's pages, pinned while f is set
+  int npg;
+};
+
+struct ioctx {
+  struct proc *p;     // Owner, or 0 if free
+  struct ioring *r;   // The shared page
+  uint sqhead;        // Next submission to take from r
+  uint head;          // Next of op[] to start
+  uint tail;          // Ops queued
+  uint done;          // Completions posted
+  int running;        // Ops being run by workers
+  int dead;           // Owner is going; start nothing more
+  struct ioop op[IORING_N];
+};
+
+static struct {
+  struct spinlock lock;
+  struct ioctx ctx[NIORING];
+  struct proc *worker[NIOWORK];
+  struct ioctx *on[NIOWORK];  // Whose op each worker is running
+  int next;           // Ring to look at first, for fairness
+} io;
+
+// p's ring, or 0.  Caller holds io.lock.
+static struct ioctx*
+ioctx(struct proc *p)
+{
+  int i;
+
+  for(i = 0; i < NIORING; i++)
+    if(io.ctx[i].p == p)
+      return &io.ctx[i];
+  return 0;
+}
+
+// Take the next op of any ring, round robin, into *op.
+// Caller holds io.lock.
+static struct ioctx*
+iotake(struct ioop *op)
+{
+  struct ioctx *c;
+  int i;
+
+  for(i = 0; i < NIORING; i++){
+    c = &io.ctx[(io.next + i) % NIORING];
+    if(c->p && !c->dead && c->head != c->tail){
+      *op = c->op[c->head++ % IORING_N];
+      c->running++;
+      io.next = (io.next + i + 1) % NIORING;
+      return c;
+    }
+  }
+  return 0;
+}
+
+// Run op, a page of its buffer at a time.
+// Returns what read() or write() would have.
+static int
+iodo(struct ioop *op)
+{
+  struct iosqe *s = &op->sqe;
+  int tot, m, r;
+  uint a;
+
+  if(op->f == 0)
+    return -1;
+  r = 0;
+  for(tot = 0; tot < s->len; tot += r){
+    a = (uint)s->addr % PGSIZE + tot;
+    m = PGSIZE - a % PGSIZE;
+    if(m > s->len - tot)
+      m = s->len - tot;
+    if(s->op == IO_READ)
+      r = fileread(op->f, op->pg[a / PGSIZE] + a % PGSIZE, m);
+    else
+      r = filewrite(op->f, op->pg[a / PGSIZE] + a % PGSIZE, m);
+    if(r <= 0)
+      break;
+    if(r < m){
+      tot += r;
+      break;
+    }
+  }
+  return tot > 0 ? tot : r;
+}
+
+// Let go of op's file and pages.
+static void
+ioput(struct ioop *op)
+{
+  int i;
+
+  if(op->f == 0)
+    return;
+  fileclose(op->f);
+  for(i = 0; i < op->npg; i++)
+    kfree(op->pg[i]);
+}
+
+static void
+ioworker(void *arg)
+{
+  int w = (int)arg;
+  struct ioctx *c;
+  struct ioop op;
+  struct iocqe *cqe;
+  int res;
+
+  acquire(&io.lock);
+  for(;;){
+    if((c = iotake(&op)) == 0){
+      sleep(&io, &io.lock);
+      continue;
+    }
+    io.on[w] = c;
+    myproc()->killed = myproc()->aborted = 0;
+    release(&io.lock);
+
+    res = iodo(&op);
+    ioput(&op);
+
+    acquire(&io.lock);
+    io.on[w] = 0;
+    c->running--;
+    if(!c->dead){
+      cqe = &c->r->cq[c->done % IORING_N];
+      cqe->data = op.sqe.data;
+      cqe->res = res;
+      __sync_synchronize();
+      c->r->cqtail = ++c->done;
+    }
+    wakeup(c);
+  }
+}
+
+// Check the submission of op, from the current process, and take
+// its file and pin its buffer.  Leaves op->f 0, for the op to fail,
+// if it is not one the process could make.
+static void
+iofile(struct ioop *op)
+{
+  struct proc *p = myproc();
+  struct iosqe *s = &op->sqe;
+  struct file *f;
+
+  op->f = 0;
+  op->npg = 0;
+  if(s->fd < 0 || s->fd >= NOFILE || (f = p->ofile[s->fd]) == 0)
+    return;
+  if((s->op != IO_READ || !f->readable) && (s->op != IO_WRITE || !f->writable))
+    return;
+  if(s->len < 0 || s->len > IORING_MAXLEN || (uint)s->addr >= p->sz ||
+     (uint)s->addr + s->len > p->sz)
+    return;
+  if((op->npg = uvmpin((uint)s->addr, s->len, s->op == IO_READ,
+                       op->pg, IOPAGES)) < 0){
+    op->npg = 0;
+    return;
+  }
+  op->f = filedup(f);
+}
+
+// Map a ring into the current process, once.  Returns its address.
+int
+ioring_setup(void)
+{
+  struct proc *p = myproc();
+  struct ioring *r;
+  struct ioctx *c;
+
+  acquire(&io.lock);
+  if(ioctx(p)){
+    release(&io.lock);
+    return IORINGMAP;
+  }
+  if((c = ioctx(0)) == 0){
+    release(&io.lock);
+    return -1;
+  }
+  c->p = p;   // Reserved; there is nothing to take yet
+  c->sqhead = c->head = c->tail = c->done = 0;
+  c->running = c->dead = 0;
+  release(&io.lock);
+
+  if((r = (struct ioring*)kalloc()) == 0 ||
+     mapkernel(p->pgdir, IORINGMAP, r, PGSIZE, 1) < 0){
+    if(r)
+      kfree((char*)r);
+    acquire(&io.lock);
+    c->p = 0;
+    release(&io.lock);
+    return -1;
+  }
+  memset(r, 0, PGSIZE);
+  c->r = r;
+  return IORINGMAP;
+}
+
+// Take up to n new submissions from the current process's ring,
+// as many as the completion ring has room for, then wait until at
+// least wait completions are there to consume.  Returns the number
+// taken.
+int
+ioring_enter(int n, int wait)
+{
+  struct proc *p = myproc();
+  struct ioctx *c;
+  struct ioring *r;
+  struct ioop op;
+  uint cqhead;
+  int k;
+
+  acquire(&io.lock);
+  c = ioctx(p);
+  release(&io.lock);
+  if(c == 0 || c->r == 0)
+    return -1;
+  r = c->r;
+
+  for(k = 0; k < n && c->sqhead != r->sqtail; k++){
+    // The process may write anything here; trust only done.
+    cqhead = r->cqhead;
+    if(c->done - cqhead > c->done)
+      cqhead = c->done;
+    if(c->tail - cqhead >= IORING_N)
+      break;
+    op.sqe = r->sq[c->sqhead % IORING_N];
+    iofile(&op);
+    acquire(&io.lock);
+    c->op[c->tail++ % IORING_N] = op;
+    release(&io.lock);
+    r->sqhead = ++c->sqhead;
+  }
+
+  acquire(&io.lock);
+  if(k > 0)
+    wakeup(&io);
+  if(wait > IORING_N)
+    wait = IORING_N;
+  while(c->done - r->cqhead < wait && c->running + (c->tail - c->head) > 0 &&
+        !p->killed)
+    sleep(c, &io.lock);
+  release(&io.lock);
+  return k;
+}
+
+// Tear down p's ring, if it has one: abort the ops in progress,
+// wait for them, drop the queued ones and unmap the page.  Called
+// from exit() and exec().
+void
+ioring_release(struct proc *p)
+{
+  struct ioctx *c;
+  struct ioring *r;
+  int i;
+
+  acquire(&io.lock);
+  if((c = ioctx(p)) == 0){
+    release(&io.lock);
+    return;
+  }
+  c->dead = 1;
+  while(c->running){
+    // Wake workers blocked in a read on c's behalf.  Only while it
+    // is c's op they run: they clear the flag when taking the next.
+    for(i = 0; i < NIOWORK; i++)
+      if(io.on[i] == c)
+        interrupt(io.worker[i]);
+    sleep(c, &io.lock);
+  }
+  // c is dead and p is here, so nobody else touches c->op[].
+  while(c->head != c->tail){
+    i = c->head++ % IORING_N;
+    release(&io.lock);
+    ioput(&c->op[i]);
+    acquire(&io.lock);
+  }
+  r = c->r;
+  c->r = 0;
+  c->p = 0;
+  release(&io.lock);
+
+  if(r){
+    unmapkernel(p->pgdir, IORINGMAP, PGSIZE);
+    kfree((char*)r);
+  }
+}
+
+// Start the workers.  Called from main() once there is a first
+// process, like klogspill_init().
+void
+ioring_init(void)
+{
+  int i;
+
+  initlock(&io.lock, "ioring");
+  for(i = 0; i < NIOWORK; i++)
+    if((io.worker[i] = kthread_create("ioworker", ioworker, (void*)i)) == 0)
+      panic("ioring_init");
+}
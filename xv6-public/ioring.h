@@ -0,0 +1,35 @@
+// Asynchronous file I/O ring for iosetup() and ioenter().
+// Shared by the kernel and user programs, like stat.h.
+//
+// The process queues submissions at sq[sqtail % IORING_N] and bumps
+// sqtail; ioenter() takes them, moving sqhead.  Kernel workers run
+// them, in any order, and post a completion each at
+// cq[cqtail % IORING_N]; the process consumes them by moving cqhead.
+
+#define IORING_N 64     // Entries in each ring
+#define IORING_MAXLEN 65536 // Longest read or write; longer ones fail
+
+#define IO_READ  1
+#define IO_WRITE 2
+
+struct iosqe {
+  int op;             // IO_READ or IO_WRITE
+  int fd;
+  char *addr;         // Buffer in the process
+  int len;
+  uint data;          // Handed back in the completion
+};
+
+struct iocqe {
+  uint data;          // Of the submission
+  int res;            // What read() or write() would have returned
+};
+
+struct ioring {
+  uint sqhead;        // Written by the kernel
+  uint sqtail;        // Written by the process
+  uint cqhead;        // Written by the process
+  uint cqtail;        // Written by the kernel
+  struct iosqe sq[IORING_N];
+  struct iocqe cq[IORING_N];
+};
@@ -0,0 +1,93 @@
+// Buffer cache and disk statistics
+//
+// usage: iostat
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "kstat.h"
+
+// Upper bound of bucket b in us, given khz TSC cycles per ms.
+static uint
+bucket_us(int b, uint khz)
+{
+  uint c;
+
+  c = b >= 31 ? 0xFFFFFFFF : 1U << (b + 1);
+  if(c < (1U << 22))
+    return c * 1000 / khz;
+  return c / khz * 1000;
+}
+
+// Print the bucket holding the pct'th percentile of hist.
+static void
+print_pct(uint *hist, uint total, int pct, uint khz)
+{
+  uint want, sum;
+  int b;
+
+  want = (total * pct + 99) / 100;
+  sum = 0;
+  for(b = 0; b < KSTAT_NBUCKET; b++){
+    sum += hist[b];
+    if(sum >= want)
+      break;
+  }
+  printf(1, "\t<%dus", bucket_us(b, khz));
+}
+
+int
+main(int argc, char *argv[])
+{
+  static struct kstat_bio st;
+  struct kstat_log lg;
+  static char *ops[] = {"read", "write"};
+  uint total, hit, miss;
+  int i, b;
+
+  if(kstat(KSTAT_BIO, &st, sizeof(st)) < 0){
+    printf(2, "iostat: kstat failed\n");
+    exit();
+  }
+
+  printf(1, "cpu\thit\tmiss\tevict\tlockwait\n");
+  hit = miss = 0;
+  for(i = 0; i < st.ncpu && i < KSTAT_NCPU; i++){
+    printf(1, "%d\t%d\t%d\t%d\t%d\n", i, st.cpu[i].hit, st.cpu[i].miss,
+           st.cpu[i].evict, st.cpu[i].lockwait);
+    hit += st.cpu[i].hit;
+    miss += st.cpu[i].miss;
+  }
+  printf(1, "%d buffers", st.nbuf);
+  if(hit + miss)
+    printf(1, ", hit rate %d%%", hit * 100 / (hit + miss));
+  printf(1, "\n");
+
+  if(kstat(KSTAT_LOG, &lg, sizeof(lg)) >= 0){
+    printf(1, "log: %d blocks, %d commits, %d waits for space\n",
+           lg.logsize, lg.ncommit, lg.nwait);
+    printf(1, "log: %d blocks logged, %d writes absorbed", lg.nunique,
+           lg.nabsorbed);
+    printf(1, " (last commit %d + %d)\n", lg.last_unique, lg.last_absorbed);
+  }
+
+  printf(1, "%d disk requests in %d commands", st.idereq, st.idecmd);
+  if(st.idecmd)
+    printf(1, ", average seek %d blocks", st.ideseek / st.idecmd);
+  printf(1, "\n");
+
+  if(st.tsckhz == 0)
+    exit();
+  printf(1, "disk\tops\tp50\tp99\n");
+  for(i = 0; i < 2; i++){
+    total = 0;
+    for(b = 0; b < KSTAT_NBUCKET; b++)
+      total += st.ide[i][b];
+    printf(1, "%s\t%d", ops[i], total);
+    if(total){
+      print_pct(st.ide[i], total, 50, st.tsckhz);
+      print_pct(st.ide[i], total, 99, st.tsckhz);
+    }
+    printf(1, "\n");
+  }
+  exit();
+}
@@ -0,0 +1,98 @@
+// Interrupt latency: times interrupt handlers and interrupts-off
+// sections while command runs (or for one second), then prints
+// per-IRQ counts with approximate p50/p99 handler times, and the
+// pushcli() callers that kept interrupts off longest, by address
+// (look them up in kernel.sym).
+//
+// usage: irqstat [command [args...]]
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "kstat.h"
+
+static char *names[KSTAT_NIRQ] = {
+[0]  "timer",
+[1]  "kbd",
+[4]  "com1",
+[14] "ide",
+[15] "ide1",
+[19] "error",
+[20] "wakeup",
+[31] "spurious",
+};
+
+// c TSC cycles in microseconds, given khz cycles per ms.
+static uint
+cycles_us(uint64 c, uint khz)
+{
+  uint k;
+
+  k = c >> 10;   // 1024-cycle units keep the product in 32 bits
+  if(c >> 42)
+    return 0xFFFFFFFF;
+  if(k < (1U << 22))
+    return k * 1000 / (khz >> 10);
+  return k / (khz >> 10) * 1000;
+}
+
+// Upper bound in us of the bucket holding the pct'th percentile.
+static uint
+percentile(uint *hist, uint n, int pct, uint khz)
+{
+  uint sum;
+  int b;
+
+  sum = 0;
+  for(b = 0; b < KSTAT_NBUCKET; b++){
+    sum += hist[b];
+    if(sum * 100 >= n * pct)
+      break;
+  }
+  if(b >= 31)
+    return 0xFFFFFFFF;
+  return cycles_us(2ULL << b, khz);
+}
+
+int
+main(int argc, char *argv[])
+{
+  static struct kstat_irq st;
+  uint n;
+  int i, b, pid;
+
+  klogctl(KLOG_CTL_IRQSTAT, 1);
+  if(argc > 1){
+    if((pid = fork()) == 0){
+      exec(argv[1], argv + 1);
+      printf(2, "irqstat: exec %s failed\n", argv[1]);
+      exit();
+    }
+    if(pid > 0)
+      wait();
+  } else
+    sleep(100);
+  klogctl(KLOG_CTL_IRQSTAT, 0);
+
+  if(kstat(KSTAT_IRQ, &st, sizeof(st)) < 0 || st.tsckhz < 1024){
+    printf(2, "irqstat: kstat failed\n");
+    exit();
+  }
+
+  printf(1, "irq\tname\tcount\tp50_us\tp99_us\n");
+  for(i = 0; i < KSTAT_NIRQ; i++){
+    for(n = 0, b = 0; b < KSTAT_NBUCKET; b++)
+      n += st.hist[i][b];
+    if(n == 0)
+      continue;
+    printf(1, "%d\t%s\t%d\t%d\t%d\n", i, names[i] ? names[i] : "?", n,
+           percentile(st.hist[i], n, 50, st.tsckhz),
+           percentile(st.hist[i], n, 99, st.tsckhz));
+  }
+
+  printf(1, "\ninterrupts off by\tcount\tmax_us\tavg_us\n");
+  for(i = 0; i < st.ncli; i++)
+    printf(1, "0x%x\t\t%d\t%d\t%d\n", st.cli[i].pc, st.cli[i].n,
+           cycles_us(st.cli[i].max, st.tsckhz),
+           cycles_us(st.cli[i].total, st.tsckhz) / st.cli[i].n);
+  exit();
+}
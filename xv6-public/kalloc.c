@@ -1,6 +1,22 @@
 // Physical memory allocator, intended to allocate
 // memory for user processes, kernel stacks, page table pages,
 // and pipe buffers. Allocates 4096-byte pages.
+//
+// Each CPU keeps a cache of free pages in front of the global free
+// list, so most kalloc()/kfree() calls take only the CPU's own,
+// uncontended lock.  An empty cache is refilled with KBATCH pages
+// from the global list, and a cache grown past KCACHEMAX drains
+// KBATCH pages back to it.  When the global list is empty too, a
+// CPU steals half of another CPU's cache.
+//
+// Heap pages that sbrk() has promised but that have not been touched
+// yet are counted as reserved; kreserve() refuses to promise more
+// than there is free memory, so running out shows up as sbrk()
+// failing rather than as a fault that cannot be served.
+//
+// Pages handed out by kalloc() carry a reference count, so fork can
+// share user pages copy-on-write (see copyuvm); kfree() drops a
+// reference and frees the page only with the last one.
 
 #include "types.h"
 #include "defs.h"
@@ -8,6 +24,11 @@
 #include "memlayout.h"
 #include "mmu.h"
 #include "spinlock.h"
+#include "x86.h"
+#include "kstat.h"
+
+#define KBATCH    32
+#define KCACHEMAX 64
 
 void freerange(void *vstart, void *vend);
 extern char end[]; // first address after kernel loaded from ELF file
@@ -17,12 +38,25 @@ struct run {
   struct run *next;
 };
 
+struct kcache {
+  struct spinlock lock;
+  struct run *freelist;
+  int n;                   // Pages on freelist
+  struct kstat_kcpu stat;
+};
+
 struct {
   struct spinlock lock;
-  int use_lock;
+  int use_lock;            // Also: CPUs are up, use the caches
   struct run *freelist;
+  int n;
+  int reserved;            // Pages promised by kreserve()
+  struct kcache cpu[NCPU];
 } kmem;
 
+// References to each physical page allocated by kalloc().
+static ushort kref[PHYSTOP / PGSIZE];
+
 // Initialization happens in two phases.
 // 1. main() calls kinit1() while still using entrypgdir to place just
 // the pages mapped by entrypgdir on free list.
@@ -31,7 +65,11 @@ struct {
 void
 kinit1(void *vstart, void *vend)
 {
-  initlock(&kmem.lock, "kmem");
+  int i;
+
+  initmcslock(&kmem.lock, "kmem");
+  for(i = 0; i < NCPU; i++)
+    initlock(&kmem.cpu[i].lock, "kmem.cpu");
   kmem.use_lock = 0;
   freerange(vstart, vend);
 }
@@ -59,38 +97,282 @@ freerange(void *vstart, void *vend)
 void
 kfree(char *v)
 {
-  struct run *r;
+  struct run *r, *batch;
+  struct kcache *kc;
+  int i;
 
   if((uint)v % PGSIZE || v < end || V2P(v) >= PHYSTOP)
     panic("kfree");
 
+  // Pages freed by freerange() were never allocated.
+  if(kmem.use_lock){
+    i = xaddw(&kref[V2P(v) / PGSIZE], -1);
+    if(i == 0)
+      panic("kfree: free page");
+    if(i > 1)
+      return;
+  }
+
   // Fill with junk to catch dangling refs.
   memset(v, 1, PGSIZE);
 
+  r = (struct run*)v;
+  if(!kmem.use_lock){
+    r->next = kmem.freelist;
+    kmem.freelist = r;
+    kmem.n++;
+    return;
+  }
+
+  pushcli();
+  kc = &kmem.cpu[cpuid()];
+  acquire(&kc->lock);
+  r->next = kc->freelist;
+  kc->freelist = r;
+  kc->n++;
+  kc->stat.free++;
+  batch = 0;
+  if(kc->n > KCACHEMAX){
+    // Hand the KBATCH pages after the newest back to the global list.
+    batch = r->next;
+    for(i = 1, r = batch; i < KBATCH; i++)
+      r = r->next;
+    kc->freelist->next = r->next;
+    kc->n -= KBATCH;
+    kc->stat.drain++;
+  }
+  release(&kc->lock);
+  if(batch){
+    acquire(&kmem.lock);
+    r->next = kmem.freelist;
+    kmem.freelist = batch;
+    kmem.n += KBATCH;
+    release(&kmem.lock);
+  }
+  popcli();
+}
+
+// Allocate npages physically contiguous pages and return the lowest.
+// Only finds runs that sit in order on the free list, as they do
+// after freerange(), so it is meant for allocations made at boot.
+// Returns 0 if no such run exists.
+char*
+kallocrun(int npages)
+{
+  struct run **start, **pp, *r, *prev;
+  int n;
+
   if(kmem.use_lock)
     acquire(&kmem.lock);
-  r = (struct run*)v;
-  r->next = kmem.freelist;
-  kmem.freelist = r;
+  n = 0;
+  prev = 0;
+  start = &kmem.freelist;
+  for(pp = &kmem.freelist; (r = *pp) != 0; pp = &r->next){
+    if(n > 0 && (char*)r == (char*)prev - PGSIZE)
+      n++;
+    else {
+      start = pp;
+      n = 1;
+    }
+    prev = r;
+    if(n == npages){
+      *start = r->next;
+      kmem.n -= npages;
+      for(n = 0; n < npages; n++)
+        kref[V2P(r) / PGSIZE + n] = 1;
+      break;
+    }
+  }
   if(kmem.use_lock)
     release(&kmem.lock);
+  return r ? (char*)r : 0;
 }
 
-// Allocate one 4096-byte page of physical memory.
-// Returns a pointer that the kernel can use.
-// Returns 0 if the memory cannot be allocated.
-char*
-kalloc(void)
+// Free npages pages starting at v, as returned by kallocrun().
+// Frees straight to the global list, in address order so the run
+// stays in order on the list.
+void
+kfreerun(char *v, int npages)
 {
   struct run *r;
+  int i;
 
+  memset(v, 1, npages*PGSIZE);
   if(kmem.use_lock)
     acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
+  for(i = 0; i < npages; i++){
+    r = (struct run*)(v + i*PGSIZE);
+    r->next = kmem.freelist;
+    kmem.freelist = r;
+    kref[V2P(r) / PGSIZE] = 0;
+  }
+  kmem.n += npages;
   if(kmem.use_lock)
     release(&kmem.lock);
+}
+
+// Take a free page off this CPU's cache, refilling the cache from
+// the global list or another CPU if need be.  Returns 0 if there
+// are no free pages.
+static struct run*
+getpage(void)
+{
+  struct run *r, *batch, *last;
+  struct kcache *kc, *other;
+  int id, i, n;
+
+  if(!kmem.use_lock){
+    if((r = kmem.freelist) != 0){
+      kmem.freelist = r->next;
+      kmem.n--;
+    }
+    return r;
+  }
+
+  pushcli();
+  id = cpuid();
+  kc = &kmem.cpu[id];
+  acquire(&kc->lock);
+  if((r = kc->freelist) != 0){
+    kc->freelist = r->next;
+    kc->n--;
+    kc->stat.alloc++;
+    release(&kc->lock);
+    popcli();
+    return r;
+  }
+  release(&kc->lock);
+
+  // Refill from the global list.  Cut the batch off under kmem.lock,
+  // then add it to the cache; only this CPU adds to its own cache.
+  acquire(&kmem.lock);
+  batch = last = kmem.freelist;
+  for(n = 0; last && n < KBATCH; n++){
+    r = last;
+    last = last->next;
+  }
+  if(n > 0){
+    kmem.freelist = last;
+    kmem.n -= n;
+    last = r;
+  }
+  release(&kmem.lock);
+
+  if(n == 0){
+    // Steal half of another CPU's cache.  Its lock is held alone,
+    // so two CPUs stealing from each other cannot deadlock.
+    for(i = 1; i < NCPU && n == 0; i++){
+      other = &kmem.cpu[(id + i) % NCPU];
+      acquire(&other->lock);
+      if(other->n > 0){
+        n = (other->n + 1) / 2;
+        batch = last = other->freelist;
+        while(--n > 0)
+          last = last->next;
+        n = (other->n + 1) / 2;
+        other->freelist = last->next;
+        other->n -= n;
+      }
+      release(&other->lock);
+    }
+    if(n > 0)
+      kc->stat.steal++;
+  } else
+    kc->stat.refill++;
+
+  if(n == 0){
+    popcli();
+    return 0;
+  }
+
+  // Keep all but the first page.
+  r = batch;
+  acquire(&kc->lock);
+  last->next = kc->freelist;
+  kc->freelist = r->next;
+  kc->n += n - 1;
+  kc->stat.alloc++;
+  release(&kc->lock);
+  popcli();
+  return r;
+}
+
+// Allocate one 4096-byte page of physical memory without asking
+// caches to give any back; for the caches themselves, which call it
+// with their own locks held.
+// Returns 0 if the memory cannot be allocated.
+char*
+kalloc_noreclaim(void)
+{
+  struct run *r;
+
+  if((r = getpage()) != 0)
+    kref[V2P(r) / PGSIZE] = 1;
   return (char*)r;
 }
 
+// Reserve n more free pages for later allocation (n < 0 gives them
+// back).  Returns -1 if there are not that many unreserved pages.
+int
+kreserve(int n)
+{
+  int i, nfree;
+
+  acquire(&kmem.lock);
+  nfree = kmem.n;
+  for(i = 0; i < NCPU; i++)
+    nfree += kmem.cpu[i].n;
+  if(n > 0 && kmem.reserved + n > nfree){
+    release(&kmem.lock);
+    return -1;
+  }
+  kmem.reserved += n;
+  release(&kmem.lock);
+  return 0;
+}
+
+// Add a reference to page v, which another page table now maps too.
+void
+kref_inc(char *v)
+{
+  xaddw(&kref[V2P(v) / PGSIZE], 1);
+}
+
+// Number of references to page v.
+int
+kref_get(char *v)
+{
+  return kref[V2P(v) / PGSIZE];
+}
+
+// Fill in the allocator counters of st.
+void
+kalloc_stat(struct kstat_mem *st)
+{
+  int i;
+
+  st->nfree = kmem.n;
+  st->reserved = kmem.reserved;
+  for(i = 0; i < NCPU && i < KSTAT_NCPU; i++){
+    st->cpu[i] = kmem.cpu[i].stat;
+    st->cpu[i].cached = kmem.cpu[i].n;
+    st->nfree += kmem.cpu[i].n;
+  }
+}
+
+// Allocate one 4096-byte page of physical memory.
+// Returns a pointer that the kernel can use.
+// Returns 0 if the memory cannot be allocated.
+// When memory runs out the buffer cache is asked to shrink,
+// so callers must not hold buffer cache locks.
+char*
+kalloc(void)
+{
+  char *r;
+
+  while((r = kalloc_noreclaim()) == 0)
+    if(bshrink() == 0)
+      break;
+  return r;
+}
+
@@ -2,54 +2,325 @@
 #include "types.h"
 #include "defs.h"
 #include "param.h"
+#include "memlayout.h"
 #include "mmu.h"
 #include "proc.h"
+#include "spinlock.h"
+#include "sleeplock.h"
 #include "x86.h"
 #include "klog.h"
+#include "kstat.h"
 
-// Per-CPU log buffers
-static struct klog_cpu_buf cpu_logs[NCPU];
+// Header page of a klog_map() mapping.  It also holds each ring's
+// counters, so the ring data pages contain nothing but records.
+static union {
+  struct klog_map hdr;
+  char pad[PGSIZE];
+} maphdr __attribute__((aligned(PGSIZE)));
 
-// Global sequence counter
+// Per-CPU rings, allocated by klog_init() for the CPUs that
+// mpinit() found.  Each is a pair of halves of ring_bytes of
+// physically contiguous pages, so klog_map() can hand them to user
+// space without exposing other kernel data.  The writer fills half
+// cpu_logs[c]->active; klog_drain() swaps in the other one.
+static struct klog_cpu_buf *cpu_logs[NCPU];
+static char *ringdata[NCPU][2];
+static struct spinlock ring_lock[NCPU];
+static int nring;         // Rings in use; 0 until klog_init()
+static uint ring_bytes;   // Bytes of data per ring (power of 2)
+
+// Format strings of deferred entries.  fmttab is indexed by the
+// number stored in an entry; fmtpage holds a copy of each string
+// for user-space readers of the klog_map() mapping.
+struct klog_fmt {
+  const char *fmt;    // Kernel format string, 0 if slot unused
+  int nargs;          // Arguments it consumes
+};
+
+static struct klog_fmt fmttab[KLOG_NFMT];
+static struct spinlock fmt_lock;
+
+static union {
+  char text[KLOG_NFMT][KLOG_FMTLEN];
+  char pad[PGSIZE];
+} fmtpage __attribute__((aligned(PGSIZE)));
+
+// Store raw arguments and format at read time (rec_text).
+int klog_defer = 1;
+
+// Per-subsystem thresholds; everything is recorded by default.
+uchar klog_minlevel[KLOG_NSUBSYS];
+
+// What to do when a ring is full (KLOG_OVERWRITE or KLOG_DROPNEW).
+int klog_policy = KLOG_OVERWRITE;
+
+// Per-call-site rate limits (struct klog_rl in klog.h).
+int klog_rl_burst = KLOG_RL_BURST;
+int klog_rl_pertick = KLOG_RL_PERTICK;
+
+// Tracepoints (struct klog_tp), gathered by kernel.ld.
+extern struct klog_tp __start_ktrace[], __stop_ktrace[];
+
+// Counts of aggregating tracepoints, per CPU so that klog_agg()
+// takes no lock.  A slot stays with its site after the site stops
+// aggregating, for kstat(KSTAT_AGG), until another site needs it.
+// agg_lock serializes klog_tp_agg(); a klog_agg() racing with it
+// may count one call in a slot just given to another site.
+static struct klog_aggslot {
+  struct klog_tp *tp;   // Site counted, or 0
+  struct {
+    uint n;
+    uint64 sum;
+    uint hist[KSTAT_NBUCKET];
+  } cpu[NCPU];
+} aggtab[KSTAT_NAGG];
+static struct spinlock agg_lock;
+
+// Record scheduler events (klog_sched() in klog.h).
+int klog_schedtrace;
+
+// Global sequence counter.  Bumped with an atomic fetch-and-add so
+// that CPUs logging in parallel never serialize on a shared lock;
+// each CPU only ever takes the lock of its own ring.
 static uint global_seq = 0;
-static struct spinlock seq_lock;
 
-// Get high-resolution timestamp (using TSC)
+// Rings klog_drain() has swapped halves of; the records it has
+// yet to return are in drain_merge below.
+static struct {
+  struct sleeplock lock;   // One drainer at a time
+  int half[NCPU];          // Half of each ring that was swapped out
+} drain;
+
+// Where each process's recent records are, so that a query for one
+// pid looks only at them (pidx_query).  ring_append() adds an entry
+// for every record logged in process context; a pid's records are
+// numbered in the order they are added, since it logs from one CPU
+// at a time with interrupts off.  A slot belongs to the last pid
+// that logged into it and starts over when another pid maps to it.
+// Readers take no lock: every entry is checked against the record
+// it names before the record is used.
+#define KLOG_PIDX 64       // Records remembered per process
+
+struct klog_pidx {
+  int pid;
+  uint n;                  // Entries ever added; next is ent[n % KLOG_PIDX]
+  struct {
+    uint seq;
+    uint pos;              // Start of the record in its ring
+    uint cpu;
+  } ent[KLOG_PIDX];
+};
+
+static struct klog_pidx pidx[NPROC];
+
+// Crash record in the first page of the memory the rings live in
+// (from KLOGKEEP), which no one else uses and a warm reboot leaves
+// alone.  klog_panic() fills it in; klog_init() adopts the
+// rings it describes if the sum checks out and the same kernel is
+// booting, whose format strings are then where fmt[] says.  sum
+// covers the whole struct, taken with sum 0.
+#define KEEPSIZE (1024*1024)   // Most memory the rings take
+#define KLOG_SAVE_MAGIC 0x7661736b  // "ksav"
+
+struct klog_save {
+  uint magic;
+  uint sum;
+  uint etext;         // Of the kernel that saved it
+  uint data_size;     // ring_bytes
+  uint ncpu;          // nring
+  uint seq;           // global_seq
+  struct klog_cpu_buf ring[NCPU];
+  struct klog_fmt fmt[KLOG_NFMT];
+};
+
+#define KLOG_PANICN 32      // Records klog_panic() prints
+
+// Readers blocked in klog_wait() for new entries.
+static struct {
+  struct spinlock lock;
+  int waiters;
+} klogwait;
+
+// Get high-resolution timestamp: nanoseconds since boot, corrected
+// for this CPU's TSC offset so that CPUs can be compared.
 static void
 get_timestamp(uint *hi, uint *lo)
 {
-  uint tsc_lo, tsc_hi;
-  asm volatile("rdtsc" : "=a"(tsc_lo), "=d"(tsc_hi));
-  *hi = tsc_hi;
-  *lo = tsc_lo;
+  uint64 ns = nanotime();
+  *hi = ns >> 32;
+  *lo = ns;
 }
 
-// Get next sequence number
+// Get next sequence number.
+// Called with the per-CPU ring lock held, so entries in one
+// ring are always in increasing sequence order.
 static uint
 next_seq(void)
 {
-  uint seq;
-  acquire(&seq_lock);
-  seq = global_seq++;
-  release(&seq_lock);
-  return seq;
+  return __sync_fetch_and_add(&global_seq, 1);
+}
+
+static struct klog_rec* rec_at(int c, uint pos);
+static struct klog_rec* rec_tag(int c, uint pos);
+
+static uint
+save_sum(struct klog_save *s)
+{
+  uint *w, sum, keep;
+  int i;
+
+  keep = s->sum;
+  s->sum = 0;
+  w = (uint*)s;
+  sum = 0;
+  for(i = 0; i < sizeof(*s) / sizeof(uint); i++)
+    sum = (sum << 5 | sum >> 27) + w[i];
+  s->sum = keep;
+  return sum;
+}
+
+// Cut ring c short at the first record that is not intact, as one
+// being appended when the kernel crashed.  Returns the records left.
+static int
+ring_check(int c)
+{
+  struct klog_cpu_buf *log = cpu_logs[c];
+  struct klog_rec *r;
+  uint pos, len, last;
+  int n;
+
+  if(log->head - log->tail > ring_bytes || log->active > 1){
+    log->active = 0;
+    log->tail = log->head;
+  }
+  n = 0;
+  last = 0;
+  for(pos = log->tail; pos != log->head; pos += len){
+    r = rec_at(c, pos);
+    len = r->len;
+    if(len < 4 || len % 4 || len > log->head - pos ||
+       *(uint*)rec_tag(c, pos + len) != *(uint*)r)
+      break;
+    if(r->level != KLOG_PAD){
+      if(len < KLOG_RECHDR + 4 || len > KLOG_RECMAX ||
+         (n > 0 && r->seq <= last))
+        break;
+      last = r->seq;
+      n++;
+    }
+  }
+  log->head = pos;
+  log->claim = pos;
+  return n;
+}
+
+// Take over the rings a crashed kernel saved, if it was this one.
+// Returns the records recovered.
+static int
+save_adopt(struct klog_save *s, int ncpu)
+{
+  extern char etext[], data[];
+  const char *f;
+  int c, i, n;
+
+  if(s->magic != KLOG_SAVE_MAGIC || s->sum != save_sum(s) ||
+     s->etext != (uint)etext || s->data_size != ring_bytes ||
+     s->ncpu > ncpu)
+    return 0;
+  s->magic = 0;   // adopted once only
+
+  for(i = 0; i < KLOG_NFMT; i++){
+    f = s->fmt[i].fmt;
+    if(f < etext || f >= data || s->fmt[i].nargs > KLOG_NARGS)
+      continue;
+    safestrcpy(fmtpage.text[i], f, KLOG_FMTLEN);
+    fmttab[i] = s->fmt[i];
+  }
+  n = 0;
+  for(c = 0; c < s->ncpu; c++){
+    *cpu_logs[c] = s->ring[c];
+    n += ring_check(c);
+  }
+  global_seq = s->seq;
+  return n;
 }
 
 // Initialize kernel logging subsystem
+// Runs after mpinit() and kvmalloc().  The rings live in memory
+// above 4MB that kinit2() leaves out (KLOGKEEP, klog_kept()); they
+// are KLOGSIZE bytes, halved until they fit in KEEPSIZE.  If the
+// previous kernel panicked and saved them there, its records are
+// kept.  Log calls made before this are dropped.
 void
 klog_init(void)
 {
-  int i;
-  
-  initlock(&seq_lock, "klog_seq");
+  struct klog_save *save;
+  char *keep;
+  int i, n, nrec;
+  uint size;
   
-  for(i = 0; i < NCPU; i++){
-    initlock(&cpu_logs[i].lock, "klog_cpu");
-    cpu_logs[i].head = 0;
-    cpu_logs[i].dropped = 0;
+  initlock(&klogwait.lock, "klog_wait");
+  initlock(&fmt_lock, "klog_fmt");
+  initlock(&agg_lock, "klog_agg");
+  initsleeplock(&drain.lock, "klog_drain");
+  klogwait.waiters = 0;
+
+  if(KLOGSIZE < PGSIZE || (KLOGSIZE & (KLOGSIZE - 1)) != 0)
+    panic("klog_init: KLOGSIZE");
+  if(((char*)__stop_ktrace - (char*)__start_ktrace) % sizeof(struct klog_tp))
+    panic("klog_init: ktrace section");
+
+  n = ncpu < NCPU ? ncpu : NCPU;
+  for(size = KLOGSIZE; PGSIZE + 2*n*size > KEEPSIZE; size /= 2)
+    ;
+  if(size < PGSIZE){
+    cprintf("klog: no memory for rings\n");
+    return;
   }
+  if(size != KLOGSIZE)
+    cprintf("klog: rings reduced to %d bytes\n", size);
+  ring_bytes = size;
+
+  keep = P2V(KLOGKEEP);
+  save = (struct klog_save*)keep;
+  for(i = 0; i < 2*n; i++)
+    ringdata[i/2][i%2] = keep + PGSIZE + i*size;
+
+  for(i = 0; i < n; i++){
+    initlock(&ring_lock[i], "klog_cpu");
+    cpu_logs[i] = &maphdr.hdr.ring[i];
+    cpu_logs[i]->head = 0;
+    cpu_logs[i]->tail = 0;
+    cpu_logs[i]->claim = 0;
+    cpu_logs[i]->dropped = 0;
+    cpu_logs[i]->active = 0;
+  }
+  nrec = save_adopt(save, n);
+
+  maphdr.hdr.magic = KLOG_MAP_MAGIC;
+  maphdr.hdr.ncpu = n;
+  maphdr.hdr.data_size = ring_bytes;
+  maphdr.hdr.ring_off = PGSIZE;
+  maphdr.hdr.ring_size = 2 * ring_bytes;
+  maphdr.hdr.fmt_off = PGSIZE + 2 * n * ring_bytes;
+  maphdr.hdr.nfmt = KLOG_NFMT;
+  maphdr.hdr.fmt_len = KLOG_FMTLEN;
+
+  // Publish the rings last; klog_printf() checks nring first.
+  __sync_synchronize();
+  nring = n;
   
-  klog_printf("klog: logging subsystem initialized");
+  klog_printf("klog: logging subsystem initialized, tsc %d kHz", tsckhz);
+  if(nrec)
+    klog_printf_level(KLOG_WARN, "klog: kept %d records from before reboot",
+                      nrec);
+}
+
+// Bytes of memory from KLOGKEEP that the rings use.
+uint
+klog_kept(void)
+{
+  return nring ? PGSIZE + 2 * nring * ring_bytes : 0;
 }
 
 // Helper: format integer
@@ -117,36 +388,18 @@ snprintf_hex(char *buf, int size, uint val)
   return j;
 }
 
-// Internal logging function with level
-static void
-klog_printf_internal(int level, const char *fmt, uint *ap)
+// Format fmt with arguments ap into buf (always NUL-terminated).
+// Understands %d, %x, %s and %%.  If strbase is non-zero, %s
+// arguments are byte offsets into strbase instead of pointers;
+// that is how deferred entries carry their copied strings.
+static int
+klog_format(char *buf, int size, const char *fmt, uint *ap, char *strbase)
 {
-  int cpu_id;
-  struct klog_cpu_buf *log;
-  struct klog_entry *entry;
-  uint idx;
-  int pid = 0;
-  char buf[64];
   int i;
   char *s;
-  
-  // Get current CPU
-  pushcli();
-  cpu_id = cpuid();
-  if(cpu_id < 0 || cpu_id >= NCPU){
-    popcli();
-    return;
-  }
-  
-  log = &cpu_logs[cpu_id];
-  
-  // Get current process ID if available
-  if(myproc())
-    pid = myproc()->pid;
-  
-  // Format the message into buffer
+
   i = 0;
-  for(; *fmt && i < sizeof(buf)-1; fmt++){
+  for(; *fmt && i < size-1; fmt++){
     if(*fmt != '%'){
       buf[i++] = *fmt;
       continue;
@@ -156,16 +409,19 @@ klog_printf_internal(int level, const char *fmt, uint *ap)
       break;
     switch(*fmt){
     case 'd':
-      i += snprintf_int(buf + i, sizeof(buf) - i, *ap++);
+      i += snprintf_int(buf + i, size - i, *ap++);
       break;
     case 'x':
-      i += snprintf_hex(buf + i, sizeof(buf) - i, *ap++);
+      i += snprintf_hex(buf + i, size - i, *ap++);
       break;
     case 's':
-      s = (char*)*ap++;
+      if(strbase)   // clamped, as a torn record may be read
+        s = strbase + (*ap < KLOG_MSGMAX ? *ap : KLOG_MSGMAX - 1), ap++;
+      else
+        s = (char*)*ap++;
       if(s == 0)
         s = "(null)";
-      for(; *s && i < sizeof(buf)-1; s++)
+      for(; *s && i < size-1; s++)
         buf[i++] = *s;
       break;
     case '%':
@@ -173,129 +429,1015 @@ klog_printf_internal(int level, const char *fmt, uint *ap)
       break;
     default:
       buf[i++] = '%';
-      buf[i++] = *fmt;
+      if(i < size-1)
+        buf[i++] = *fmt;
       break;
     }
   }
   buf[i] = 0;
+  return i;
+}
+
+// Look up (or add) fmt in the format table.  Returns its index, or
+// -1 if it cannot be deferred (table full, too long, too many args).
+// The table is append-only; lookups take no lock.
+static int
+fmt_intern(const char *fmt)
+{
+  struct klog_fmt *f;
+  const char *p;
+  int h, i, n, nargs;
+
+  h = ((uint)fmt >> 2) % KLOG_NFMT;
+  for(i = 0; i < KLOG_NFMT; i++){
+    f = &fmttab[(h + i) % KLOG_NFMT];
+    if(f->fmt == fmt)
+      return (h + i) % KLOG_NFMT;
+    if(f->fmt == 0)
+      break;
+  }
+  if(i == KLOG_NFMT)
+    return -1;
+
+  // Count arguments once, here, rather than on every call.
+  n = 0;
+  nargs = 0;
+  for(p = fmt; *p; p++, n++){
+    if(*p == '%' && p[1] != 0){
+      p++;
+      n++;
+      if(*p == 'd' || *p == 'x' || *p == 's')
+        nargs++;
+    }
+  }
+  if(n >= KLOG_FMTLEN || nargs > KLOG_NARGS)
+    return -1;
+
+  acquire(&fmt_lock);
+  for(i = 0; i < KLOG_NFMT; i++){
+    f = &fmttab[(h + i) % KLOG_NFMT];
+    if(f->fmt == fmt || f->fmt == 0)
+      break;
+  }
+  if(i == KLOG_NFMT){
+    release(&fmt_lock);
+    return -1;
+  }
+  i = (h + i) % KLOG_NFMT;
+  if(f->fmt == 0){
+    safestrcpy(fmtpage.text[i], fmt, KLOG_FMTLEN);
+    f->nargs = nargs;
+    __sync_synchronize();  // publish text and nargs before fmt
+    f->fmt = fmt;
+  }
+  release(&fmt_lock);
+  return i;
+}
+
+// Store raw arguments for format number fi in msg, which must be
+// word aligned.  %s strings are copied after the argument words.
+// Returns the number of bytes of msg used.
+static int
+pack_args(char *msg, int fi, const char *fmt, uint *ap)
+{
+  struct klog_args *a = (struct klog_args*)msg;
+  const char *p, *s;
+  uint off;
+  int k;
+
+  a->fmt = fi;
+  a->nargs = fmttab[fi].nargs;
+  off = sizeof(struct klog_args) - sizeof(a->arg) + a->nargs*sizeof(uint);
+  k = 0;
+  for(p = fmt; *p; p++){
+    if(*p != '%' || p[1] == 0)
+      continue;
+    p++;
+    if(*p == 'd' || *p == 'x'){
+      a->arg[k++] = *ap++;
+    } else if(*p == 's'){
+      if((s = (char*)*ap++) == 0)
+        s = "(null)";
+      a->arg[k++] = off < KLOG_MSGMAX ? off : KLOG_MSGMAX - 1;
+      while(*s && off < KLOG_MSGMAX - 1)
+        msg[off++] = *s++;
+      if(off < KLOG_MSGMAX)
+        msg[off++] = 0;
+    }
+  }
+  msg[KLOG_MSGMAX - 1] = 0;
+  return off;
+}
+
+// Record starting at byte position pos of half h of ring c.
+static struct klog_rec*
+half_at(int c, int h, uint pos)
+{
+  return (struct klog_rec*)&ringdata[c][h][pos & (ring_bytes - 1)];
+}
+
+// Record starting at byte position pos of ring c.
+static struct klog_rec*
+rec_at(int c, uint pos)
+{
+  return half_at(c, cpu_logs[c]->active, pos);
+}
+
+// Trailing copy of the first word of the record ending at pos;
+// only len, level and cpu are valid.
+static struct klog_rec*
+rec_tag(int c, uint pos)
+{
+  return rec_at(c, pos - 4);
+}
+
+// Fill in r's trailing word once len, level and cpu are set.
+static void
+rec_settag(struct klog_rec *r)
+{
+  *(uint*)((char*)r + r->len - 4) = *(uint*)r;
+}
+
+// Make room for a len-byte record at the head of ring c by evicting
+// the oldest records, and claim it.  If the record would straddle
+// the end of the ring the rest of the ring becomes a KLOG_PAD record
+// and the new one goes at the start.  Returns where to build the
+// record; the caller publishes it by setting head = claim.  Under
+// KLOG_DROPNEW a full ring keeps its records and 0 is returned.
+// Either way every lost record is counted in log->dropped.
+static struct klog_rec*
+ring_reserve(int c, uint len)
+{
+  struct klog_cpu_buf *log = cpu_logs[c];
+  struct klog_rec *pad;
+  uint gap;
+
+  gap = ring_bytes - (log->head & (ring_bytes - 1));
+  if(gap >= len)
+    gap = 0;
+  if(klog_policy == KLOG_DROPNEW &&
+     log->head + gap + len - log->tail > ring_bytes){
+    log->dropped++;
+    return 0;
+  }
+  while(log->head + gap + len - log->tail > ring_bytes){
+    pad = rec_at(c, log->tail);
+    if(pad->level != KLOG_PAD)
+      log->dropped++;
+    log->tail += pad->len;
+  }
+
+  // Claim the space before overwriting it so that lock-free readers
+  // of a klog_map() mapping can tell a torn record from a good one.
+  log->claim = log->head + gap + len;
+  __sync_synchronize();
+
+  if(gap){
+    pad = rec_at(c, log->head);
+    pad->len = gap;
+    pad->level = KLOG_PAD;
+    pad->cpu = 0;
+    rec_settag(pad);
+  }
+  return rec_at(c, log->head + gap);
+}
+
+// Render r's message as text into text[KLOG_MSGMAX].
+// Returns the length, not counting the NUL.
+static int
+rec_text(struct klog_rec *r, char *text)
+{
+  struct klog_args *a;
+  uint n;
+
+  if(r->level & KLOG_EVENT){
+    n = r->len - KLOG_RECHDR - 4;
+    if(n > KLOG_MSGMAX)   // torn
+      n = KLOG_MSGMAX;
+    return klog_evtext((struct klog_event*)r->msg, n, text, KLOG_MSGMAX);
+  }
+  if((r->level & KLOG_DEFERRED) == 0){
+    safestrcpy(text, r->msg, KLOG_MSGMAX);
+    return strlen(text);
+  }
+  a = (struct klog_args*)r->msg;
+  if(a->fmt >= KLOG_NFMT || fmttab[a->fmt].fmt == 0){
+    safestrcpy(text, "(bad deferred entry)", KLOG_MSGMAX);
+    return strlen(text);
+  }
+  return klog_format(text, KLOG_MSGMAX, fmttab[a->fmt].fmt, a->arg, r->msg);
+}
+
+// Copy r to dst as a text record, rendering it if it is deferred.
+// Returns the bytes written, or 0 if that would exceed n.
+static int
+rec_put(struct klog_rec *r, char *dst, int n)
+{
+  struct klog_rec *d = (struct klog_rec*)dst;
+  char text[KLOG_MSGMAX];
+  int tlen, len;
+
+  tlen = rec_text(r, text);
+  len = KLOG_RECLEN(tlen + 1);
+  if(len > n)
+    return 0;
+  d->len = len;
+  d->level = r->level & ~(KLOG_DEFERRED | KLOG_EVENT);
+  d->cpu = r->cpu;
+  d->seq = r->seq;
+  d->timestamp_hi = r->timestamp_hi;
+  d->timestamp_lo = r->timestamp_lo;
+  d->pid = r->pid;
+  memmove(d->msg, text, tlen + 1);
+  rec_settag(d);
+  return len;
+}
+
+// Convert a text record, as returned by klog_snapshot() or
+// klog_read(), to the fixed-size entry of the getklog() ABI.
+void
+klog_rec_entry(struct klog_rec *r, struct klog_entry *e)
+{
+  e->seq = r->seq;
+  e->timestamp_hi = r->timestamp_hi;
+  e->timestamp_lo = r->timestamp_lo;
+  e->cpu = r->cpu;
+  e->pid = r->pid;
+  e->level = r->level;
+  safestrcpy(e->msg, r->msg, sizeof(e->msg));
+}
+
+// Remember that pid's record seq starts at pos of ring c.
+static void
+pidx_add(int pid, int c, uint pos, uint seq)
+{
+  struct klog_pidx *x = &pidx[pid % NPROC];
+  uint i;
+
+  if(x->pid != pid){
+    x->n = 0;
+    __sync_synchronize();
+    x->pid = pid;
+  }
+  i = x->n;
+  x->ent[i % KLOG_PIDX].seq = seq;
+  x->ent[i % KLOG_PIDX].pos = pos;
+  x->ent[i % KLOG_PIDX].cpu = c;
+  __sync_synchronize();
+  x->n = i + 1;
+}
+
+// Append a record holding the n-byte msg to this CPU's ring.
+// Only this CPU appends to it and the caller has interrupts off,
+// so the lock is contended only by klog_clear(), never by other
+// writers or by readers, which copy without it (ring_valid).
+static void
+ring_append(int level, void *msg, int n)
+{
+  int cpu_id;
+  struct klog_cpu_buf *log;
+  struct klog_rec *r;
+
+  cpu_id = cpuid();
+  acquire(&ring_lock[cpu_id]);
+
+  log = cpu_logs[cpu_id];
+  r = ring_reserve(cpu_id, KLOG_RECLEN(n));
+  if(r == 0){
+    release(&ring_lock[cpu_id]);
+    return;
+  }
+  r->len = KLOG_RECLEN(n);
+  r->level = level;
+  r->cpu = cpu_id;
+  r->seq = next_seq();
+  get_timestamp(&r->timestamp_hi, &r->timestamp_lo);
+  r->pid = myproc() ? myproc()->pid : 0;
+  memmove(r->msg, msg, n);
+  rec_settag(r);
+
+  // Publish the completed record.
+  __sync_synchronize();
+  log->head = log->claim;
+  if(r->pid)
+    pidx_add(r->pid, cpu_id, log->head - r->len, r->seq);
+
+  release(&ring_lock[cpu_id]);
+}
+
+// Wake streaming readers after an append.  The fetch-and-add in
+// next_seq() orders the new entry before this check, pairing with
+// klog_wait().
+static void
+wake_readers(void)
+{
+  if(klogwait.waiters){
+    acquire(&klogwait.lock);
+    wakeup(&klogwait);
+    release(&klogwait.lock);
+  }
+}
+
+// Internal logging function with level
+static void
+klog_printf_internal(int level, const char *fmt, uint *ap)
+{
+  int fi, n;
+  uint msg[KLOG_MSGMAX / sizeof(uint)];  // word aligned for klog_args
   
-  // Add entry to log buffer
-  acquire(&log->lock);
-  
-  idx = log->head % KLOG_BUF_SIZE;
-  entry = &log->entries[idx];
-  
-  entry->seq = next_seq();
-  get_timestamp(&entry->timestamp_hi, &entry->timestamp_lo);
-  entry->cpu = cpu_id;
-  entry->pid = pid;
-  entry->level = level;
-  
-  // Copy message
-  for(i = 0; i < sizeof(entry->msg)-1 && buf[i]; i++)
-    entry->msg[i] = buf[i];
-  entry->msg[i] = 0;
-  
-  log->head++;
+  pushcli();
+  if(cpuid() >= nring){
+    popcli();
+    return;
+  }
   
-  release(&log->lock);
+  // In deferred mode the caller only stores raw arguments; the
+  // message is formatted when someone reads it (rec_text).
+  fi = -1;
+  if(klog_defer)
+    fi = fmt_intern(fmt);
+  if(fi >= 0){
+    level |= KLOG_DEFERRED;
+    n = pack_args((char*)msg, fi, fmt, ap);
+  } else {
+    n = klog_format((char*)msg, sizeof(msg), fmt, ap, 0) + 1;
+  }
+  ring_append(level, msg, n);
+  wake_readers();
+  popcli();
+}
+
+// Pack typed event type and its fields, words in ap, into msg as
+// a struct klog_event followed by copies of its strings.  Returns
+// the bytes used.
+static int
+ev_pack(char *msg, int type, uint *ap)
+{
+  struct klog_event *e = (struct klog_event*)msg;
+  struct klog_evtype *t;
+  char name[16], *f, *s;
+  int k, off, ft;
+
+  e->type = type;
+  e->nargs = 0;
+  if((t = klog_evtype(type)) == 0)
+    return 4;
+  f = t->fields;
+  for(k = 0; k < KLOG_EVARGS && klog_evfield(&f, name, sizeof(name)); k++)
+    ;
+  e->nargs = k;
+  off = 4 + 4*k;
+  f = t->fields;
+  for(k = 0; k < e->nargs; k++){
+    ft = klog_evfield(&f, name, sizeof(name));
+    if(ft != 's'){
+      e->arg[k] = ap[k];
+      continue;
+    }
+    if((s = (char*)ap[k]) == 0)
+      s = "(null)";
+    e->arg[k] = off < KLOG_MSGMAX ? off : KLOG_MSGMAX - 1;
+    while(*s && off < KLOG_MSGMAX - 1)
+      msg[off++] = *s++;
+    if(off < KLOG_MSGMAX)
+      msg[off++] = 0;
+  }
+  msg[KLOG_MSGMAX - 1] = 0;
+  return off;
+}
+
+// Record scheduler event type for pid; see klog_sched().  Called
+// with ptable.lock held, so streaming readers are not woken here;
+// they see the event with the next ordinary record.
+void
+klog_event(int type, int pid, uint chan)
+{
+  uint msg[KLOG_MSGMAX / sizeof(uint)];
+  uint args[2];
+  int n;
+
+  pushcli();
+  if(cpuid() < nring){
+    args[0] = pid;
+    args[1] = chan;
+    n = ev_pack((char*)msg, type, args);
+    ring_append(KLOG_EVENT | KLOG_DEBUG, msg, n);
+  }
   popcli();
 }
 
+// Record typed event type; the klog_ev() macro has already checked
+// klog_minlevel.  Wakes streaming readers like klog_printf().
+void
+klog_event_sub(int level, int type, ...)
+{
+  uint *ap = (uint*)(void*)&type + 1;
+  uint msg[KLOG_MSGMAX / sizeof(uint)];
+  int n;
+
+  pushcli();
+  if(cpuid() >= nring){
+    popcli();
+    return;
+  }
+  n = ev_pack((char*)msg, type, ap);
+  ring_append(KLOG_EVENT | level, msg, n);
+  wake_readers();
+  popcli();
+}
+
+// Top up rl for the ticks since its last refill, and report the
+// calls it dropped meanwhile.  Only the CPU that moves rl->tick
+// refills; the others go on with the tokens they find.
+void
+klog_rl_refill(struct klog_rl *rl)
+{
+  uint old, now, n;
+  int t;
+
+  old = rl->tick;
+  now = ticks;
+  if(old == now || !__sync_bool_compare_and_swap(&rl->tick, old, now))
+    return;
+  t = rl->tokens < 0 ? 0 : rl->tokens;
+  if(now - old >= klog_rl_burst)
+    t = klog_rl_burst;
+  else
+    t += (now - old) * klog_rl_pertick;
+  rl->tokens = t < klog_rl_burst ? t : klog_rl_burst;
+  if((n = xchg(&rl->suppressed, 0)) != 0)
+    klog_printf_level(KLOG_WARN, "klog: suppressed %d at %s", n, rl->site);
+}
+
 // Log a formatted message (default INFO level)
 void
 klog_printf(const char *fmt, ...)
 {
   uint *ap = (uint*)(void*)&fmt + 1;
-  klog_printf_internal(KLOG_INFO, fmt, ap);
+  if(klog_enabled(KLOG_SS_KERNEL, KLOG_INFO))
+    klog_printf_internal(KLOG_INFO, fmt, ap);
 }
 
 // Log a formatted message with specific level
 void
 klog_printf_level(int level, const char *fmt, ...)
+{
+  uint *ap = (uint*)(void*)&fmt + 1;
+  if(klog_enabled(KLOG_SS_KERNEL, level))
+    klog_printf_internal(level, fmt, ap);
+}
+
+// Log for a subsystem; the klog_debug() etc. macros have already
+// checked klog_minlevel.
+void
+klog_printf_sub(int subsys, int level, const char *fmt, ...)
 {
   uint *ap = (uint*)(void*)&fmt + 1;
   klog_printf_internal(level, fmt, ap);
 }
 
-// Snapshot all logs into user buffer - returns LAST (most recent) entries
-int
-klog_snapshot(struct klog_entry *buf, int max_entries)
+// Was the record starting at byte position pos of ring c still
+// intact when everything before this call was read?  The writer
+// moves claim past the bytes it is about to overwrite first, so a
+// copy made before claim got more than a ring ahead of pos is good.
+static int
+ring_valid(int c, uint pos)
+{
+  __sync_synchronize();
+  return cpu_logs[c]->claim - pos <= ring_bytes;
+}
+
+// Record the range of bytes each ring holds in [low[c], high[c])
+// without stopping its writer.  Returns a sequence number below
+// which every record either is in a ring or is gone for good: any
+// writer that had taken such a number has published its record by
+// the time its ring shows no claim beyond head.
+static uint
+sample_rings(uint *low, uint *high)
 {
-  int cpu_id, count = 0, total = 0;
   struct klog_cpu_buf *log;
-  uint start, end, i, idx, j;
-  uint min_seq = 0xFFFFFFFF;
-  int skip_count = 0;
-  
-  // First pass: count total entries and find minimum sequence number
-  for(cpu_id = 0; cpu_id < NCPU; cpu_id++){
-    log = &cpu_logs[cpu_id];
-    acquire(&log->lock);
-    
-    if(log->head > KLOG_BUF_SIZE){
-      total += KLOG_BUF_SIZE;
-      // Find minimum sequence in this buffer
-      for(i = 0; i < KLOG_BUF_SIZE; i++){
-        if(log->entries[i].seq < min_seq)
-          min_seq = log->entries[i].seq;
-      }
-    } else {
-      total += log->head;
-      // Find minimum sequence in this buffer
-      for(i = 0; i < log->head; i++){
-        if(log->entries[i].seq < min_seq)
-          min_seq = log->entries[i].seq;
+  uint bound, claim;
+  int c;
+
+  bound = global_seq;
+  for(c = 0; c < nring; c++){
+    log = cpu_logs[c];
+    for(;;){
+      __sync_synchronize();
+      claim = log->claim;
+      __sync_synchronize();
+      high[c] = log->head;
+      if(claim == high[c])
+        break;
+      pause();
+    }
+    low[c] = log->tail;
+    if((int)(high[c] - low[c]) < 0)
+      low[c] = high[c];
+  }
+  return bound;
+}
+
+// Log msg, which user space wrote to /dev/klog, as a text record
+// stamped like any other; msg[KLOG_MSGMAX-1] may be overwritten.
+void
+klog_user(int level, char *msg)
+{
+  int n;
+
+  pushcli();
+  if(cpuid() >= nring){
+    popcli();
+    return;
+  }
+  msg[KLOG_MSGMAX - 1] = 0;
+  n = strlen(msg) + 1;
+  ring_append(level, msg, n);
+  wake_readers();
+  popcli();
+}
+
+// Merge state over the per-CPU rings.  Each ring is already in
+// sequence order, so an NCPU-way merge with a heap of ring cursors
+// emits records in order in O(log NCPU) per record.  Cursors are
+// byte positions.  A forward merge walks pos[c] up to stop[c],
+// oldest first, with pos[c] at the start of the next record; a
+// backward merge walks pos[c] down to stop[c], newest first, with
+// pos[c] at the end of the next record.  Cursors never rest on a
+// KLOG_PAD record or one numbered bound or later.
+//
+// No ring is locked, so the writers may overwrite the oldest
+// records under the merge.  The header of the record under each
+// cursor is copied into start[], len[] and seq[] and checked with
+// ring_valid(); a cursor whose record is gone skips to the ring's
+// new tail (forward), or stops, as everything older is gone too
+// (backward).  A drained merge walks the halves klog_drain() took,
+// which no writer touches.
+struct klog_merge {
+  int backward;
+  int drained;        // Over drain.half[], not the live rings
+  uint bound;         // First sequence number not to return
+  int n;              // live cursors in heap[]
+  int heap[NCPU];
+  uint pos[NCPU];
+  uint stop[NCPU];
+  uint start[NCPU];   // Start of the record under the cursor
+  uint len[NCPU];     // ... its length
+  uint seq[NCPU];     // ... and its sequence number
+  int last;           // Ring of the record merge_next() returned
+  uint lastpos;       // ... its start
+  uint lastseq;       // ... and its sequence number
+};
+
+// Record starting at pos under cursor c.
+static struct klog_rec*
+merge_rec(struct klog_merge *m, int c, uint pos)
+{
+  if(m->drained)
+    return half_at(c, drain.half[c], pos);
+  return rec_at(c, pos);
+}
+
+// Is the record starting at pos under cursor c still intact?
+static int
+merge_ok(struct klog_merge *m, int c, uint pos)
+{
+  return m->drained || ring_valid(c, pos);
+}
+
+// Cursor c's record was overwritten.
+static void
+merge_lapped(struct klog_merge *m, int c)
+{
+  if(m->backward){
+    m->pos[c] = m->stop[c];
+    return;
+  }
+  m->pos[c] = cpu_logs[c]->tail;
+  if((int)(m->stop[c] - m->pos[c]) < 0)
+    m->pos[c] = m->stop[c];
+}
+
+// Move cursor c past any padding and load the header of the
+// record it is then on.
+static void
+merge_skip(struct klog_merge *m, int c)
+{
+  struct klog_rec *r;
+  uint start, len, level, seq;
+
+  while(m->pos[c] != m->stop[c]){
+    if(m->backward){
+      len = rec_tag(c, m->pos[c])->len;
+      if(!merge_ok(m, c, m->pos[c] - 4)){
+        merge_lapped(m, c);
+        continue;
       }
+      start = m->pos[c] - len;
+    } else
+      start = m->pos[c];
+    r = merge_rec(m, c, start);
+    len = r->len;
+    level = r->level;
+    seq = level != KLOG_PAD ? r->seq : 0;
+    if(!merge_ok(m, c, start)){
+      merge_lapped(m, c);
+      continue;
+    }
+    if(level != KLOG_PAD && seq >= m->bound && !m->backward){
+      m->pos[c] = m->stop[c];   // the rest are newer still
+      break;
     }
-    
-    release(&log->lock);
+    if(level != KLOG_PAD && seq < m->bound){
+      m->start[c] = start;
+      m->len[c] = len;
+      m->seq[c] = seq;
+      break;
+    }
+    if(m->backward)
+      m->pos[c] = start;
+    else
+      m->pos[c] += len;
   }
-  
-  // Calculate how many entries to skip (if total > max_entries, skip oldest)
-  if(total > max_entries){
-    skip_count = total - max_entries;
+}
+
+// Should cursor a be emitted before cursor b?
+static int
+merge_before(struct klog_merge *m, int a, int b)
+{
+  uint sa = m->seq[a];
+  uint sb = m->seq[b];
+  return m->backward ? sa > sb : sa < sb;
+}
+
+// Restore the heap property of m->heap starting at slot i.
+static void
+merge_down(struct klog_merge *m, int i)
+{
+  int l, r, x, t;
+
+  for(;;){
+    x = i;
+    l = 2*i + 1;
+    r = l + 1;
+    if(l < m->n && merge_before(m, m->heap[l], m->heap[x]))
+      x = l;
+    if(r < m->n && merge_before(m, m->heap[r], m->heap[x]))
+      x = r;
+    if(x == i)
+      return;
+    t = m->heap[i];
+    m->heap[i] = m->heap[x];
+    m->heap[x] = t;
+    i = x;
   }
-  
-  // Second pass: collect entries, skipping the oldest ones
-  for(cpu_id = 0; cpu_id < NCPU; cpu_id++){
-    log = &cpu_logs[cpu_id];
-    
-    acquire(&log->lock);
-    
-    // Determine range to copy
-    if(log->head > KLOG_BUF_SIZE){
-      start = log->head - KLOG_BUF_SIZE;
-      end = log->head;
-    } else {
-      start = 0;
-      end = log->head;
+}
+
+// Build the heap once pos[] and stop[] are set.
+static void
+merge_start(struct klog_merge *m)
+{
+  int c, i;
+
+  m->n = 0;
+  for(c = 0; c < nring; c++){
+    merge_skip(m, c);
+    if(m->pos[c] != m->stop[c])
+      m->heap[m->n++] = c;
+  }
+  for(i = m->n/2 - 1; i >= 0; i--)
+    merge_down(m, i);
+}
+
+// Return the next record in merge order, or 0 when all rings are
+// done.  The record is still in its ring: check merge_valid() after
+// copying it.
+static struct klog_rec*
+merge_next(struct klog_merge *m)
+{
+  struct klog_rec *r;
+  int c;
+
+  while(m->n > 0){
+    c = m->heap[0];
+    r = 0;
+    if(merge_ok(m, c, m->start[c])){
+      r = merge_rec(m, c, m->start[c]);
+      m->last = c;
+      m->lastpos = m->start[c];
+      m->lastseq = m->seq[c];
+      if(m->backward)
+        m->pos[c] = m->start[c];
+      else
+        m->pos[c] += m->len[c];
+    } else
+      merge_lapped(m, c);
+    merge_skip(m, c);
+    if(m->pos[c] == m->stop[c])
+      m->heap[0] = m->heap[--m->n];
+    merge_down(m, 0);
+    if(r)
+      return r;
+  }
+  return 0;
+}
+
+// Did the record merge_next() last returned survive until now?
+// Callers check after copying it.
+static int
+merge_valid(struct klog_merge *m)
+{
+  return merge_ok(m, m->last, m->lastpos);
+}
+
+// Snapshot all logs into buf as text records (struct klog_rec),
+// oldest first - returns the bytes used by the most recent records
+// that fit in n bytes.  The merge runs backwards from the newest
+// record of every ring and fills buf from the end, so only records
+// that are returned are ever rendered and copied.  Writers carry
+// on meanwhile; a record they overwrite while it is being copied
+// is left out, along with the older ones of its ring.
+int
+klog_snapshot(char *buf, int n)
+{
+  struct klog_merge m;
+  struct klog_rec *r;
+  int space, len;
+
+  if(n <= 0)
+    return 0;
+
+  m.bound = sample_rings(m.stop, m.pos);
+  m.backward = 1;
+  m.drained = 0;
+  merge_start(&m);
+  space = n;
+  while((r = merge_next(&m)) != 0){
+    // Build the record at the front of the free space, then move
+    // it to the end of it; rec_put() needs its size first.
+    if((len = rec_put(r, buf, space)) == 0)
+      break;
+    if(!merge_valid(&m))
+      continue;
+    space -= len;
+    memmove(buf + space, buf, len);
+  }
+
+  memmove(buf, buf + space, n - space);
+  return n - space;
+}
+
+// Copy text records with sequence number >= *seq into buf, oldest
+// first, as many as fit in n bytes, and advance *seq past what was
+// returned.  Used by streaming readers that remember where they
+// stopped.  Returns the bytes used.  If nothing is returned, *seq
+// moves up to the next number to be assigned: anything older has
+// been overwritten or cleared and will not come.
+int
+klog_read(uint *seq, char *buf, int n)
+{
+  return klog_query(seq, 0, buf, n);
+}
+
+// Does record r, straight from a ring or rendered, match query q?
+int
+klog_match(struct klog_query *q, struct klog_rec *r)
+{
+  int level = r->level & ~(KLOG_DEFERRED | KLOG_EVENT);
+  uint64 ts = (uint64)r->timestamp_hi << 32 | r->timestamp_lo;
+
+  if(q->levels && (level >= 32 || !(q->levels & (1 << level))))
+    return 0;
+  if(q->pid >= 0 && r->pid != q->pid)
+    return 0;
+  if(q->cpu >= 0 && r->cpu != q->cpu)
+    return 0;
+  if((q->maxseq && r->seq > q->maxseq) || ts < q->mintime ||
+     (q->maxtime && ts > q->maxtime))
+    return 0;
+  if(q->events && (!(r->level & KLOG_EVENT) ||
+     ((struct klog_event*)r->msg)->type >= KLOG_NEV ||
+     !(q->events & (1 << ((struct klog_event*)r->msg)->type))))
+    return 0;
+  return 1;
+}
+
+// klog_query() for q->pid through its index, without a merge of
+// the rings.  Returns -1 if the index may not hold every record of
+// the pid numbered *seq or later that is still in a ring.
+static int
+pidx_query(uint *seq, struct klog_query *q, char *buf, int n)
+{
+  struct klog_pidx *x = &pidx[q->pid % NPROC];
+  struct klog_rec *r;
+  uint i, end, eseq, pos, c, last;
+  int used, len;
+
+  if(x->pid != q->pid)
+    return -1;
+  __sync_synchronize();
+  end = x->n;
+  i = end > KLOG_PIDX ? end - KLOG_PIDX : 0;
+  used = 0;
+  last = *seq;
+  for(; i < end; i++){
+    eseq = x->ent[i % KLOG_PIDX].seq;
+    pos = x->ent[i % KLOG_PIDX].pos;
+    c = x->ent[i % KLOG_PIDX].cpu;
+    __sync_synchronize();
+    if(x->pid != q->pid || x->n - i > KLOG_PIDX){
+      // The entry was reused while being read.
+      if(used == 0 && last == *seq)
+        return -1;
+      break;
     }
-    
-    // Copy entries, skipping based on sequence number
-    for(i = start; i < end && count < max_entries; i++){
-      idx = i % KLOG_BUF_SIZE;
-      // Skip entries with sequence numbers in the skip range
-      if(log->entries[idx].seq >= min_seq + skip_count){
-        buf[count++] = log->entries[idx];
-      }
+    if(eseq < *seq)
+      continue;
+    if(i == end - KLOG_PIDX && eseq > *seq)
+      return -1;   // older records may not be indexed any more
+    if(c >= nring || (int)(pos - cpu_logs[c]->tail) < 0)
+      goto gone;
+    r = rec_at(c, pos);
+    if(r->level == KLOG_PAD || r->seq != eseq || r->pid != q->pid ||
+       !ring_valid(c, pos))
+      goto gone;
+    if(klog_match(q, r)){
+      if((len = rec_put(r, buf + used, n - used)) == 0)
+        break;
+      if(ring_valid(c, pos))
+        used += len;
     }
-    
-    release(&log->lock);
+  gone:
+    last = eseq + 1;
   }
-  
-  // Sort by sequence number (simple bubble sort)
-  for(i = 0; i < count - 1; i++){
-    for(j = 0; j < count - i - 1; j++){
-      if(buf[j].seq > buf[j+1].seq){
-        struct klog_entry t = buf[j];
-        buf[j] = buf[j+1];
-        buf[j+1] = t;
-      }
+  if(used > 0 || last != *seq)
+    *seq = last;
+  return used;
+}
+
+// klog_read(), but returning only the records that match q (if q
+// is not 0).  Others are skipped before they are rendered, and
+// *seq moves past them too.  Like klog_snapshot() it never holds
+// up a writer; records overwritten before they are copied count
+// as gone.  A query for one pid goes through that pid's index when
+// it can.
+int
+klog_query(uint *seq, struct klog_query *q, char *buf, int n)
+{
+  struct klog_merge m;
+  struct klog_rec *r;
+  int cpu_id, len, used;
+  uint last, head, start, level, rseq;
+
+  if(q && q->pid > 0 && (used = pidx_query(seq, q, buf, n)) >= 0)
+    return used;
+
+  m.bound = sample_rings(m.stop, m.pos);
+  for(cpu_id = 0; cpu_id < nring; cpu_id++){
+    // Walk back from the head to the first record with seq >= *seq;
+    // streaming readers are usually close behind the writer.
+    head = m.pos[cpu_id];
+    while(m.pos[cpu_id] != m.stop[cpu_id]){
+      start = m.pos[cpu_id] - rec_tag(cpu_id, m.pos[cpu_id])->len;
+      r = rec_at(cpu_id, start);
+      level = r->level;
+      rseq = r->seq;
+      if(!ring_valid(cpu_id, m.pos[cpu_id] - 4) || !ring_valid(cpu_id, start))
+        break;
+      if(level != KLOG_PAD && rseq < *seq)
+        break;
+      m.pos[cpu_id] = start;
     }
+    m.stop[cpu_id] = head;
   }
-  
-  return count;
+
+  m.backward = 0;
+  m.drained = 0;
+  merge_start(&m);
+  used = 0;
+  last = *seq;
+  while((r = merge_next(&m)) != 0){
+    if(q && q->maxseq && r->seq > q->maxseq)
+      break;   // the rest are later still
+    if(q == 0 || klog_match(q, r)){
+      if((len = rec_put(r, buf + used, n - used)) == 0)
+        break;
+      if(merge_valid(&m))
+        used += len;
+    }
+    last = m.lastseq + 1;
+  }
+
+  // All numbers below m.bound are either in a ring or gone for good.
+  if(used > 0 || last != *seq)
+    *seq = last;
+  else if(*seq < m.bound)
+    *seq = m.bound;
+
+  return used;
+}
+
+// Records swapped out by klog_drain() and not yet returned.
+static struct klog_merge drain_merge;
+
+// Give ring c's writer its empty half and leave the full one to
+// drain_merge.  The writer waits only for this exchange.  Its
+// positions jump more than a ring ahead, so to every lock-free
+// reader the swapped-out records look overwritten.
+static void
+ring_swap(int c)
+{
+  struct klog_cpu_buf *log = cpu_logs[c];
+  uint pos;
+
+  acquire(&ring_lock[c]);
+  drain.half[c] = log->active;
+  drain_merge.pos[c] = log->tail;
+  drain_merge.stop[c] = log->head;
+  pos = (log->claim + 2*ring_bytes) & ~(ring_bytes - 1);
+  log->claim = pos;
+  __sync_synchronize();
+  log->active ^= 1;
+  __sync_synchronize();
+  log->tail = pos;
+  log->head = pos;
+  release(&ring_lock[c]);
+}
+
+// Bulk read: take every record buffered so far out of the rings,
+// swapping each CPU's full half for its empty one, and copy them
+// to dst as text records (struct klog_rec) in sequence order, as
+// many as fit in n bytes.  What does not fit stays for the next
+// call; once all of it is returned, a call swaps again only if
+// swap is set.  Other readers never see drained records.  Returns
+// the bytes copied, 0 if there is nothing, or -1 if n is too small
+// for a record.
+int
+klog_drain(char *dst, int n, int swap)
+{
+  union {
+    struct klog_rec r;
+    char b[KLOG_RECMAX];
+  } t;
+  struct klog_merge *m = &drain_merge;
+  struct klog_rec *r;
+  int c, len, copied;
+
+  acquiresleep(&drain.lock);
+  if(m->n == 0 && swap){
+    for(c = 0; c < nring; c++)
+      ring_swap(c);
+    m->backward = 0;
+    m->drained = 1;
+    m->bound = 0xFFFFFFFF;
+    merge_start(m);
+  }
+  copied = 0;
+  while(m->n > 0){
+    c = m->heap[0];
+    r = merge_rec(m, c, m->start[c]);
+    len = rec_put(r, t.b, sizeof(t));
+    if(copied + len > n)
+      break;
+    if(copyto(dst + copied, t.b, len) < 0){
+      copied = -1;
+      break;
+    }
+    copied += len;
+    merge_next(m);
+  }
+  if(copied == 0 && m->n > 0)
+    copied = -1;
+  releasesleep(&drain.lock);
+  return copied;
+}
+
+// Sequence number the next record will get.
+uint
+klog_nextseq(void)
+{
+  return global_seq;
+}
+
+// Sleep until an entry with sequence number >= seq exists.
+// Returns -1 if the calling process is interrupted() while waiting.
+int
+klog_wait(uint seq)
+{
+  acquire(&klogwait.lock);
+  klogwait.waiters++;
+  __sync_synchronize();
+  while(global_seq <= seq){
+    if(interrupted()){
+      klogwait.waiters--;
+      release(&klogwait.lock);
+      return -1;
+    }
+    sleep(&klogwait, &klogwait.lock);
+  }
+  klogwait.waiters--;
+  release(&klogwait.lock);
+  return 0;
 }
 
 // Clear all logs
@@ -305,12 +1447,239 @@ klog_clear(void)
   int cpu_id;
   struct klog_cpu_buf *log;
   
-  for(cpu_id = 0; cpu_id < NCPU; cpu_id++){
-    log = &cpu_logs[cpu_id];
-    acquire(&log->lock);
+  for(cpu_id = 0; cpu_id < nring; cpu_id++){
+    log = cpu_logs[cpu_id];
+    acquire(&ring_lock[cpu_id]);
     log->head = 0;
+    log->tail = 0;
+    log->claim = 0;
     log->dropped = 0;
-    release(&log->lock);
+    release(&ring_lock[cpu_id]);
+  }
+}
+
+// Name tracepoint tp in name[0..n-1]: its event, or the start of
+// its format string.
+static void
+tp_name(struct klog_tp *tp, char *name, int n)
+{
+  struct klog_evtype *t;
+
+  if(tp->fmt)
+    safestrcpy(name, tp->fmt, n);
+  else if((t = klog_evtype(tp->type)) != 0)
+    safestrcpy(name, t->name, n);
+  else
+    safestrcpy(name, "?", n);
+}
+
+// Describe every tracepoint for kstat(KSTAT_TRACE).
+void
+klog_tp_stat(struct kstat_trace *st)
+{
+  struct klog_tp *tp;
+  int i;
+
+  st->ntp = __stop_ktrace - __start_ktrace;
+  for(i = 0; i < st->ntp && i < KSTAT_NTP; i++){
+    tp = &__start_ktrace[i];
+    safestrcpy(st->tp[i].site, tp->rl.site, sizeof(st->tp[i].site));
+    tp_name(tp, st->tp[i].name, sizeof(st->tp[i].name));
+    st->tp[i].level = tp->level;
+    st->tp[i].on = tp->on;
+  }
+}
+
+// Switch tracepoint i on or off.  Returns its old state, or -1 if
+// there is no such tracepoint.
+static int
+klog_tp_set(int i, int on)
+{
+  int old;
+
+  if(i < 0 || i >= __stop_ktrace - __start_ktrace)
+    return -1;
+  old = __start_ktrace[i].on;
+  __start_ktrace[i].on = on;
+  return old;
+}
+
+// Count a call of aggregating site tp with first argument v.
+void
+klog_agg(struct klog_tp *tp, uint v)
+{
+  struct klog_aggslot *a;
+  int slot, c;
+
+  if((slot = tp->agg) == 0)
+    return;
+  a = &aggtab[slot - 1];
+  pushcli();
+  c = cpuid();
+  a->cpu[c].n++;
+  a->cpu[c].sum += v;
+  a->cpu[c].hist[kstat_bucket(v)]++;
+  popcli();
+}
+
+// Switch tracepoint i to aggregating, its counts from zero (on),
+// or off.  Returns its old state, or -1 if there is no such
+// tracepoint or no slot for its counts.
+static int
+klog_tp_agg(int i, int on)
+{
+  struct klog_aggslot *a, *free;
+  struct klog_tp *tp;
+  int old;
+
+  if(i < 0 || i >= __stop_ktrace - __start_ktrace)
+    return -1;
+  tp = &__start_ktrace[i];
+  acquire(&agg_lock);
+  old = tp->on;
+  if(!on){
+    if(old == KLOG_TP_AGG)
+      tp->on = KLOG_TP_OFF;
+    release(&agg_lock);
+    return old;
+  }
+
+  // A free slot, or failing that one whose site stopped.
+  if(tp->agg == 0){
+    free = 0;
+    for(a = aggtab; a < &aggtab[KSTAT_NAGG]; a++){
+      if(a->tp == 0){
+        free = a;
+        break;
+      }
+      if(free == 0 && a->tp->on != KLOG_TP_AGG)
+        free = a;
+    }
+    if(free == 0){
+      release(&agg_lock);
+      return -1;
+    }
+    if(free->tp)
+      free->tp->agg = 0;
+    free->tp = tp;
+    tp->agg = free - aggtab + 1;
+  }
+  a = &aggtab[tp->agg - 1];
+  tp->on = KLOG_TP_OFF;
+  __sync_synchronize();
+  memset(a->cpu, 0, sizeof(a->cpu));
+  __sync_synchronize();
+  tp->on = KLOG_TP_AGG;
+  release(&agg_lock);
+  return old;
+}
+
+// Sum the counts of each slot over CPUs for kstat(KSTAT_AGG).
+void
+klog_agg_stat(struct kstat_agg *st)
+{
+  struct klog_aggslot *a;
+  struct kstat_aggtp *s;
+  int c, b;
+
+  acquire(&agg_lock);
+  st->nagg = 0;
+  for(a = aggtab; a < &aggtab[KSTAT_NAGG]; a++){
+    if(a->tp == 0)
+      continue;
+    s = &st->agg[st->nagg++];
+    memset(s, 0, sizeof(*s));
+    s->tp = a->tp - __start_ktrace;
+    s->on = a->tp->on;
+    safestrcpy(s->site, a->tp->rl.site, sizeof(s->site));
+    tp_name(a->tp, s->name, sizeof(s->name));
+    for(c = 0; c < NCPU; c++){
+      s->n += a->cpu[c].n;
+      s->sum += a->cpu[c].sum;
+      for(b = 0; b < KSTAT_NBUCKET; b++)
+        s->hist[b] += a->cpu[c].hist[b];
+    }
+  }
+  release(&agg_lock);
+}
+
+// Fill in the crash record for klog_init() of the next boot.
+static void
+save_rings(struct klog_save *s)
+{
+  extern char etext[];
+  int c;
+
+  s->magic = 0;
+  s->etext = (uint)etext;
+  s->data_size = ring_bytes;
+  s->ncpu = nring;
+  s->seq = global_seq;
+  for(c = 0; c < nring; c++)
+    s->ring[c] = *cpu_logs[c];
+  memmove(s->fmt, fmttab, sizeof(s->fmt));
+  s->sum = save_sum(s);
+  __sync_synchronize();
+  s->magic = KLOG_SAVE_MAGIC;
+}
+
+// Called by panic() with interrupts off, after the console has
+// stopped locking: save the rings for the next boot, then print
+// the last KLOG_PANICN records, oldest first, one line each:
+//
+//   seq ms cpu:pid level message
+//
+// Takes no lock, since the crashed CPU may hold any of them, and
+// does not wait for other CPUs' appends: a backward merge finds
+// where the last records start and a forward merge prints them,
+// both checking records as klog_snapshot() does.
+void
+klog_panic(void)
+{
+  static char *lv[] = { "D", "I", "W", "E" };
+  static uint once;
+  struct klog_merge m;
+  struct klog_rec *r;
+  char text[KLOG_MSGMAX];
+  uint head[NCPU], hi, lo, ms, cpu, pid;
+  int c, i, level;
+
+  if(nring == 0 || xchg(&once, 1))
+    return;
+  save_rings((struct klog_save*)P2V(KLOGKEEP));
+
+  m.bound = global_seq;
+  for(c = 0; c < nring; c++){
+    head[c] = cpu_logs[c]->head;
+    m.pos[c] = head[c];
+    m.stop[c] = cpu_logs[c]->tail;
+    if(head[c] - m.stop[c] > ring_bytes)
+      m.stop[c] = head[c];
+  }
+  m.backward = 1;
+  m.drained = 0;
+  merge_start(&m);
+  for(i = 0; i < KLOG_PANICN && merge_next(&m) != 0; i++)
+    ;
+
+  cprintf("klog: last %d records\n", i);
+  for(c = 0; c < nring; c++)
+    m.stop[c] = head[c];
+  m.backward = 0;
+  merge_start(&m);
+  while((r = merge_next(&m)) != 0){
+    rec_text(r, text);
+    hi = r->timestamp_hi;
+    lo = r->timestamp_lo;
+    level = r->level & 3;
+    cpu = r->cpu;
+    pid = r->pid;
+    if(!merge_valid(&m))
+      continue;
+    // The quotient must fit in 32 bits, or divl traps.
+    ms = hi < 1000000 ? div64((uint64)hi << 32 | lo, 1000000) : -1;
+    cprintf("%d %d %d:%d %s %s\n", m.lastseq, ms, cpu, pid,
+            lv[level], text);
   }
 }
 
@@ -322,12 +1691,138 @@ klog_get_dropped(void)
   uint total = 0;
   struct klog_cpu_buf *log;
   
-  for(cpu_id = 0; cpu_id < NCPU; cpu_id++){
-    log = &cpu_logs[cpu_id];
-    acquire(&log->lock);
+  // Each count is one word, read without stopping its writer.
+  for(cpu_id = 0; cpu_id < nring; cpu_id++){
+    log = cpu_logs[cpu_id];
     total += log->dropped;
-    release(&log->lock);
   }
   
   return total;
 }
+
+// Dropped count of one CPU's ring, or -1 if there is no such ring.
+static int
+klog_cpu_dropped(int cpu_id)
+{
+  uint n;
+
+  if(cpu_id < 0 || cpu_id >= nring)
+    return -1;
+  n = cpu_logs[cpu_id]->dropped;
+  return n;
+}
+
+// Log n records at level, as the kernel's own callers do, and
+// return the average TSC cycles a call took (for klogbench).
+// Records below the level threshold time the filtered path.
+static int
+klog_bench(int level, int n)
+{
+  uint64 t;
+  uint sum;
+  int i;
+
+  if(level < KLOG_DEBUG || level > KLOG_ERROR || n <= 0)
+    return -1;
+  sum = 0;
+  for(i = 0; i < n; i++){
+    t = rdtsc();
+    klog_printf_level(level, "klogbench %d", i);
+    sum += rdtsc() - t;
+  }
+  return sum / n;
+}
+
+// klogctl() system call: query or change klog settings.  The
+// KLOG_CTL_POLICY and KLOG_CTL_DEFER commands return the previous
+// value and leave it alone if arg is negative; KLOG_CTL_LEVEL
+// returns the subsystem's previous threshold.
+int
+klog_ctl(int cmd, int arg)
+{
+  int old, ss, level;
+
+  switch(cmd){
+  case KLOG_CTL_POLICY:
+    old = klog_policy;
+    if(arg == KLOG_OVERWRITE || arg == KLOG_DROPNEW)
+      klog_policy = arg;
+    else if(arg >= 0)
+      return -1;
+    return old;
+  case KLOG_CTL_DEFER:
+    old = klog_defer;
+    if(arg >= 0)
+      klog_defer = arg != 0;
+    return old;
+  case KLOG_CTL_DROPPED:
+    return klog_cpu_dropped(arg);
+  case KLOG_CTL_CLEAR:
+    klog_clear();
+    return 0;
+  case KLOG_CTL_FLUSH:
+    klogspill_flush();
+    return 0;
+  case KLOG_CTL_SYSTRACE:
+    return systrace_set(arg);
+  case KLOG_CTL_SCHEDTRACE:
+    old = klog_schedtrace;
+    if(arg >= 0)
+      klog_schedtrace = arg != 0;
+    return old;
+  case KLOG_CTL_LOCKSTAT:
+    return lockstat_set(arg);
+  case KLOG_CTL_IRQSTAT:
+    return irqstat_set(arg);
+  case KLOG_CTL_TRACE:
+    return klog_tp_set(arg >> 1, arg & 1);
+  case KLOG_CTL_AGG:
+    return klog_tp_agg(arg >> 1, arg & 1);
+  case KLOG_CTL_RATELIMIT:
+    old = klog_rl_burst << 16 | klog_rl_pertick;
+    if(arg >= 0){
+      klog_rl_burst = arg >> 16;
+      klog_rl_pertick = arg & 0xffff;
+    }
+    return old;
+  case KLOG_CTL_BENCH:
+    return klog_bench((arg >> 24) & 0xff, arg & 0xffffff);
+  case KLOG_CTL_LEVEL:
+    ss = (arg >> 8) & 0xff;
+    level = arg & 0xff;
+    if(level > KLOG_ERROR + 1)   // ERROR+1 silences a subsystem
+      return -1;
+    if(ss == KLOG_SS_ALL){
+      for(ss = 0; ss < KLOG_NSUBSYS; ss++)
+        klog_minlevel[ss] = level;
+      return 0;
+    }
+    if(ss >= KLOG_NSUBSYS)
+      return -1;
+    old = klog_minlevel[ss];
+    klog_minlevel[ss] = level;
+    return old;
+  }
+  return -1;
+}
+
+// Map the klog header page and every ring read-only at KLOGMAP in
+// process p, so a reader can consume entries in place (see the
+// consistency rule in klog.h).  Returns the user address of the
+// struct klog_map header, or -1.
+int
+klog_map(struct proc *p)
+{
+  int i;
+
+  if(mapkernel(p->pgdir, KLOGMAP, &maphdr, PGSIZE, 0) < 0)
+    return -1;
+  for(i = 0; i < 2*nring; i++)
+    if(mapkernel(p->pgdir, KLOGMAP + PGSIZE + i*ring_bytes,
+                 ringdata[i/2][i%2], ring_bytes, 0) < 0)
+      return -1;
+  if(mapkernel(p->pgdir, KLOGMAP + maphdr.hdr.fmt_off, &fmtpage,
+               sizeof(fmtpage), 0) < 0)
+    return -1;
+  return KLOGMAP;
+}
@@ -3,9 +3,14 @@
 #define KLOG_H
 
 #include "types.h"
-#include "spinlock.h"
+#include "param.h"
+#include "klogev.h"
 
-// Log entry structure
+#define KLOG_MSGLEN 64
+
+// Fixed-size log entry returned by getklog() and /dev/klog.
+// The rings themselves hold variable-length struct klog_rec;
+// klog_rec_entry() converts, truncating msg.
 struct klog_entry {
   uint seq;           // Global sequence number
   uint timestamp_hi;  // High 32 bits of timestamp (nanoseconds)
@@ -13,37 +18,299 @@ struct klog_entry {
   uint cpu;           // CPU ID
   uint pid;           // Process ID (0 for kernel)
   uint level;         // Log level (DEBUG, INFO, WARN, ERROR)
-  char msg[64];       // Log message
+  char msg[KLOG_MSGLEN]; // Log message
+};
+
+// Query for getklog2(): entries with seq >= minseq that match every
+// given field, oldest first.  getklog2() moves minseq past what it
+// returned, so the same query can be passed again for the rest.
+// With KLOG_Q_ARCHIVE, records of this boot already overwritten in
+// the rings come from the disk spill instead, as text.
+struct klog_query {
+  uint minseq;        // First sequence number wanted
+  uint levels;        // Bit 1<<level for each level wanted; 0 for all
+  int pid;            // Only this pid, or -1
+  int cpu;            // Only this CPU, or -1
+  int max;            // Most entries to return
+  uint events;        // Bit 1<<id for each typed event wanted (klogev.h);
+                      // 0 for all records, text and events alike
+  uint maxseq;        // Last sequence number wanted, or 0 for no limit
+  uint flags;         // KLOG_Q_*
+  uint64 mintime;     // Only records stamped at or after (ns)
+  uint64 maxtime;     // and at or before, or 0 for no limit
 };
 
-#define KLOG_BUF_SIZE 256  // Per-CPU buffer size (must be power of 2)
+#define KLOG_Q_ARCHIVE 1   // Serve older records from the spill
+
+// Variable-length log record.  len covers the header, the message
+// rounded up to 4 bytes, and a trailing copy of the first word
+// (len, level, cpu) that lets readers walk a ring backwards.
+struct klog_rec {
+  ushort len;         // Bytes in this record, always a multiple of 4
+  uchar level;        // Log level, possibly | KLOG_DEFERRED
+  uchar cpu;          // CPU ID
+  uint seq;           // Global sequence number
+  uint timestamp_hi;  // ns since boot, high 32 bits
+  uint timestamp_lo;  // ns since boot, low 32 bits
+  uint pid;           // Process ID (0 for kernel)
+  char msg[];         // NUL-terminated text, or struct klog_args
+};
+
+#define KLOG_MSGMAX  128   // Longest message, NUL included
+#define KLOG_RECHDR  sizeof(struct klog_rec)
+#define KLOG_RECLEN(n) (KLOG_RECHDR + (((n) + 3) & ~3) + 4)
+#define KLOG_RECMAX  KLOG_RECLEN(KLOG_MSGMAX)
+
+// A record that does not fit before the end of the ring goes at
+// the start instead; the gap is filled by one KLOG_PAD record,
+// which readers skip.  It may be as short as its single word.
+#define KLOG_PAD 0xff
 
-// Per-CPU log buffer
+// Deferred-format records.  With KLOG_DEFERRED set in level, msg
+// is not text but a struct klog_args: the index of the format
+// string in the klog format table and the raw 32-bit arguments.
+// A %s argument is copied into msg after the argument words and
+// its word holds the string's offset within msg.  Snapshots and
+// /dev/klog return rendered text; only klog_map() readers see the
+// raw form.
+#define KLOG_DEFERRED 0x80
+#define KLOG_NARGS    15
+#define KLOG_NFMT     64    // Format table slots
+#define KLOG_FMTLEN   64    // Longest deferrable format string
+
+struct klog_args {
+  ushort fmt;         // Format table index
+  ushort nargs;       // Words used in arg[]
+  uint arg[KLOG_NARGS];
+};
+
+// Per-CPU log ring.  Records live in bytes [tail, head) of the
+// ring's data, positions being byte counts that only grow and are
+// taken mod the ring size (KLOGSIZE in param.h, a power of 2).
+// The data pages contain nothing but records, so klog_map() can map
+// them read-only into a reader; these counters live in the header
+// page.  The owning CPU sets claim to the new head before writing
+// anything and bumps head once the record is complete.  A lock-free
+// reader that copied the record at position p may trust the copy
+// if, read afterwards, claim - p <= ring size; otherwise it was
+// overwritten.  The kernel's own readers work the same way, so
+// claim is in effect the ring's sequence counter and a writer
+// never waits for a reader.
+//
+// Each ring is a pair of halves; the writer fills half active.
+// klog_drain() swaps them, moving claim, head and tail more than
+// a ring ahead first, so copies from the old half fail the check.
 struct klog_cpu_buf {
-  struct spinlock lock;
-  struct klog_entry entries[KLOG_BUF_SIZE];
-  uint head;          // Next write position
-  uint dropped;       // Count of dropped entries due to overflow
+  uint head;          // End of the newest published record
+  uint tail;          // Start of the oldest record
+  uint claim;         // Bytes claimed by the writer
+  uint dropped;       // Records lost to overflow (evicted or refused)
+  uint active;        // Half being written, 0 or 1
+};
+
+// Header page at the start of a klog_map() mapping; half h of
+// ring i follows at ring_off + i*ring_size + h*data_size.
+struct klog_map {
+  uint magic;         // KLOG_MAP_MAGIC
+  uint ncpu;          // Number of rings
+  uint data_size;     // Bytes of record data per ring
+  uint ring_off;      // Offset of ring 0 from the header
+  uint ring_size;     // Distance between consecutive rings
+  uint fmt_off;       // Offset of the format string table
+  uint nfmt;          // Format strings in the table
+  uint fmt_len;       // Bytes per format string slot
+  struct klog_cpu_buf ring[NCPU];  // Counters of each ring
 };
 
+#define KLOG_MAP_MAGIC 0x676f6c6b  // "klog"
+
+// klogctl() commands
+#define KLOG_CTL_POLICY  1  // Set full-ring policy to arg
+#define KLOG_CTL_DEFER   2  // Enable (1) or disable (0) deferred formatting
+#define KLOG_CTL_DROPPED 3  // Return records lost by CPU arg's ring
+#define KLOG_CTL_CLEAR   4  // Empty every ring
+#define KLOG_CTL_LEVEL   5  // arg = subsys<<8 | level: set subsystem threshold
+#define KLOG_CTL_FLUSH   6  // Ask the spill thread to write to disk now
+#define KLOG_CTL_SYSTRACE 7 // Trace syscall latency of pid arg (-1 all, 0 off)
+#define KLOG_CTL_SCHEDTRACE 8 // Record scheduler events (1) or not (0)
+#define KLOG_CTL_BENCH   9  // arg = level<<24 | n: time n klog calls
+#define KLOG_CTL_LOCKSTAT 10 // Count lock waits from zero (1), stop (0)
+#define KLOG_CTL_RATELIMIT 11 // arg = burst<<16 | tokens per tick (0 off)
+#define KLOG_CTL_TRACE   12 // arg = i<<1 | on: switch tracepoint i (KSTAT_TRACE)
+#define KLOG_CTL_IRQSTAT 13 // Time interrupts from zero (1), stop (0)
+#define KLOG_CTL_AGG     14 // arg = i<<1 | on: aggregate tracepoint i (KSTAT_AGG)
+
+// Full-ring policies
+#define KLOG_OVERWRITE 0    // Evict the oldest records (default)
+#define KLOG_DROPNEW   1    // Keep old records, drop new ones
+
 // Log levels
 #define KLOG_DEBUG 0
 #define KLOG_INFO  1
 #define KLOG_WARN  2
 #define KLOG_ERROR 3
 
+// Subsystems.  A file tags its log calls by defining KLOG_SUBSYS
+// before including klog.h; untagged calls belong to KLOG_SS_KERNEL.
+#define KLOG_SS_KERNEL 0
+#define KLOG_SS_FS     1
+#define KLOG_SS_PROC   2
+#define KLOG_SS_EXEC   3
+#define KLOG_SS_USER   4    // Records written to /dev/klog
+#define KLOG_NSUBSYS   8
+#define KLOG_SS_ALL    0xff   // KLOG_CTL_LEVEL: every subsystem
+
+#ifndef KLOG_SUBSYS
+#define KLOG_SUBSYS KLOG_SS_KERNEL
+#endif
+
+// Least level compiled in (make KLOG_MIN_LEVEL=n).  Calls below it
+// are constant-false and the compiler drops them, arguments and all.
+#ifndef KLOG_MIN_LEVEL
+#define KLOG_MIN_LEVEL KLOG_DEBUG
+#endif
+
+// Least level recorded per subsystem, set with klogctl().  The
+// macros below test it before evaluating any argument, so a
+// filtered call costs one load and compare.
+extern uchar klog_minlevel[KLOG_NSUBSYS];
+#define klog_enabled(ss, level) \
+  ((level) >= KLOG_MIN_LEVEL && (level) >= klog_minlevel[ss])
+
+// Per-call-site token bucket.  Every klog_log() and klog_ev() site
+// has one: a call spends a token, and a site out of tokens drops
+// the call before any argument is evaluated, counting it.  Buckets
+// refill from the timer's ticks (trap.c), klog_rl_pertick tokens a
+// tick up to klog_rl_burst, when the site is next reached; the
+// refill first logs how many calls it dropped.  klog_rl_pertick 0
+// turns limiting off.
+#define KLOG_RL_BURST   32  // Default bucket size
+#define KLOG_RL_PERTICK 4   // Default tokens added per tick
+
+struct klog_rl {
+  uint tick;          // ticks at the last refill
+  int tokens;         // May go below 0 under contention
+  uint suppressed;    // Calls dropped since the last refill
+  const char *site;   // "file:line"
+};
+
+#define KLOG_STR_(x) #x
+#define KLOG_STR(x) KLOG_STR_(x)
+#define KLOG_RL_INIT { 0, KLOG_RL_BURST, 0, __FILE__ ":" KLOG_STR(__LINE__) }
+
+extern uint ticks;
+extern int klog_rl_burst;
+extern int klog_rl_pertick;
+void klog_rl_refill(struct klog_rl *rl);
+
+static inline int
+klog_rl_ok(struct klog_rl *rl)
+{
+  if(klog_rl_pertick == 0)
+    return 1;
+  if(rl->tick != ticks)
+    klog_rl_refill(rl);
+  if(__sync_fetch_and_sub(&rl->tokens, 1) > 0)
+    return 1;
+  __sync_fetch_and_add(&rl->suppressed, 1);
+  return 0;
+}
+
+// Record a scheduler event if tracing is on.  Safe to call with
+// ptable.lock held: unlike klog_printf() it never wakes readers.
+extern int klog_schedtrace;
+#define klog_sched(type, pid, chan) \
+  do { if(klog_schedtrace) klog_event(type, pid, (uint)(chan)); } while(0)
+
 // Kernel logging functions
 void klog_init(void);
+void klog_event(int type, int pid, uint chan);
+void klog_event_sub(int level, int type, ...);
 void klog_printf(const char *fmt, ...);
 void klog_printf_level(int level, const char *fmt, ...);
-int klog_snapshot(struct klog_entry *buf, int max_entries);
+void klog_printf_sub(int subsys, int level, const char *fmt, ...);
+void klog_user(int level, char *msg);
+int klog_snapshot(char *buf, int n);
+int klog_read(uint *seq, char *buf, int n);
+int klog_wait(uint seq);
+int klog_drain(char *dst, int n, int swap);
+void klog_rec_entry(struct klog_rec *r, struct klog_entry *e);
+extern int klog_defer;
+extern int klog_policy;
 void klog_clear(void);
 uint klog_get_dropped(void);
+uint klog_nextseq(void);
+int klog_ctl(int cmd, int arg);
+struct proc;
+int klog_map(struct proc *p);
+
+// Static tracepoints.  Every klog_log() and klog_ev() call site
+// compiled in is one: its struct klog_tp goes in section "ktrace", which
+// kernel.ld gathers between __start_ktrace and __stop_ktrace, so
+// kstat(KSTAT_TRACE) can list the sites and klogctl(KLOG_CTL_TRACE)
+// switch each on or off.  A site that is off costs a load and an
+// untaken branch, ahead of the level check and the arguments.
+// Sites declared with klog_ev_off() start out off.
+//
+// A site switched to aggregate (klogctl(KLOG_CTL_AGG)) records
+// nothing: klog_agg() counts its calls and a log2 histogram of its
+// first argument, such as the byte count of a read event, per CPU,
+// for kstat(KSTAT_AGG).  Neither the klogctl() level nor the rate
+// limit applies; KLOG_MIN_LEVEL does, since it leaves no site.
+#define KLOG_TP_OFF 0
+#define KLOG_TP_ON  1
+#define KLOG_TP_AGG 2
+
+struct klog_tp {
+  volatile uchar on;  // KLOG_TP_*
+  uchar level;
+  uchar type;         // Event ID, or 0 at a text site
+  uchar agg;          // Slot of its counts + 1, or 0 (klog.c)
+  const char *fmt;    // Format string of a text site
+  struct klog_rl rl;  // Its site names the call: "file:line"
+};
+
+void klog_agg(struct klog_tp *tp, uint v);
+
+#define KLOG_TP(on, level, type, fmt) \
+  static struct klog_tp _tp __attribute__((section("ktrace"))) = \
+    { on, level, type, 0, fmt, KLOG_RL_INIT }
+#define klog_tp_ok(level, arg) \
+  (__builtin_expect(_tp.on, 0) && \
+   (_tp.on != KLOG_TP_AGG ? \
+    klog_enabled(KLOG_SUBSYS, level) && klog_rl_ok(&_tp.rl) : \
+    (klog_agg(&_tp, (uint)(arg)), 0)))
+
+// The first of a call's arguments, or 0 if it has none.
+#define KLOG_ARG1(x, a, ...) (a)
+#define klog_arg1(...) KLOG_ARG1(0, ##__VA_ARGS__, 0)
+
+// Convenience macros.  The constant test comes first, so a site
+// below KLOG_MIN_LEVEL leaves no tracepoint and no code behind;
+// a site above it refers to its _tp, which keeps it.
+#define klog_log(level, fmt, ...) do { \
+  if((level) >= KLOG_MIN_LEVEL){ \
+    KLOG_TP(1, level, 0, fmt); \
+    if(klog_tp_ok(level, klog_arg1(__VA_ARGS__))) \
+      klog_printf_sub(KLOG_SUBSYS, level, fmt, ##__VA_ARGS__); \
+  } \
+} while(0)
+#define klog_debug(fmt, ...) klog_log(KLOG_DEBUG, fmt, ##__VA_ARGS__)
+#define klog_info(fmt, ...)  klog_log(KLOG_INFO, fmt, ##__VA_ARGS__)
+#define klog_warn(fmt, ...)  klog_log(KLOG_WARN, fmt, ##__VA_ARGS__)
+#define klog_error(fmt, ...) klog_log(KLOG_ERROR, fmt, ##__VA_ARGS__)
 
-// Convenience macros
-#define klog_debug(fmt, ...) klog_printf_level(KLOG_DEBUG, fmt, ##__VA_ARGS__)
-#define klog_info(fmt, ...)  klog_printf_level(KLOG_INFO, fmt, ##__VA_ARGS__)
-#define klog_warn(fmt, ...)  klog_printf_level(KLOG_WARN, fmt, ##__VA_ARGS__)
-#define klog_error(fmt, ...) klog_printf_level(KLOG_ERROR, fmt, ##__VA_ARGS__)
+// Record typed event type (klogev.h) at level, its fields given in
+// the order of its table entry.
+#define klog_ev_tp(on, level, type, ...) do { \
+  if((level) >= KLOG_MIN_LEVEL){ \
+    KLOG_TP(on, level, type, 0); \
+    if(klog_tp_ok(level, klog_arg1(__VA_ARGS__))) \
+      klog_event_sub(level, type, ##__VA_ARGS__); \
+  } \
+} while(0)
+#define klog_ev(level, type, ...) klog_ev_tp(1, level, type, ##__VA_ARGS__)
+#define klog_ev_off(level, type, ...) \
+  klog_ev_tp(0, level, type, ##__VA_ARGS__)
 
 #endif // KLOG_H
@@ -3,6 +3,17 @@
 #include "stat.h"
 #include "user.h"
 #include "fcntl.h"
+#include "klogev.h"
+#include "kstat.h"
+
+// Does s start with p?
+static int
+prefix(char *s, char *p)
+{
+  while(*p && *s == *p)
+    s++, p++;
+  return *p == 0;
+}
 
 void
 test_getklog(void)
@@ -49,6 +60,7 @@ test_klog_device(void)
   int fd;
   struct klog_entry entry;
   int n, count = 0;
+  int last = -1;
   
   printf(1, "\nTesting /dev/klog device...\n");
   
@@ -65,6 +77,10 @@ test_klog_device(void)
   while(count < 5 && (n = read(fd, &entry, sizeof(entry))) == sizeof(entry)){
     printf(1, "  [%d] CPU%d PID%d: %s\n",
            entry.seq, entry.cpu, entry.pid, entry.msg);
+    // The device streams: every read must return newer entries.
+    if((int)entry.seq <= last)
+      printf(2, "ERROR: /dev/klog repeated entry %d\n", entry.seq);
+    last = entry.seq;
     count++;
   }
   
@@ -72,6 +88,467 @@ test_klog_device(void)
   printf(1, "Read %d entries from device\n", count);
 }
 
+// Overflow accounting: with KLOG_DROPNEW the rings keep their
+// oldest records and count what they refuse.
+void
+test_klogctl(void)
+{
+  int old, cpu, n;
+  uint dropped;
+
+  printf(1, "\nTesting klogctl() overflow policy...\n");
+
+  old = klogctl(KLOG_CTL_POLICY, KLOG_DROPNEW);
+  if(old < 0 || klogctl(KLOG_CTL_POLICY, -1) != KLOG_DROPNEW){
+    printf(2, "ERROR: klogctl() cannot set policy\n");
+    return;
+  }
+  klogctl(KLOG_CTL_CLEAR, 0);
+
+  // Log many more records than this CPU's ring holds.
+  klogctl(KLOG_CTL_BENCH, KLOG_INFO << 24 | 20000);
+
+  dropped = 0;
+  for(cpu = 0; (n = klogctl(KLOG_CTL_DROPPED, cpu)) >= 0; cpu++)
+    dropped += n;
+  klogctl(KLOG_CTL_POLICY, old);
+
+  printf(1, "Dropped %d records on %d rings\n", dropped, cpu);
+  if(dropped == 0)
+    printf(2, "ERROR: full rings did not count dropped records\n");
+}
+
+// getklog2() filters in the kernel: ask for this process's records.
+void
+test_getklog2(void)
+{
+  struct klog_query q;
+  struct klog_entry e[8];
+  char buf[64];
+  int i, n, p[2], pid;
+
+  printf(1, "\nTesting getklog2() filters...\n");
+
+  pid = getpid();
+  if(pipe(p) < 0){
+    printf(2, "ERROR: pipe failed\n");
+    return;
+  }
+  memset(buf, 0, sizeof(buf));
+  for(i = 0; i < 4; i++){
+    write(p[1], buf, sizeof(buf));
+    read(p[0], buf, sizeof(buf));
+  }
+  close(p[0]);
+  close(p[1]);
+
+  memset(&q, 0, sizeof(q));
+  q.pid = pid;
+  q.cpu = -1;
+  q.max = 8;
+  n = getklog2(&q, e);
+  if(n < 0){
+    printf(2, "ERROR: getklog2() failed\n");
+    return;
+  }
+  for(i = 0; i < n; i++){
+    if(e[i].pid != pid)
+      printf(2, "ERROR: getklog2() returned pid %d\n", e[i].pid);
+    if(e[i].seq >= q.minseq)
+      printf(2, "ERROR: getklog2() did not move minseq\n");
+  }
+  printf(1, "Found %d of our entries, next seq %d\n", n, q.minseq);
+}
+
+// splice() moves /dev/klog records into a pipe without a user copy.
+void
+test_splice(void)
+{
+  struct klog_entry e[4];
+  int fd, p[2], n, i;
+
+  printf(1, "\nTesting splice() from /dev/klog...\n");
+
+  mknod("klog", 2, KLOG);
+  if((fd = open("klog", O_RDONLY)) < 0 || pipe(p) < 0){
+    printf(2, "ERROR: cannot set up splice test\n");
+    return;
+  }
+  n = splice(fd, p[1], sizeof(e));
+  close(fd);
+  close(p[1]);
+  if(n <= 0 || n % sizeof(e[0]) != 0){
+    printf(2, "ERROR: splice() returned %d\n", n);
+    close(p[0]);
+    return;
+  }
+  if(read(p[0], e, sizeof(e)) != n)
+    printf(2, "ERROR: pipe holds a different count than spliced\n");
+  close(p[0]);
+  for(i = 1; i < n / sizeof(e[0]); i++)
+    if(e[i].seq <= e[i-1].seq)
+      printf(2, "ERROR: spliced records out of order\n");
+  printf(1, "Spliced %d entries\n", n / sizeof(e[0]));
+}
+
+// Snapshots taken while another process fills the rings must
+// still come out in order; getklog() no longer stops the writers.
+void
+test_snapshot_race(void)
+{
+  static struct klog_entry e[32];
+  int i, j, n, pid, bad;
+
+  printf(1, "\nTesting getklog() against a busy writer...\n");
+
+  if((pid = fork()) < 0){
+    printf(2, "ERROR: fork failed\n");
+    return;
+  }
+  if(pid == 0){
+    klogctl(KLOG_CTL_BENCH, KLOG_INFO << 24 | 20000);
+    exit();
+  }
+  bad = 0;
+  for(i = 0; i < 200; i++){
+    n = getklog(e, 32);
+    for(j = 1; j < n; j++)
+      if(e[j].seq <= e[j-1].seq)
+        bad++;
+  }
+  wait();
+  if(bad)
+    printf(2, "ERROR: %d entries out of order\n", bad);
+  else
+    printf(1, "Snapshots stayed in order\n");
+}
+
+// /dev/klogdrain hands back what the rings held, in order, once.
+void
+test_drain(void)
+{
+  static char buf[2048];
+  struct klog_rec *r;
+  uint last;
+  int fd, n, off, count, bad;
+
+  printf(1, "\nTesting /dev/klogdrain...\n");
+
+  klogctl(KLOG_CTL_BENCH, KLOG_INFO << 24 | 100);
+  mknod("klogdrain", KLOGDRAIN, 0);
+  if((fd = open("klogdrain", O_RDONLY)) < 0){
+    printf(2, "ERROR: cannot open klogdrain\n");
+    return;
+  }
+  count = bad = 0;
+  last = 0;
+  while((n = read(fd, buf, sizeof(buf))) > 0){
+    for(off = 0; off < n; off += r->len){
+      r = (struct klog_rec*)(buf + off);
+      if(count++ > 0 && r->seq <= last)
+        bad++;
+      last = r->seq;
+    }
+  }
+  close(fd);
+  if(n < 0 || count < 100)
+    printf(2, "ERROR: drained %d records\n", count);
+  else if(bad)
+    printf(2, "ERROR: %d drained records out of order\n", bad);
+  else
+    printf(1, "Drained %d records\n", count);
+}
+
+// Typed events can be selected in the kernel: our own forks only.
+void
+test_events(void)
+{
+  struct klog_query q;
+  struct klog_entry e[8];
+  int i, n, pid;
+
+  printf(1, "\nTesting getklog2() event selection...\n");
+
+  if((pid = fork()) == 0)
+    exit();
+  if(pid > 0)
+    wait();
+  memset(&q, 0, sizeof(q));
+  q.pid = getpid();
+  q.cpu = -1;
+  q.max = 8;
+  q.events = 1 << KLOG_EV_FORK;
+  n = getklog2(&q, e);
+  if(n <= 0){
+    printf(2, "ERROR: no fork events\n");
+    return;
+  }
+  for(i = 0; i < n; i++)
+    if(e[i].pid != q.pid || !prefix(e[i].msg, "fork:"))
+      printf(2, "ERROR: getklog2() returned %s\n", e[i].msg);
+  printf(1, "Found %d fork events: %s\n", n, e[n-1].msg);
+}
+
+// A storm of writes from one call site is cut down to its bucket
+// and summed up in a "suppressed" record once the bucket refills.
+void
+test_ratelimit(void)
+{
+  struct klog_query q;
+  struct klog_entry e[8];
+  char buf[64];
+  int i, n, p[2], found;
+
+  printf(1, "\nTesting klog rate limiting...\n");
+
+  if(pipe(p) < 0){
+    printf(2, "ERROR: pipe failed\n");
+    return;
+  }
+  memset(buf, 0, sizeof(buf));
+  for(i = 0; i < 200; i++){
+    write(p[1], buf, sizeof(buf));
+    read(p[0], buf, sizeof(buf));
+  }
+  sleep(2);
+  write(p[1], buf, sizeof(buf));
+  close(p[0]);
+  close(p[1]);
+
+  memset(&q, 0, sizeof(q));
+  q.levels = 1 << KLOG_WARN;
+  q.pid = getpid();
+  q.cpu = -1;
+  q.max = 8;
+  found = 0;
+  while((n = getklog2(&q, e)) > 0)
+    for(i = 0; i < n; i++)
+      if(prefix(e[i].msg, "klog: suppressed"))
+        found++;
+  if(found == 0)
+    printf(2, "ERROR: no suppressed-calls record\n");
+  else
+    printf(1, "Found %d suppressed-calls records\n", found);
+}
+
+// One write() of several records to /dev/klog logs all of them, in
+// order and stamped with this process's pid.  The batch is larger
+// than a file system write chunk, and a cut-off record at its end
+// is discarded, not refused.
+void
+test_inject(void)
+{
+  static char buf[2048];
+  struct klog_query q;
+  struct klog_entry e[16];
+  struct klog_rec *r;
+  int i, n, fd, off, found;
+
+  printf(1, "\nTesting writes to /dev/klog...\n");
+
+  off = 0;
+  for(i = 0; i < 30; i++){
+    r = (struct klog_rec*)(buf + off);
+    memset(r, 0, sizeof(*r) + 16);
+    r->len = sizeof(*r) + 16;
+    r->level = KLOG_WARN;
+    strcpy(r->msg, "inject 0");
+    r->msg[7] = '0' + i % 10;
+    off += r->len;
+  }
+  r = (struct klog_rec*)(buf + off);
+  memset(r, 0, sizeof(*r));
+  r->len = sizeof(*r) + 64;     // longer than what follows
+  r->level = KLOG_WARN;
+  off += sizeof(*r);
+  mknod("klog", 2, KLOG);
+  if((fd = open("klog", O_WRONLY)) < 0){
+    printf(2, "ERROR: Cannot open /dev/klog for writing\n");
+    return;
+  }
+  if((n = write(fd, buf, off)) != off)
+    printf(2, "ERROR: write to /dev/klog took %d of %d bytes\n", n, off);
+  close(fd);
+
+  memset(&q, 0, sizeof(q));
+  q.levels = 1 << KLOG_WARN;
+  q.pid = getpid();
+  q.cpu = -1;
+  q.max = 16;
+  found = 0;
+  while((n = getklog2(&q, e)) > 0)
+    for(i = 0; i < n; i++)
+      if(prefix(e[i].msg, "inject ")){
+        if(e[i].msg[7] != '0' + found % 10)
+          printf(2, "ERROR: injected record out of order: %s\n", e[i].msg);
+        found++;
+      }
+  if(found < 30)
+    printf(2, "ERROR: found %d of 30 injected records\n", found);
+  else
+    printf(1, "Found %d injected records\n", found);
+}
+
+// Our fork events since the newest record when called, after a
+// fork with the fork tracepoint tp switched on or off.
+static int
+forks_traced(int tp, int on)
+{
+  struct klog_query q;
+  struct klog_entry e[4];
+  int pid;
+
+  memset(&q, 0, sizeof(q));
+  if(getklog(e, 1) == 1)
+    q.minseq = e[0].seq + 1;
+  klogctl(KLOG_CTL_TRACE, tp << 1 | on);
+  if((pid = fork()) == 0)
+    exit();
+  if(pid > 0)
+    wait();
+  q.pid = getpid();
+  q.cpu = -1;
+  q.max = 4;
+  q.events = 1 << KLOG_EV_FORK;
+  return getklog2(&q, e);
+}
+
+// A tracepoint switched off records nothing.
+void
+test_tracepoints(void)
+{
+  static struct kstat_trace st;
+  int i, n;
+
+  printf(1, "\nTesting tracepoints...\n");
+
+  if(kstat(KSTAT_TRACE, &st, sizeof(st)) < 0){
+    printf(2, "ERROR: kstat(KSTAT_TRACE) failed\n");
+    return;
+  }
+  for(i = 0; i < st.ntp && i < KSTAT_NTP; i++)
+    if(strcmp(st.tp[i].name, "fork") == 0)
+      break;
+  if(i == st.ntp || i == KSTAT_NTP){
+    printf(2, "ERROR: no fork tracepoint among %d\n", st.ntp);
+    return;
+  }
+  if((n = forks_traced(i, 0)) != 0)
+    printf(2, "ERROR: %d fork events with the tracepoint off\n", n);
+  if((n = forks_traced(i, 1)) != 1)
+    printf(2, "ERROR: %d fork events with the tracepoint on\n", n);
+  printf(1, "%d tracepoints, fork at %s\n", st.ntp, st.tp[i].site);
+}
+
+// An aggregated tracepoint counts its calls and records nothing.
+void
+test_agg(void)
+{
+  static struct kstat_trace st;
+  static struct kstat_agg ag;
+  struct klog_query q;
+  struct klog_entry e[4];
+  int i, k, n, pid;
+
+  printf(1, "\nTesting tracepoint aggregation...\n");
+
+  if(kstat(KSTAT_TRACE, &st, sizeof(st)) < 0){
+    printf(2, "ERROR: kstat(KSTAT_TRACE) failed\n");
+    return;
+  }
+  for(i = 0; i < st.ntp && i < KSTAT_NTP; i++)
+    if(strcmp(st.tp[i].name, "fork") == 0)
+      break;
+  if(i == st.ntp || i == KSTAT_NTP){
+    printf(2, "ERROR: no fork tracepoint\n");
+    return;
+  }
+
+  memset(&q, 0, sizeof(q));
+  if(getklog(e, 1) == 1)
+    q.minseq = e[0].seq + 1;
+  if(klogctl(KLOG_CTL_AGG, i << 1 | 1) < 0){
+    printf(2, "ERROR: cannot aggregate tracepoint %d\n", i);
+    return;
+  }
+  for(k = 0; k < 3; k++){
+    if((pid = fork()) == 0)
+      exit();
+    if(pid > 0)
+      wait();
+  }
+  klogctl(KLOG_CTL_AGG, i << 1);
+  klogctl(KLOG_CTL_TRACE, i << 1 | 1);
+
+  q.pid = getpid();
+  q.cpu = -1;
+  q.max = 4;
+  q.events = 1 << KLOG_EV_FORK;
+  if((n = getklog2(&q, e)) != 0)
+    printf(2, "ERROR: %d fork events while aggregating\n", n);
+  if(kstat(KSTAT_AGG, &ag, sizeof(ag)) < 0){
+    printf(2, "ERROR: kstat(KSTAT_AGG) failed\n");
+    return;
+  }
+  for(k = 0; k < ag.nagg; k++)
+    if(ag.agg[k].tp == i)
+      break;
+  if(k == ag.nagg)
+    printf(2, "ERROR: tracepoint %d has no counts\n", i);
+  else if(ag.agg[k].n < 3 || ag.agg[k].sum < 3 * getpid())
+    printf(2, "ERROR: counted %d forks, parents summed %d\n",
+           ag.agg[k].n, (uint)ag.agg[k].sum);
+  else
+    printf(1, "%d forks counted at %s\n", ag.agg[k].n, ag.agg[k].site);
+}
+
+// KLOG_Q_ARCHIVE reaches a record on disk after the rings lose it.
+void
+test_archive(void)
+{
+  static char buf[sizeof(struct klog_rec) + 20];
+  struct klog_query q;
+  struct klog_entry e[4];
+  struct klog_rec *r;
+  int fd, n;
+
+  printf(1, "\nTesting getklog2() from the spill...\n");
+
+  r = (struct klog_rec*)buf;
+  r->len = sizeof(buf);
+  r->level = KLOG_INFO;
+  strcpy(r->msg, "klog_test: archive");
+  mknod("klog", 2, KLOG);
+  if((fd = open("klog", O_WRONLY)) < 0 || write(fd, buf, sizeof(buf)) != sizeof(buf)){
+    printf(2, "ERROR: cannot write klog\n");
+    close(fd);
+    return;
+  }
+  close(fd);
+  if(getklog(e, 1) != 1){
+    printf(2, "ERROR: getklog() failed\n");
+    return;
+  }
+  klogctl(KLOG_CTL_FLUSH, 0);
+  sleep(50);
+  klogctl(KLOG_CTL_CLEAR, 0);
+
+  memset(&q, 0, sizeof(q));
+  q.pid = -1;
+  q.cpu = -1;
+  q.max = 4;
+  q.minseq = q.maxseq = e[0].seq;
+  if((n = getklog2(&q, e + 1)) != 0)
+    printf(2, "ERROR: %d entries from cleared rings\n", n);
+  q.minseq = e[0].seq;
+  q.flags = KLOG_Q_ARCHIVE;
+  n = getklog2(&q, e + 1);
+  if(n != 1 || e[1].seq != e[0].seq || strcmp(e[1].msg, e[0].msg) != 0)
+    printf(2, "ERROR: %d entries from the spill for seq %d\n", n, e[0].seq);
+  else
+    printf(1, "seq %d read back from the spill\n", e[1].seq);
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -79,6 +556,17 @@ main(int argc, char *argv[])
   
   test_getklog();
   test_klog_device();
+  test_klogctl();
+  test_getklog2();
+  test_splice();
+  test_snapshot_race();
+  test_drain();
+  test_events();
+  test_ratelimit();
+  test_inject();
+  test_tracepoints();
+  test_agg();
+  test_archive();
   
   printf(1, "\n=== Test Complete ===\n");
   exit();
@@ -0,0 +1,175 @@
+// Logging hot path benchmarks: cycles per kernel log call at each
+// level and with 1..ncpu processes logging at once, getklog() and
+// getklog2() latency with full rings, and /dev/klog drain rate.
+// Every result is one line of key=value fields after the name of
+// the measurement, for scripts to compare across commits.
+//
+// usage: klogbench [calls]
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "fcntl.h"
+#include "x86.h"
+#include "kstat.h"
+
+#define NGET 100      // getklog() calls timed
+
+static char *level_names[] = { "DEBUG", "INFO", "WARN", "ERROR" };
+
+// n / d without 64-bit division, which there is no library for.
+static uint
+div64(uint64 n, uint d)
+{
+  uint hi, lo, r, q, part[4];
+  int i;
+
+  hi = n >> 32;
+  lo = n;
+  part[0] = hi >> 16;
+  part[1] = hi & 0xFFFF;
+  part[2] = lo >> 16;
+  part[3] = lo & 0xFFFF;
+  r = 0;
+  for(i = 0; i < 4; i++){
+    q = (r << 16 | part[i]) / d;
+    r = (r << 16 | part[i]) % d;
+    part[i] = q;
+  }
+  if(part[0] | part[1])
+    return 0xFFFFFFFF;
+  return part[2] << 16 | part[3];
+}
+
+static int
+bench(int level, int n)
+{
+  return klogctl(KLOG_CTL_BENCH, level << 24 | n);
+}
+
+// Cycles per call with nproc processes logging n records each.
+static void
+concurrent(int nproc, int n)
+{
+  int i, fd[2], c, sum, max, got;
+
+  if(pipe(fd) < 0){
+    printf(2, "klogbench: pipe failed\n");
+    exit();
+  }
+  for(i = 0; i < nproc; i++){
+    if(fork() == 0){
+      close(fd[0]);
+      c = bench(KLOG_INFO, n);
+      write(fd[1], &c, sizeof(c));
+      exit();
+    }
+  }
+  close(fd[1]);
+  sum = max = got = 0;
+  while(read(fd[0], &c, sizeof(c)) == sizeof(c)){
+    sum += c;
+    if(c > max)
+      max = c;
+    got++;
+  }
+  close(fd[0]);
+  for(i = 0; i < nproc; i++)
+    wait();
+  printf(1, "printf_concurrent nproc=%d calls=%d cycles_avg=%d cycles_max=%d\n",
+         nproc, n, got ? sum / got : -1, max);
+}
+
+// Latency of snapshot reads; the rings are full by now.
+static void
+snapshot(void)
+{
+  static struct klog_entry e[48];
+  struct klog_query q;
+  uint64 t;
+  int i, n;
+
+  n = 0;
+  t = rdtsc();
+  for(i = 0; i < NGET; i++)
+    n = getklog(e, 48);
+  t = rdtsc() - t;
+  printf(1, "getklog entries=%d cycles=%d\n", n, div64(t, NGET));
+
+  n = 0;
+  t = rdtsc();
+  for(i = 0; i < NGET; i++){
+    memset(&q, 0, sizeof(q));
+    q.levels = 1 << KLOG_ERROR;
+    q.pid = -1;
+    q.cpu = -1;
+    q.max = 48;
+    n = getklog2(&q, e);
+  }
+  t = rdtsc() - t;
+  printf(1, "getklog2_errors entries=%d cycles=%d\n", n, div64(t, NGET));
+}
+
+// Read /dev/klog from the oldest record up to the newest one now.
+static void
+drain(void)
+{
+  struct klog_entry e;
+  uint64 t, t0, t1;
+  uint end, n, per, us;
+  int fd;
+
+  if(getklog(&e, 1) != 1){
+    printf(2, "klogbench: no records to drain\n");
+    return;
+  }
+  end = e.seq;
+  mknod("klog", 2, KLOG);
+  if((fd = open("klog", O_RDONLY)) < 0){
+    printf(2, "klogbench: cannot open klog\n");
+    return;
+  }
+  n = 0;
+  uptimens(&t0);
+  t = rdtsc();
+  while(read(fd, &e, sizeof(e)) == sizeof(e)){
+    n++;
+    if(e.seq >= end)
+      break;
+  }
+  t = rdtsc() - t;
+  uptimens(&t1);
+  close(fd);
+  per = n ? div64(t, n) : 0;
+  us = div64(t1 - t0, 1000);
+  printf(1, "klogdev_drain entries=%d cycles_per_entry=%d entries_per_sec=%d\n",
+         n, per, us ? div64((uint64)n * 1000000, us) : 0);
+}
+
+int
+main(int argc, char *argv[])
+{
+  static struct kstat_syscall ks;
+  static struct kstat_sched ss;
+  int calls, level, i;
+
+  calls = argc > 1 ? atoi(argv[1]) : 10000;
+  if(calls <= 0 || calls > 0xffffff){
+    printf(2, "usage: klogbench [calls]\n");
+    exit();
+  }
+  if(kstat(KSTAT_SYSCALL, &ks, sizeof(ks)) < 0 ||
+     kstat(KSTAT_SCHED, &ss, sizeof(ss)) < 0){
+    printf(2, "klogbench: kstat failed\n");
+    exit();
+  }
+  printf(1, "config tsckhz=%d ncpu=%d calls=%d\n", ks.tsckhz, ss.ncpu, calls);
+
+  for(level = KLOG_DEBUG; level <= KLOG_ERROR; level++)
+    printf(1, "printf level=%s cycles=%d\n", level_names[level],
+           bench(level, calls));
+  for(i = 1; i <= ss.ncpu; i++)
+    concurrent(i, calls);
+  snapshot();
+  drain();
+  exit();
+}
@@ -1,4 +1,10 @@
-// /dev/klog character device implementation
+// /dev/klog character device implementation, and /dev/klogdrain
+//
+// Reads stream log entries like `dmesg -w`: each open file keeps
+// the next sequence number it wants in f->off, a read returns only
+// entries at or after it, and a reader that has consumed everything
+// sleeps in klog_wait() until klog_printf() logs something new.
+// Writes inject records from user space into the same timeline.
 #include "types.h"
 #include "defs.h"
 #include "param.h"
@@ -10,47 +16,131 @@
 #include "proc.h"
 #include "klog.h"
 
-// Device state for streaming reads
-static struct {
-  struct spinlock lock;
-  uint last_seq;  // Last sequence number read
-} klogdev;
+// Bytes of records moved per klog_read() call; bounded by the
+// kernel stack.  Must hold at least one KLOG_RECMAX record.
+#define KLOGDEV_BUF 512
 
 void
 klogdev_init(void)
 {
-  initlock(&klogdev.lock, "klogdev");
-  klogdev.last_seq = 0;
-  
   // Register device
   devsw[KLOG].read = klogdev_read;
   devsw[KLOG].write = klogdev_write;
+  devsw[KLOGDRAIN].read = klogdrain_read;
+  devsw[KLOGDRAIN].write = klogdev_write;
 }
 
-// Read from /dev/klog
+// Read from /dev/klog.  Returns whole fixed-size entries only;
+// blocks until at least one entry at or after this file's cursor
+// is available.
 int
-klogdev_read(struct inode *ip, char *dst, int n)
+klogdev_read(struct file *f, char *dst, int n)
 {
-  struct klog_entry entries[64];
-  int count, i, copied = 0;
-  
-  // Snapshot current logs
-  count = klog_snapshot(entries, 64);
-  
-  // Copy entries to user space
-  for(i = 0; i < count && copied + sizeof(struct klog_entry) <= n; i++){
-    if(copyout(myproc()->pgdir, (uint)dst + copied, &entries[i], 
-               sizeof(struct klog_entry)) < 0)
-      return -1;
-    copied += sizeof(struct klog_entry);
+  char buf[KLOGDEV_BUF];
+  struct klog_entry e;
+  struct klog_rec *r;
+  int len, off, copied = 0;
+
+  if(n < sizeof(struct klog_entry))
+    return -1;
+
+  while(n - copied >= sizeof(struct klog_entry)){
+    len = klog_read(&f->off, buf, sizeof(buf));
+    if(len == 0){
+      if(copied > 0)
+        break;
+      // Nothing new: drop the inode lock so other readers of this
+      // device are not stuck behind us, and wait for klog_printf().
+      iunlock(f->ip);
+      off = klog_wait(f->off);
+      ilock(f->ip);
+      if(off < 0)
+        return -1;
+      continue;
+    }
+
+    for(off = 0; off < len; off += r->len){
+      r = (struct klog_rec*)(buf + off);
+      if(n - copied < sizeof(struct klog_entry)){
+        // Out of room: the next read starts with this record.
+        f->off = r->seq;
+        break;
+      }
+      klog_rec_entry(r, &e);
+      if(copyto(dst + copied, &e, sizeof(e)) < 0)
+        return -1;
+      copied += sizeof(e);
+    }
   }
-  
+
   return copied;
 }
 
-// Write to /dev/klog (not supported)
+// Records each process may write to /dev/klog, limited like a
+// kernel call site (struct klog_rl).  A slot starts over when a
+// different pid maps to it.
+static struct {
+  int pid;
+  struct klog_rl rl;
+} urate[NPROC];
+
+// Write to /dev/klog: a batch of struct klog_rec records, each
+// giving len, level and a NUL-terminated msg; the other header
+// fields are ignored, as the kernel stamps seq, time, cpu and pid.
+// Records beyond the writer's rate limit are dropped and counted.
+// Returns -1 if the first record is malformed, else n: a malformed
+// or cut-off record ends the batch, and it and the rest are
+// discarded rather than left for a retry that would fail the same
+// way.
+int
+klogdev_write(struct file *f, char *src, int n)
+{
+  union {
+    struct klog_rec r;
+    char b[KLOG_RECMAX];
+  } t;
+  struct klog_rl *rl;
+  int off, len, pid;
+
+  pid = myproc()->pid;
+  rl = &urate[pid % NPROC].rl;
+  if(urate[pid % NPROC].pid != pid){
+    urate[pid % NPROC].pid = pid;
+    rl->tick = ticks;
+    rl->tokens = klog_rl_burst;
+    rl->suppressed = 0;
+    rl->site = "/dev/klog";
+  }
+
+  for(off = 0; n - off >= KLOG_RECHDR; off += len){
+    memmove(&t.r, src + off, KLOG_RECHDR);
+    len = t.r.len;
+    if(len <= KLOG_RECHDR || len > KLOG_RECMAX || len > n - off ||
+       t.r.level > KLOG_ERROR)
+      break;
+    if(!klog_enabled(KLOG_SS_USER, t.r.level) || !klog_rl_ok(rl))
+      continue;
+    memmove(t.b, src + off, len);
+    if(len < KLOG_RECMAX)
+      t.b[len] = 0;
+    klog_user(t.r.level, t.r.msg);
+  }
+  if(off == 0 && n > 0)
+    return -1;
+  return n;
+}
+
+// Read from /dev/klogdrain: every record buffered when the file
+// was first read, taken out of the rings in one swap per CPU
+// (klog_drain) and returned as variable-length struct klog_rec,
+// oldest first.  Then 0: each open takes one batch, so a reader
+// is not kept going by records logged while it reads.
 int
-klogdev_write(struct inode *ip, char *buf, int n)
+klogdrain_read(struct file *f, char *dst, int n)
 {
-  return -1;  // Read-only device
+  int swap;
+
+  swap = f->off == 0;
+  f->off = 1;
+  return klog_drain(dst, n, swap);
 }
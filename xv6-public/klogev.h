@@ -0,0 +1,181 @@
+// Typed klog events.  A record with KLOG_EVENT in its level holds
+// a struct klog_event instead of text: an event ID and its fields
+// as raw words, named and typed by the ID's entry in the table in
+// klog_evtype().  A string field's word is the offset within msg of
+// its NUL-terminated copy, which follows the words.  The kernel
+// records events with klog_ev() and can select them by ID (struct
+// klog_query.events); text interfaces render them with
+// klog_evtext() as "name: field=value ...", and ulog_tool renders
+// the raw ones it maps with the same code.
+//
+// Shared by the kernel and user programs.
+#ifndef KLOGEV_H
+#define KLOGEV_H
+
+#define KLOG_EVENT     0x40
+
+// Scheduler events, recorded only while klogctl(KLOG_CTL_SCHEDTRACE)
+// is on.
+#define KLOG_EV_RUN    1    // RUNNABLE -> RUNNING on this CPU
+#define KLOG_EV_YIELD  2    // RUNNING -> RUNNABLE (preempted)
+#define KLOG_EV_SLEEP  3    // RUNNING -> SLEEPING on chan
+#define KLOG_EV_WAKEUP 4    // -> RUNNABLE: woken from chan, or new (0)
+#define KLOG_EV_EXIT   5    // RUNNING -> ZOMBIE
+
+// Process and file system events.
+#define KLOG_EV_FORK        6   // parent created child
+#define KLOG_EV_PEXIT       7   // pid called exit()
+#define KLOG_EV_EXEC        8   // exec of path succeeded
+#define KLOG_EV_EXECNOENT   9   // exec: no such path
+#define KLOG_EV_OPEN        10  // path opened as fd
+#define KLOG_EV_CREATE      11  // open created path
+#define KLOG_EV_OPENNOENT   12  // open: no such path
+#define KLOG_EV_OPENNOCREAT 13  // open: could not create path
+#define KLOG_EV_OPENNOFD    14  // open: no file or fd left
+#define KLOG_EV_READ        15  // read() or readv() of iov buffers
+#define KLOG_EV_WRITE       16  // write() or writev()
+#define KLOG_EV_BREAD       17  // buffer cache miss read block from disk
+#define KLOG_EV_BWRITE      18  // block written to disk
+#define KLOG_EV_PGFAULT     19  // page fault served (lazy or copy-on-write)
+#define KLOG_EV_BOOT        20  // boot step of main() done, in us
+#define KLOG_EV_BOOTCPU     21  // AP brought up by startothers(), in us
+
+#define KLOG_NEV     32   // IDs are below this (struct klog_query.events)
+#define KLOG_EVARGS  6    // Most fields an event has
+
+struct klog_event {
+  ushort type;        // KLOG_EV_*
+  ushort nargs;       // Words used in arg[]; strings follow them
+  uint arg[KLOG_EVARGS];
+};
+
+// An event's name and fields: space-separated names, each with a
+// type suffix of :s (string) or :x (hex); plain names are decimal.
+struct klog_evtype {
+  char *name;
+  char *fields;
+};
+
+static inline struct klog_evtype*
+klog_evtype(int type)
+{
+  static struct klog_evtype tab[KLOG_NEV] = {
+  [KLOG_EV_RUN]         { "sched.run",     "pid" },
+  [KLOG_EV_YIELD]       { "sched.yield",   "pid" },
+  [KLOG_EV_SLEEP]       { "sched.sleep",   "pid chan:x" },
+  [KLOG_EV_WAKEUP]      { "sched.wakeup",  "pid chan:x" },
+  [KLOG_EV_EXIT]        { "sched.exit",    "pid" },
+  [KLOG_EV_FORK]        { "fork",          "parent child" },
+  [KLOG_EV_PEXIT]       { "exit",          "pid" },
+  [KLOG_EV_EXEC]        { "exec",          "path:s" },
+  [KLOG_EV_EXECNOENT]   { "exec.noent",    "path:s" },
+  [KLOG_EV_OPEN]        { "open",          "path:s fd flags:x" },
+  [KLOG_EV_CREATE]      { "open.create",   "path:s" },
+  [KLOG_EV_OPENNOENT]   { "open.noent",    "path:s" },
+  [KLOG_EV_OPENNOCREAT] { "open.nocreate", "path:s" },
+  [KLOG_EV_OPENNOFD]    { "open.nofd",     "path:s" },
+  [KLOG_EV_READ]        { "read",          "bytes iov" },
+  [KLOG_EV_WRITE]       { "write",         "bytes iov" },
+  [KLOG_EV_BREAD]       { "bio.read",      "dev block" },
+  [KLOG_EV_BWRITE]      { "bio.write",     "dev block" },
+  [KLOG_EV_PGFAULT]     { "pagefault",     "va:x write eip:x" },
+  [KLOG_EV_BOOT]        { "boot.phase",    "phase:s us" },
+  [KLOG_EV_BOOTCPU]     { "boot.cpu",      "cpu us" },
+  };
+
+  if(type <= 0 || type >= KLOG_NEV || tab[type].name == 0)
+    return 0;
+  return &tab[type];
+}
+
+// Step *f through a fields string: copy the next field's name to
+// name[0..n-1] and return its type, 's', 'x' or 'd'; 0 at the end.
+static inline int
+klog_evfield(char **f, char *name, int n)
+{
+  char *s = *f;
+  int i, t;
+
+  while(*s == ' ')
+    s++;
+  if(*s == 0)
+    return 0;
+  for(i = 0; *s && *s != ' ' && *s != ':'; s++)
+    if(i < n - 1)
+      name[i++] = *s;
+  name[i] = 0;
+  t = 'd';
+  if(*s == ':' && s[1]){
+    t = s[1];
+    s += 2;
+  }
+  *f = s;
+  return t;
+}
+
+static inline void
+klog_evput(char *text, int *i, int size, char *s)
+{
+  for(; *s && *i < size - 1; s++)
+    text[(*i)++] = *s;
+}
+
+static inline void
+klog_evnum(char *text, int *i, int size, uint x, int base)
+{
+  char b[12];
+  int n, neg;
+
+  neg = base == 10 && (int)x < 0;
+  if(neg)
+    x = -x;
+  if(base == 16)
+    klog_evput(text, i, size, "0x");
+  n = 0;
+  do {
+    b[n++] = "0123456789abcdef"[x % base];
+    x /= base;
+  } while(x);
+  if(neg)
+    b[n++] = '-';
+  while(n > 0 && *i < size - 1)
+    text[(*i)++] = b[--n];
+}
+
+// Render event e, from a msg of msglen bytes, into text[0..size-1].
+// Returns the length, not counting the NUL.
+static inline int
+klog_evtext(struct klog_event *e, int msglen, char *text, int size)
+{
+  struct klog_evtype *t;
+  char name[16], *f;
+  int i, k, type;
+  uint off;
+
+  i = 0;
+  if((t = klog_evtype(e->type)) == 0){
+    klog_evput(text, &i, size, "(bad event)");
+    text[i] = 0;
+    return i;
+  }
+  klog_evput(text, &i, size, t->name);
+  klog_evput(text, &i, size, ":");
+  f = t->fields;
+  for(k = 0; k < e->nargs && k < KLOG_EVARGS &&
+             (type = klog_evfield(&f, name, sizeof(name))) != 0; k++){
+    klog_evput(text, &i, size, " ");
+    klog_evput(text, &i, size, name);
+    klog_evput(text, &i, size, "=");
+    if(type == 's'){
+      // Bounded by msglen, in case the record is torn.
+      for(off = e->arg[k]; off < msglen && ((char*)e)[off] &&
+                           i < size - 1; off++)
+        text[i++] = ((char*)e)[off];
+    } else
+      klog_evnum(text, &i, size, e->arg[k], type == 'x' ? 16 : 10);
+  }
+  text[i] = 0;
+  return i;
+}
+
+#endif // KLOGEV_H
@@ -0,0 +1,128 @@
+// Packed klog records, for the on-disk spill and for reading it
+// back through /dev/klogspill.  A text record (struct klog_rec)
+// spends 24 bytes on its header and trailing word and pads its
+// message; packed, a typical record needs six bytes besides the
+// text.  Each record is four varints, 7 bits a byte, low bits
+// first, with the top bit set on every byte except the last:
+//
+//   seq - previous seq
+//   zigzag(timestamp - previous timestamp), in ns
+//   pid << 5 | cpu << 2 | level
+//   length of the message, which follows without its NUL
+//
+// "previous" starts out 0 at the beginning of every packed run
+// (one spill block, or what one read() of /dev/klogspill returns),
+// so each run decodes on its own.  Timestamps are deltas in either
+// direction, as records are merged from several CPUs.
+//
+// Shared by the kernel and user programs: include after klog.h or
+// user.h, which declare struct klog_rec.
+#ifndef KLOGPACK_H
+#define KLOGPACK_H
+
+#define KLOGPACK_MAX 152   // Longest packed record
+
+struct klogpack {
+  uint seq;           // Of the previous record in the run
+  uint64 ts;          // ns, of the previous record in the run
+};
+
+static inline void
+klogpack_reset(struct klogpack *pk)
+{
+  pk->seq = 0;
+  pk->ts = 0;
+}
+
+static inline int
+klogpack_putv(char *dst, uint64 v)
+{
+  int n;
+
+  for(n = 0; v >= 0x80; v >>= 7)
+    dst[n++] = (v & 0x7f) | 0x80;
+  dst[n++] = v;
+  return n;
+}
+
+// Read a varint of at most 10 bytes from src[0..n-1] into *v.
+// Returns the bytes used, or 0 if it is cut short.
+static inline int
+klogpack_getv(char *src, int n, uint64 *v)
+{
+  int i;
+
+  *v = 0;
+  for(i = 0; i < n && i < 10; i++){
+    *v |= (uint64)(src[i] & 0x7f) << (7*i);
+    if((src[i] & 0x80) == 0)
+      return i + 1;
+  }
+  return 0;
+}
+
+// Pack the text record r after the previous one of pk's run into
+// dst.  Returns the bytes written, or 0 if they exceed n.
+static inline int
+klogpack_put(struct klogpack *pk, struct klog_rec *r, char *dst, int n)
+{
+  char b[KLOGPACK_MAX];
+  uint64 ts, z;
+  int i, len;
+
+  ts = (uint64)r->timestamp_hi << 32 | r->timestamp_lo;
+  if(ts >= pk->ts)
+    z = (ts - pk->ts) << 1;
+  else
+    z = ((pk->ts - ts) << 1) - 1;
+  len = strlen(r->msg);
+  if(len > KLOGPACK_MAX - 24)
+    len = KLOGPACK_MAX - 24;
+  i = klogpack_putv(b, r->seq - pk->seq);
+  i += klogpack_putv(b + i, z);
+  i += klogpack_putv(b + i, (uint64)r->pid << 5 | (r->cpu & 7) << 2 |
+                            (r->level & 3));
+  i += klogpack_putv(b + i, len);
+  if(i + len > n)
+    return 0;
+  memmove(dst, b, i);
+  memmove(dst + i, r->msg, len);
+  pk->seq = r->seq;
+  pk->ts = ts;
+  return i + len;
+}
+
+// Unpack the record at src[0..n-1] into out, which has room for
+// KLOG_RECMAX bytes; sets every field but len.  Returns the bytes
+// used, or 0 if the record is cut short or damaged.
+static inline int
+klogpack_get(struct klogpack *pk, char *src, int n, struct klog_rec *out)
+{
+  uint64 v[4], ts;
+  int i, j, k;
+
+  for(i = j = 0; j < 4; j++){
+    if((k = klogpack_getv(src + i, n - i, &v[j])) == 0)
+      return 0;
+    i += k;
+  }
+  if(v[3] >= 128 || i + v[3] > n)
+    return 0;
+  if(v[1] & 1)
+    ts = pk->ts - ((v[1] + 1) >> 1);
+  else
+    ts = pk->ts + (v[1] >> 1);
+  out->seq = pk->seq + v[0];
+  out->timestamp_hi = ts >> 32;
+  out->timestamp_lo = ts;
+  out->pid = v[2] >> 5;
+  out->cpu = (v[2] >> 2) & 7;
+  out->level = v[2] & 3;
+  memmove(out->msg, src + i, v[3]);
+  out->msg[v[3]] = 0;
+  pk->seq = out->seq;
+  pk->ts = ts;
+  return i + v[3];
+}
+
+#endif // KLOGPACK_H
@@ -0,0 +1,496 @@
+// Persistent klog spill.
+//
+// A kernel thread drains the rings with klog_read(), as a /dev/klog
+// reader would, and packs the rendered records (klogpack.h) into
+// blocks of the region mkfs leaves after the free bitmap
+// (sb.klogstart, sb.nklog), or on the log disk (sb.klogdev) with
+// mkfs -d, away from file system I/O.
+// The first block of the region is a header; the rest is a circular
+// log of data blocks, each stamped with its index so that a stale
+// block is recognised.  The header records the index of the block
+// being filled and is rewritten each time one fills up, after the
+// full block itself, so a crash loses at most the unwritten part of
+// the current block.  klog_printf() never waits for the disk: the
+// thread wakes when SPILL_MARK records are pending, or every
+// SPILL_TICKS if anything is.  /dev/klogspill reads the region back,
+// still packed.
+//
+// Each boot starts a fresh block, and the header doubles as a sparse
+// index: the data blocks fall into SPILL_NIDX segments, and for each
+// the header keeps the first sequence number and timestamp of the
+// block that began it (or began this boot) most recently.  Since a
+// block's records decode on their own, klogspill_query() can binary
+// search the index and read from the right block on, which lets
+// getklog2() reach records long gone from the rings.
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "buf.h"
+#include "file.h"
+#include "mmu.h"
+#include "proc.h"
+#include "klog.h"
+#include "klogpack.h"
+
+#define SPILL_MAGIC 0x78707362  // "bspx": packed records, indexed
+#define SPILL_MARK  64          // Pending records that force a flush
+#define SPILL_TICKS HZ          // Longest a record waits in memory
+#define SPILL_NIDX  24          // Index entries in the header
+
+// Block index begins with record seq, stamped ts.
+struct spillidx {
+  uint index;
+  uint boot;          // Boot that wrote the block
+  uint seq;
+  uint ts_hi;
+  uint ts_lo;
+};
+
+struct spillhdr {
+  uint magic;
+  uint nblk;          // Data blocks in the region
+  uint next;          // Index of the block being filled
+  uint boot;          // Boots that have spilled here
+  struct spillidx idx[SPILL_NIDX];  // By segment of index % nblk
+};
+
+#define SPILL_DATA (BSIZE - 3*sizeof(uint))
+
+struct spillblk {
+  uint magic;
+  uint index;         // Which data block this is; block index % nblk
+  uint used;          // Bytes of records in data[]
+  char data[SPILL_DATA];  // Packed records, one run per block
+};
+
+static struct {
+  struct spinlock lock;  // Protects next, done and idx for readers
+  int dev;            // Disk of the region
+  uint start;         // Block number of the header
+  uint nblk;          // Data blocks, 0 if there is no region
+  uint seg;           // Data blocks per index segment
+  uint next;          // Index of the block being filled
+  uint first;         // Index of this boot's first block
+  uint boot;          // This boot's number in the header
+  uint done;          // Records numbered below are on disk
+  struct spillidx idx[SPILL_NIDX];
+  int force;          // klogspill_flush() was called
+  struct spillblk cur;   // Block being filled
+  struct klogpack pk;    // Packing state at the end of cur
+} spill;
+
+// Unpack the records of blk from offset 0 until off, each into r,
+// leaving pk after the last.  Returns where unpacking stopped: at
+// off, or before the first damaged record.
+static uint
+spill_scan(struct spillblk *blk, uint off, struct klogpack *pk,
+           struct klog_rec *r)
+{
+  uint pos;
+  int n;
+
+  klogpack_reset(pk);
+  for(pos = 0; pos < off; pos += n)
+    if((n = klogpack_get(pk, blk->data + pos, off - pos, r)) == 0)
+      break;
+  return pos;
+}
+
+static uint
+spill_blockno(uint index)
+{
+  return spill.start + 1 + index % spill.nblk;
+}
+
+// Write a whole block; no need to read it first.
+static void
+spill_write(uint blockno, void *data)
+{
+  struct buf *b;
+
+  b = bgetblk(spill.dev, blockno);
+  memmove(b->data, data, BSIZE);
+  bwrite(b);
+  brelse(b);
+}
+
+static void
+spill_header(void)
+{
+  union {
+    struct spillhdr h;
+    char b[BSIZE];
+  } u;
+
+  memset(&u, 0, sizeof(u));
+  u.h.magic = SPILL_MAGIC;
+  u.h.nblk = spill.nblk;
+  u.h.next = spill.next;
+  u.h.boot = spill.boot;
+  memmove(u.h.idx, spill.idx, sizeof(u.h.idx));
+  spill_write(spill.start, &u);
+}
+
+// Note in the index that the block being filled begins with r, if
+// it is the first of its segment or of this boot.  Returns 1 if the
+// header needs writing.
+static int
+spill_index(struct klog_rec *r)
+{
+  struct spillidx *x;
+  uint i = spill.cur.index;
+
+  if(i % spill.nblk % spill.seg != 0 && i != spill.first)
+    return 0;
+  x = &spill.idx[i % spill.nblk / spill.seg];
+  acquire(&spill.lock);
+  x->index = i;
+  x->boot = spill.boot;
+  x->seq = r->seq;
+  x->ts_hi = r->timestamp_hi;
+  x->ts_lo = r->timestamp_lo;
+  release(&spill.lock);
+  return 1;
+}
+
+// Pick up where the previous boot left off, in the next block.
+static void
+spill_load(void)
+{
+  struct superblock sb;
+  struct spillhdr *h;
+  struct spillblk *blk;
+  struct buf *b;
+
+  readsb(ROOTDEV, &sb);
+  if(sb.nklog < 2)
+    return;
+  spill.dev = ROOTDEV;
+  if(sb.klogdev){
+    if(!logdisk(sb.klogdev, &sb)){
+      klog_printf_level(KLOG_WARN, "klogspill: no log disk; not spilling");
+      return;
+    }
+    spill.dev = sb.klogdev;
+  }
+  spill.start = sb.klogstart;
+
+  b = bread(spill.dev, spill.start);
+  h = (struct spillhdr*)b->data;
+  if(h->magic == SPILL_MAGIC && h->nblk == sb.nklog - 1){
+    spill.next = h->next;
+    spill.boot = h->boot;
+    memmove(spill.idx, h->idx, sizeof(spill.idx));
+  }
+  brelse(b);
+  spill.nblk = sb.nklog - 1;
+  spill.seg = (spill.nblk + SPILL_NIDX - 1) / SPILL_NIDX;
+  spill.boot++;
+
+  // Leave the previous boot's last block as it is.
+  b = bread(spill.dev, spill_blockno(spill.next));
+  blk = (struct spillblk*)b->data;
+  if(blk->magic == SPILL_MAGIC && blk->index == spill.next && blk->used > 0)
+    spill.next++;
+  brelse(b);
+  spill.first = spill.next;
+
+  spill.cur.magic = SPILL_MAGIC;
+  spill.cur.index = spill.next;
+  spill.cur.used = 0;
+  klogpack_reset(&spill.pk);
+  spill_header();
+}
+
+// Wait until there is enough to write, or until records have
+// waited SPILL_TICKS, or until someone asks.
+static void
+spill_wait(uint seq)
+{
+  uint t0;
+
+  acquire(&tickslock);
+  tickupdate();
+  t0 = ticks;
+  while(!spill.force && klog_nextseq() - seq < SPILL_MARK &&
+        (klog_nextseq() == seq || ticks - t0 < SPILL_TICKS)){
+    // Logging wakes nobody, so look for new records every
+    // SPILL_TICKS; they wait from the first look that sees them.
+    if(klog_nextseq() == seq)
+      t0 = ticks;
+    tickwait(t0 + SPILL_TICKS);
+    sleep(&ticks, &tickslock);
+  }
+  spill.force = 0;
+  release(&tickslock);
+}
+
+static void
+klogspill(void *arg)
+{
+  struct klog_rec *r;
+  char *buf;
+  uint seq;
+  int n, off, dirty, len;
+
+  spill_load();
+  if(spill.nblk == 0 || (buf = kalloc()) == 0){
+    // Nothing to do; stay out of the way.
+    acquire(&tickslock);
+    for(;;)
+      sleep(&spill, &tickslock);
+  }
+
+  seq = 0;
+  for(;;){
+    spill_wait(seq);
+    dirty = 0;
+    while((n = klog_read(&seq, buf, PGSIZE)) > 0){
+      for(off = 0; off < n; off += r->len){
+        r = (struct klog_rec*)(buf + off);
+        if(spill.cur.used == 0 && spill_index(r))
+          spill_header();
+        len = klogpack_put(&spill.pk, r, spill.cur.data + spill.cur.used,
+                           SPILL_DATA - spill.cur.used);
+        if(len == 0){
+          // Full: write it out, then move the header on.
+          spill_write(spill_blockno(spill.cur.index), &spill.cur);
+          acquire(&spill.lock);
+          spill.next++;
+          release(&spill.lock);
+          spill.cur.index = spill.next;
+          spill.cur.used = 0;
+          klogpack_reset(&spill.pk);
+          spill_index(r);
+          spill_header();
+          len = klogpack_put(&spill.pk, r, spill.cur.data, SPILL_DATA);
+        }
+        spill.cur.used += len;
+        dirty = 1;
+      }
+    }
+    if(dirty){
+      spill_write(spill_blockno(spill.cur.index), &spill.cur);
+      acquire(&spill.lock);
+      spill.done = seq;
+      release(&spill.lock);
+    }
+  }
+}
+
+// Ask the spill thread to write pending records now.
+void
+klogspill_flush(void)
+{
+  acquire(&tickslock);
+  spill.force = 1;
+  wakeup(&ticks);
+  release(&tickslock);
+}
+
+// Read from /dev/klogspill: the spilled records, oldest first, as
+// one packed run (klogpack.h) per read.  f->off is index*BSIZE plus
+// the offset within that block's data.  Returns whole records only,
+// 0 at the end.
+int
+klogspill_read(struct file *f, char *dst, int n)
+{
+  union {
+    struct klog_rec r;
+    char b[KLOG_RECMAX];
+  } t;
+  char p[KLOGPACK_MAX];
+  struct klogpack in, out, save;
+  struct spillblk *blk;
+  struct buf *b;
+  uint idx, off, end, first, next;
+  int copied = 0, full = 0, len, plen;
+
+  if(spill.nblk == 0)
+    return 0;
+
+  klogpack_reset(&out);
+  for(;;){
+    acquire(&spill.lock);
+    next = spill.next;
+    release(&spill.lock);
+    first = next >= spill.nblk ? next - spill.nblk + 1 : 0;
+    idx = f->off / BSIZE;
+    off = f->off % BSIZE;
+    if(idx < first){
+      idx = first;
+      off = 0;
+    }
+    if(idx > next)
+      break;
+
+    b = bread(spill.dev, spill_blockno(idx));
+    blk = (struct spillblk*)b->data;
+    end = 0;
+    if(blk->magic == SPILL_MAGIC && blk->index == idx && blk->used <= SPILL_DATA)
+      end = blk->used;
+    if(off > end || spill_scan(blk, off, &in, &t.r) != off)
+      off = end;
+    full = 0;
+    for(; off < end; off += len){
+      if((len = klogpack_get(&in, blk->data + off, end - off, &t.r)) == 0){
+        off = end;  // damaged; skip the rest of the block
+        break;
+      }
+      save = out;
+      plen = klogpack_put(&out, &t.r, p, sizeof(p));
+      if(copied + plen > n){
+        out = save;
+        full = 1;
+        break;
+      }
+      if(copyto(dst + copied, p, plen) < 0){
+        brelse(b);
+        return -1;
+      }
+      copied += plen;
+    }
+    brelse(b);
+
+    // Stop when out of room, or at the block still being filled.
+    if(full || idx == next){
+      f->off = idx*BSIZE + off;
+      break;
+    }
+    f->off = (idx + 1)*BSIZE;
+  }
+
+  if(full && copied == 0)
+    return -1;
+  return copied;
+}
+
+// The block to read from for records numbered seq or later and
+// stamped mintime or later: of the index entries for this boot's
+// blocks from first to next, the last to begin before both, by
+// binary search, or first if there is none.
+static uint
+spill_find(uint first, uint next, uint seq, uint64 mintime)
+{
+  struct spillidx x[SPILL_NIDX], e;
+  int i, j, n, lo, hi, mid;
+
+  acquire(&spill.lock);
+  for(n = 0, i = 0; i < SPILL_NIDX; i++){
+    e = spill.idx[i];
+    if(e.boot != spill.boot || e.index < first || e.index > next)
+      continue;
+    // In block order; the segments wrap around the region.
+    for(j = n++; j > 0 && x[j-1].index > e.index; j--)
+      x[j] = x[j-1];
+    x[j] = e;
+  }
+  release(&spill.lock);
+
+  lo = 0;
+  hi = n;
+  while(lo < hi){
+    mid = (lo + hi) / 2;
+    if(x[mid].seq <= seq &&
+       ((uint64)x[mid].ts_hi << 32 | x[mid].ts_lo) <= mintime)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo > 0 ? x[lo-1].index : first;
+}
+
+// klog_query() over the spill: this boot's records numbered *seq or
+// later that match q, up to those not yet on disk, rendered as text
+// records into buf.  *seq moves past what was returned, or to where
+// the spill ends if nothing more matches, for klog_query() to take
+// over from there.  Typed events are spilled as text, so a query
+// for q->events finds nothing here.
+int
+klogspill_query(uint *seq, struct klog_query *q, char *buf, int n)
+{
+  union {
+    struct klog_rec r;
+    char b[KLOG_RECMAX];
+  } t;
+  struct klogpack pk;
+  struct spillblk *blk;
+  struct klog_rec *d;
+  struct buf *b;
+  uint idx, off, end, first, next, done, last;
+  int used, len, rlen, stop;
+
+  if(spill.nblk == 0 || q->events)
+    return 0;
+  acquire(&spill.lock);
+  next = spill.next;
+  done = spill.done;
+  release(&spill.lock);
+  if(*seq >= done)
+    return 0;
+  first = next >= spill.nblk ? next - spill.nblk + 1 : 0;
+  if(first < spill.first)
+    first = spill.first;
+
+  used = 0;
+  last = done;
+  stop = 0;
+  for(idx = spill_find(first, next, *seq, q->mintime); idx <= next; idx++){
+    b = bread(spill.dev, spill_blockno(idx));
+    blk = (struct spillblk*)b->data;
+    end = 0;
+    if(blk->magic == SPILL_MAGIC && blk->index == idx && blk->used <= SPILL_DATA)
+      end = blk->used;
+    klogpack_reset(&pk);
+    for(off = 0; off < end; off += len){
+      if((len = klogpack_get(&pk, blk->data + off, end - off, &t.r)) == 0)
+        break;  // damaged; skip the rest of the block
+      if(t.r.seq < *seq)
+        continue;
+      if(t.r.seq >= done || (q->maxseq && t.r.seq > q->maxseq)){
+        stop = 1;
+        break;
+      }
+      if(!klog_match(q, &t.r))
+        continue;
+      rlen = KLOG_RECLEN(strlen(t.r.msg) + 1);
+      if(used + rlen > n){
+        last = t.r.seq;
+        stop = 1;
+        break;
+      }
+      d = (struct klog_rec*)(buf + used);
+      memmove(d, &t.r, rlen - 4);
+      d->len = rlen;
+      *(uint*)((char*)d + rlen - 4) = *(uint*)d;
+      used += rlen;
+    }
+    brelse(b);
+    if(stop)
+      break;
+  }
+  *seq = last;
+  return used;
+}
+
+int
+klogspill_write(struct file *f, char *buf, int n)
+{
+  return -1;  // Read-only device
+}
+
+// Register /dev/klogspill and start the flusher.  Called from main()
+// once there is a first process; the thread reads the superblock
+// itself, as that needs a process context.
+void
+klogspill_init(void)
+{
+  initlock(&spill.lock, "klogspill");
+  devsw[KLOGSPILL].read = klogspill_read;
+  devsw[KLOGSPILL].write = klogspill_write;
+  if(kthread_create("klogspill", klogspill, 0) == 0)
+    panic("klogspill_init");
+}
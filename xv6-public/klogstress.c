@@ -0,0 +1,196 @@
+// Concurrent logging stress: a worker per CPU logs as fast as it
+// can (klogctl(KLOG_CTL_BENCH)) while two readers drain the rings
+// at once, one polling getklog2() and one reading /dev/klog.  Each
+// reader checks that sequence numbers only go up and counts those
+// it never saw, which may not be more than the rings report
+// dropped meanwhile.  Prints a key=value line per reader and the
+// sustained rate, then PASS or FAIL, as a regression gate for
+// changes to the ring paths.
+//
+// usage: klogstress [records per worker]
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "fcntl.h"
+#include "kstat.h"
+
+#define CHUNK 1000    // Records per klogctl(KLOG_CTL_BENCH)
+#define END   "klogstress: end"
+
+struct result {
+  uint n;          // Records seen from the run
+  uint gaps;       // Sequence numbers skipped
+  uint disorder;   // Records not after the one before
+};
+
+static uint start;    // First sequence number of the run
+
+// Account for record seq; returns 1 at the end marker.
+static int
+check(struct result *res, uint *last, struct klog_entry *e)
+{
+  if(e->seq < start)
+    return 0;
+  if(*last && e->seq <= *last)
+    res->disorder++;
+  else if(e->seq > (*last ? *last + 1 : start))
+    res->gaps += e->seq - (*last ? *last + 1 : start);
+  if(e->seq > *last)
+    *last = e->seq;
+  res->n++;
+  return strcmp(e->msg, END) == 0;
+}
+
+// Drain with getklog2(), from start on, until the end marker.
+static void
+poller(int fd)
+{
+  static struct klog_entry e[32];
+  struct klog_query q;
+  struct result res;
+  uint last;
+  int i, n, done;
+
+  memset(&res, 0, sizeof(res));
+  memset(&q, 0, sizeof(q));
+  q.pid = -1;
+  q.cpu = -1;
+  q.max = sizeof(e) / sizeof(e[0]);
+  last = 0;
+  for(done = 0; !done; ){
+    q.minseq = last ? last + 1 : start;
+    if((n = getklog2(&q, e)) <= 0){
+      sleep(1);
+      continue;
+    }
+    for(i = 0; i < n && !done; i++)
+      done = check(&res, &last, &e[i]);
+  }
+  write(fd, &res, sizeof(res));
+}
+
+// Drain /dev/klog until the end marker.
+static void
+reader(int fd)
+{
+  static struct klog_entry e[16];
+  struct result res;
+  uint last;
+  int i, n, kfd, done;
+
+  memset(&res, 0, sizeof(res));
+  mknod("klog", KLOG, 0);
+  if((kfd = open("klog", O_RDONLY)) < 0){
+    printf(2, "klogstress: cannot open klog\n");
+    exit();
+  }
+  last = 0;
+  for(done = 0; !done; ){
+    if((n = read(kfd, e, sizeof(e))) <= 0)
+      break;
+    for(i = 0; i < n / sizeof(e[0]) && !done; i++)
+      done = check(&res, &last, &e[i]);
+  }
+  close(kfd);
+  write(fd, &res, sizeof(res));
+}
+
+// Records the rings report lost, summed over CPUs.
+static uint
+dropped(int ncpu)
+{
+  uint n;
+  int c;
+
+  for(n = 0, c = 0; c < ncpu; c++)
+    n += klogctl(KLOG_CTL_DROPPED, c);
+  return n;
+}
+
+// Append the end marker through /dev/klog.
+static void
+mark_end(void)
+{
+  static char buf[sizeof(struct klog_rec) + sizeof(END)];
+  struct klog_rec *r;
+  int fd;
+
+  r = (struct klog_rec*)buf;
+  r->len = sizeof(buf);
+  r->level = KLOG_WARN;
+  strcpy(r->msg, END);
+  if((fd = open("klog", O_WRONLY)) < 0 || write(fd, buf, sizeof(buf)) != sizeof(buf))
+    printf(2, "klogstress: cannot write klog\n");
+  close(fd);
+}
+
+int
+main(int argc, char *argv[])
+{
+  static struct kstat_sched ss;
+  static char *names[2] = { "getklog2", "devklog" };
+  struct klog_entry e;
+  struct result res[2];
+  uint end, drop0, drop, t0, t1;
+  int i, n, ncpu, fd[2][2], fail;
+
+  n = argc > 1 ? atoi(argv[1]) : 20000;
+  if(n < CHUNK || kstat(KSTAT_SCHED, &ss, sizeof(ss)) < 0){
+    printf(2, "usage: klogstress [records per worker, at least %d]\n", CHUNK);
+    exit();
+  }
+  ncpu = ss.ncpu;
+
+  mknod("klog", KLOG, 0);
+  drop0 = dropped(ncpu);
+  start = getklog(&e, 1) == 1 ? e.seq + 1 : 1;
+  for(i = 0; i < 2; i++){
+    pipe(fd[i]);
+    if(fork() == 0){
+      close(fd[i][0]);
+      if(i == 0)
+        poller(fd[i][1]);
+      else
+        reader(fd[i][1]);
+      exit();
+    }
+    close(fd[i][1]);
+  }
+
+  t0 = uptime();
+  for(i = 0; i < ncpu; i++){
+    if(fork() == 0){
+      for(; n > 0; n -= CHUNK)
+        klogctl(KLOG_CTL_BENCH, KLOG_INFO << 24 | CHUNK);
+      exit();
+    }
+  }
+  for(i = 0; i < ncpu; i++)
+    wait();
+  t1 = uptime();
+  end = getklog(&e, 1) == 1 ? e.seq : start;
+  drop = dropped(ncpu) - drop0;
+
+  mark_end();
+  fail = 0;
+  for(i = 0; i < 2; i++){
+    if(read(fd[i][0], &res[i], sizeof(res[i])) != sizeof(res[i])){
+      printf(1, "%s failed\n", names[i]);
+      fail = 1;
+      continue;
+    }
+    close(fd[i][0]);
+    printf(1, "%s records=%d gaps=%d disorder=%d\n", names[i],
+           res[i].n, res[i].gaps, res[i].disorder);
+    if(res[i].disorder || res[i].gaps > drop || res[i].n == 0)
+      fail = 1;
+  }
+  for(i = 0; i < 2; i++)
+    wait();
+
+  printf(1, "klogstress workers=%d records=%d dropped=%d ticks=%d rate=%d\n",
+         ncpu, end - start + 1, drop, t1 - t0,
+         t1 > t0 ? (end - start + 1) / (t1 - t0) * 100 : 0);
+  printf(1, fail ? "FAIL\n" : "PASS\n");
+  exit();
+}
@@ -0,0 +1,122 @@
+// Sampling profiler, read through /dev/kprof.
+//
+// While profiling is on, every timer interrupt records where it
+// found its CPU: the interrupted EIP, the process and the CPU.
+// As with klog, each CPU appends to a ring of its own, under a lock
+// that only readers contend for, and a full ring overwrites its
+// oldest samples.  Reading /dev/kprof takes whole samples out of
+// the rings.  Writing '1' empties the rings and starts sampling,
+// writing '0' stops it.
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "fs.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "file.h"
+#include "mmu.h"
+#include "proc.h"
+#include "x86.h"
+#include "fcntl.h"
+#include "kprof.h"
+
+#define KPROFSIZE 2048   // Samples per ring; 20s at 100 ticks/s
+#define KPROFBUF  32     // Samples copied out per lock hold
+
+struct kprof_ring {
+  struct spinlock lock;
+  uint head;             // Samples ever recorded
+  uint tail;             // Oldest sample still held
+  struct kprof_sample s[KPROFSIZE];
+};
+
+static struct kprof_ring ring[NCPU];
+static int kprof_on;
+
+void
+kprofinit(void)
+{
+  int i;
+
+  for(i = 0; i < NCPU; i++)
+    initlock(&ring[i].lock, "kprof");
+  devsw[KPROF].read = kprofread;
+  devsw[KPROF].write = kprofwrite;
+}
+
+// Record a sample for the timer interrupt tf.  Interrupts are off.
+void
+kprof_tick(struct trapframe *tf)
+{
+  struct kprof_ring *r;
+  struct kprof_sample *s;
+  struct proc *p;
+
+  if(!kprof_on)
+    return;
+  r = &ring[cpuid()];
+  p = myproc();
+  acquire(&r->lock);
+  s = &r->s[r->head++ % KPROFSIZE];
+  s->eip = tf->eip;
+  s->pid = p ? p->pid : 0;
+  s->cpu = cpuid();
+  s->user = (tf->cs & 3) == DPL_USER;
+  if(r->head - r->tail > KPROFSIZE)
+    r->tail = r->head - KPROFSIZE;
+  release(&r->lock);
+}
+
+// Move whole samples to dst, ring by ring.  Does not wait: returns
+// 0 when every ring is empty.
+int
+kprofread(struct file *f, char *dst, int n)
+{
+  struct kprof_sample buf[KPROFBUF];
+  struct kprof_ring *r;
+  int i, m, copied;
+
+  copied = 0;
+  for(i = 0; i < ncpu; i++){
+    r = &ring[i];
+    for(;;){
+      acquire(&r->lock);
+      for(m = 0; m < KPROFBUF && r->tail != r->head &&
+                 copied + (m+1)*sizeof(buf[0]) <= n; m++)
+        buf[m] = r->s[r->tail++ % KPROFSIZE];
+      release(&r->lock);
+      if(m == 0)
+        break;
+      if(copyto(dst + copied, buf, m * sizeof(buf[0])) < 0)
+        return -1;
+      copied += m * sizeof(buf[0]);
+    }
+  }
+  return copied;
+}
+
+int
+kprofwrite(struct file *f, char *buf, int n)
+{
+  int i;
+
+  if(n < 1)
+    return -1;
+  switch(buf[0]){
+  case '1':
+    kprof_on = 0;
+    for(i = 0; i < NCPU; i++){
+      acquire(&ring[i].lock);
+      ring[i].tail = ring[i].head;
+      release(&ring[i].lock);
+    }
+    kprof_on = 1;
+    break;
+  case '0':
+    kprof_on = 0;
+    break;
+  default:
+    return -1;
+  }
+  return n;
+}
@@ -0,0 +1,9 @@
+// Profiler samples read from /dev/kprof.
+// Shared by the kernel and user programs, like stat.h.
+
+struct kprof_sample {
+  uint eip;       // Where the timer interrupt found the CPU
+  uint pid;       // Process running, 0 for none
+  ushort cpu;
+  ushort user;    // eip is a user address of pid
+};
@@ -0,0 +1,243 @@
+// Kernel statistics read with kstat(what, buf, n).
+// Shared by the kernel and user programs, like stat.h.
+
+#define KSTAT_SYSCALL 1   // struct kstat_syscall
+#define KSTAT_BIO     2   // struct kstat_bio
+#define KSTAT_LOG     3   // struct kstat_log
+#define KSTAT_MEM     4   // struct kstat_mem
+#define KSTAT_SLAB    5   // struct kstat_slab
+#define KSTAT_SCHED   6   // struct kstat_sched
+#define KSTAT_LOCK    7   // struct kstat_lock
+#define KSTAT_TRACE   8   // struct kstat_trace
+#define KSTAT_IRQ     9   // struct kstat_irq
+#define KSTAT_BOOT    10  // struct kstat_boot
+#define KSTAT_AGG     11  // struct kstat_agg
+#define KSTAT_PROC    12  // struct kstat_proc
+
+#define KSTAT_NSYSCALL 36   // syscall numbers below this are traced
+#define KSTAT_NBUCKET  32   // log2(cycles) latency buckets
+
+// Syscall latency histograms, summed over CPUs.  hist[num][b] counts
+// calls to syscall num that took [2^b, 2^(b+1)) TSC cycles.
+struct kstat_syscall {
+  uint tsckhz;   // TSC cycles per millisecond
+  int pid;       // Traced pid: -1 every process, 0 tracing off
+  uint hist[KSTAT_NSYSCALL][KSTAT_NBUCKET];
+};
+
+#define KSTAT_NCPU 8   // NCPU in param.h
+
+// Buffer cache counters per CPU, and IDE service times from
+// idestart() to ideintr().  ide[0] counts reads, ide[1] writes,
+// in the same log2(cycles) buckets as kstat_syscall.
+struct kstat_bcpu {
+  uint hit;        // bget() found the block cached
+  uint miss;       // bget() had to recycle a buffer
+  uint evict;      // ... that held another valid block
+  uint lockwait;   // bget() found bcache.lock or the buffer held
+};
+
+struct kstat_bio {
+  uint tsckhz;   // TSC cycles per millisecond
+  uint ncpu;     // Entries of cpu[] in use
+  struct kstat_bcpu cpu[KSTAT_NCPU];
+  uint ide[2][KSTAT_NBUCKET];
+  uint nbuf;     // Buffers in the cache now
+  uint idereq;   // Disk requests queued
+  uint idecmd;   // Disk commands, each serving a run of requests
+  uint ideseek;  // Blocks the head moved between commands, summed
+};
+
+// File system log (log.c).  A log_write() of a block already in the
+// open transaction is absorbed: it costs no extra log block.
+struct kstat_log {
+  uint logsize;        // Most blocks one transaction may log
+  uint ncommit;        // Transactions committed
+  uint nunique;        // Blocks logged, summed over commits
+  uint nabsorbed;      // Absorbed log_write()s, summed over commits
+  uint last_unique;    // ... of the latest commit
+  uint last_absorbed;
+  uint nwait;          // begin_op() sleeps for log space
+};
+
+// Page allocator (kalloc.c), per CPU.  A refill takes a batch of
+// pages from the global free list, a drain gives one back, and a
+// steal takes half of another CPU's cache because the global list
+// was empty.
+struct kstat_kcpu {
+  uint alloc;     // Pages allocated on this CPU
+  uint free;      // Pages freed on this CPU
+  uint refill;
+  uint drain;
+  uint steal;
+  uint cached;    // Free pages in this CPU's cache now
+};
+
+struct kstat_mem {
+  uint ncpu;      // Entries of cpu[] in use
+  uint nfree;     // Free pages, cached ones included
+  uint reserved;  // ... promised to heaps by sbrk(), not touched yet
+  uint ntext;     // Program pages cached for exec() (textcache.c)
+  uint texthit;   // ... found there by exec()
+  uint textmiss;  // ... read from the file
+  struct kstat_kcpu cpu[KSTAT_NCPU];
+};
+
+// Small object allocator (slab.c), per size class.  alloc - free
+// objects are in use; npage pages hold the class's objects.
+#define KSTAT_NSLAB 8
+
+struct kstat_sclass {
+  uint size;      // Object size in bytes
+  uint npage;
+  uint alloc;
+  uint free;
+};
+
+struct kstat_slab {
+  uint nclass;    // Entries of class[] in use
+  struct kstat_sclass class[KSTAT_NSLAB];
+};
+
+// Scheduler (proc.c).  A spurious wakeup is one after which the
+// process sleeps on the same chan again within the same system call.
+// Times are in ns since boot; idle time is time halted.
+struct kstat_scpu {
+  uint64 idle;
+  uint nrun;       // Processes switched to
+  uint nsteal;     // ... taken from another CPU's run queue
+  uint nkeep;      // ... without a TLB flush: its page table was loaded
+};
+
+struct kstat_sched {
+  uint nwakeup;    // wakeup() calls
+  uint nempty;     // ... with nobody sleeping on the chan
+  uint nspurious;
+  uint ncpu;       // Entries of cpu[] in use
+  uint64 now;
+  struct kstat_scpu cpu[KSTAT_NCPU];
+};
+
+// Spinlocks (spinlock.c), added up by lock name over CPUs, while
+// klogctl(KLOG_CTL_LOCKSTAT) has them on.  Times are TSC cycles.
+#define KSTAT_NLOCK 64
+
+struct kstat_lk {
+  char name[16];
+  uint nacq;       // Acquisitions
+  uint ncont;      // ... that found the lock held
+  uint64 spin;     // Cycles spent waiting for it
+  uint maxhold;    // Longest time held
+};
+
+struct kstat_lock {
+  uint tsckhz;
+  uint on;         // Being counted now
+  uint nlock;      // Entries of lock[] in use
+  struct kstat_lk lock[KSTAT_NLOCK];
+};
+
+// Static tracepoints (klog.h), in link order; i in
+// klogctl(KLOG_CTL_TRACE, i<<1 | on) indexes tp[].
+#define KSTAT_NTP 64
+
+struct kstat_tp {
+  char site[24];   // "file:line"
+  char name[24];   // Event name, or the start of the format string
+  uint level;
+  uint on;
+};
+
+struct kstat_trace {
+  uint ntp;        // Tracepoints in the kernel, maybe more than KSTAT_NTP
+  struct kstat_tp tp[KSTAT_NTP];
+};
+
+// Counts of the tracepoints aggregated (klogctl(KLOG_CTL_AGG)), or
+// once aggregated and not yet replaced, summed over CPUs.  hist[b]
+// counts calls whose first argument was in [2^b, 2^(b+1)); hist[0]
+// counts 0 as well.
+#define KSTAT_NAGG 16
+
+struct kstat_aggtp {
+  uint tp;         // Tracepoint number, as in kstat_trace
+  uint on;         // Its state: 2 while aggregating
+  char site[24];
+  char name[24];
+  uint n;          // Calls
+  uint64 sum;      // First arguments, summed
+  uint hist[KSTAT_NBUCKET];
+};
+
+struct kstat_agg {
+  uint nagg;
+  struct kstat_aggtp agg[KSTAT_NAGG];
+};
+
+// Interrupts (trap.c, spinlock.c), summed over CPUs.  count[irq]
+// counts every interrupt; while klogctl(KLOG_CTL_IRQSTAT) has them
+// on, hist[irq] also counts handler times in the log2(cycles)
+// buckets of kstat_syscall, and cli[] lists the callers of
+// pushcli() (or acquire()) that kept interrupts off longest, from
+// the outermost pushcli() to the popcli() that turned them back on.
+#define KSTAT_NIRQ 32   // IRQs from T_IRQ0
+#define KSTAT_NCLI 16
+
+struct kstat_cli {
+  uint pc;         // Return address of the pushcli() or acquire()
+  uint n;          // Sections
+  uint max;        // Longest, TSC cycles
+  uint64 total;    // TSC cycles, summed
+};
+
+struct kstat_irq {
+  uint tsckhz;
+  uint on;
+  uint count[KSTAT_NIRQ];
+  uint hist[KSTAT_NIRQ][KSTAT_NBUCKET];
+  uint ncli;       // Entries of cli[] in use, longest first
+  struct kstat_cli cli[KSTAT_NCLI];
+};
+
+// Boot phases (main.c): the steps of main() in order, and within
+// startothers() the bring-up of each AP, from lapicstartap() until
+// it runs mpmain().  The first, "firmware", runs from TSC 0 to the
+// entry of main(): BIOS, boot loader and entry.S, if the TSC was
+// reset with the machine.
+#define KSTAT_NBOOT 40
+
+struct kstat_bphase {
+  char name[16];   // Function main() called, or "startap"
+  int cpu;         // CPU started, or -1
+  uint64 start;    // TSC cycles
+  uint64 end;
+};
+
+struct kstat_boot {
+  uint tsckhz;
+  uint nphase;
+  struct kstat_bphase phase[KSTAT_NBOOT];
+};
+
+// Processes (proc.c): every ptable entry in use.  run counts the
+// time each has run, added up whenever it goes back to scheduler();
+// rbytes and wbytes the bytes its reads and writes of files, pipes
+// and devices moved.
+#define KSTAT_NPROC 64   // NPROC in param.h
+
+struct kstat_p {
+  int pid;
+  uint state;      // enum procstate in proc.h
+  char name[16];
+  uint sz;         // Bytes of memory
+  uint nsyscall;
+  uint64 run;      // ns
+  uint64 rbytes;
+  uint64 wbytes;
+};
+
+struct kstat_proc {
+  uint nproc;
+  uint64 now;      // nanotime(), ns
+  struct kstat_p proc[KSTAT_NPROC];
+};
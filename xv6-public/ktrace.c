@@ -0,0 +1,103 @@
+// Static tracepoints: every klog call site in the kernel.
+//
+// usage: ktrace               list them: number, state, level,
+//                             site and event or format string
+//        ktrace on|off|agg what...
+//                             switch the ones whose number, event
+//                             name, file:line or file is what, or
+//                             all of them for "all"; agg makes them
+//                             count calls instead of recording
+//        ktrace counts        print what the aggregated ones
+//                             counted: calls, first arguments summed
+//                             and their log2 histogram
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "kstat.h"
+
+static char *level_names[] = { "DEBUG", "INFO", "WARN", "ERROR" };
+static char *state_names[] = { "off", "on", "agg" };
+
+// Does tracepoint i, tp, match what?
+static int
+match(int i, struct kstat_tp *tp, char *what)
+{
+  char file[24];
+  int n;
+
+  if(strcmp(what, "all") == 0 || strcmp(what, tp->name) == 0 ||
+     strcmp(what, tp->site) == 0)
+    return 1;
+  if(what[0] >= '0' && what[0] <= '9')
+    return atoi(what) == i;
+  for(n = 0; tp->site[n] && tp->site[n] != ':' && n < sizeof(file) - 1; n++)
+    file[n] = tp->site[n];
+  file[n] = 0;
+  return strcmp(what, file) == 0;
+}
+
+// Print the counts of the aggregated tracepoints.
+static void
+counts(void)
+{
+  static struct kstat_agg st;
+  struct kstat_aggtp *a;
+  int i, b;
+
+  if(kstat(KSTAT_AGG, &st, sizeof(st)) < 0){
+    printf(2, "ktrace: kstat failed\n");
+    exit();
+  }
+  for(i = 0; i < st.nagg; i++){
+    a = &st.agg[i];
+    printf(1, "%d\t%s\t%s\t%s\tcalls %d sum %d\n", a->tp,
+           a->on < 3 ? state_names[a->on] : "?", a->site, a->name,
+           a->n, (uint)a->sum);
+    for(b = 0; b < KSTAT_NBUCKET; b++)
+      if(a->hist[b])
+        printf(1, "\t< 2^%d\t%d\n", b + 1, a->hist[b]);
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  static struct kstat_trace st;
+  int i, j, n, on, cmd;
+
+  if(kstat(KSTAT_TRACE, &st, sizeof(st)) < 0){
+    printf(2, "ktrace: kstat failed\n");
+    exit();
+  }
+  n = st.ntp < KSTAT_NTP ? st.ntp : KSTAT_NTP;
+
+  if(argc == 1){
+    for(i = 0; i < n; i++)
+      printf(1, "%d\t%s\t%s\t%s\t%s\n", i,
+             st.tp[i].on < 3 ? state_names[st.tp[i].on] : "?",
+             st.tp[i].level < 4 ? level_names[st.tp[i].level] : "?",
+             st.tp[i].site, st.tp[i].name);
+    if(st.ntp > n)
+      printf(1, "(%d more)\n", st.ntp - n);
+    exit();
+  }
+  if(argc == 2 && strcmp(argv[1], "counts") == 0){
+    counts();
+    exit();
+  }
+  if(argc < 3 || (strcmp(argv[1], "on") != 0 && strcmp(argv[1], "off") != 0 &&
+                  strcmp(argv[1], "agg") != 0)){
+    printf(2, "usage: ktrace [counts | on|off|agg what...]\n");
+    exit();
+  }
+  on = strcmp(argv[1], "off") != 0;
+  cmd = strcmp(argv[1], "agg") == 0 ? KLOG_CTL_AGG : KLOG_CTL_TRACE;
+  for(i = 0; i < n; i++)
+    for(j = 2; j < argc; j++)
+      if(match(i, &st.tp[i], argv[j])){
+        if(klogctl(cmd, i << 1 | on) < 0)
+          printf(2, "ktrace: cannot aggregate %s\n", st.tp[i].site);
+        break;
+      }
+  exit();
+}
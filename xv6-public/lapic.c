@@ -9,6 +9,7 @@
 #include "traps.h"
 #include "mmu.h"
 #include "x86.h"
+#include "proc.h"
 
 // Local APIC registers, divided by 4 for use as uint[] indices.
 #define ID      (0x0020/4)   // ID
@@ -42,6 +43,7 @@
 #define TDCR    (0x03E0/4)   // Timer Divide Configuration
 
 volatile uint *lapic;  // Initialized in mp.c
+static uint lapicpertick;  // Timer counts per tick, from lapiccal()
 
 //PAGEBREAK!
 static void
@@ -51,6 +53,58 @@ lapicw(int index, int value)
   lapic[ID];  // wait for write to finish, by reading
 }
 
+// Time the timer's bus clock against the TSC for 1 ms, so that it
+// can be set to interrupt HZ times a second.  All CPUs share the bus
+// clock; CPU 0 calibrates, after tscinit().
+static void
+lapiccal(void)
+{
+  uint64 t0;
+  uint n;
+
+  lapicw(TDCR, X1);
+  lapicw(TIMER, MASKED);
+  lapicw(TICR, 0xFFFFFFFF);
+  t0 = rdtsc();
+  while(rdtsc() - t0 < tsckhz)
+    ;
+  n = 0xFFFFFFFF - lapic[TCCR];
+  lapicw(TICR, 0);
+  lapicpertick = n * 1000 / HZ;
+  if(lapicpertick == 0)
+    lapicpertick = 10000000;  // no timer to speak of: the old guess
+}
+
+// Interrupt every tick, as while this CPU has work.
+void
+lapicperiodic(void)
+{
+  if(!lapic)
+    return;
+  lapicw(TIMER, PERIODIC | (T_IRQ0 + IRQ_TIMER));
+  lapicw(TICR, lapicpertick);
+}
+
+// Interrupt once, ns (at most a second) from now, or never if ns
+// is 0: for a CPU about to halt.
+void
+lapiconeshot(uint ns)
+{
+  uint n;
+
+  if(!lapic)
+    return;
+  if(ns == 0){
+    lapicw(TICR, 0);
+    return;
+  }
+  if(ns > 1000000000)
+    ns = 1000000000;
+  n = div64((uint64)ns * lapicpertick, 1000000000 / HZ);
+  lapicw(TIMER, T_IRQ0 + IRQ_TIMER);
+  lapicw(TICR, n ? n : 1);
+}
+
 void
 lapicinit(void)
 {
@@ -61,12 +115,12 @@ lapicinit(void)
   lapicw(SVR, ENABLE | (T_IRQ0 + IRQ_SPURIOUS));
 
   // The timer repeatedly counts down at bus frequency
-  // from lapic[TICR] and then issues an interrupt.
-  // If xv6 cared more about precise timekeeping,
-  // TICR would be calibrated using an external time source.
+  // from lapic[TICR] and then issues an interrupt, HZ times a
+  // second.  An idle CPU reprograms it; see tickidle().
+  if(lapicpertick == 0)
+    lapiccal();
   lapicw(TDCR, X1);
-  lapicw(TIMER, PERIODIC | (T_IRQ0 + IRQ_TIMER));
-  lapicw(TICR, 10000000);
+  lapicperiodic();
 
   // Disable logical interrupt lines.
   lapicw(LINT0, MASKED);
@@ -113,6 +167,17 @@ lapiceoi(void)
     lapicw(EOI, 0);
 }
 
+// Send an interrupt with the given vector to the CPU with the
+// given APIC ID.
+void
+lapicipi(uchar apicid, int vector)
+{
+  lapicw(ICRHI, apicid<<24);
+  lapicw(ICRLO, FIXED | ASSERT | vector);
+  while(lapic[ICRLO] & DELIVS)
+    ;
+}
+
 // Spin for a given number of microseconds.
 // On real hardware would want to tune this dynamically.
 void
@@ -120,6 +185,113 @@ microdelay(int us)
 {
 }
 
+// TSC calibration.  The LAPIC timer counts at the unknown bus
+// clock, so time the TSC against PIT channel 2 instead, whose input
+// is a fixed 1.193182 MHz.  nanotime() turns cycles into ns as
+// (cycles * tscmult) >> tscshift, which needs only 32x32-bit
+// multiplies: the kernel has no 64-bit division.
+#define PIT_CH2      0x42
+#define PIT_MODE     0x43
+#define PIT_GATE     0x61
+#define PIT_LATCH    11932  // 10 ms at 1193182 Hz
+
+uint tsckhz;                // TSC frequency
+static uint tscmult, tscshift;
+static uint64 tscboot;      // CPU 0's TSC at tscinit()
+
+// n / d, for quotients known to fit in 32 bits.
+uint
+div64(uint64 n, uint d)
+{
+  uint q, r;
+
+  asm("divl %4" : "=a" (q), "=d" (r) : "a" ((uint)n), "d" ((uint)(n >> 32)), "rm" (d));
+  return q;
+}
+
+// Called on CPU 0 before anything is timestamped.
+void
+tscinit(void)
+{
+  uint64 t0, t1;
+
+  // Gate channel 2 on with the speaker off; count down once in mode 0.
+  outb(PIT_GATE, (inb(PIT_GATE) & ~0x02) | 0x01);
+  outb(PIT_MODE, 0xB0);
+  outb(PIT_CH2, PIT_LATCH & 0xFF);
+  outb(PIT_CH2, PIT_LATCH >> 8);
+  t0 = rdtsc();
+  while((inb(PIT_GATE) & 0x20) == 0)  // OUT2 goes high at zero
+    ;
+  t1 = rdtsc();
+
+  tsckhz = (uint)(t1 - t0) / 10;
+  if(tsckhz == 0)
+    tsckhz = 1000000;  // no PIT: pretend 1 GHz
+  for(tscshift = 32; tscshift > 0 && (1000000ULL << tscshift) >> 32 >= tsckhz; tscshift--)
+    ;
+  tscmult = div64(1000000ULL << tscshift, tsckhz);
+  tscboot = t1;
+}
+
+// Nanoseconds since tscinit(), comparable across CPUs.
+// Interrupts must be off, as for mycpu().
+uint64
+nanotime(void)
+{
+  uint64 c;
+
+  c = rdtsc() + mycpu()->tscoff - tscboot;
+  return (((uint64)(uint)(c >> 32) * tscmult) << (32 - tscshift)) +
+         (((uint64)(uint)c * tscmult) >> tscshift);
+}
+
+// Offset estimation between an AP and CPU 0.  The AP asks for CPU 0's
+// TSC and takes the midpoint of its own readings around the reply,
+// keeping the round with the shortest round trip.
+#define TSCSYNC_ROUNDS 8
+
+static volatile uint tscreq, tscack;
+static volatile uint64 tscval;
+
+// Run by each AP in mpenter(), while startothers() calls tscserve().
+void
+tscsync(void)
+{
+  uint64 t0, t1, v, best;
+  long long off;
+  int i;
+
+  best = ~0ULL;
+  off = 0;
+  for(i = 0; i < TSCSYNC_ROUNDS; i++){
+    t0 = rdtsc();
+    tscreq = 1;
+    while(tscack == 0)
+      ;
+    t1 = rdtsc();
+    v = tscval;
+    tscack = 0;
+    if(t1 - t0 < best){
+      best = t1 - t0;
+      off = v - (t0 + (t1 - t0) / 2);
+    }
+  }
+  mycpu()->tscoff = off;
+}
+
+// CPU 0's side of tscsync(); returns at once if nothing was asked.
+void
+tscserve(void)
+{
+  if(tscreq == 0)
+    return;
+  tscreq = 0;
+  tscval = rdtsc();
+  __sync_synchronize();
+  tscack = 1;
+}
+
 #define CMOS_PORT    0x70
 #define CMOS_RETURN  0x71
 
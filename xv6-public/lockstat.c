@@ -0,0 +1,66 @@
+// Spinlock contention: counts lock waits while command runs (or for
+// one second), then prints each lock by total wait, longest first.
+//
+// usage: lockstat [command [args...]]
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "kstat.h"
+
+// c TSC cycles in microseconds, given khz cycles per ms.
+static uint
+cycles_us(uint64 c, uint khz)
+{
+  uint k;
+
+  k = c >> 10;   // 1024-cycle units keep the product in 32 bits
+  if(c >> 42)
+    return 0xFFFFFFFF;
+  if(k < (1U << 22))
+    return k * 1000 / (khz >> 10);
+  return k / (khz >> 10) * 1000;
+}
+
+int
+main(int argc, char *argv[])
+{
+  static struct kstat_lock st;
+  struct kstat_lk t;
+  int i, j, pid;
+
+  klogctl(KLOG_CTL_LOCKSTAT, 1);
+  if(argc > 1){
+    if((pid = fork()) == 0){
+      exec(argv[1], argv + 1);
+      printf(2, "lockstat: exec %s failed\n", argv[1]);
+      exit();
+    }
+    if(pid > 0)
+      wait();
+  } else
+    sleep(100);
+  klogctl(KLOG_CTL_LOCKSTAT, 0);
+
+  if(kstat(KSTAT_LOCK, &st, sizeof(st)) < 0 || st.tsckhz < 1024){
+    printf(2, "lockstat: kstat failed\n");
+    exit();
+  }
+
+  // By total wait, longest first.
+  for(i = 1; i < st.nlock; i++){
+    t = st.lock[i];
+    for(j = i; j > 0 && st.lock[j-1].spin < t.spin; j--)
+      st.lock[j] = st.lock[j-1];
+    st.lock[j] = t;
+  }
+
+  printf(1, "lock\t\tacquire\tcontend\twait_us\tmaxhold_us\n");
+  for(i = 0; i < st.nlock; i++){
+    printf(1, "%s\t%s%d\t%d\t%d\t%d\n", st.lock[i].name,
+           strlen(st.lock[i].name) < 8 ? "\t" : "",
+           st.lock[i].nacq, st.lock[i].ncont,
+           cycles_us(st.lock[i].spin, st.tsckhz),
+           cycles_us(st.lock[i].maxhold, st.tsckhz));
+  }
+  exit();
+}
@@ -5,6 +5,8 @@
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "mmu.h"
+#include "kstat.h"
 
 // Simple logging that allows concurrent FS system calls.
 //
@@ -18,7 +20,17 @@
 // its start and end. Usually begin_op() just increments
 // the count of in-progress FS system calls and returns.
 // But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// sleeps until the transaction is handed to the commit thread.
+//
+// Commits happen in the background.  Once no FS system call is
+// active, the commit thread takes the open transaction (log.cur)
+// as log.com, copies its blocks out of the buffer cache, and lets
+// new system calls start filling the next transaction while it
+// writes the copies to the log and then to their home locations.
+// end_op() therefore never waits for the disk.  The buffers of
+// log.com stay pinned (B_DIRTY) until their home blocks are
+// written, or until the transaction after it commits if that one
+// logged them too.
 //
 // The log is a physical re-do log containing disk blocks.
 // The on-disk log format:
@@ -28,52 +40,107 @@
 //   block C
 //   ...
 // Log appends are synchronous.
+// mkfs -j puts the log on the log disk (sb.logdev), where its
+// writes do not queue behind those to home locations.
 
 // Contents of the header block, used for both the on-disk header block
 // and to keep track in memory of logged block# before commit.
+// Only the first cap entries of block[] are used; mkfs chooses the
+// log size (sb.nlog), up to a header block's worth.
 struct logheader {
   int n;
-  int block[LOGSIZE];
+  int block[LOGMAX];
 };
 
+#define SNAPPERPAGE (PGSIZE / BSIZE)
+
 struct log {
   struct spinlock lock;
   int start;
   int size;
+  int cap;         // most blocks one transaction may log
   int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
+  int freezing;    // commit thread is copying log.com's blocks
   int dev;
-  struct logheader lh;
+  int logdev;      // where the log blocks are: dev, or the log disk
+  int absorbed;    // log_write()s absorbed into log.cur
+  struct logheader *cur;  // transaction being filled
+  struct logheader *com;  // transaction being committed
+  // Commit thread's copies of log.com's blocks, in kalloc pages.
+  uchar *snap[(LOGMAX + SNAPPERPAGE - 1) / SNAPPERPAGE];
+  struct kstat_log stat;
 };
 struct log log;
 
+// Buffer outside the cache for writing the copies to their home
+// locations.
+static struct buf ibuf;
+
+// Commit thread's copy of block i of log.com.
+static uchar*
+snap(int i)
+{
+  return log.snap[i / SNAPPERPAGE] + (i % SNAPPERPAGE) * BSIZE;
+}
+
 static void recover_from_log(void);
-static void commit();
+static void logcommit(void*);
 
 void
 initlog(int dev)
 {
-  if (sizeof(struct logheader) >= BSIZE)
+  if (sizeof(struct logheader) > BSIZE)
     panic("initlog: too big logheader");
 
   struct superblock sb;
+  char *p;
+  int i;
+
   initlock(&log.lock, "log");
   readsb(dev, &sb);
   log.start = sb.logstart;
   log.size = sb.nlog;
   log.dev = dev;
+  log.logdev = dev;
+  if(sb.logdev){
+    // Without it, committed transactions could not be recovered.
+    if(!logdisk(sb.logdev, &sb))
+      panic("initlog: no log disk");
+    log.logdev = sb.logdev;
+  }
+  log.cap = log.size - 1;
+  if(log.cap > LOGMAX)
+    log.cap = LOGMAX;
+  if(log.cap < MAXOPBLOCKS)
+    panic("initlog: log too small");
+  log.stat.logsize = log.cap;
+
+  // Both headers in one page, and pages for the copies.
+  if((p = kalloc()) == 0)
+    panic("initlog: kalloc");
+  log.cur = (struct logheader*)p;
+  log.com = (struct logheader*)(p + PGSIZE/2);
+  for(i = 0; i*SNAPPERPAGE < log.cap; i++)
+    if((log.snap[i] = (uchar*)kalloc()) == 0)
+      panic("initlog: kalloc");
+
   recover_from_log();
+
+  initsleeplock(&ibuf.lock, "logcommit");
+  if(kthread_create("logcommit", logcommit, 0) == 0)
+    panic("initlog: no commit thread");
 }
 
-// Copy committed blocks from log to their home location
+// Copy committed blocks from log to their home location,
+// during recovery.
 static void
-install_trans(void)
+install_trans(struct logheader *lh)
 {
   int tail;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
+  for (tail = 0; tail < lh->n; tail++) {
+    struct buf *lbuf = bread(log.logdev, log.start+tail+1); // read log block
+    struct buf *dbuf = bread(log.dev, lh->block[tail]); // read dst
     memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
     bwrite(dbuf);  // write dst to disk
     brelse(lbuf);
@@ -81,32 +148,32 @@ install_trans(void)
   }
 }
 
-// Read the log header from disk into the in-memory log header
+// Read the log header from disk into lh
 static void
-read_head(void)
+read_head(struct logheader *lh)
 {
-  struct buf *buf = bread(log.dev, log.start);
-  struct logheader *lh = (struct logheader *) (buf->data);
+  struct buf *buf = bread(log.logdev, log.start);
+  struct logheader *hb = (struct logheader *) (buf->data);
   int i;
-  log.lh.n = lh->n;
-  for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
+  lh->n = hb->n;
+  for (i = 0; i < lh->n; i++) {
+    lh->block[i] = hb->block[i];
   }
   brelse(buf);
 }
 
-// Write in-memory log header to disk.
+// Write in-memory log header lh to disk.
 // This is the true point at which the
 // current transaction commits.
 static void
-write_head(void)
+write_head(struct logheader *lh)
 {
-  struct buf *buf = bread(log.dev, log.start);
+  struct buf *buf = bread(log.logdev, log.start);
   struct logheader *hb = (struct logheader *) (buf->data);
   int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
+  hb->n = lh->n;
+  for (i = 0; i < lh->n; i++) {
+    hb->block[i] = lh->block[i];
   }
   bwrite(buf);
   brelse(buf);
@@ -115,10 +182,10 @@ write_head(void)
 static void
 recover_from_log(void)
 {
-  read_head();
-  install_trans(); // if committed, copy from log to disk
-  log.lh.n = 0;
-  write_head(); // clear the log
+  read_head(log.com);
+  install_trans(log.com); // if committed, copy from log to disk
+  log.com->n = 0;
+  write_head(log.com); // clear the log
 }
 
 // called at the start of each FS system call.
@@ -127,10 +194,11 @@ begin_op(void)
 {
   acquire(&log.lock);
   while(1){
-    if(log.committing){
+    if(log.freezing){
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
+    } else if(log.cur->n + (log.outstanding+1)*MAXOPBLOCKS > log.cap){
       // this op might exhaust log space; wait for commit.
+      log.stat.nwait++;
       sleep(&log, &log.lock);
     } else {
       log.outstanding += 1;
@@ -141,63 +209,115 @@ begin_op(void)
 }
 
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// hands the transaction to the commit thread if this was the
+// last outstanding operation.
 void
 end_op(void)
 {
-  int do_commit = 0;
-
   acquire(&log.lock);
   log.outstanding -= 1;
-  if(log.committing)
-    panic("log.committing");
-  if(log.outstanding == 0){
-    do_commit = 1;
-    log.committing = 1;
-  } else {
-    // begin_op() may be waiting for log space,
-    // and decrementing log.outstanding has decreased
-    // the amount of reserved space.
-    wakeup(&log);
-  }
+  if(log.outstanding == 0 && log.cur->n > 0)
+    wakeup(&log.cur);
+  // begin_op() may be waiting for log space,
+  // and decrementing log.outstanding has decreased
+  // the amount of reserved space.
+  wakeup(&log);
   release(&log.lock);
-
-  if(do_commit){
-    // call commit w/o holding locks, since not allowed
-    // to sleep with locks.
-    commit();
-    acquire(&log.lock);
-    log.committing = 0;
-    wakeup(&log);
-    release(&log.lock);
-  }
 }
 
-// Copy modified blocks from cache to log.
+// Copy the blocks of log.com from snap to the log.
 static void
 write_log(void)
 {
   int tail;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
+  for (tail = 0; tail < log.com->n; tail++) {
+    struct buf *to = bgetblk(log.logdev, log.start+tail+1); // log block
+    memmove(to->data, snap(tail), BSIZE);
     bwrite(to);  // write the log
-    brelse(from);
     brelse(to);
   }
 }
 
+// Write the blocks of log.com from snap to their home locations,
+// then unpin the cached buffers the next transaction has not
+// logged again.
 static void
-commit()
+install_com(void)
 {
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
-    write_head();    // Write header to disk -- the real commit
-    install_trans(); // Now install writes to home locations
-    log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
+  struct buf *b;
+  int tail, i;
+
+  for (tail = 0; tail < log.com->n; tail++) {
+    ibuf.dev = log.dev;
+    ibuf.blockno = log.com->block[tail];
+    ibuf.flags = B_DIRTY;
+    memmove(ibuf.data, snap(tail), BSIZE);
+    iderw(&ibuf);
+
+    // Holding b's lock keeps log_write() from adding it to log.cur
+    // while we look.
+    b = bread(log.dev, log.com->block[tail]);
+    acquire(&log.lock);
+    for (i = 0; i < log.cur->n; i++)
+      if (log.cur->block[i] == b->blockno)
+        break;
+    if (i == log.cur->n)
+      b->flags &= ~B_DIRTY;
+    release(&log.lock);
+    brelse(b);
+  }
+}
+
+// The commit thread: commit each transaction once no FS system
+// call is active in it.
+static void
+logcommit(void *arg)
+{
+  struct logheader *h;
+  struct buf *b;
+  int i, absorbed;
+
+  acquiresleep(&ibuf.lock);
+  for(;;){
+    acquire(&log.lock);
+    while(log.outstanding > 0 || log.cur->n == 0)
+      sleep(&log.cur, &log.lock);
+    h = log.com;
+    log.com = log.cur;
+    log.cur = h;
+    log.cur->n = 0;
+    absorbed = log.absorbed;
+    log.absorbed = 0;
+    log.freezing = 1;
+    release(&log.lock);
+
+    // Copy the blocks before new operations can change them.
+    for (i = 0; i < log.com->n; i++) {
+      b = bread(log.dev, log.com->block[i]);
+      memmove(snap(i), b->data, BSIZE);
+      brelse(b);
+    }
+
+    acquire(&log.lock);
+    log.freezing = 0;
+    wakeup(&log);
+    release(&log.lock);
+
+    write_log();          // Write the copies to the log
+    write_head(log.com); // Write header to disk -- the real commit
+    install_com();        // Now install writes to home locations
+
+    acquire(&log.lock);
+    log.stat.ncommit++;
+    log.stat.nunique += log.com->n;
+    log.stat.nabsorbed += absorbed;
+    log.stat.last_unique = log.com->n;
+    log.stat.last_absorbed = absorbed;
+    release(&log.lock);
+
+    log.com->n = 0;
+    write_head(log.com); // Erase the transaction from the log
   }
 }
 
@@ -215,20 +335,30 @@ log_write(struct buf *b)
 {
   int i;
 
-  if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
+  if (log.cur->n >= log.cap)
     panic("too big a transaction");
   if (log.outstanding < 1)
     panic("log_write outside of trans");
 
   acquire(&log.lock);
-  for (i = 0; i < log.lh.n; i++) {
-    if (log.lh.block[i] == b->blockno)   // log absorbtion
+  for (i = 0; i < log.cur->n; i++) {
+    if (log.cur->block[i] == b->blockno)   // log absorbtion
       break;
   }
-  log.lh.block[i] = b->blockno;
-  if (i == log.lh.n)
-    log.lh.n++;
+  log.cur->block[i] = b->blockno;
+  if (i == log.cur->n)
+    log.cur->n++;
+  else
+    log.absorbed++;
   b->flags |= B_DIRTY; // prevent eviction
   release(&log.lock);
 }
 
+// Fill in st with the log counters.
+void
+log_stat(struct kstat_log *st)
+{
+  acquire(&log.lock);
+  *st = log.stat;
+  release(&log.lock);
+}
@@ -5,37 +5,94 @@
 #include "mmu.h"
 #include "proc.h"
 #include "x86.h"
+#include "klog.h"
+#include "klogev.h"
+#include "kstat.h"
 
 static void startothers(void);
 static void mpmain(void)  __attribute__((noreturn));
 extern pde_t *kpgdir;
 extern char end[]; // first address after kernel loaded from ELF file
 
+// Boot phases, for kstat(KSTAT_BOOT).  Each is logged as it ends,
+// as a boot.phase or boot.cpu event; those that end before the
+// rings are up (klog_kept() is 0 until klog_init()), just after.
+static struct kstat_boot boot;
+static int bootlogged;     // Phases logged so far
+
+static void
+bootphase(char *name, int cpu, uint64 start)
+{
+  struct kstat_bphase *p;
+  uint64 c;
+  uint us;
+
+  if(boot.nphase < KSTAT_NBOOT){
+    p = &boot.phase[boot.nphase++];
+    safestrcpy(p->name, name, sizeof(p->name));
+    p->cpu = cpu;
+    p->start = start;
+    p->end = rdtsc();
+  }
+  if(klog_kept() == 0)
+    return;
+  for(; bootlogged < boot.nphase; bootlogged++){
+    p = &boot.phase[bootlogged];
+    c = (p->end - p->start) * 1000;
+    us = (c >> 32) < tsckhz ? div64(c, tsckhz) : 0xFFFFFFFF;
+    if(p->cpu < 0)
+      klog_ev(KLOG_INFO, KLOG_EV_BOOT, p->name, us);
+    else
+      klog_ev(KLOG_INFO, KLOG_EV_BOOTCPU, p->cpu, us);
+  }
+}
+
+// Call f(...) as a timed boot phase named f.
+#define BOOT(f, ...) do { \
+  uint64 _t = rdtsc(); \
+  f(__VA_ARGS__); \
+  bootphase(#f, -1, _t); \
+} while(0)
+
+void
+boot_stat(struct kstat_boot *st)
+{
+  *st = boot;
+  st->tsckhz = tsckhz;
+}
+
 // Bootstrap processor starts running C code here.
 // Allocate a real stack and switch to it, first
 // doing some setup required for memory allocator to work.
 int
 main(void)
 {
-  kinit1(end, P2V(4*1024*1024)); // phys page allocator
-  kvmalloc();      // kernel page table
-  mpinit();        // detect other processors
-  lapicinit();     // interrupt controller
-  seginit();       // segment descriptors
-  picinit();       // disable pic
-  ioapicinit();    // another interrupt controller
-  consoleinit();   // console hardware
-  uartinit();      // serial port
-  pinit();         // process table
-  tvinit();        // trap vectors
-  binit();         // buffer cache
-  fileinit();      // file table
-  ideinit();       // disk 
-  klog_init();     // kernel logging
-  klogdev_init();  // klog device
-  startothers();   // start other processors
-  kinit2(P2V(4*1024*1024), P2V(PHYSTOP)); // must come after startothers()
-  userinit();      // first user process
+  bootphase("firmware", -1, 0);
+  BOOT(kinit1, end, P2V(4*1024*1024)); // phys page allocator
+  BOOT(slabinit);      // small object allocator
+  BOOT(kvmalloc);      // kernel page table
+  BOOT(mpinit);        // detect other processors
+  BOOT(seginit);       // segment descriptors; mycpu() works from here
+  BOOT(tscinit);       // calibrate the TSC for nanotime()
+  BOOT(klog_init);     // kernel logging
+  BOOT(lapicinit);     // interrupt controller
+  BOOT(picinit);       // disable pic
+  BOOT(ioapicinit);    // another interrupt controller
+  BOOT(consoleinit);   // console hardware
+  BOOT(uartinit);      // serial port
+  BOOT(pinit);         // process table
+  BOOT(tvinit);        // trap vectors
+  BOOT(binit);         // buffer cache
+  BOOT(fileinit);      // file table
+  BOOT(textinit);      // shared program pages
+  BOOT(ideinit);       // disk 
+  BOOT(klogdev_init);  // klog device
+  BOOT(kprofinit);     // profiler device
+  BOOT(startothers);   // start other processors
+  BOOT(kinit2, P2V(KLOGKEEP) + klog_kept(), P2V(PHYSTOP)); // must come after startothers()
+  BOOT(userinit);      // first user process
+  BOOT(klogspill_init); // klog disk flusher
+  BOOT(ioring_init);   // asynchronous I/O workers
   mpmain();        // finish this processor's setup
 }
 
@@ -46,6 +103,7 @@ mpenter(void)
   switchkvm();
   seginit();
   lapicinit();
+  tscsync();
   mpmain();
 }
 
@@ -69,6 +127,7 @@ startothers(void)
   uchar *code;
   struct cpu *c;
   char *stack;
+  uint64 t;
 
   // Write entry code to unused memory at 0x7000.
   // The linker has placed the image of entryother.S in
@@ -79,6 +138,7 @@ startothers(void)
   for(c = cpus; c < cpus+ncpu; c++){
     if(c == mycpu())  // We've started already.
       continue;
+    t = rdtsc();
 
     // Tell entryother.S what stack to use, where to enter, and what
     // pgdir to use. We cannot use kpgdir yet, because the AP processor
@@ -90,9 +150,10 @@ startothers(void)
 
     lapicstartap(c->apicid, V2P(code));
 
-    // wait for cpu to finish mpmain()
+    // wait for cpu to finish mpmain(), answering its tscsync()
     while(c->started == 0)
-      ;
+      tscserve();
+    bootphase("startap", c - cpus, t);
   }
 }
 
@@ -12,6 +12,7 @@
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "kstat.h"
 
 extern uchar _binary_fs_img_start[], _binary_fs_img_size[];
 
@@ -27,11 +28,37 @@ ideinit(void)
 
 // Interrupt handler.
 void
-ideintr(void)
+ideintr(int i)
 {
   // no-op
 }
 
+// Only the file system disk is here.
+int
+idedisk(int dev)
+{
+  return dev == 1;
+}
+
+// Read b at once; there is nothing to wait for.  Hands b to bdone()
+// like ideintr() does after an asynchronous read.
+void
+iderw_async(struct buf *b)
+{
+  iderw(b);
+  bdone(b);
+}
+
+// No disk requests to time.
+void
+ide_stat(struct kstat_bio *st)
+{
+  memset(st->ide, 0, sizeof(st->ide));
+  st->idereq = 0;
+  st->idecmd = 0;
+  st->ideseek = 0;
+}
+
 // Sync buf with disk.
 // If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
 // Else if B_VALID is not set, read buf from disk, set B_VALID.
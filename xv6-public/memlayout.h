@@ -2,10 +2,15 @@
 
 #define EXTMEM  0x100000            // Start of extended memory
 #define PHYSTOP 0xE000000           // Top physical memory
+#define KLOGKEEP 0x400000           // klog rings, kept across reboot (klog_kept())
 #define DEVSPACE 0xFE000000         // Other devices are at high addresses
 
 // Key addresses for address space layout (see kmap in vm.c for layout)
 #define KERNBASE 0x80000000         // First kernel virtual address
+#define MMAPBASE 0x60000000         // mmap()ed files, up to UMAPBASE
+#define UMAPBASE 0x70000000         // Kernel-provided mappings in user space
+#define KLOGMAP  UMAPBASE           // klog_map(): header page, then rings
+#define IORINGMAP 0x7F000000        // ioring_setup(): the struct ioring
 #define KERNLINK (KERNBASE+EXTMEM)  // Address where kernel is linked
 
 #define V2P(a) (((uint) (a)) - KERNBASE)
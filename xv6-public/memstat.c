@@ -0,0 +1,38 @@
+// Page allocator statistics
+//
+// usage: memstat
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "kstat.h"
+
+int
+main(int argc, char *argv[])
+{
+  struct kstat_mem st;
+  struct kstat_slab sl;
+  int i;
+
+  if(kstat(KSTAT_MEM, &st, sizeof(st)) < 0){
+    printf(2, "memstat: kstat failed\n");
+    exit();
+  }
+
+  printf(1, "cpu\talloc\tfree\trefill\tdrain\tsteal\tcached\n");
+  for(i = 0; i < st.ncpu && i < KSTAT_NCPU; i++)
+    printf(1, "%d\t%d\t%d\t%d\t%d\t%d\t%d\n", i, st.cpu[i].alloc,
+           st.cpu[i].free, st.cpu[i].refill, st.cpu[i].drain,
+           st.cpu[i].steal, st.cpu[i].cached);
+  printf(1, "%d pages free (%dKB), %d reserved\n", st.nfree, st.nfree * 4,
+         st.reserved);
+  printf(1, "%d program pages cached, %d hits, %d misses\n", st.ntext,
+         st.texthit, st.textmiss);
+
+  if(kstat(KSTAT_SLAB, &sl, sizeof(sl)) < 0)
+    exit();
+  printf(1, "size\tpages\tinuse\talloc\n");
+  for(i = 0; i < sl.nclass && i < KSTAT_NSLAB; i++)
+    printf(1, "%d\t%d\t%d\t%d\n", sl.class[i].size, sl.class[i].npage,
+           sl.class[i].alloc - sl.class[i].free, sl.class[i].alloc);
+  exit();
+}
@@ -18,13 +18,19 @@
 #define NINODES 200
 
 // Disk layout:
-// [ boot block | sb block | log | inode blocks | free bit map | data blocks ]
+// [ boot block | sb block | log | inode blocks | free bit map | klog | data blocks ]
+// With -d, the klog spill region, and with -j the log as well, go
+// on the log disk instead:
+// [ boot block | sb block | log | klog ]
 
 int nbitmap = FSSIZE/(BSIZE*8) + 1;
 int ninodeblocks = NINODES / IPB + 1;
 int nlog = LOGSIZE;
-int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
+int nklog = KLOGBLOCKS;
+int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap, klog)
 int nblocks;  // Number of data blocks
+char *logdisk;  // Image of the log disk (-d), or 0
+int logonlogdisk;  // Log on the log disk too (-j)
 
 int fsfd;
 struct superblock sb;
@@ -40,6 +46,7 @@ void rinode(uint inum, struct dinode *ip);
 void rsect(uint sec, void *buf);
 uint ialloc(ushort type);
 void iappend(uint inum, void *p, int n);
+void mklogdisk(void);
 
 // convert to intel byte order
 ushort
@@ -67,7 +74,7 @@ xint(uint x)
 int
 main(int argc, char *argv[])
 {
-  int i, cc, fd;
+  int i, cc, fd, first;
   uint rootino, inum, off;
   struct dirent de;
   char buf[BSIZE];
@@ -77,7 +84,30 @@ main(int argc, char *argv[])
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
 
   if(argc < 2){
-    fprintf(stderr, "Usage: mkfs fs.img files...\n");
+    fprintf(stderr, "Usage: mkfs fs.img [-l logblocks] [-d logdisk.img [-j]] files...\n");
+    exit(1);
+  }
+  first = 2;
+  for(;;){
+    if(argc > first + 1 && strcmp(argv[first], "-l") == 0){
+      nlog = atoi(argv[first + 1]);
+      if(nlog <= MAXOPBLOCKS || nlog > LOGMAX + 1){
+        fprintf(stderr, "mkfs: log must have %d to %d blocks\n",
+                MAXOPBLOCKS + 1, (int)LOGMAX + 1);
+        exit(1);
+      }
+      first += 2;
+    } else if(argc > first + 1 && strcmp(argv[first], "-d") == 0){
+      logdisk = argv[first + 1];
+      first += 2;
+    } else if(argc > first && strcmp(argv[first], "-j") == 0){
+      logonlogdisk = 1;
+      first++;
+    } else
+      break;
+  }
+  if(logonlogdisk && logdisk == 0){
+    fprintf(stderr, "mkfs: -j needs a log disk (-d)\n");
     exit(1);
   }
 
@@ -91,7 +121,11 @@ main(int argc, char *argv[])
   }
 
   // 1 fs block = 1 disk sector
-  nmeta = 2 + nlog + ninodeblocks + nbitmap;
+  nmeta = 2 + ninodeblocks + nbitmap;
+  if(!logonlogdisk)
+    nmeta += nlog;
+  if(logdisk == 0)
+    nmeta += nklog;
   nblocks = FSSIZE - nmeta;
 
   sb.size = xint(FSSIZE);
@@ -99,11 +133,20 @@ main(int argc, char *argv[])
   sb.ninodes = xint(NINODES);
   sb.nlog = xint(nlog);
   sb.logstart = xint(2);
-  sb.inodestart = xint(2+nlog);
-  sb.bmapstart = xint(2+nlog+ninodeblocks);
-
-  printf("nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u) blocks %d total %d\n",
-         nmeta, nlog, ninodeblocks, nbitmap, nblocks, FSSIZE);
+  sb.inodestart = xint(logonlogdisk ? 2 : 2+nlog);
+  sb.bmapstart = xint(xint(sb.inodestart)+ninodeblocks);
+  if(logdisk){
+    sb.klogstart = xint(2+(logonlogdisk ? nlog : 0));
+    sb.klogdev = xint(LOGDEV);
+  } else
+    sb.klogstart = xint(xint(sb.bmapstart)+nbitmap);
+  sb.nklog = xint(nklog);
+  if(logonlogdisk)
+    sb.logdev = xint(LOGDEV);
+
+  printf("nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u, klog blocks %u) blocks %d total %d\n",
+         nmeta, logonlogdisk ? 0 : nlog, ninodeblocks, nbitmap,
+         logdisk ? 0 : nklog, nblocks, FSSIZE);
 
   freeblock = nmeta;     // the first free block that we can allocate
 
@@ -127,7 +170,7 @@ main(int argc, char *argv[])
   strcpy(de.name, "..");
   iappend(rootino, &de, sizeof(de));
 
-  for(i = 2; i < argc; i++){
+  for(i = first; i < argc; i++){
     assert(index(argv[i], '/') == 0);
 
     if((fd = open(argv[i], 0)) < 0){
@@ -164,9 +207,46 @@ main(int argc, char *argv[])
 
   balloc(freeblock);
 
+  if(logdisk)
+    mklogdisk();
+
   exit(0);
 }
 
+// Write the log disk: the klog spill region, with the log before
+// it for -j, all zero.
+void
+mklogdisk(void)
+{
+  struct superblock lsb;
+  char buf[BSIZE];
+  uint i, size;
+
+  close(fsfd);
+  fsfd = open(logdisk, O_RDWR|O_CREAT|O_TRUNC, 0666);
+  if(fsfd < 0){
+    perror(logdisk);
+    exit(1);
+  }
+  size = xint(sb.klogstart) + nklog;
+  printf("log disk %s: log blocks %u klog blocks %u total %u\n",
+         logdisk, logonlogdisk ? nlog : 0, nklog, size);
+
+  memset(&lsb, 0, sizeof(lsb));
+  lsb.size = xint(size);
+  lsb.klogstart = sb.klogstart;
+  lsb.nklog = sb.nklog;
+  if(logonlogdisk){
+    lsb.nlog = sb.nlog;
+    lsb.logstart = sb.logstart;
+  }
+  for(i = 0; i < size; i++)
+    wsect(i, zeroes);
+  memset(buf, 0, sizeof(buf));
+  memmove(buf, &lsb, sizeof(lsb));
+  wsect(1, buf);
+}
+
 void
 wsect(uint sec, void *buf)
 {
@@ -252,6 +332,21 @@ balloc(int used)
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
+// Return entry i of indirect block bn, allocating a block for it
+// if it is empty.
+uint
+ientry(uint bn, uint i)
+{
+  uint indirect[NINDIRECT];
+
+  rsect(bn, (char*)indirect);
+  if(indirect[i] == 0){
+    indirect[i] = xint(freeblock++);
+    wsect(bn, (char*)indirect);
+  }
+  return xint(indirect[i]);
+}
+
 void
 iappend(uint inum, void *xp, int n)
 {
@@ -259,7 +354,6 @@ iappend(uint inum, void *xp, int n)
   uint fbn, off, n1;
   struct dinode din;
   char buf[BSIZE];
-  uint indirect[NINDIRECT];
   uint x;
 
   rinode(inum, &din);
@@ -273,16 +367,18 @@ iappend(uint inum, void *xp, int n)
         din.addrs[fbn] = xint(freeblock++);
       }
       x = xint(din.addrs[fbn]);
-    } else {
+    } else if(fbn < NDIRECT + NINDIRECT){
       if(xint(din.addrs[NDIRECT]) == 0){
         din.addrs[NDIRECT] = xint(freeblock++);
       }
-      rsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      if(indirect[fbn - NDIRECT] == 0){
-        indirect[fbn - NDIRECT] = xint(freeblock++);
-        wsect(xint(din.addrs[NDIRECT]), (char*)indirect);
+      x = ientry(xint(din.addrs[NDIRECT]), fbn - NDIRECT);
+    } else {
+      if(xint(din.addrs[NDIRECT+1]) == 0){
+        din.addrs[NDIRECT+1] = xint(freeblock++);
       }
-      x = xint(indirect[fbn-NDIRECT]);
+      x = ientry(xint(din.addrs[NDIRECT+1]),
+                 (fbn - NDIRECT - NINDIRECT) / NINDIRECT);
+      x = ientry(x, (fbn - NDIRECT - NINDIRECT) % NINDIRECT);
     }
     n1 = min(n, (fbn + 1) * BSIZE - off);
     rsect(x, buf);
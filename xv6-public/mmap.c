@@ -0,0 +1,143 @@
+// Read-only file mappings.
+//
+// mmap() reserves address space in [MMAPBASE, UMAPBASE) for a file
+// and takes a reference on its inode; nothing is read then.  The
+// first touch of each page faults, and mmap_fault() fills a fresh
+// page from the buffer cache with readi(), so a program reading a
+// large file pays one copy per page it uses and allocates nothing
+// up front.  A page holds what the file did when it was first
+// touched; later writes to the file do not show.  Writes to the
+// mapping, and system calls given a buffer in it, fail.  Mappings
+// are not inherited across fork() and go away at exec() and exit().
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "x86.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "stat.h"
+#include "fs.h"
+#include "file.h"
+
+// p's mapping holding address va, or 0.
+static struct vma*
+vmafind(struct proc *p, uint va)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->ip && va >= v->start && va < v->end)
+      return v;
+  return 0;
+}
+
+// Lowest free run of len bytes in p's mmap area, or 0.
+static uint
+vmaspace(struct proc *p, uint len)
+{
+  struct vma *v;
+  uint a;
+
+  a = MMAPBASE;
+again:
+  if(a + len > UMAPBASE || a + len < a)
+    return 0;
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->ip && a < v->end && a + len > v->start){
+      a = v->end;
+      goto again;
+    }
+  return a;
+}
+
+// Map len bytes of file f from offset off, which must be page
+// aligned, into the current process.  Returns the address.
+int
+mmap(struct file *f, uint off, uint len)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  uint a;
+
+  if(f->type != FD_INODE || !f->readable || f->ip->type != T_FILE ||
+     off % PGSIZE || len == 0)
+    return -1;
+  len = PGROUNDUP(len);
+  for(v = p->vma; v < &p->vma[NVMA] && v->ip; v++)
+    ;
+  if(v == &p->vma[NVMA] || (a = vmaspace(p, len)) == 0)
+    return -1;
+  v->start = a;
+  v->end = a + len;
+  v->off = off;
+  v->ip = idup(f->ip);
+  return a;
+}
+
+// Drop v: free the pages it faulted in and put its inode.
+static void
+vmafree(struct proc *p, struct vma *v)
+{
+  struct inode *ip = v->ip;
+
+  deallocuvm(p->pgdir, v->end, v->start);
+  v->ip = 0;
+  begin_op();
+  iput(ip);
+  end_op();
+}
+
+// Undo the mmap() that returned addr.  len must be its length.
+int
+munmap(uint addr, uint len)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+
+  if((v = vmafind(p, addr)) == 0 || v->start != addr ||
+     v->end != addr + PGROUNDUP(len))
+    return -1;
+  vmafree(p, v);
+  lcr3(V2P(p->pgdir));
+  return 0;
+}
+
+// Fill in the page holding va if it is in one of p's mappings.
+// Returns -1 if it is not, or if the access was a write.
+int
+mmap_fault(struct proc *p, uint va, int write)
+{
+  struct vma *v;
+  char *mem;
+  uint a;
+
+  if((v = vmafind(p, va)) == 0 || write)
+    return -1;
+  if((mem = kalloc()) == 0)
+    return -1;
+  memset(mem, 0, PGSIZE);   // past the end of the file
+  a = PGROUNDDOWN(va);
+  ilockshared(v->ip);
+  readi(v->ip, mem, v->off + (a - v->start), PGSIZE);
+  iunlockshared(v->ip);
+  if(mappages(p->pgdir, (char*)a, PGSIZE, V2P(mem), PTE_U) < 0){
+    kfree(mem);
+    return -1;
+  }
+  return 0;
+}
+
+// Drop all of p's mappings, at exec() and exit().  The caller
+// frees or switches the page table afterwards.
+void
+mmap_release(struct proc *p)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->ip)
+      vmafree(p, v);
+}
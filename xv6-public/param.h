@@ -1,14 +1,25 @@
 #define NPROC        64  // maximum number of processes
 #define KSTACKSIZE 4096  // size of per-process kernel stack
 #define NCPU          8  // maximum number of CPUs
-#define NOFILE       16  // open files per process
-#define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NOFILE       64  // open files per process
+#define NVMA          8  // mmap()ed files per process
+#define NFILE      4096  // open files per system
+#define NINODE      200  // maximum number of active i-nodes
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
+#define LOGDEV        2  // device number of the log disk (mkfs -d)
 #define MAXARG       32  // max exec arguments
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
-#define FSSIZE       1000  // size of file system in blocks
+#define LOGSIZE      (MAXOPBLOCKS*3)  // default log blocks (mkfs -l)
+#define NBUF         (MAXOPBLOCKS*3)  // disk block cache buffers allocated at boot
+#define NBUFMAX      512  // most buffers the cache may grow to
+#define NREADAHEAD   8  // blocks prefetched ahead of a sequential reader
+#define NDCACHE      128  // directory lookup cache entries
+#define PIPESIZE    8192  // bytes buffered per pipe (power of 2)
+#define FSSIZE       4000  // size of file system in blocks
+#define KLOGSIZE    16384  // bytes of klog records per CPU (power of 2)
+#define KLOGBLOCKS    128  // blocks of on-disk klog spill region
+#ifndef HZ
+#define HZ            100  // timer ticks per second (make HZ=n)
+#endif
 
@@ -0,0 +1,251 @@
+// Performance tests for core OS paths, in the manner of usertests:
+// process creation, pipes, small files and large files.  Each test
+// runs ITERS times and reports the fastest and the median run as
+// TSC cycles per operation, the median in nanoseconds per operation
+// (from uptimens()) and as operations per second, on one key=value
+// line.
+//
+// usage: perftests
+#include "param.h"
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "fcntl.h"
+#include "x86.h"
+#include "kstat.h"
+
+#define ITERS 5
+
+char buf[4096];
+int stdout = 1;
+char *self;
+
+// Low 32 bits of the TSC; a run is timed as the difference, which
+// is right as long as it takes fewer than 2^32 cycles.
+static uint
+now(void)
+{
+  return (uint)rdtsc();
+}
+
+static void
+fail(char *what)
+{
+  printf(stdout, "perftests: %s failed\n", what);
+  exit();
+}
+
+// n fork()s of a child that exits at once.
+static uint
+forkexit(int n)
+{
+  uint t;
+  int i, pid;
+
+  t = now();
+  for(i = 0; i < n; i++){
+    if((pid = fork()) < 0)
+      fail("fork");
+    if(pid == 0)
+      exit();
+    wait();
+  }
+  return now() - t;
+}
+
+// n fork()s of a child that execs this program, which exits at once.
+static uint
+forkexec(int n)
+{
+  char *argv[] = { self, "-exit", 0 };
+  uint t;
+  int i, pid;
+
+  t = now();
+  for(i = 0; i < n; i++){
+    if((pid = fork()) < 0)
+      fail("fork");
+    if(pid == 0){
+      exec(self, argv);
+      fail("exec");
+    }
+    wait();
+  }
+  return now() - t;
+}
+
+// n round trips of a byte between two processes.
+static uint
+pingpong(int n)
+{
+  int a[2], b[2], i, pid;
+  char c = 0;
+  uint t;
+
+  if(pipe(a) < 0 || pipe(b) < 0)
+    fail("pipe");
+  if((pid = fork()) < 0)
+    fail("fork");
+  if(pid == 0){
+    for(i = 0; i < n; i++){
+      if(read(a[0], &c, 1) != 1)
+        break;
+      write(b[1], &c, 1);
+    }
+    exit();
+  }
+  t = now();
+  for(i = 0; i < n; i++){
+    write(a[1], &c, 1);
+    if(read(b[0], &c, 1) != 1)
+      fail("pingpong read");
+  }
+  t = now() - t;
+  close(a[0]);
+  close(a[1]);
+  close(b[0]);
+  close(b[1]);
+  wait();
+  return t;
+}
+
+// n 4096-byte writes through a pipe to another process.
+static uint
+pipebulk(int n)
+{
+  int p[2], i, m, pid, tot;
+  uint t;
+
+  if(pipe(p) < 0)
+    fail("pipe");
+  if((pid = fork()) < 0)
+    fail("fork");
+  if(pid == 0){
+    close(p[0]);
+    for(i = 0; i < n; i++)
+      if(write(p[1], buf, sizeof(buf)) != sizeof(buf))
+        fail("pipe write");
+    exit();
+  }
+  close(p[1]);
+  tot = 0;
+  t = now();
+  while((m = read(p[0], buf, sizeof(buf))) > 0)
+    tot += m;
+  t = now() - t;
+  close(p[0]);
+  wait();
+  if(tot != n * sizeof(buf))
+    fail("pipe read");
+  return t;
+}
+
+// n create, close and unlink of an empty file.
+static uint
+smallfile(int n)
+{
+  char name[4];
+  uint t;
+  int i, fd;
+
+  name[0] = 'p';
+  name[1] = 'f';
+  name[3] = 0;
+  t = now();
+  for(i = 0; i < n; i++){
+    name[2] = 'a' + i % 26;
+    if((fd = open(name, O_CREATE | O_RDWR)) < 0)
+      fail("create");
+    close(fd);
+    if(unlink(name) < 0)
+      fail("unlink");
+  }
+  return now() - t;
+}
+
+// n 4096-byte writes to one new file.
+static uint
+bigwrite(int n)
+{
+  uint t;
+  int i, fd;
+
+  unlink("perfbig");
+  t = now();
+  if((fd = open("perfbig", O_CREATE | O_RDWR)) < 0)
+    fail("create");
+  for(i = 0; i < n; i++)
+    if(write(fd, buf, sizeof(buf)) != sizeof(buf))
+      fail("write");
+  close(fd);
+  return now() - t;
+}
+
+// n 4096-byte reads of the file bigwrite() left.
+static uint
+bigread(int n)
+{
+  uint t;
+  int i, fd;
+
+  t = now();
+  if((fd = open("perfbig", O_RDONLY)) < 0)
+    fail("open");
+  for(i = 0; i < n; i++)
+    if(read(fd, buf, sizeof(buf)) != sizeof(buf))
+      fail("read");
+  close(fd);
+  return now() - t;
+}
+
+// Insert x into the sorted a[0..n-1].
+static void
+insert(uint *a, int n, uint x)
+{
+  for(; n > 0 && a[n-1] > x; n--)
+    a[n] = a[n-1];
+  a[n] = x;
+}
+
+// Run f(n) ITERS times and report per-operation times.
+static void
+run(char *name, uint (*f)(int), int n)
+{
+  uint c[ITERS], ns[ITERS], x;
+  uint64 t0, t1;
+  int i;
+
+  for(i = 0; i < ITERS; i++){
+    uptimens(&t0);
+    x = f(n) / n;
+    uptimens(&t1);
+    insert(c, i, x);
+    insert(ns, i, (uint)(t1 - t0) / n);
+  }
+  x = ns[ITERS/2];
+  printf(stdout, "%s ops=%d min=%d median=%d ns=%d ops_per_sec=%d\n",
+         name, n, c[0], c[ITERS/2], x, x ? 1000000000 / x : 0);
+}
+
+int
+main(int argc, char *argv[])
+{
+  static struct kstat_syscall ks;
+
+  if(argc > 1 && strcmp(argv[1], "-exit") == 0)
+    exit();
+  self = argv[0];
+  if(kstat(KSTAT_SYSCALL, &ks, sizeof(ks)) < 0)
+    fail("kstat");
+  printf(stdout, "config tsckhz=%d iters=%d\n", ks.tsckhz, ITERS);
+
+  run("fork_exit", forkexit, 20);
+  run("fork_exec_wait", forkexec, 10);
+  run("pipe_pingpong", pingpong, 200);
+  run("pipe_bulk_4k", pipebulk, 64);
+  run("file_create_unlink", smallfile, 50);
+  run("file_write_4k", bigwrite, 32);
+  run("file_read_4k", bigread, 32);
+  unlink("perfbig");
+  exit();
+}
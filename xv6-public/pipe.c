@@ -7,29 +7,60 @@
 #include "spinlock.h"
 #include "sleeplock.h"
 #include "file.h"
+#include "uio.h"
 
-#define PIPESIZE 512
+// The PIPESIZE-byte ring (param.h; a power of 2) is made of chunks
+// of at most a page, kmalloc()ed separately.  Readers and writers
+// copy whole runs of bytes, up to the end of a chunk at a time.
+#define PIPECHUNK (PIPESIZE < PGSIZE ? PIPESIZE : PGSIZE)
+#define NPIPECHUNK (PIPESIZE / PIPECHUNK)
 
 struct pipe {
   struct spinlock lock;
-  char data[PIPESIZE];
+  char *data[NPIPECHUNK];
   uint nread;     // number of bytes read
   uint nwrite;    // number of bytes written
   int readopen;   // read fd is still open
   int writeopen;  // write fd is still open
 };
 
+static void
+pipefree(struct pipe *p)
+{
+  int i;
+
+  for(i = 0; i < NPIPECHUNK; i++)
+    if(p->data[i])
+      kmfree(p->data[i]);
+  kmfree(p);
+}
+
+// Where byte position pos of the ring lives, and how many bytes
+// follow it contiguously.
+static char*
+pipebuf(struct pipe *p, uint pos, uint *left)
+{
+  pos %= PIPESIZE;
+  *left = PIPECHUNK - pos % PIPECHUNK;
+  return p->data[pos / PIPECHUNK] + pos % PIPECHUNK;
+}
+
 int
 pipealloc(struct file **f0, struct file **f1)
 {
   struct pipe *p;
+  int i;
 
   p = 0;
   *f0 = *f1 = 0;
   if((*f0 = filealloc()) == 0 || (*f1 = filealloc()) == 0)
     goto bad;
-  if((p = (struct pipe*)kalloc()) == 0)
+  if((p = (struct pipe*)kmalloc(sizeof(struct pipe))) == 0)
     goto bad;
+  memset(p->data, 0, sizeof(p->data));
+  for(i = 0; i < NPIPECHUNK; i++)
+    if((p->data[i] = kmalloc(PIPECHUNK)) == 0)
+      goto bad;
   p->readopen = 1;
   p->writeopen = 1;
   p->nwrite = 0;
@@ -48,7 +79,7 @@ pipealloc(struct file **f0, struct file **f1)
 //PAGEBREAK: 20
  bad:
   if(p)
-    kfree((char*)p);
+    pipefree(p);
   if(*f0)
     fileclose(*f0);
   if(*f1)
@@ -69,53 +100,82 @@ pipeclose(struct pipe *p, int writable)
   }
   if(p->readopen == 0 && p->writeopen == 0){
     release(&p->lock);
-    kfree((char*)p);
+    pipefree(p);
   } else
     release(&p->lock);
 }
 
 //PAGEBREAK: 40
+// Write cnt buffers to the pipe in turn.
 int
-pipewrite(struct pipe *p, char *addr, int n)
+pipewrite(struct pipe *p, struct iovec *iov, int cnt)
 {
-  int i;
+  int i, j, n, tot;
+  uint m, left;
+  char *addr, *buf;
 
   acquire(&p->lock);
-  for(i = 0; i < n; i++){
-    while(p->nwrite == p->nread + PIPESIZE){  //DOC: pipewrite-full
-      if(p->readopen == 0 || myproc()->killed){
-        release(&p->lock);
-        return -1;
+  for(tot = 0, j = 0; j < cnt; j++){
+    addr = iov[j].base;
+    n = iov[j].len;
+    for(i = 0; i < n; i += m){
+      while(p->nwrite == p->nread + PIPESIZE){  //DOC: pipewrite-full
+        if(p->readopen == 0 || interrupted()){
+          release(&p->lock);
+          return -1;
+        }
+        wakeup(&p->nread);
+        sleep(&p->nwrite, &p->lock);  //DOC: pipewrite-sleep
       }
-      wakeup(&p->nread);
-      sleep(&p->nwrite, &p->lock);  //DOC: pipewrite-sleep
+      buf = pipebuf(p, p->nwrite, &left);
+      m = n - i;
+      if(m > left)
+        m = left;
+      if(m > p->nread + PIPESIZE - p->nwrite)
+        m = p->nread + PIPESIZE - p->nwrite;
+      memmove(buf, addr + i, m);
+      p->nwrite += m;
     }
-    p->data[p->nwrite++ % PIPESIZE] = addr[i];
+    tot += n;
   }
   wakeup(&p->nread);  //DOC: pipewrite-wakeup1
   release(&p->lock);
-  return n;
+  return tot;
 }
 
+// Read into cnt buffers in turn.  Waits only until the pipe
+// holds something, then takes what there is.
 int
-piperead(struct pipe *p, char *addr, int n)
+piperead(struct pipe *p, struct iovec *iov, int cnt)
 {
-  int i;
+  int i, j, n, tot;
+  uint m, left;
+  char *addr, *buf;
 
   acquire(&p->lock);
   while(p->nread == p->nwrite && p->writeopen){  //DOC: pipe-empty
-    if(myproc()->killed){
+    if(interrupted()){
       release(&p->lock);
       return -1;
     }
     sleep(&p->nread, &p->lock); //DOC: piperead-sleep
   }
-  for(i = 0; i < n; i++){  //DOC: piperead-copy
-    if(p->nread == p->nwrite)
-      break;
-    addr[i] = p->data[p->nread++ % PIPESIZE];
+  for(tot = 0, j = 0; j < cnt && p->nread != p->nwrite; j++){
+    addr = iov[j].base;
+    n = iov[j].len;
+    for(i = 0; i < n && p->nread != p->nwrite; i += m){  //DOC: piperead-copy
+      buf = pipebuf(p, p->nread, &left);
+      m = n - i;
+      if(m > left)
+        m = left;
+      if(m > p->nwrite - p->nread)
+        m = p->nwrite - p->nread;
+      memmove(addr + i, buf, m);
+      p->nread += m;
+    }
+    tot += i;
   }
   wakeup(&p->nwrite);  //DOC: piperead-wakeup
   release(&p->lock);
-  return i;
+  return tot;
 }
@@ -1,15 +1,147 @@
 #include "types.h"
 #include "stat.h"
 #include "user.h"
+#include "uio.h"
+
+// Buffered output for printf() and bufwrite().  Descriptors below
+// NOBUF get a buffer the first time they are written: a console's is
+// flushed after each call that ends a line, a file's or pipe's when
+// it fills.  fd 2 and higher descriptors go out at the end of every
+// call.  ulib.c flushes everything before a process exits, forks or
+// execs, and a descriptor's buffer before it is closed.  Data that
+// does not fit in what is left of a buffer is written together with
+// it in one writev(), without being copied.
+
+#define NOBUF    8
+#define OBUFSIZE 512
+
+#define OB_NONE  0   // not used yet
+#define OB_CALL  1   // flush at the end of every call
+#define OB_LINE  2   // flush at the end of a call that ends a line
+#define OB_FULL  3   // flush when full
+
+struct obuf {
+  int fd;
+  int mode;
+  int nl;          // buf holds a newline
+  int n;           // bytes used in buf
+  char buf[OBUFSIZE];
+};
+
+static struct obuf obuf[NOBUF];
+static struct obuf callbuf;    // for everything else
 
 static void
-putc(int fd, char c)
+oflush(struct obuf *b)
 {
-  write(fd, &c, 1);
+  if(b->n > 0)
+    write(b->fd, b->buf, b->n);
+  b->n = 0;
+  b->nl = 0;
+}
+
+// Write out fd's buffered output, or everyone's if fd is -1.
+void
+bufflush(int fd)
+{
+  int i;
+
+  for(i = 0; i < NOBUF; i++)
+    if(fd < 0 || fd == i)
+      oflush(&obuf[i]);
+}
+
+// Called by ulib.c: fd -1 before exit, fork, exec and reads of the
+// console, fd before it is closed.  A closed descriptor may come
+// back as something else, so its mode is looked up again.
+static void
+ohook(int fd)
+{
+  bufflush(fd);
+  if(fd >= 0 && fd < NOBUF)
+    obuf[fd].mode = OB_NONE;
+}
+
+static struct obuf*
+getbuf(int fd)
+{
+  struct obuf *b;
+  struct stat st;
+
+  if(fd < 0 || fd == 2 || fd >= NOBUF){
+    b = &callbuf;
+    b->fd = fd;
+    b->mode = OB_CALL;
+    return b;
+  }
+  b = &obuf[fd];
+  if(b->mode == OB_NONE){
+    b->fd = fd;
+    if(fstat(fd, &st) < 0)    // a pipe
+      b->mode = OB_FULL;
+    else
+      b->mode = st.type == T_DEV ? OB_LINE : OB_FULL;
+    flushhook = ohook;
+  }
+  return b;
+}
+
+static void
+putc(struct obuf *b, char c)
+{
+  if(b->n == OBUFSIZE)
+    oflush(b);
+  b->buf[b->n++] = c;
+  if(c == '\n')
+    b->nl = 1;
+}
+
+// Add n bytes at p to b's output.
+static int
+oput(struct obuf *b, const char *p, int n)
+{
+  struct iovec iov[2];
+  int i;
+
+  if(n > OBUFSIZE - b->n){
+    iov[0].base = b->buf;
+    iov[0].len = b->n;
+    iov[1].base = (void*)p;
+    iov[1].len = n;
+    b->n = 0;
+    b->nl = 0;
+    return writev(b->fd, iov, 2) < 0 ? -1 : n;
+  }
+  memmove(b->buf + b->n, p, n);
+  for(i = 0; i < n && !b->nl; i++)
+    if(p[i] == '\n')
+      b->nl = 1;
+  b->n += n;
+  return n;
+}
+
+// The end of a call that wrote to b.
+static void
+odone(struct obuf *b)
+{
+  if(b->mode == OB_CALL || (b->mode == OB_LINE && b->nl))
+    oflush(b);
+}
+
+// Like write(), but through fd's buffer.
+int
+bufwrite(int fd, const void *p, int n)
+{
+  struct obuf *b;
+
+  b = getbuf(fd);
+  n = oput(b, p, n);
+  odone(b);
+  return n;
 }
 
 static void
-printint(int fd, int xx, int base, int sgn)
+printint(struct obuf *b, int xx, int base, int sgn)
 {
   static char digits[] = "0123456789ABCDEF";
   char buf[16];
@@ -32,17 +164,19 @@ printint(int fd, int xx, int base, int sgn)
     buf[i++] = '-';
 
   while(--i >= 0)
-    putc(fd, buf[i]);
+    putc(b, buf[i]);
 }
 
 // Print to the given fd. Only understands %d, %x, %p, %s.
 void
 printf(int fd, const char *fmt, ...)
 {
+  struct obuf *b;
   char *s;
   int c, i, state;
   uint *ap;
 
+  b = getbuf(fd);
   state = 0;
   ap = (uint*)(void*)&fmt + 1;
   for(i = 0; fmt[i]; i++){
@@ -51,35 +185,33 @@ printf(int fd, const char *fmt, ...)
       if(c == '%'){
         state = '%';
       } else {
-        putc(fd, c);
+        putc(b, c);
       }
     } else if(state == '%'){
       if(c == 'd'){
-        printint(fd, *ap, 10, 1);
+        printint(b, *ap, 10, 1);
         ap++;
       } else if(c == 'x' || c == 'p'){
-        printint(fd, *ap, 16, 0);
+        printint(b, *ap, 16, 0);
         ap++;
       } else if(c == 's'){
         s = (char*)*ap;
         ap++;
         if(s == 0)
           s = "(null)";
-        while(*s != 0){
-          putc(fd, *s);
-          s++;
-        }
+        oput(b, s, strlen(s));
       } else if(c == 'c'){
-        putc(fd, *ap);
+        putc(b, *ap);
         ap++;
       } else if(c == '%'){
-        putc(fd, c);
+        putc(b, c);
       } else {
         // Unknown % sequence.  Print it to draw attention.
-        putc(fd, '%');
-        putc(fd, c);
+        putc(b, '%');
+        putc(b, c);
       }
       state = 0;
     }
   }
+  odone(b);
 }
@@ -4,8 +4,11 @@
 #include "memlayout.h"
 #include "mmu.h"
 #include "x86.h"
+#include "traps.h"
 #include "proc.h"
 #include "spinlock.h"
+#include "kstat.h"
+#define KLOG_SUBSYS KLOG_SS_PROC
 #include "klog.h"
 
 struct {
@@ -13,6 +16,40 @@ struct {
   struct proc proc[NPROC];
 } ptable;
 
+// Each CPU has a FIFO queue of RUNNABLE processes, which is what
+// its scheduler() runs.  A process is put on a queue when it becomes
+// RUNNABLE (with ptable.lock held, as for every state change) and the
+// scheduler takes it off again holding only the queue's lock, so
+// idle CPUs never touch ptable.lock.  A RUNNABLE process that is on
+// no queue belongs to the scheduler that dequeued it: nothing else
+// changes the state of a RUNNABLE process.  That scheduler then
+// takes ptable.lock to switch to it as before; since whoever made
+// the process RUNNABLE holds ptable.lock until it has left the
+// process's stack, the switch cannot start early.  A CPU whose queue
+// is empty steals from the others, and one with nothing to do halts
+// until an interrupt; setrunnable() sends an IPI to an idle CPU when
+// it queues work.
+struct runq {
+  struct spinlock lock;
+  struct proc *head;
+  struct proc *tail;
+  int n;
+} runq[NCPU];
+
+// Sleeping processes, hashed by chan so wakeup() only looks at
+// processes that may be sleeping on its chan.  Protected by
+// ptable.lock, like the SLEEPING state itself.
+#define NSLEEPQ 61
+
+static struct proc *sleepq[NSLEEPQ];
+
+// Counters for kstat(KSTAT_SCHED), under ptable.lock.
+static struct {
+  uint wakeup;     // wakeup() calls
+  uint empty;      // ... that found nobody sleeping on chan
+  uint spurious;   // Sleeps on the chan just woken from, same syscall
+} sqstat;
+
 static struct proc *initproc;
 
 int nextpid = 1;
@@ -24,7 +61,11 @@ static void wakeup1(void *chan);
 void
 pinit(void)
 {
-  initlock(&ptable.lock, "ptable");
+  int i;
+
+  initmcslock(&ptable.lock, "ptable");
+  for(i = 0; i < NCPU; i++)
+    initlock(&runq[i].lock, "runq");
 }
 
 // Must be called with interrupts disabled
@@ -33,39 +74,107 @@ cpuid() {
   return mycpu()-cpus;
 }
 
-// Must be called with interrupts disabled to avoid the caller being
-// rescheduled between reading lapicid and running through the loop.
+// Must be called with interrupts disabled, so that the caller is
+// not rescheduled onto another CPU while it uses the result.
+// %gs maps this CPU's struct cpu (see seginit()).
 struct cpu*
 mycpu(void)
 {
-  int apicid, i;
-  
+  struct cpu *c;
+
   if(readeflags()&FL_IF)
     panic("mycpu called with interrupts enabled\n");
-  
-  apicid = lapicid();
-  // APIC IDs are not guaranteed to be contiguous. Maybe we should have
-  // a reverse map, or reserve a register to store &cpus[i].
-  for (i = 0; i < ncpu; ++i) {
-    if (cpus[i].apicid == apicid)
-      return &cpus[i];
-  }
-  panic("unknown apicid\n");
+  asm volatile("movl %%gs:%c1, %0" : "=r" (c) : "i" (__builtin_offsetof(struct cpu, self)));
+  return c;
 }
 
-// Disable interrupts so that we are not rescheduled
-// while reading proc from the cpu structure
+// The process on this CPU.  One load through %gs cannot be split by
+// a reschedule, so unlike mycpu() this needs interrupts off for no
+// more than the instruction; the answer is the same on any CPU the
+// caller may be moved to.
 struct proc*
 myproc(void) {
-  struct cpu *c;
   struct proc *p;
-  pushcli();
-  c = mycpu();
-  p = c->proc;
-  popcli();
+
+  asm volatile("movl %%gs:%c1, %0" : "=r" (p) : "i" (__builtin_offsetof(struct cpu, proc)));
   return p;
 }
 
+// Make p RUNNABLE and queue it.  It goes back to the CPU it last ran
+// on, whose cache may still be warm, unless that CPU has a backlog;
+// then to the CPU with the shortest queue.  Caller holds ptable.lock.
+static void
+setrunnable(struct proc *p)
+{
+  struct runq *rq;
+  int i, c, me;
+
+  if(!holding(&ptable.lock))
+    panic("setrunnable");
+  p->state = RUNNABLE;
+  c = p->cpu >= 0 ? p->cpu : cpuid();
+  if(runq[c].n > 0)
+    for(i = 0; i < ncpu; i++)
+      if(runq[i].n < runq[c].n)
+        c = i;
+  rq = &runq[c];
+  acquire(&rq->lock);
+  p->rqnext = 0;
+  if(rq->tail)
+    rq->tail->rqnext = p;
+  else
+    rq->head = p;
+  rq->tail = p;
+  rq->n++;
+  release(&rq->lock);
+
+  // Wake the CPU if it is halted, or else any halted CPU so it can
+  // steal the process.  release() has made rq->n visible already;
+  // see scheduler() for the other side.
+  me = cpuid();
+  if(c == me || !cpus[c].idle)
+    for(c = 0; c < ncpu && (c == me || !cpus[c].idle); c++)
+      ;
+  if(c < ncpu)
+    lapicipi(cpus[c].apicid, T_IRQ0 + IRQ_WAKEUP);
+}
+
+// Take the first process off rq, or return 0 if it is empty.
+static struct proc*
+dequeue(struct runq *rq)
+{
+  struct proc *p;
+
+  if(rq->n == 0)   // Peek without the lock; recheck below.
+    return 0;
+  acquire(&rq->lock);
+  if((p = rq->head) != 0){
+    rq->head = p->rqnext;
+    if(rq->head == 0)
+      rq->tail = 0;
+    rq->n--;
+  }
+  release(&rq->lock);
+  return p;
+}
+
+static struct proc**
+sqhash(void *chan)
+{
+  return &sleepq[((uint)chan >> 2) % NSLEEPQ];
+}
+
+// Take sleeping process p off its sleep queue.
+static void
+sqremove(struct proc *p)
+{
+  struct proc **pp;
+
+  for(pp = sqhash(p->chan); *pp != p; pp = &(*pp)->sqnext)
+    ;
+  *pp = p->sqnext;
+}
+
 //PAGEBREAK: 32
 // Look in the process table for an UNUSED proc.
 // If found, change state to EMBRYO and initialize
@@ -89,6 +198,12 @@ allocproc(void)
 found:
   p->state = EMBRYO;
   p->pid = nextpid++;
+  p->cpu = -1;
+  p->runns = 0;
+  p->nsyscall = 0;
+  p->rbytes = 0;
+  p->wbytes = 0;
+  memset(p->vma, 0, sizeof(p->vma));
 
   release(&ptable.lock);
 
@@ -149,26 +264,77 @@ userinit(void)
   // because the assignment might not be atomic.
   acquire(&ptable.lock);
 
-  p->state = RUNNABLE;
+  setrunnable(p);
 
   release(&ptable.lock);
 }
 
+// A kernel thread's first scheduling by scheduler() swtches here.
+// Its trap frame is never used for a return to user space, so it
+// holds the function to run in eip and its argument in eax.
+static void
+kthreadret(void)
+{
+  struct trapframe *tf = myproc()->tf;
+
+  // Still holding ptable.lock from scheduler.
+  release(&ptable.lock);
+  ((void (*)(void*))tf->eip)((void*)tf->eax);
+  panic("kthread returned");
+}
+
+// Start a kernel thread running fn(arg) in a process of its own.
+// It has only the kernel's mappings and must never return.
+struct proc*
+kthread_create(char *name, void (*fn)(void*), void *arg)
+{
+  struct proc *p;
+
+  if((p = allocproc()) == 0)
+    return 0;
+  if((p->pgdir = setupkvm()) == 0){
+    kfree(p->kstack);
+    p->kstack = 0;
+    p->state = UNUSED;
+    return 0;
+  }
+  p->sz = 0;
+  p->tf->eip = (uint)fn;
+  p->tf->eax = (uint)arg;
+  p->context->eip = (uint)kthreadret;
+  safestrcpy(p->name, name, sizeof(p->name));
+
+  acquire(&ptable.lock);
+  setrunnable(p);
+  release(&ptable.lock);
+  return p;
+}
+
 // Grow current process's memory by n bytes.
 // Return 0 on success, -1 on failure.
 int
 growproc(int n)
 {
   uint sz;
+  int lazy;
   struct proc *curproc = myproc();
 
   sz = curproc->sz;
   if(n > 0){
-    if((sz = allocuvm(curproc->pgdir, sz, sz + n)) == 0)
+    // Pages are allocated when first touched; see pagefault().
+    if(sz + n < sz || sz + n >= MMAPBASE)
+      return -1;
+    lazy = (PGROUNDUP(sz + n) - PGROUNDUP(sz)) / PGSIZE;
+    if(kreserve(lazy) < 0)
       return -1;
+    curproc->lazy += lazy;
+    sz += n;
   } else if(n < 0){
+    lazy = uvmlazy(curproc->pgdir, sz + n, sz);
     if((sz = deallocuvm(curproc->pgdir, sz, sz + n)) == 0)
       return -1;
+    curproc->lazy -= lazy;
+    kreserve(-lazy);
   }
   curproc->sz = sz;
   switchuvm(curproc);
@@ -177,7 +343,7 @@ growproc(int n)
 
 // Create a new process copying p as the parent.
 // Sets up stack to return as if from system call.
-// Caller must set state of returned proc to RUNNABLE.
+// The child is made RUNNABLE with setrunnable() once complete.
 int
 fork(void)
 {
@@ -190,14 +356,23 @@ fork(void)
     return -1;
   }
 
-  // Copy process state from proc.
+  // Copy process state from proc.  The child is promised the heap
+  // pages the parent has not touched yet, too.
+  if(kreserve(curproc->lazy) < 0){
+    kfree(np->kstack);
+    np->kstack = 0;
+    np->state = UNUSED;
+    return -1;
+  }
   if((np->pgdir = copyuvm(curproc->pgdir, curproc->sz)) == 0){
+    kreserve(-curproc->lazy);
     kfree(np->kstack);
     np->kstack = 0;
     np->state = UNUSED;
     return -1;
   }
   np->sz = curproc->sz;
+  np->lazy = curproc->lazy;
   np->parent = curproc;
   *np->tf = *curproc->tf;
 
@@ -215,11 +390,12 @@ fork(void)
 
   acquire(&ptable.lock);
 
-  np->state = RUNNABLE;
+  setrunnable(np);
+  klog_sched(KLOG_EV_WAKEUP, np->pid, 0);
 
   release(&ptable.lock);
 
-  klog_printf("fork: pid %d created child %d", curproc->pid, pid);
+  klog_ev(KLOG_INFO, KLOG_EV_FORK, curproc->pid, pid);
 
   return pid;
 }
@@ -237,7 +413,9 @@ exit(void)
   if(curproc == initproc)
     panic("init exiting");
 
-  klog_printf("exit: pid %d exiting", curproc->pid);
+  klog_ev(KLOG_INFO, KLOG_EV_PEXIT, curproc->pid);
+  ioring_release(curproc);
+  mmap_release(curproc);
 
   // Close all open files.
   for(fd = 0; fd < NOFILE; fd++){
@@ -268,6 +446,7 @@ exit(void)
 
   // Jump into the scheduler, never to return.
   curproc->state = ZOMBIE;
+  klog_sched(KLOG_EV_EXIT, curproc->pid, 0);
   sched();
   panic("zombie exit");
 }
@@ -279,6 +458,7 @@ wait(void)
 {
   struct proc *p;
   int havekids, pid;
+  pde_t *pgdir;
   struct proc *curproc = myproc();
   
   acquire(&ptable.lock);
@@ -294,13 +474,19 @@ wait(void)
         pid = p->pid;
         kfree(p->kstack);
         p->kstack = 0;
-        freevm(p->pgdir);
+        pgdir = p->pgdir;
+        p->pgdir = 0;
+        kreserve(-p->lazy);
+        p->lazy = 0;
         p->pid = 0;
         p->parent = 0;
         p->name[0] = 0;
         p->killed = 0;
+        p->aborted = 0;
         p->state = UNUSED;
         release(&ptable.lock);
+        // Not under ptable.lock: freevm() may wait for another CPU.
+        freevm(pgdir);
         return pid;
       }
     }
@@ -329,34 +515,82 @@ scheduler(void)
 {
   struct proc *p;
   struct cpu *c = mycpu();
+  int id, i;
+  uint64 t0;
+
   c->proc = 0;
-  
+  id = cpuid();
+
   for(;;){
     // Enable interrupts on this processor.
     sti();
 
-    // Loop over process table looking for process to run.
-    acquire(&ptable.lock);
-    for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
-      if(p->state != RUNNABLE)
-        continue;
+    // Run the next process of this CPU's queue, or steal one.
+    if((p = dequeue(&runq[id])) == 0){
+      for(i = 1; i < ncpu && p == 0; i++)
+        p = dequeue(&runq[(id + i) % ncpu]);
+      if(p)
+        c->nsteal++;
+    }
+    if(p == 0){
+      // A halted CPU must not hold up freevm().
+      if(c->pgdir){
+        switchkvm();
+        c->pgdir = 0;
+      }
+      // Nothing to run: halt until an interrupt.  Set idle before
+      // the last look at the queues (xchg is a full barrier), so a
+      // setrunnable() that queues work after that look sees idle
+      // and sends an IPI, which with interrupts off until the hlt
+      // cannot arrive too early to end it.
+      cli();
+      xchg(&c->idle, 1);
+      tickidle();
+      for(i = 0; i < ncpu && runq[i].n == 0; i++)
+        ;
+      if(i == ncpu){
+        t0 = nanotime();
+        stihlt();
+        c->idlens += nanotime() - t0;
+      }
+      c->idle = 0;
+      lapicperiodic();
+      continue;
+    }
 
-      // Switch to chosen process.  It is the process's job
-      // to release ptable.lock and then reacquire it
-      // before jumping back to us.
-      c->proc = p;
+    // Switch to chosen process.  It is the process's job
+    // to release ptable.lock and then reacquire it
+    // before jumping back to us.
+    acquire(&ptable.lock);
+    if(p->state != RUNNABLE)
+      panic("scheduler: not runnable");
+    c->proc = p;
+    // A process picked again after a yield, with nothing run here
+    // in between, finds its page table loaded and its kernel stack
+    // in the TSS; it ran nowhere else, so nothing it changed there
+    // can be stale in this CPU's TLB.
+    if(c->pgdir == p->pgdir && p->cpu == id)
+      c->nkeep++;
+    else
       switchuvm(p);
-      p->state = RUNNING;
-
-      swtch(&(c->scheduler), p->context);
+    p->state = RUNNING;
+    p->cpu = id;
+    c->nrun++;
+    klog_sched(KLOG_EV_RUN, p->pid, 0);
+
+    t0 = nanotime();
+    swtch(&(c->scheduler), p->context);
+    p->runns += nanotime() - t0;
+    // Keep p's page table loaded, unless wait() is about to free it.
+    if(p->state == ZOMBIE){
       switchkvm();
-
-      // Process is done running for now.
-      // It should have changed its p->state before coming back.
-      c->proc = 0;
+      c->pgdir = 0;
     }
-    release(&ptable.lock);
 
+    // Process is done running for now.
+    // It should have changed its p->state before coming back.
+    c->proc = 0;
+    release(&ptable.lock);
   }
 }
 
@@ -391,7 +625,8 @@ void
 yield(void)
 {
   acquire(&ptable.lock);  //DOC: yieldlock
-  myproc()->state = RUNNABLE;
+  setrunnable(myproc());
+  klog_sched(KLOG_EV_YIELD, myproc()->pid, 0);
   sched();
   release(&ptable.lock);
 }
@@ -440,9 +675,18 @@ sleep(void *chan, struct spinlock *lk)
     acquire(&ptable.lock);  //DOC: sleeplock1
     release(lk);
   }
+  // A process woken from chan that sleeps on it again before the
+  // system call is over was woken for nothing.  Kernel threads
+  // never leave their loop, so they are not counted.
+  if(p->woke == chan && p->sz != 0)
+    sqstat.spurious++;
+
   // Go to sleep.
   p->chan = chan;
   p->state = SLEEPING;
+  p->sqnext = *sqhash(chan);
+  *sqhash(chan) = p;
+  klog_sched(KLOG_EV_SLEEP, p->pid, chan);
 
   sched();
 
@@ -462,11 +706,24 @@ sleep(void *chan, struct spinlock *lk)
 static void
 wakeup1(void *chan)
 {
-  struct proc *p;
+  struct proc **pp, *p;
+  int n;
 
-  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++)
-    if(p->state == SLEEPING && p->chan == chan)
-      p->state = RUNNABLE;
+  n = 0;
+  for(pp = sqhash(chan); (p = *pp) != 0; ){
+    if(p->chan != chan){
+      pp = &p->sqnext;
+      continue;
+    }
+    *pp = p->sqnext;
+    p->woke = chan;
+    setrunnable(p);
+    klog_sched(KLOG_EV_WAKEUP, p->pid, chan);
+    n++;
+  }
+  sqstat.wakeup++;
+  if(n == 0)
+    sqstat.empty++;
 }
 
 // Wake up all processes sleeping on chan.
@@ -478,6 +735,53 @@ wakeup(void *chan)
   release(&ptable.lock);
 }
 
+// Fill in the scheduler counters of st.
+void
+proc_stat(struct kstat_sched *st)
+{
+  int i;
+
+  acquire(&ptable.lock);
+  st->nwakeup = sqstat.wakeup;
+  st->nempty = sqstat.empty;
+  st->nspurious = sqstat.spurious;
+  release(&ptable.lock);
+  st->ncpu = ncpu;
+  st->now = nanotime();
+  for(i = 0; i < ncpu && i < KSTAT_NCPU; i++){
+    st->cpu[i].idle = cpus[i].idlens;
+    st->cpu[i].nrun = cpus[i].nrun;
+    st->cpu[i].nsteal = cpus[i].nsteal;
+    st->cpu[i].nkeep = cpus[i].nkeep;
+  }
+}
+
+// Fill in the accounting of every process in use.
+void
+proc_acct(struct kstat_proc *st)
+{
+  struct proc *p;
+  struct kstat_p *s;
+
+  st->nproc = 0;
+  acquire(&ptable.lock);
+  st->now = nanotime();
+  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
+    if(p->state == UNUSED || st->nproc >= KSTAT_NPROC)
+      continue;
+    s = &st->proc[st->nproc++];
+    s->pid = p->pid;
+    s->state = p->state;
+    safestrcpy(s->name, p->name, sizeof(s->name));
+    s->sz = p->sz;
+    s->nsyscall = p->nsyscall;
+    s->run = p->runns;
+    s->rbytes = p->rbytes;
+    s->wbytes = p->wbytes;
+  }
+  release(&ptable.lock);
+}
+
 // Kill the process with the given pid.
 // Process won't exit until it returns
 // to user space (see trap in trap.c).
@@ -491,8 +795,11 @@ kill(int pid)
     if(p->pid == pid){
       p->killed = 1;
       // Wake process from sleep if necessary.
-      if(p->state == SLEEPING)
-        p->state = RUNNABLE;
+      if(p->state == SLEEPING){
+        sqremove(p);
+        setrunnable(p);
+        klog_sched(KLOG_EV_WAKEUP, p->pid, p->chan);
+      }
       release(&ptable.lock);
       return 0;
     }
@@ -501,6 +808,32 @@ kill(int pid)
   return -1;
 }
 
+// Make kernel thread p give up waiting, as kill() would, without
+// killing it: what it waits for is no longer wanted.  It sees
+// interrupted() until it clears p->aborted.
+void
+interrupt(struct proc *p)
+{
+  acquire(&ptable.lock);
+  p->aborted = 1;
+  if(p->state == SLEEPING){
+    sqremove(p);
+    setrunnable(p);
+    klog_sched(KLOG_EV_WAKEUP, p->pid, p->chan);
+  }
+  release(&ptable.lock);
+}
+
+// Whether the current process should stop waiting and fail the
+// call: it has been killed, or interrupt()ed.
+int
+interrupted(void)
+{
+  struct proc *p = myproc();
+
+  return p->killed || p->aborted;
+}
+
 //PAGEBREAK: 36
 // Print a process listing to console.  For debugging.
 // Runs when user types ^P on console.
@@ -1,5 +1,15 @@
+// A CPU's place in an MCS lock's queue (spinlock.h).  A CPU may
+// hold or wait for NMCS MCS locks at once.
+#define NMCS 4
+struct mcsnode {
+  struct mcsnode *volatile next;
+  volatile uint wait;      // Spin while set; the previous holder clears it
+  uint busy;               // In use by one of this CPU's locks
+};
+
 // Per-CPU state
 struct cpu {
+  struct cpu *self;            // This struct, for mycpu() through %gs
   uchar apicid;                // Local APIC ID
   struct context *scheduler;   // swtch() here to enter scheduler
   struct taskstate ts;         // Used by x86 to find stack for interrupt
@@ -7,7 +17,18 @@ struct cpu {
   volatile uint started;       // Has the CPU started?
   int ncli;                    // Depth of pushcli nesting.
   int intena;                  // Were interrupts enabled before pushcli?
+  uint64 clistart;             // When pushcli turned them off (irqstat_on)
+  uint clipc;                  // ... and for whom
   struct proc *proc;           // The process running on this cpu or null
+  long long tscoff;            // Added to this CPU's TSC to match CPU 0's
+  volatile uint idle;          // Halted in scheduler(), wake with an IPI
+  uint64 idlens;               // Time spent halted
+  uint nrun;                   // Processes switched to
+  uint nsteal;                 // ... taken from another CPU's queue
+  uint nkeep;                  // ... whose page table was still loaded
+  pde_t *volatile pgdir;       // Process page table in %cr3, or 0
+  int tssready;                // gdt[SEG_TSS] set up and loaded
+  struct mcsnode mcs[NMCS];    // Queue nodes for MCS locks
 };
 
 extern struct cpu cpus[NCPU];
@@ -34,9 +55,18 @@ struct context {
 
 enum procstate { UNUSED, EMBRYO, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
+// A file mapped by mmap() at [start, end).
+struct vma {
+  uint start;
+  uint end;
+  struct inode *ip;            // Referenced; 0 if unused
+  uint off;                    // File offset of start
+};
+
 // Per-process state
 struct proc {
   uint sz;                     // Size of process memory (bytes)
+  int lazy;                    // Pages below sz not allocated yet
   pde_t* pgdir;                // Page table
   char *kstack;                // Bottom of kernel stack for this process
   enum procstate state;        // Process state
@@ -46,9 +76,19 @@ struct proc {
   struct context *context;     // swtch() here to run process
   void *chan;                  // If non-zero, sleeping on chan
   int killed;                  // If non-zero, have been killed
+  int aborted;                 // If non-zero, its I/O op is gone (ioring.c)
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
   char name[16];               // Process name (debugging)
+  struct proc *rqnext;         // Next on its run queue, if RUNNABLE
+  struct proc *sqnext;         // Next on its sleep queue, if SLEEPING
+  void *woke;                  // Chan last woken from in this syscall
+  int cpu;                     // CPU it last ran on, -1 if none
+  uint64 runns;                // Time run, ns, added up by scheduler()
+  uint nsyscall;               // System calls made
+  uint64 rbytes;               // Bytes read through files, pipes, devices
+  uint64 wbytes;               // ... and written
+  struct vma vma[NVMA];        // mmap()ed files
 };
 
 // Process memory is laid out contiguously, low addresses first:
@@ -56,3 +96,4 @@ struct proc {
 //   original data and bss
 //   fixed-size stack
 //   expandable heap
+//   ... then from MMAPBASE, mmap()ed files (mmap.c)
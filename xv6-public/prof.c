@@ -0,0 +1,189 @@
+// Flat kernel profile from /dev/kprof samples.
+//
+// usage: prof [command [args...]]
+//
+// Samples every CPU's timer interrupts while command runs (or for
+// one second), then prints how many samples fell in each kernel
+// function, named from /kernel.sym, busiest first.  Samples taken
+// in user space are counted per process.
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "fcntl.h"
+#include "kprof.h"
+
+#define MAXSYM  1024
+#define MAXUSER 32
+#define NSHOW   30
+
+struct sym {
+  uint addr;
+  char *name;
+  uint count;
+};
+
+struct sym syms[MAXSYM];
+int nsym;
+
+struct {
+  uint pid;
+  uint count;
+} users[MAXUSER];
+int nuser;
+
+static uint
+hex(char *s, char **end)
+{
+  uint x;
+  int c;
+
+  x = 0;
+  for(;;){
+    c = *s;
+    if(c >= '0' && c <= '9')
+      c -= '0';
+    else if(c >= 'a' && c <= 'f')
+      c -= 'a' - 10;
+    else
+      break;
+    x = x << 4 | c;
+    s++;
+  }
+  *end = s;
+  return x;
+}
+
+// Read "address name" lines of kernel text symbols, sorted by address.
+static void
+loadsyms(void)
+{
+  struct stat st;
+  char *buf, *p, *q, *e;
+  struct sym t;
+  int fd, j;
+
+  if((fd = open("/kernel.sym", O_RDONLY)) < 0 || fstat(fd, &st) < 0){
+    printf(2, "prof: cannot read /kernel.sym\n");
+    exit();
+  }
+  buf = malloc(st.size + 1);
+  if(buf == 0 || read(fd, buf, st.size) != st.size){
+    printf(2, "prof: cannot read /kernel.sym\n");
+    exit();
+  }
+  close(fd);
+  buf[st.size] = 0;
+
+  for(p = buf; *p && nsym < MAXSYM; p = e){
+    if((e = strchr(p, '\n')) != 0)
+      *e++ = 0;
+    else
+      e = p + strlen(p);
+    t.addr = hex(p, &q);
+    if(*q != ' ' || t.addr < 0x80100000)
+      continue;
+    t.name = q + 1;
+    t.count = 0;
+    for(j = nsym++; j > 0 && syms[j-1].addr > t.addr; j--)
+      syms[j] = syms[j-1];
+    syms[j] = t;
+  }
+}
+
+// The symbol covering kernel address a, or 0.
+static struct sym*
+lookup(uint a)
+{
+  int lo, hi, mid;
+
+  lo = 0;
+  hi = nsym - 1;
+  if(nsym == 0 || a < syms[0].addr)
+    return 0;
+  while(lo < hi){
+    mid = (lo + hi + 1) / 2;
+    if(syms[mid].addr <= a)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return &syms[lo];
+}
+
+static void
+account(struct kprof_sample *s)
+{
+  struct sym *y;
+  int i;
+
+  if(!s->user){
+    if((y = lookup(s->eip)) != 0)
+      y->count++;
+    return;
+  }
+  for(i = 0; i < nuser; i++)
+    if(users[i].pid == s->pid)
+      break;
+  if(i == nuser){
+    if(nuser == MAXUSER)
+      return;
+    users[nuser].pid = s->pid;
+    users[nuser++].count = 0;
+  }
+  users[i].count++;
+}
+
+int
+main(int argc, char *argv[])
+{
+  static struct kprof_sample s[64];
+  uint total, best;
+  int fd, n, i, j, pid;
+
+  loadsyms();
+  mknod("kprof", KPROF, 0);
+  if((fd = open("kprof", O_RDWR)) < 0){
+    printf(2, "prof: cannot open kprof\n");
+    exit();
+  }
+
+  write(fd, "1", 1);
+  if(argc > 1){
+    if((pid = fork()) == 0){
+      exec(argv[1], argv + 1);
+      printf(2, "prof: exec %s failed\n", argv[1]);
+      exit();
+    }
+    if(pid > 0)
+      wait();
+  } else
+    sleep(100);
+  write(fd, "0", 1);
+
+  total = 0;
+  while((n = read(fd, s, sizeof(s))) > 0){
+    for(i = 0; i < n / sizeof(s[0]); i++)
+      account(&s[i]);
+    total += n / sizeof(s[0]);
+  }
+  close(fd);
+
+  printf(1, "%d samples\n", total);
+  if(total == 0)
+    exit();
+  for(i = 0; i < NSHOW; i++){
+    best = 0;
+    for(j = 1; j < nsym; j++)
+      if(syms[j].count > syms[best].count)
+        best = j;
+    if(syms[best].count == 0)
+      break;
+    printf(1, "%d\t%d%%\t%s\n", syms[best].count,
+           syms[best].count * 100 / total, syms[best].name);
+    syms[best].count = 0;
+  }
+  for(i = 0; i < nuser; i++)
+    printf(1, "%d\t%d%%\t(user pid %d)\n", users[i].count,
+           users[i].count * 100 / total, users[i].pid);
+  exit();
+}
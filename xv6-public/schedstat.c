@@ -0,0 +1,35 @@
+// Scheduler statistics: per-CPU idle time over one second, and
+// switch and wakeup counters since boot.
+//
+// usage: schedstat
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "kstat.h"
+
+int
+main(int argc, char *argv[])
+{
+  static struct kstat_sched a, b;
+  uint dt, idle;
+  int i;
+
+  if(kstat(KSTAT_SCHED, &a, sizeof(a)) < 0){
+    printf(2, "schedstat: kstat failed\n");
+    exit();
+  }
+  sleep(100);
+  kstat(KSTAT_SCHED, &b, sizeof(b));
+
+  // In units of 1024ns, so the percentages fit in 32 bits.
+  dt = (b.now - a.now) >> 10;
+  printf(1, "cpu\tidle\truns\tsteals\tkept\n");
+  for(i = 0; i < b.ncpu && i < KSTAT_NCPU; i++){
+    idle = (b.cpu[i].idle - a.cpu[i].idle) >> 10;
+    printf(1, "%d\t%d%%\t%d\t%d\t%d\n", i, dt ? idle * 100 / dt : 0,
+           b.cpu[i].nrun, b.cpu[i].nsteal, b.cpu[i].nkeep);
+  }
+  printf(1, "%d wakeups, %d with no sleeper, %d spurious\n",
+         b.nwakeup, b.nempty, b.nspurious);
+  exit();
+}
@@ -0,0 +1,184 @@
+// Small object allocator, layered on kalloc().
+//
+// kmalloc(n) rounds n up to a power-of-2 size class from 32 to 2048
+// bytes and returns an object carved from a page of that class;
+// larger requests of up to a page get a whole page from kalloc().
+// kmfree() finds an object's class from the page it lies in.
+//
+// Each CPU keeps a magazine of up to MAGSIZE free objects per class,
+// used with interrupts off and no lock.  An empty magazine takes
+// MAGSIZE/2 objects from the class's free list, which is refilled a
+// page at a time; a full one gives MAGSIZE/2 back.  Pages are not
+// returned to kalloc(): a class keeps the most it ever needed.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "kstat.h"
+
+#define MINSHIFT 5   // Smallest class, 32 bytes
+#define NCLASS   7   // 32 .. 2048
+#define MAGSIZE  16
+
+struct obj {
+  struct obj *next;
+};
+
+struct magazine {
+  int n;
+  void *obj[MAGSIZE];
+  uint alloc;     // Counters of this CPU, entered in kstat_slab
+  uint free;
+};
+
+struct {
+  struct spinlock lock;
+  struct obj *free;
+  uint npage;
+} class[NCLASS];
+
+static struct magazine mag[NCPU][NCLASS];
+
+// Class+1 of each physical page carved by newslab(), 0 for others.
+static uchar pgclass[PHYSTOP / PGSIZE];
+
+void
+slabinit(void)
+{
+  int c;
+
+  for(c = 0; c < NCLASS; c++)
+    initlock(&class[c].lock, "slab");
+}
+
+// Size class of an n-byte object, or -1 if a page is needed.
+static int
+sizeclass(uint n)
+{
+  int c;
+
+  for(c = 0; c < NCLASS; c++)
+    if(n <= (1 << (MINSHIFT + c)))
+      return c;
+  return -1;
+}
+
+// Carve a new page into objects of class c and put them on its free
+// list.  Returns 0 if out of memory.
+static int
+newslab(int c)
+{
+  char *p, *o;
+  uint size;
+
+  if((p = kalloc()) == 0)
+    return 0;
+  pgclass[V2P(p) / PGSIZE] = c + 1;
+  size = 1 << (MINSHIFT + c);
+  acquire(&class[c].lock);
+  for(o = p + PGSIZE - size; o >= p; o -= size){
+    ((struct obj*)o)->next = class[c].free;
+    class[c].free = (struct obj*)o;
+  }
+  class[c].npage++;
+  release(&class[c].lock);
+  return 1;
+}
+
+// Move up to MAGSIZE/2 objects of class c to magazine m.
+static void
+refill(int c, struct magazine *m)
+{
+  struct obj *o;
+
+  acquire(&class[c].lock);
+  while(m->n < MAGSIZE/2 && (o = class[c].free) != 0){
+    class[c].free = o->next;
+    m->obj[m->n++] = o;
+  }
+  release(&class[c].lock);
+}
+
+// Allocate n bytes, n <= PGSIZE.
+// Returns 0 if the memory cannot be allocated.
+void*
+kmalloc(uint n)
+{
+  struct magazine *m;
+  void *p;
+  int c;
+
+  if((c = sizeclass(n)) < 0)
+    return n <= PGSIZE ? kalloc() : 0;
+
+  pushcli();
+  m = &mag[cpuid()][c];
+  if(m->n == 0){
+    refill(c, m);
+    if(m->n == 0 && newslab(c))
+      refill(c, m);
+  }
+  p = 0;
+  if(m->n > 0){
+    p = m->obj[--m->n];
+    m->alloc++;
+  }
+  popcli();
+  return p;
+}
+
+// Free p, returned by kmalloc().
+void
+kmfree(void *p)
+{
+  struct magazine *m;
+  struct obj *o;
+  int c;
+
+  if((uint)p < KERNBASE || V2P(p) >= PHYSTOP)
+    panic("kmfree");
+  if((c = pgclass[V2P(p) / PGSIZE]) == 0){
+    kfree((char*)p);
+    return;
+  }
+  c--;
+
+  // Fill with junk to catch dangling refs.
+  memset(p, 1, 1 << (MINSHIFT + c));
+
+  pushcli();
+  m = &mag[cpuid()][c];
+  if(m->n == MAGSIZE){
+    acquire(&class[c].lock);
+    while(m->n > MAGSIZE/2){
+      o = m->obj[--m->n];
+      o->next = class[c].free;
+      class[c].free = o;
+    }
+    release(&class[c].lock);
+  }
+  m->obj[m->n++] = p;
+  m->free++;
+  popcli();
+}
+
+// Fill in the allocator counters of st.
+void
+slab_stat(struct kstat_slab *st)
+{
+  int c, i;
+
+  st->nclass = NCLASS;
+  for(c = 0; c < NCLASS && c < KSTAT_NSLAB; c++){
+    st->class[c].size = 1 << (MINSHIFT + c);
+    st->class[c].npage = class[c].npage;
+    st->class[c].alloc = st->class[c].free = 0;
+    for(i = 0; i < NCPU; i++){
+      st->class[c].alloc += mag[i][c].alloc;
+      st->class[c].free += mag[i][c].free;
+    }
+  }
+}
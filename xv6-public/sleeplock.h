@@ -1,6 +1,8 @@
 // Long-term locks for processes
 struct sleeplock {
-  uint locked;       // Is the lock held?
+  uint locked;       // Is the lock held exclusively?
+  int readers;       // Holders in shared mode
+  int wwait;         // Waiting to hold it exclusively
   struct spinlock lk; // spinlock protecting this sleep lock
   
   // For debugging:
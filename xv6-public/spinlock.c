@@ -8,13 +8,125 @@
 #include "mmu.h"
 #include "proc.h"
 #include "spinlock.h"
+#include "kstat.h"
+
+// Lock statistics, kept while lockstat_set(1) has them on.  Each
+// CPU counts into a table of its own, keyed by lock name, so keeping
+// them adds no sharing between CPUs; lock_stat() adds them up.
+#define NLOCKSTAT 64
+
+struct lockstat {
+  char *name;
+  uint nacq;
+  uint ncont;        // Acquisitions that had to spin
+  uint64 spin;       // TSC cycles spent spinning
+  uint maxhold;      // Longest hold, TSC cycles
+};
+
+static struct lockstat lstat[NCPU][NLOCKSTAT];
+static int lockstat_on;
+
+// Interrupts-off sections, kept while irqstat_on: per CPU, keyed
+// by the code that called pushcli(), like lstat.
+#define NCLISTAT 32
+
+static struct kstat_cli cstat[NCPU][NCLISTAT];
+
+static void pushcli_pc(uint pc);
 
 void
 initlock(struct spinlock *lk, char *name)
 {
   lk->name = name;
   lk->locked = 0;
+  lk->kind = SPIN_TICKET;
+  lk->next = 0;
+  lk->owner = 0;
+  lk->tail = 0;
+  lk->qnode = 0;
   lk->cpu = 0;
+  lk->tstart = 0;
+}
+
+// Like initlock, for a lock that waiters queue for (SPIN_MCS).
+void
+initmcslock(struct spinlock *lk, char *name)
+{
+  initlock(lk, name);
+  lk->kind = SPIN_MCS;
+}
+
+// The entry for lk in the table of the CPU holding it, or 0.
+static struct lockstat*
+lockstat_get(struct spinlock *lk)
+{
+  struct lockstat *t, *s;
+  uint h, i;
+
+  if(lk->name == 0)
+    return 0;
+  t = lstat[lk->cpu - cpus];
+  h = (uint)lk->name >> 2;
+  for(i = 0; i < NLOCKSTAT; i++){
+    s = &t[(h + i) % NLOCKSTAT];
+    if(s->name == lk->name)
+      return s;
+    if(s->name == 0){
+      s->name = lk->name;
+      return s;
+    }
+  }
+  return 0;
+}
+
+// Join lk's queue with a free node of this CPU and wait to reach
+// its head.  Returns whether anyone was ahead; *spin gets the wait.
+static int
+mcs_acquire(struct spinlock *lk, uint64 *spin)
+{
+  struct mcsnode *n, *prev;
+  struct cpu *c;
+  int i;
+
+  c = mycpu();
+  for(i = 0; i < NMCS && c->mcs[i].busy; i++)
+    ;
+  if(i == NMCS)
+    panic("acquire: mcs nodes");
+  n = &c->mcs[i];
+  n->busy = 1;
+  n->next = 0;
+  n->wait = 1;
+  prev = (struct mcsnode*)xchg((volatile uint*)&lk->tail, (uint)n);
+  if(prev){
+    prev->next = n;
+    *spin = rdtsc();
+    while(n->wait)
+      pause();
+    *spin = rdtsc() - *spin;
+  }
+  lk->qnode = n;
+  return prev != 0;
+}
+
+// Hand lk to the next node in its queue, if any.
+static void
+mcs_release(struct spinlock *lk)
+{
+  struct mcsnode *n;
+
+  n = lk->qnode;
+  if(n->next == 0){
+    if(cmpxchg((volatile uint*)&lk->tail, (uint)n, 0) == (uint)n){
+      n->busy = 0;
+      return;
+    }
+    // Someone is joining; wait until it links in.
+    while(n->next == 0)
+      pause();
+  }
+  n->next->wait = 0;
+  n->busy = 0;
 }
 
 // Acquire the lock.
@@ -24,13 +136,31 @@ initlock(struct spinlock *lk, char *name)
 void
 acquire(struct spinlock *lk)
 {
-  pushcli(); // disable interrupts to avoid deadlock.
+  struct lockstat *s;
+  uint64 spin;
+  int contended;
+  ushort t;
+
+  // disable interrupts to avoid deadlock.
+  pushcli_pc((uint)__builtin_return_address(0));
   if(holding(lk))
     panic("acquire");
 
-  // The xchg is atomic.
-  while(xchg(&lk->locked, 1) != 0)
-    ;
+  contended = 0;
+  if(lk->kind == SPIN_MCS)
+    contended = mcs_acquire(lk, &spin);
+  else {
+    // The xadd is atomic.
+    t = xaddw(&lk->next, 1);
+    if(lk->owner != t){
+      contended = 1;
+      spin = rdtsc();
+      while(lk->owner != t)
+        pause();
+      spin = rdtsc() - spin;
+    }
+  }
+  lk->locked = 1;
 
   // Tell the C compiler and the processor to not move loads or stores
   // past this point, to ensure that the critical section's memory
@@ -40,15 +170,34 @@ acquire(struct spinlock *lk)
   // Record info about lock acquisition for debugging.
   lk->cpu = mycpu();
   getcallerpcs(&lk, lk->pcs);
+
+  if(lockstat_on && (s = lockstat_get(lk)) != 0){
+    s->nacq++;
+    if(contended){
+      s->ncont++;
+      s->spin += spin;
+    }
+    lk->tstart = (uint)rdtsc() | 1;
+  }
 }
 
 // Release the lock.
 void
 release(struct spinlock *lk)
 {
+  struct lockstat *s;
+  uint hold;
+
   if(!holding(lk))
     panic("release");
 
+  if(lk->tstart){
+    hold = (uint)rdtsc() - lk->tstart;
+    if(lockstat_on && (s = lockstat_get(lk)) != 0 && hold > s->maxhold)
+      s->maxhold = hold;
+    lk->tstart = 0;
+  }
+
   lk->pcs[0] = 0;
   lk->cpu = 0;
 
@@ -59,10 +208,13 @@ release(struct spinlock *lk)
   // stores; __sync_synchronize() tells them both not to.
   __sync_synchronize();
 
-  // Release the lock, equivalent to lk->locked = 0.
-  // This code can't use a C assignment, since it might
-  // not be atomic. A real OS would use C atomics here.
-  asm volatile("movl $0, %0" : "+m" (lk->locked) : );
+  // Release the lock.  Only the holder writes owner, so a plain
+  // store of the next ticket is enough.
+  lk->locked = 0;
+  if(lk->kind == SPIN_MCS)
+    mcs_release(lk);
+  else
+    lk->owner = lk->owner + 1;
 
   popcli();
 }
@@ -101,26 +253,181 @@ holding(struct spinlock *lock)
 // it takes two popcli to undo two pushcli.  Also, if interrupts
 // are off, then pushcli, popcli leaves them off.
 
-void
-pushcli(void)
+// pushcli() on behalf of the code at pc, which irqstat_on charges
+// for the time until interrupts are back on.
+static void
+pushcli_pc(uint pc)
 {
+  struct cpu *c;
   int eflags;
 
   eflags = readeflags();
   cli();
-  if(mycpu()->ncli == 0)
-    mycpu()->intena = eflags & FL_IF;
-  mycpu()->ncli += 1;
+  c = mycpu();
+  if(c->ncli == 0){
+    c->intena = eflags & FL_IF;
+    c->clistart = 0;
+    if(irqstat_on && c->intena){
+      c->clistart = rdtsc();
+      c->clipc = pc;
+    }
+  }
+  c->ncli += 1;
+}
+
+void
+pushcli(void)
+{
+  pushcli_pc((uint)__builtin_return_address(0));
+}
+
+// Charge an interrupts-off section of cycles to pc on this CPU.
+// When the table is full, the shortest section makes room.
+static void
+cli_account(uint pc, uint cycles)
+{
+  struct kstat_cli *t, *s;
+  int i;
+
+  t = cstat[cpuid()];
+  s = &t[0];
+  for(i = 0; i < NCLISTAT; i++){
+    if(t[i].pc == pc || t[i].n == 0){
+      s = &t[i];
+      break;
+    }
+    if(t[i].max < s->max)
+      s = &t[i];
+  }
+  if(s->pc != pc){
+    memset(s, 0, sizeof(*s));
+    s->pc = pc;
+  }
+  s->n++;
+  s->total += cycles;
+  if(cycles > s->max)
+    s->max = cycles;
 }
 
 void
 popcli(void)
 {
+  struct cpu *c;
+
   if(readeflags()&FL_IF)
     panic("popcli - interruptible");
-  if(--mycpu()->ncli < 0)
+  c = mycpu();
+  if(--c->ncli < 0)
     panic("popcli");
-  if(mycpu()->ncli == 0 && mycpu()->intena)
+  if(c->ncli == 0 && c->intena){
+    if(c->clistart){
+      if(irqstat_on)
+        cli_account(c->clipc, rdtsc() - c->clistart);
+      c->clistart = 0;
+    }
     sti();
+  }
 }
 
+// Turn lock statistics on (1, starting from zero) or off (0);
+// -1 leaves them alone.  Returns whether they were on.
+int
+lockstat_set(int on)
+{
+  int old;
+
+  old = lockstat_on;
+  if(on == 1){
+    lockstat_on = 0;
+    memset(lstat, 0, sizeof(lstat));
+    lockstat_on = 1;
+  } else if(on == 0)
+    lockstat_on = 0;
+  return old;
+}
+
+// Add up the CPUs' tables by lock name into st.
+void
+lock_stat(struct kstat_lock *st)
+{
+  struct lockstat *s;
+  struct kstat_lk *k;
+  int c, i, j;
+
+  st->on = lockstat_on;
+  st->nlock = 0;
+  for(c = 0; c < ncpu; c++){
+    for(i = 0; i < NLOCKSTAT; i++){
+      s = &lstat[c][i];
+      if(s->name == 0)
+        continue;
+      for(j = 0; j < st->nlock; j++)
+        if(strncmp(st->lock[j].name, s->name, sizeof(k->name) - 1) == 0)
+          break;
+      if(j == st->nlock){
+        if(j == KSTAT_NLOCK)
+          continue;
+        k = &st->lock[st->nlock++];
+        memset(k, 0, sizeof(*k));
+        safestrcpy(k->name, s->name, sizeof(k->name));
+      }
+      k = &st->lock[j];
+      k->nacq += s->nacq;
+      k->ncont += s->ncont;
+      k->spin += s->spin;
+      if(s->maxhold > k->maxhold)
+        k->maxhold = s->maxhold;
+    }
+  }
+}
+
+void
+cli_stat_clear(void)
+{
+  memset(cstat, 0, sizeof(cstat));
+}
+
+// Add up the CPUs' interrupts-off tables by pc into st, keeping
+// the KSTAT_NCLI longest, longest first.
+void
+cli_stat(struct kstat_irq *st)
+{
+  struct kstat_cli *s, *k, t;
+  int c, i, j;
+
+  st->ncli = 0;
+  for(c = 0; c < ncpu; c++){
+    for(i = 0; i < NCLISTAT; i++){
+      s = &cstat[c][i];
+      if(s->n == 0)
+        continue;
+      for(j = 0; j < st->ncli; j++)
+        if(st->cli[j].pc == s->pc)
+          break;
+      if(j == st->ncli){
+        if(j == KSTAT_NCLI){
+          // Replace the shortest, if this one is longer.
+          for(j = 0, k = &st->cli[0]; j < KSTAT_NCLI; j++)
+            if(st->cli[j].max < k->max)
+              k = &st->cli[j];
+          if(k->max >= s->max)
+            continue;
+        } else
+          k = &st->cli[st->ncli++];
+        memset(k, 0, sizeof(*k));
+        k->pc = s->pc;
+      } else
+        k = &st->cli[j];
+      k->n += s->n;
+      k->total += s->total;
+      if(s->max > k->max)
+        k->max = s->max;
+    }
+  }
+  for(i = 1; i < st->ncli; i++){
+    t = st->cli[i];
+    for(j = i; j > 0 && st->cli[j-1].max < t.max; j--)
+      st->cli[j] = st->cli[j-1];
+    st->cli[j] = t;
+  }
+}
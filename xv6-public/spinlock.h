@@ -1,14 +1,29 @@
 // Mutual exclusion lock.
 #ifndef SPINLOCK_H
 #define SPINLOCK_H
+
+// A ticket lock serves waiters in order of arrival, all spinning on
+// the one word of the lock.  An MCS lock queues them, each spinning
+// on its own node (struct mcsnode in proc.h), so a handoff touches
+// only the next waiter's cache line; for the most contended locks.
+#define SPIN_TICKET 0
+#define SPIN_MCS    1
+
 struct spinlock {
   uint locked;       // Is the lock held?
+  uint kind;         // SPIN_TICKET or SPIN_MCS
+
+  volatile ushort next;    // Ticket: next ticket to hand out
+  volatile ushort owner;   // Ticket: ticket now served
+  struct mcsnode *volatile tail;  // MCS: last node in the queue
+  struct mcsnode *qnode;          // MCS: the holder's node
 
   // For debugging:
   char *name;        // Name of lock.
   struct cpu *cpu;   // The cpu holding the lock.
   uint pcs[10];      // The call stack (an array of program counters)
                      // that locked the lock.
+  uint tstart;       // Low TSC bits when acquired, while lockstat is on
 };
 #endif
 
@@ -6,12 +6,19 @@
 #include "proc.h"
 #include "x86.h"
 #include "syscall.h"
+#include "kstat.h"
 
 // User code makes a system call with INT T_SYSCALL.
 // System call number in %eax.
 // Arguments on the stack, from the user call to the C
 // library system call function. The saved user %esp points
 // to a saved program counter, and then the first argument.
+//
+// The kernel reads and writes user memory directly, so the fetch
+// functions fault in what they hand out (uvmfault): a fault in the
+// kernel that finds no memory for a lazy or copy-on-write page
+// panics, while one here just fails the call.  A system call that
+// writes a buffer directly faults it in writable first.
 
 // Fetch the int at addr from the current process.
 int
@@ -19,7 +26,8 @@ fetchint(uint addr, int *ip)
 {
   struct proc *curproc = myproc();
 
-  if(addr >= curproc->sz || addr+4 > curproc->sz)
+  if(addr >= curproc->sz || addr+4 > curproc->sz ||
+     uvmfault(addr, 4, 0) < 0)
     return -1;
   *ip = *(int*)(addr);
   return 0;
@@ -39,6 +47,8 @@ fetchstr(uint addr, char **pp)
   *pp = (char*)addr;
   ep = (char*)curproc->sz;
   for(s = *pp; s < ep; s++){
+    if((s == *pp || (uint)s % PGSIZE == 0) && uvmfault((uint)s, 1, 0) < 0)
+      return -1;
     if(*s == 0)
       return s - *pp;
   }
@@ -63,7 +73,8 @@ argptr(int n, char **pp, int size)
  
   if(argint(n, &i) < 0)
     return -1;
-  if(size < 0 || (uint)i >= curproc->sz || (uint)i+size > curproc->sz)
+  if(size < 0 || (uint)i >= curproc->sz || (uint)i+size > curproc->sz ||
+     uvmfault(i, size, 0) < 0)
     return -1;
   *pp = (char*)i;
   return 0;
@@ -104,6 +115,19 @@ extern int sys_wait(void);
 extern int sys_write(void);
 extern int sys_uptime(void);
 extern int sys_getklog(void);
+extern int sys_klogmap(void);
+extern int sys_getklogrec(void);
+extern int sys_klogctl(void);
+extern int sys_kstat(void);
+extern int sys_splice(void);
+extern int sys_readv(void);
+extern int sys_writev(void);
+extern int sys_getklog2(void);
+extern int sys_uptimens(void);
+extern int sys_iosetup(void);
+extern int sys_ioenter(void);
+extern int sys_mmap(void);
+extern int sys_munmap(void);
 
 static int (*syscalls[])(void) = {
 [SYS_fork]    sys_fork,
@@ -128,17 +152,109 @@ static int (*syscalls[])(void) = {
 [SYS_mkdir]   sys_mkdir,
 [SYS_close]   sys_close,
 [SYS_getklog] sys_getklog,
+[SYS_klogmap] sys_klogmap,
+[SYS_getklogrec] sys_getklogrec,
+[SYS_klogctl] sys_klogctl,
+[SYS_kstat]   sys_kstat,
+[SYS_splice]  sys_splice,
+[SYS_readv]   sys_readv,
+[SYS_writev]  sys_writev,
+[SYS_getklog2] sys_getklog2,
+[SYS_uptimens] sys_uptimens,
+[SYS_iosetup] sys_iosetup,
+[SYS_ioenter] sys_ioenter,
+[SYS_mmap]    sys_mmap,
+[SYS_munmap]  sys_munmap,
 };
 
+// Syscall latency tracer, enabled with klogctl(KLOG_CTL_SYSTRACE).
+// Each CPU counts calls into its own log2 histogram, so a traced
+// call costs two rdtsc's and an increment; kstat() sums them.
+int systrace_pid;     // -1 trace everyone, 0 off, else just this pid
+static struct {
+  uint hist[KSTAT_NSYSCALL][KSTAT_NBUCKET];
+} systrace_cpu[NCPU];
+
+// Histogram bucket for a latency of cycles: floor(log2(cycles)),
+// with the last bucket catching everything longer.
+uint
+kstat_bucket(uint64 cycles)
+{
+  uint hi, lo, b;
+
+  hi = cycles >> 32;
+  lo = cycles;
+  if(hi)
+    b = 32 + bsr(hi);
+  else
+    b = lo ? bsr(lo) : 0;
+  if(b >= KSTAT_NBUCKET)
+    b = KSTAT_NBUCKET - 1;
+  return b;
+}
+
+static void
+systrace(int num, uint64 cycles)
+{
+  uint b;
+
+  if(num >= KSTAT_NSYSCALL)
+    return;
+  b = kstat_bucket(cycles);
+
+  // The caller may have moved CPUs; count on the one we are on now.
+  pushcli();
+  systrace_cpu[mycpu() - cpus].hist[num][b]++;
+  popcli();
+}
+
+// Start tracing pid (-1 for every process, 0 to stop), clearing the
+// histograms when tracing starts.  Returns the previous setting.
+int
+systrace_set(int pid)
+{
+  int old;
+
+  old = systrace_pid;
+  if(pid != 0 && old == 0)
+    memset(systrace_cpu, 0, sizeof(systrace_cpu));
+  systrace_pid = pid;
+  return old;
+}
+
+// Fill st with the histograms summed over CPUs.
+void
+systrace_stat(struct kstat_syscall *st)
+{
+  int c, i, b;
+
+  st->tsckhz = tsckhz;
+  st->pid = systrace_pid;
+  memset(st->hist, 0, sizeof(st->hist));
+  for(c = 0; c < ncpu; c++)
+    for(i = 0; i < KSTAT_NSYSCALL; i++)
+      for(b = 0; b < KSTAT_NBUCKET; b++)
+        st->hist[i][b] += systrace_cpu[c].hist[i][b];
+}
+
 void
 syscall(void)
 {
-  int num;
+  int num, trace;
+  uint64 t0;
   struct proc *curproc = myproc();
 
   num = curproc->tf->eax;
+  curproc->woke = 0;
+  curproc->nsyscall++;
   if(num > 0 && num < NELEM(syscalls) && syscalls[num]) {
+    trace = systrace_pid != 0 &&
+            (systrace_pid < 0 || systrace_pid == curproc->pid);
+    if(trace)
+      t0 = rdtsc();
     curproc->tf->eax = syscalls[num]();
+    if(trace)
+      systrace(num, rdtsc() - t0);
   } else {
     cprintf("%d %s: unknown sys call %d\n",
             curproc->pid, curproc->name, num);
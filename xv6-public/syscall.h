@@ -21,3 +21,16 @@
 #define SYS_mkdir  20
 #define SYS_close  21
 #define SYS_getklog 22
+#define SYS_klogmap 23
+#define SYS_getklogrec 24
+#define SYS_klogctl 25
+#define SYS_kstat  26
+#define SYS_splice 27
+#define SYS_readv  28
+#define SYS_writev 29
+#define SYS_getklog2 30
+#define SYS_uptimens 31
+#define SYS_iosetup 32
+#define SYS_ioenter 33
+#define SYS_mmap   34
+#define SYS_munmap 35
@@ -15,6 +15,8 @@
 #include "sleeplock.h"
 #include "file.h"
 #include "fcntl.h"
+#include "uio.h"
+#define KLOG_SUBSYS KLOG_SS_FS
 #include "klog.h"
 
 // Fetch the nth word-sized system call argument as a file descriptor
@@ -77,10 +79,13 @@ sys_read(void)
 
   if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argptr(1, &p, n) < 0)
     return -1;
+  // The file system, pipes and devices write p directly.
+  if(uvmfault((uint)p, n, 1) < 0)
+    return -1;
   result = fileread(f, p, n);
   // Only log significant reads (>= 64 bytes) to avoid flooding
   if(result >= 64)
-    klog_debug("read: %d bytes", result);
+    klog_ev(KLOG_DEBUG, KLOG_EV_READ, result, 0);
   return result;
 }
 
@@ -97,10 +102,122 @@ sys_write(void)
   result = filewrite(f, p, n);
   // Only log significant writes (>= 64 bytes) to avoid flooding
   if(result >= 64)
-    klog_debug("write: %d bytes", result);
+    klog_ev(KLOG_DEBUG, KLOG_EV_WRITE, result, 0);
+  return result;
+}
+
+// Fetch the iovec array of readv()/writev(), arguments 1 and 2,
+// into iov, checking that every buffer is in the process's memory
+// and faulting it in, writable too if write is set.
+// Returns the number of buffers.
+static int
+argiov(struct iovec *iov, int write)
+{
+  struct proc *curproc = myproc();
+  char *p;
+  int i, cnt;
+
+  if(argint(2, &cnt) < 0 || cnt < 0 || cnt > UIO_MAXIOV)
+    return -1;
+  if(argptr(1, &p, cnt * sizeof(*iov)) < 0)
+    return -1;
+  memmove(iov, p, cnt * sizeof(*iov));
+  for(i = 0; i < cnt; i++){
+    if(iov[i].len < 0 || (uint)iov[i].base >= curproc->sz ||
+       (uint)iov[i].base + iov[i].len > curproc->sz ||
+       uvmfault((uint)iov[i].base, iov[i].len, write) < 0)
+      return -1;
+  }
+  return cnt;
+}
+
+int
+sys_readv(void)
+{
+  struct file *f;
+  struct iovec iov[UIO_MAXIOV];
+  int cnt, result;
+
+  if(argfd(0, 0, &f) < 0 || (cnt = argiov(iov, 1)) < 0)
+    return -1;
+  result = filereadv(f, iov, cnt);
+  if(result >= 64)
+    klog_ev(KLOG_DEBUG, KLOG_EV_READ, result, cnt);
+  return result;
+}
+
+int
+sys_writev(void)
+{
+  struct file *f;
+  struct iovec iov[UIO_MAXIOV];
+  int cnt, result;
+
+  if(argfd(0, 0, &f) < 0 || (cnt = argiov(iov, 0)) < 0)
+    return -1;
+  result = filewritev(f, iov, cnt);
+  if(result >= 64)
+    klog_ev(KLOG_DEBUG, KLOG_EV_WRITE, result, cnt);
   return result;
 }
 
+// Move up to n bytes from fd in to fd out inside the kernel.
+int
+sys_splice(void)
+{
+  struct file *in, *out;
+  int n;
+
+  if(argfd(0, 0, &in) < 0 || argfd(1, 0, &out) < 0 || argint(2, &n) < 0)
+    return -1;
+  return filesplice(in, out, n);
+}
+
+// Map this process's asynchronous I/O ring (ioring.h).
+// Returns its address.
+int
+sys_iosetup(void)
+{
+  return ioring_setup();
+}
+
+// ioenter(n, wait): hand over up to n queued submissions, then
+// wait for wait completions.  Returns the number handed over.
+int
+sys_ioenter(void)
+{
+  int n, wait;
+
+  if(argint(0, &n) < 0 || argint(1, &wait) < 0)
+    return -1;
+  return ioring_enter(n, wait);
+}
+
+// mmap(fd, off, len): map len bytes of fd's file from off, a
+// multiple of the page size, read-only.  Returns the address.
+int
+sys_mmap(void)
+{
+  struct file *f;
+  int off, len;
+
+  if(argfd(0, 0, &f) < 0 || argint(1, &off) < 0 || argint(2, &len) < 0 ||
+     off < 0 || len <= 0)
+    return -1;
+  return mmap(f, off, len);
+}
+
+// munmap(addr, len): undo the mmap() that returned addr.
+int
+sys_munmap(void)
+{
+  int addr, len;
+
+  if(argint(0, &addr) < 0 || argint(1, &len) < 0)
+    return -1;
+  return munmap(addr, len);
+}
+
 int
 sys_close(void)
 {
@@ -120,7 +237,8 @@ sys_fstat(void)
   struct file *f;
   struct stat *st;
 
-  if(argfd(0, 0, &f) < 0 || argptr(1, (void*)&st, sizeof(*st)) < 0)
+  if(argfd(0, 0, &f) < 0 || argptr(1, (void*)&st, sizeof(*st)) < 0 ||
+     uvmfault((uint)st, sizeof(*st), 1) < 0)
     return -1;
   return filestat(f, st);
 }
@@ -229,6 +347,7 @@ sys_unlink(void)
   memset(&de, 0, sizeof(de));
   if(writei(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
     panic("unlink: writei");
+  dcache_remove(dp, name);
   if(ip->type == T_DIR){
     dp->nlink--;
     iupdate(dp);
@@ -310,14 +429,14 @@ sys_open(void)
     ip = create(path, T_FILE, 0, 0);
     if(ip == 0){
       end_op();
-      klog_error("open: failed to create %s", path);
+      klog_ev(KLOG_ERROR, KLOG_EV_OPENNOCREAT, path);
       return -1;
     }
-    klog_info("open: created file %s", path);
+    klog_ev(KLOG_INFO, KLOG_EV_CREATE, path);
   } else {
     if((ip = namei(path)) == 0){
       end_op();
-      klog_warn("open: file not found %s", path);
+      klog_ev(KLOG_WARN, KLOG_EV_OPENNOENT, path);
       return -1;
     }
     ilock(ip);
@@ -333,13 +452,13 @@ sys_open(void)
       fileclose(f);
     iunlockput(ip);
     end_op();
-    klog_error("open: failed to allocate fd for %s", path);
+    klog_ev(KLOG_ERROR, KLOG_EV_OPENNOFD, path);
     return -1;
   }
   iunlock(ip);
   end_op();
 
-  klog_info("open: %s fd=%d", path, fd);
+  klog_ev(KLOG_INFO, KLOG_EV_OPEN, path, fd, omode);
 
   f->type = FD_INODE;
   f->ip = ip;
@@ -443,7 +562,8 @@ sys_pipe(void)
   struct file *rf, *wf;
   int fd0, fd1;
 
-  if(argptr(0, (void*)&fd, 2*sizeof(fd[0])) < 0)
+  if(argptr(0, (void*)&fd, 2*sizeof(fd[0])) < 0 ||
+     uvmfault((uint)fd, 2*sizeof(fd[0]), 1) < 0)
     return -1;
   if(pipealloc(&rf, &wf) < 0)
     return -1;
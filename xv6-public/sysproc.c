@@ -7,6 +7,7 @@
 #include "mmu.h"
 #include "proc.h"
 #include "klog.h"
+#include "kstat.h"
 
 int
 sys_fork(void)
@@ -66,19 +67,21 @@ sys_sleep(void)
   if(argint(0, &n) < 0)
     return -1;
   acquire(&tickslock);
+  tickupdate();
   ticks0 = ticks;
   while(ticks - ticks0 < n){
     if(myproc()->killed){
       release(&tickslock);
       return -1;
     }
+    tickwait(ticks0 + n);
     sleep(&ticks, &tickslock);
   }
   release(&tickslock);
   return 0;
 }
 
-// return how many clock tick interrupts have occurred
+// return how many clock ticks (HZ a second) have passed
 // since start.
 int
 sys_uptime(void)
@@ -86,19 +89,38 @@ sys_uptime(void)
   uint xticks;
 
   acquire(&tickslock);
+  tickupdate();
   xticks = ticks;
   release(&tickslock);
   return xticks;
 }
 
+// Nanoseconds since boot, from the calibrated TSC clock that
+// klog timestamps use, stored at the uint64 pointed to by arg 0.
+int
+sys_uptimens(void)
+{
+  uint64 *ns;
+
+  if(argptr(0, (char**)&ns, sizeof(*ns)) < 0 ||
+     uvmfault((uint)ns, sizeof(*ns), 1) < 0)
+    return -1;
+  pushcli();
+  *ns = nanotime();
+  popcli();
+  return 0;
+}
+
 // Get kernel log snapshot
 int
 sys_getklog(void)
 {
   int buf_addr;
   int max_entries;
-  struct klog_entry *kbuf;
-  int count, i;
+  char *kbuf;
+  struct klog_rec *r;
+  struct klog_entry e;
+  int count, i, n, off;
   struct proc *curproc = myproc();
   
   // Get arguments
@@ -116,27 +138,217 @@ sys_getklog(void)
   if(buf_addr + max_entries * sizeof(struct klog_entry) > curproc->sz)
     return -1;
   
-  // Allocate kernel buffer
-  kbuf = (struct klog_entry*)kalloc();
+  // Snapshot one page of records, then convert the newest
+  // max_entries of them to the fixed-size entry ABI.
+  kbuf = kalloc();
   if(kbuf == 0)
     return -1;
-  
-  // Get snapshot (limited to one page worth)
-  int max_fit = PGSIZE / sizeof(struct klog_entry);
-  if(max_entries > max_fit)
-    max_entries = max_fit;
-  
-  count = klog_snapshot(kbuf, max_entries);
-  
-  // Copy to user space
+  n = klog_snapshot(kbuf, PGSIZE);
+
+  count = 0;
+  for(off = 0; off < n; off += ((struct klog_rec*)(kbuf + off))->len)
+    count++;
+  for(off = 0; count > max_entries; count--)
+    off += ((struct klog_rec*)(kbuf + off))->len;
+
   for(i = 0; i < count; i++){
+    r = (struct klog_rec*)(kbuf + off);
+    klog_rec_entry(r, &e);
     if(copyout(curproc->pgdir, (uint)buf_addr + i * sizeof(struct klog_entry),
-               &kbuf[i], sizeof(struct klog_entry)) < 0){
-      kfree((char*)kbuf);
+               &e, sizeof(e)) < 0){
+      kfree(kbuf);
       return -1;
     }
+    off += r->len;
   }
   
-  kfree((char*)kbuf);
+  kfree(kbuf);
+  return count;
+}
+
+// getklog2(query, buf): entries matching a struct klog_query,
+// oldest first, converted a page of records at a time straight into
+// buf, which holds query->max entries.  Filtering happens in the
+// merge, so unwanted records are never copied.  Returns the number
+// of entries and moves query->minseq past them.
+int
+sys_getklog2(void)
+{
+  struct klog_query q;
+  struct klog_entry e;
+  struct klog_rec *r;
+  char *uq, *buf, *kbuf;
+  int count, n, off;
+  uint seq;
+  struct proc *curproc = myproc();
+
+  if(argptr(0, &uq, sizeof(q)) < 0)
+    return -1;
+  memmove(&q, uq, sizeof(q));
+  if(q.max < 0 || q.max > curproc->sz / sizeof(e))
+    return -1;
+  if(argptr(1, &buf, q.max * sizeof(e)) < 0)
+    return -1;
+  if((kbuf = kalloc()) == 0)
+    return -1;
+
+  count = 0;
+  while(count < q.max){
+    // The spill first, for what the rings may have lost, then
+    // the rings from where it ends.
+    seq = q.minseq;
+    n = 0;
+    if(q.flags & KLOG_Q_ARCHIVE)
+      n = klogspill_query(&seq, &q, kbuf, PGSIZE);
+    if(n == 0 && (n = klog_query(&seq, &q, kbuf, PGSIZE)) == 0){
+      q.minseq = seq;
+      break;
+    }
+    for(off = 0; off < n && count < q.max; off += r->len){
+      r = (struct klog_rec*)(kbuf + off);
+      klog_rec_entry(r, &e);
+      if(copyout(curproc->pgdir, (uint)buf + count * sizeof(e),
+                 &e, sizeof(e)) < 0){
+        kfree(kbuf);
+        return -1;
+      }
+      count++;
+    }
+    // Resume at the first record not returned.
+    q.minseq = off < n ? ((struct klog_rec*)(kbuf + off))->seq : seq;
+  }
+  kfree(kbuf);
+
+  if(copyout(curproc->pgdir, (uint)uq, &q, sizeof(q)) < 0)
+    return -1;
   return count;
 }
+
+// Get kernel log snapshot as variable-length records
+// (struct klog_rec), at most one page.  Returns bytes copied.
+int
+sys_getklogrec(void)
+{
+  char *buf, *kbuf;
+  int n;
+
+  if(argint(1, &n) < 0 || n <= 0)
+    return -1;
+  if(argptr(0, &buf, n) < 0)
+    return -1;
+  if(n > PGSIZE)
+    n = PGSIZE;
+  if(uvmfault((uint)buf, n, 1) < 0)
+    return -1;
+
+  kbuf = kmalloc(n);
+  if(kbuf == 0)
+    return -1;
+  n = klog_snapshot(kbuf, n);
+  memmove(buf, kbuf, n);
+  kmfree(kbuf);
+  return n;
+}
+
+// Query or change klog settings; see KLOG_CTL_* in klog.h.
+int
+sys_klogctl(void)
+{
+  int cmd, arg;
+
+  if(argint(0, &cmd) < 0 || argint(1, &arg) < 0)
+    return -1;
+  return klog_ctl(cmd, arg);
+}
+
+// Copy kernel statistics of kind what (KSTAT_* in kstat.h) to buf.
+int
+sys_kstat(void)
+{
+  int what, n;
+  char *buf;
+
+  if(argint(0, &what) < 0 || argint(2, &n) < 0 || argptr(1, &buf, n) < 0)
+    return -1;
+  // The fill functions write buf directly, some holding a spinlock,
+  // so it must not fault: no lazy or copy-on-write pages.
+  if(uvmfault((uint)buf, n, 1) < 0)
+    return -1;
+  switch(what){
+  case KSTAT_SYSCALL:
+    if(n < sizeof(struct kstat_syscall))
+      return -1;
+    systrace_stat((struct kstat_syscall*)buf);
+    return sizeof(struct kstat_syscall);
+  case KSTAT_BIO:
+    if(n < sizeof(struct kstat_bio))
+      return -1;
+    ((struct kstat_bio*)buf)->tsckhz = tsckhz;
+    ((struct kstat_bio*)buf)->ncpu = ncpu;
+    bio_stat((struct kstat_bio*)buf);
+    ide_stat((struct kstat_bio*)buf);
+    return sizeof(struct kstat_bio);
+  case KSTAT_LOG:
+    if(n < sizeof(struct kstat_log))
+      return -1;
+    log_stat((struct kstat_log*)buf);
+    return sizeof(struct kstat_log);
+  case KSTAT_MEM:
+    if(n < sizeof(struct kstat_mem))
+      return -1;
+    ((struct kstat_mem*)buf)->ncpu = ncpu;
+    kalloc_stat((struct kstat_mem*)buf);
+    text_stat((struct kstat_mem*)buf);
+    return sizeof(struct kstat_mem);
+  case KSTAT_SLAB:
+    if(n < sizeof(struct kstat_slab))
+      return -1;
+    slab_stat((struct kstat_slab*)buf);
+    return sizeof(struct kstat_slab);
+  case KSTAT_SCHED:
+    if(n < sizeof(struct kstat_sched))
+      return -1;
+    proc_stat((struct kstat_sched*)buf);
+    return sizeof(struct kstat_sched);
+  case KSTAT_LOCK:
+    if(n < sizeof(struct kstat_lock))
+      return -1;
+    ((struct kstat_lock*)buf)->tsckhz = tsckhz;
+    lock_stat((struct kstat_lock*)buf);
+    return sizeof(struct kstat_lock);
+  case KSTAT_IRQ:
+    if(n < sizeof(struct kstat_irq))
+      return -1;
+    irq_stat((struct kstat_irq*)buf);
+    return sizeof(struct kstat_irq);
+  case KSTAT_BOOT:
+    if(n < sizeof(struct kstat_boot))
+      return -1;
+    boot_stat((struct kstat_boot*)buf);
+    return sizeof(struct kstat_boot);
+  case KSTAT_PROC:
+    if(n < sizeof(struct kstat_proc))
+      return -1;
+    proc_acct((struct kstat_proc*)buf);
+    return sizeof(struct kstat_proc);
+  case KSTAT_AGG:
+    if(n < sizeof(struct kstat_agg))
+      return -1;
+    klog_agg_stat((struct kstat_agg*)buf);
+    return sizeof(struct kstat_agg);
+  case KSTAT_TRACE:
+    if(n < sizeof(struct kstat_trace))
+      return -1;
+    klog_tp_stat((struct kstat_trace*)buf);
+    return sizeof(struct kstat_trace);
+  }
+  return -1;
+}
+
+// Map the per-CPU klog rings read-only into this process.
+// Returns the address of the struct klog_map header.
+int
+sys_klogmap(void)
+{
+  return klog_map(myproc());
+}
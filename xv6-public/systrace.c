@@ -0,0 +1,124 @@
+// Syscall latency tracer
+//
+// usage: systrace on [pid]   start tracing pid, or every process
+//        systrace off        stop tracing
+//        systrace            print approximate p50/p99 per syscall
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "kstat.h"
+
+static char *names[] = {
+[1]  "fork",   "exit",   "wait",    "pipe",    "read",
+     "kill",   "exec",   "fstat",   "chdir",   "dup",
+     "getpid", "sbrk",   "sleep",   "uptime",  "open",
+     "write",  "mknod",  "unlink",  "link",    "mkdir",
+     "close",  "getklog", "klogmap", "getklogrec", "klogctl",
+     "kstat",  "splice", "readv",   "writev",  "getklog2",
+     "uptimens", "iosetup", "ioenter", "mmap", "munmap",
+};
+
+#define NELEM(x) (sizeof(x)/sizeof((x)[0]))
+
+// Upper bound of bucket b in ns, given khz TSC cycles per ms.
+static uint
+bucket_ns(int b, uint khz)
+{
+  uint c;
+
+  c = b >= 31 ? 0xFFFFFFFF : 1U << (b + 1);
+  if(c < (1U << 22))
+    return c * 1000 / khz;
+  return c / khz * 1000;
+}
+
+static void
+print_time(uint ns)
+{
+  char *unit;
+
+  unit = "ns";
+  if(ns >= 10000){
+    ns /= 1000;
+    unit = "us";
+  }
+  if(ns >= 10000){
+    ns /= 1000;
+    unit = "ms";
+  }
+  printf(1, "\t<%d%s", ns, unit);
+}
+
+// Print the bucket holding the pct'th percentile of hist.
+static void
+print_pct(uint *hist, uint total, int pct, uint khz)
+{
+  uint want, sum;
+  int b;
+
+  want = (total * pct + 99) / 100;
+  sum = 0;
+  for(b = 0; b < KSTAT_NBUCKET; b++){
+    sum += hist[b];
+    if(sum >= want)
+      break;
+  }
+  print_time(bucket_ns(b, khz));
+}
+
+static int
+report(void)
+{
+  static struct kstat_syscall st;
+  uint total;
+  int i, b;
+
+  if(kstat(KSTAT_SYSCALL, &st, sizeof(st)) < 0){
+    printf(2, "systrace: kstat failed\n");
+    return -1;
+  }
+  if(st.tsckhz == 0){
+    printf(2, "systrace: TSC not calibrated\n");
+    return -1;
+  }
+  if(st.pid == 0)
+    printf(1, "tracing off\n");
+  else if(st.pid < 0)
+    printf(1, "tracing all processes\n");
+  else
+    printf(1, "tracing pid %d\n", st.pid);
+
+  printf(1, "syscall\tcalls\tp50\tp99\n");
+  for(i = 1; i < KSTAT_NSYSCALL; i++){
+    total = 0;
+    for(b = 0; b < KSTAT_NBUCKET; b++)
+      total += st.hist[i][b];
+    if(total == 0)
+      continue;
+    if(i < NELEM(names) && names[i])
+      printf(1, "%s", names[i]);
+    else
+      printf(1, "sys%d", i);
+    printf(1, "\t%d", total);
+    print_pct(st.hist[i], total, 50, st.tsckhz);
+    print_pct(st.hist[i], total, 99, st.tsckhz);
+    printf(1, "\n");
+  }
+  return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  if(argc > 1 && strcmp(argv[1], "on") == 0){
+    if(klogctl(KLOG_CTL_SYSTRACE, argc > 2 ? atoi(argv[2]) : -1) < 0)
+      printf(2, "systrace: klogctl failed\n");
+  } else if(argc > 1 && strcmp(argv[1], "off") == 0){
+    klogctl(KLOG_CTL_SYSTRACE, 0);
+  } else if(argc > 1){
+    printf(2, "usage: systrace [on [pid] | off]\n");
+  } else {
+    report();
+  }
+  exit();
+}
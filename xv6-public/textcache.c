@@ -0,0 +1,194 @@
+// Shared program pages.
+//
+// exec() maps each page of a program's file image from this cache
+// instead of reading it into a fresh page.  A cached page is keyed
+// by the file, the offset it was read from and how many bytes of
+// it came from the file (the rest is zero), and holds one page
+// reference of its own; every process mapping it holds another.
+// User programs are linked with -N into one writable segment, so
+// pages are mapped copy-on-write: text stays shared, and data gets
+// a private copy on first write (see cowcopy).  Read-only segments
+// are mapped read-only.
+//
+// writei() and itrunc() purge a file's pages, as does iget() when
+// it recycles the in-memory inode, after which a write could no
+// longer find them.  Processes already running keep the old pages.
+// The least recently used page makes room for a new one.
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "elf.h"
+#include "kstat.h"
+
+#define NTEXT 256   // Cached pages
+
+struct tpage {
+  uint dev;
+  uint inum;
+  uint off;           // File offset of the page's first byte
+  uint len;           // Bytes from the file; the rest is zero
+  char *page;         // 0 if the slot is free
+  uint used;          // tcache.clock when last mapped
+};
+
+static struct {
+  struct spinlock lock;
+  struct tpage t[NTEXT];
+  uint clock;
+  uint hit;
+  uint miss;
+} tcache;
+
+void
+textinit(void)
+{
+  initlock(&tcache.lock, "textcache");
+}
+
+// The cached page of ip's bytes [off, off+len), with a reference
+// for the caller, or 0.  Caller holds tcache.lock.
+static char*
+tfind(struct inode *ip, uint off, uint len)
+{
+  struct tpage *t;
+
+  for(t = tcache.t; t < &tcache.t[NTEXT]; t++)
+    if(t->page && t->dev == ip->dev && t->inum == ip->inum &&
+       t->off == off && t->len == len){
+      t->used = ++tcache.clock;
+      kref_inc(t->page);
+      return t->page;
+    }
+  return 0;
+}
+
+// A page holding ip's bytes [off, off+len) and zeroes after, with a
+// reference for the caller.  Caller holds ip->lock, shared at least.
+static char*
+textpage(struct inode *ip, uint off, uint len)
+{
+  struct tpage *t, *lru;
+  char *mem, *old;
+
+  acquire(&tcache.lock);
+  if((mem = tfind(ip, off, len)) != 0){
+    tcache.hit++;
+    release(&tcache.lock);
+    return mem;
+  }
+  tcache.miss++;
+  release(&tcache.lock);
+
+  if((mem = kalloc()) == 0)
+    return 0;
+  memset(mem, 0, PGSIZE);
+  if(readi(ip, mem, off, len) != len){
+    kfree(mem);
+    return 0;
+  }
+
+  acquire(&tcache.lock);
+  if((old = tfind(ip, off, len)) != 0){
+    // Another exec read it meanwhile.
+    release(&tcache.lock);
+    kfree(mem);
+    return old;
+  }
+  lru = tcache.t;
+  for(t = tcache.t; t < &tcache.t[NTEXT] && lru->page; t++)
+    if(t->page == 0 || t->used < lru->used)
+      lru = t;
+  old = lru->page;
+  lru->dev = ip->dev;
+  lru->inum = ip->inum;
+  lru->off = off;
+  lru->len = len;
+  lru->page = mem;
+  lru->used = ++tcache.clock;
+  ip->textcached = 1;
+  kref_inc(mem);
+  release(&tcache.lock);
+  if(old)
+    kfree(old);
+  return mem;
+}
+
+// Map program segment ph of ip at ph->vaddr in pgdir: the pages
+// read from the file through the cache, the rest up to ph->memsz
+// fresh and zeroed.  Caller holds ip->lock, shared at least.
+int
+textload(pde_t *pgdir, struct inode *ip, struct proghdr *ph)
+{
+  char *mem;
+  uint a, len;
+  int perm;
+
+  if(ph->vaddr % PGSIZE != 0 || ph->vaddr + ph->memsz >= MMAPBASE)
+    return -1;
+  for(a = 0; a < ph->memsz; a += PGSIZE){
+    if(a < ph->filesz){
+      len = ph->filesz - a < PGSIZE ? ph->filesz - a : PGSIZE;
+      if((mem = textpage(ip, ph->off + a, len)) == 0)
+        return -1;
+      perm = PTE_U | (ph->flags & ELF_PROG_FLAG_WRITE ? PTE_COW : 0);
+    } else {
+      if((mem = kalloc()) == 0)
+        return -1;
+      memset(mem, 0, PGSIZE);
+      perm = PTE_U | PTE_W;
+    }
+    if(mappages(pgdir, (char*)ph->vaddr + a, PGSIZE, V2P(mem), perm) < 0){
+      kfree(mem);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Forget ip's pages; their contents are changing, or ip is being
+// recycled.  Each page is freed outside tcache.lock, one at a time.
+void
+textpurge(struct inode *ip)
+{
+  struct tpage *t;
+  char *old;
+
+  for(;;){
+    acquire(&tcache.lock);
+    old = 0;
+    for(t = tcache.t; t < &tcache.t[NTEXT]; t++)
+      if(t->page && t->dev == ip->dev && t->inum == ip->inum){
+        old = t->page;
+        t->page = 0;
+        break;
+      }
+    if(old == 0)
+      break;
+    release(&tcache.lock);
+    kfree(old);
+  }
+  ip->textcached = 0;
+  release(&tcache.lock);
+}
+
+// Fill in the cache counters of st.
+void
+text_stat(struct kstat_mem *st)
+{
+  struct tpage *t;
+
+  acquire(&tcache.lock);
+  st->ntext = 0;
+  for(t = tcache.t; t < &tcache.t[NTEXT]; t++)
+    if(t->page)
+      st->ntext++;
+  st->texthit = tcache.hit;
+  st->textmiss = tcache.miss;
+  release(&tcache.lock);
+}
@@ -0,0 +1,109 @@
+// Processes by CPU use: every ticks (one second by default) for
+// count rounds (10), each process with its share of a CPU, and the
+// system calls it made and bytes it read and wrote meanwhile,
+// busiest first.
+//
+// usage: top [count [ticks]]
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "kstat.h"
+
+static char *states[] = {
+  "unused", "embryo", "sleep", "runble", "run", "zombie"
+};
+
+struct row {
+  struct kstat_p *p;
+  uint cpu;        // Percent of one CPU
+  uint nsyscall;
+  uint rbytes;
+  uint wbytes;
+};
+
+// d ns as a percentage of t ns.
+static uint
+percent(uint64 d, uint64 t)
+{
+  // Both in units that keep d*100 in 32 bits.
+  while(t >= (1U << 24)){
+    d >>= 1;
+    t >>= 1;
+  }
+  return t ? (uint)d * 100 / (uint)t : 0;
+}
+
+// The entry of st for pid, or 0 if it was not there.
+static struct kstat_p*
+find(struct kstat_proc *st, int pid)
+{
+  int i;
+
+  for(i = 0; i < st->nproc; i++)
+    if(st->proc[i].pid == pid)
+      return &st->proc[i];
+  return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  static struct kstat_proc st[2];
+  static struct row rows[KSTAT_NPROC];
+  static struct kstat_p none;
+  struct kstat_proc *a, *b, *t;
+  struct kstat_p *p, *q;
+  struct row r;
+  int count, ticks, k, i, j, n;
+
+  count = argc > 1 ? atoi(argv[1]) : 10;
+  ticks = argc > 2 ? atoi(argv[2]) : 100;
+  if(count <= 0 || ticks <= 0){
+    printf(2, "usage: top [count [ticks]]\n");
+    exit();
+  }
+
+  a = &st[0];
+  b = &st[1];
+  if(kstat(KSTAT_PROC, a, sizeof(*a)) < 0){
+    printf(2, "top: kstat failed\n");
+    exit();
+  }
+  for(k = 0; k < count; k++){
+    sleep(ticks);
+    kstat(KSTAT_PROC, b, sizeof(*b));
+
+    n = 0;
+    for(i = 0; i < b->nproc; i++){
+      p = &b->proc[i];
+      if((q = find(a, p->pid)) == 0)
+        q = &none;
+      r.p = p;
+      r.cpu = percent(p->run - q->run, b->now - a->now);
+      r.nsyscall = p->nsyscall - q->nsyscall;
+      r.rbytes = p->rbytes - q->rbytes;
+      r.wbytes = p->wbytes - q->wbytes;
+      // By CPU use, then system calls, highest first.
+      for(j = n; j > 0 && (rows[j-1].cpu < r.cpu ||
+                           (rows[j-1].cpu == r.cpu &&
+                            rows[j-1].nsyscall < r.nsyscall)); j--)
+        rows[j] = rows[j-1];
+      rows[j] = r;
+      n++;
+    }
+
+    printf(1, "\npid\tstate\tcpu%%\tsyscall\tread\twrite\tmem_kb\tname\n");
+    for(i = 0; i < n; i++){
+      p = rows[i].p;
+      printf(1, "%d\t%s\t%d\t%d\t%d\t%d\t%d\t%s\n", p->pid,
+             p->state < 6 ? states[p->state] : "?", rows[i].cpu,
+             rows[i].nsyscall, rows[i].rbytes, rows[i].wbytes,
+             p->sz >> 10, p->name);
+    }
+
+    t = a;
+    a = b;
+    b = t;
+  }
+  exit();
+}
@@ -7,6 +7,8 @@
 #include "x86.h"
 #include "traps.h"
 #include "spinlock.h"
+#include "klog.h"
+#include "kstat.h"
 
 // Interrupt descriptor table (shared by all CPUs).
 struct gatedesc idt[256];
@@ -14,6 +16,23 @@ extern uint vectors[];  // in vectors.S: array of 256 entry pointers
 struct spinlock tickslock;
 uint ticks;
 
+// ticks follows nanotime(), not interrupts, so a CPU 0 that halted
+// through some ticks catches up when it next looks.  Nobody is
+// woken on ticks until the earliest tickwait() deadline is due.
+#define TICKNS (1000000000 / HZ)
+static uint64 nexttick = TICKNS;  // nanotime() that ends tick ticks
+static uint tickdue;              // Earliest deadline, if tickarmed
+static int tickarmed;
+
+// Interrupt counts and, while irqstat_on, handler times: per CPU,
+// so counting takes no lock; irq_stat() adds them up.  Handlers run
+// with interrupts off and never move CPUs.
+int irqstat_on;
+static struct {
+  uint count[KSTAT_NIRQ];
+  uint hist[KSTAT_NIRQ][KSTAT_NBUCKET];
+} irqstat[NCPU];
+
 void
 tvinit(void)
 {
@@ -32,10 +51,113 @@ idtinit(void)
   lidt(idt, sizeof(idt));
 }
 
+// Bring ticks up to date, and wake the sleepers on it if the
+// earliest deadline has come.  Caller holds tickslock.
+void
+tickupdate(void)
+{
+  uint64 now;
+  uint n;
+
+  now = nanotime();
+  if(now >= nexttick){
+    // CPU 0 never halts for more than a second, so n fits.
+    n = div64(now - nexttick, TICKNS) + 1;
+    ticks += n;
+    nexttick += (uint64)n * TICKNS;
+  }
+  if(tickarmed && (int)(ticks - tickdue) >= 0){
+    tickarmed = 0;
+    wakeup(&ticks);
+  }
+}
+
+// Ask for a wakeup(&ticks) once ticks reaches due; the caller then
+// sleeps on &ticks.  Sleepers woken check their condition and call
+// this again.  Caller holds tickslock.
+void
+tickwait(uint due)
+{
+  if(tickarmed && (int)(due - tickdue) >= 0)
+    return;
+  tickdue = due;
+  tickarmed = 1;
+  // A halted CPU 0 set its timer for the old deadline; see tickidle().
+  if(cpus[0].idle)
+    lapicipi(cpus[0].apicid, T_IRQ0 + IRQ_WAKEUP);
+}
+
+// Set this CPU's timer before it halts in scheduler(), with
+// interrupts off and idle set.  CPU 0 keeps time, so it wakes at
+// the next deadline, or in a second; the others need no timer
+// until they have work again.  The caller restores the periodic
+// timer after the halt.
+void
+tickidle(void)
+{
+  uint64 now, ns;
+
+  if(cpuid() != 0){
+    lapiconeshot(0);
+    return;
+  }
+  acquire(&tickslock);
+  tickupdate();
+  ns = 1000000000;
+  if(tickarmed && tickdue - ticks <= HZ){
+    now = nanotime();
+    ns = nexttick > now ? nexttick - now : 1;
+    ns += (uint64)(tickdue - ticks - 1) * TICKNS;
+  }
+  release(&tickslock);
+  lapiconeshot(ns);
+}
+
+// Turn handler timing and interrupts-off tracking on (1, starting
+// from zero) or off (0); -1 leaves them alone.  Returns whether
+// they were on.
+int
+irqstat_set(int on)
+{
+  int old;
+
+  old = irqstat_on;
+  if(on == 1){
+    irqstat_on = 0;
+    memset(irqstat, 0, sizeof(irqstat));
+    cli_stat_clear();
+    irqstat_on = 1;
+  } else if(on == 0)
+    irqstat_on = 0;
+  return old;
+}
+
+// Add up the CPUs' counts into st.
+void
+irq_stat(struct kstat_irq *st)
+{
+  int c, i, b;
+
+  st->tsckhz = tsckhz;
+  st->on = irqstat_on;
+  memset(st->count, 0, sizeof(st->count));
+  memset(st->hist, 0, sizeof(st->hist));
+  for(c = 0; c < ncpu; c++)
+    for(i = 0; i < KSTAT_NIRQ; i++){
+      st->count[i] += irqstat[c].count[i];
+      for(b = 0; b < KSTAT_NBUCKET; b++)
+        st->hist[i][b] += irqstat[c].hist[i][b];
+    }
+  cli_stat(st);
+}
+
 //PAGEBREAK: 41
 void
 trap(struct trapframe *tf)
 {
+  uint64 t0;
+  uint irq, va;
+
   if(tf->trapno == T_SYSCALL){
     if(myproc()->killed)
       exit();
@@ -46,22 +168,29 @@ trap(struct trapframe *tf)
     return;
   }
 
+  irq = tf->trapno - T_IRQ0;
+  t0 = irq < KSTAT_NIRQ && irqstat_on ? rdtsc() : 0;
+
   switch(tf->trapno){
   case T_IRQ0 + IRQ_TIMER:
-    if(cpuid() == 0){
+    // CPU 0 keeps time; while it is halted, the CPUs still busy do.
+    if(cpuid() == 0 || cpus[0].idle){
       acquire(&tickslock);
-      ticks++;
-      wakeup(&ticks);
+      tickupdate();
       release(&tickslock);
     }
+    kprof_tick(tf);
     lapiceoi();
     break;
   case T_IRQ0 + IRQ_IDE:
-    ideintr();
+    ideintr(0);
     lapiceoi();
     break;
   case T_IRQ0 + IRQ_IDE+1:
-    // Bochs generates spurious IDE1 interrupts.
+    // The log disk.  Bochs also generates spurious IDE1 interrupts;
+    // ideintr() ignores them, as no request is on the disk.
+    ideintr(1);
+    lapiceoi();
     break;
   case T_IRQ0 + IRQ_KBD:
     kbdintr();
@@ -71,6 +200,10 @@ trap(struct trapframe *tf)
     uartintr();
     lapiceoi();
     break;
+  case T_IRQ0 + IRQ_WAKEUP:
+    // Only here to end the hlt in scheduler().
+    lapiceoi();
+    break;
   case T_IRQ0 + 7:
   case T_IRQ0 + IRQ_SPURIOUS:
     cprintf("cpu%d: spurious interrupt at %x:%x\n",
@@ -78,22 +211,47 @@ trap(struct trapframe *tf)
     lapiceoi();
     break;
 
+  case T_PGFLT:
+    // A first touch of a page sbrk() did not allocate, or a write to
+    // a copy-on-write page, by the process or by the kernel accessing
+    // its memory, is not an error.  Reading in a page of an mmap()ed
+    // file sleeps; from user space, take interrupts meanwhile, as a
+    // system call does.  Another fault on this CPU would overwrite
+    // %cr2 then, so read it first.
+    va = rcr2();
+    if(myproc() && (tf->cs&3) == DPL_USER)
+      sti();
+    if(myproc() && pagefault(myproc(), va, tf->err & 2) == 0){
+      klog_ev_off(KLOG_DEBUG, KLOG_EV_PGFAULT, va, (tf->err & 2) != 0,
+                  tf->eip);
+      break;
+    }
+    // fall through
+
   //PAGEBREAK: 13
   default:
+    if(tf->trapno != T_PGFLT)
+      va = rcr2();
     if(myproc() == 0 || (tf->cs&3) == 0){
       // In kernel, it must be our mistake.
       cprintf("unexpected trap %d from cpu %d eip %x (cr2=0x%x)\n",
-              tf->trapno, cpuid(), tf->eip, rcr2());
+              tf->trapno, cpuid(), tf->eip, va);
       panic("trap");
     }
     // In user space, assume process misbehaved.
     cprintf("pid %d %s: trap %d err %d on cpu %d "
             "eip 0x%x addr 0x%x--kill proc\n",
             myproc()->pid, myproc()->name, tf->trapno,
-            tf->err, cpuid(), tf->eip, rcr2());
+            tf->err, cpuid(), tf->eip, va);
     myproc()->killed = 1;
   }
 
+  if(irq < KSTAT_NIRQ){
+    irqstat[cpuid()].count[irq]++;
+    if(t0)
+      irqstat[cpuid()].hist[irq][kstat_bucket(rdtsc() - t0)]++;
+  }
+
   // Force process exit if it has been killed and is in user space.
   // (If it is still executing in the kernel, let it keep running
   // until it gets to the regular system call return.)
@@ -14,6 +14,23 @@
 
 #define COM1    0x3f8
 
+#define UARTTXSIZE 1024
+
+// Output goes into a ring that the transmitter-empty interrupt
+// drains, a FIFO's worth of bytes at a time, so writers do not wait
+// for the line.  A writer only waits when the ring is full, as it is
+// when a lot is printed with interrupts off.  After a panic there
+// are no interrupts left to wait for, and output is written out
+// directly (uartsync).
+static struct {
+  struct spinlock lock;
+  char buf[UARTTXSIZE];
+  uint r;     // next byte to transmit
+  uint w;     // next free slot
+  int fifo;   // bytes the transmitter takes at once
+  int sync;   // write straight out, without the lock
+} tx;
+
 static int uart;    // is there a uart?
 
 void
@@ -21,8 +38,12 @@ uartinit(void)
 {
   char *p;
 
-  // Turn off the FIFO
-  outb(COM1+2, 0);
+  initlock(&tx.lock, "uart");
+  tx.fifo = 1;
+
+  // Turn on the FIFO, interrupting for every received byte;
+  // a 16550 says so in the interrupt identification register.
+  outb(COM1+2, 0x07);
 
   // 9600 baud, 8 data bits, 1 stop bit, parity off.
   outb(COM1+3, 0x80);    // Unlock divisor
@@ -39,7 +60,8 @@ uartinit(void)
 
   // Acknowledge pre-existing interrupt conditions;
   // enable interrupts.
-  inb(COM1+2);
+  if((inb(COM1+2) & 0xC0) == 0xC0)
+    tx.fifo = 16;
   inb(COM1+0);
   ioapicenable(IRQ_COM1, 0);
 
@@ -48,16 +70,83 @@ uartinit(void)
     uartputc(*p);
 }
 
+// Hand the transmitter as many bytes from the ring as it takes,
+// and ask for an interrupt when it is empty if more are waiting.
+// Caller holds tx.lock.
+static void
+uartstart(void)
+{
+  int i;
+
+  if(inb(COM1+5) & 0x20){
+    for(i = 0; i < tx.fifo && tx.r != tx.w; i++)
+      outb(COM1+0, tx.buf[tx.r++ % UARTTXSIZE]);
+  }
+  outb(COM1+1, tx.r != tx.w ? 0x03 : 0x01);
+}
+
+// Wait for the transmitter to empty, but not forever.
+static void
+uartwait(void)
+{
+  int i;
+
+  for(i = 0; i < 128 && !(inb(COM1+5) & 0x20); i++)
+    microdelay(10);
+}
+
+// Queue n bytes for the serial line.
 void
-uartputc(int c)
+uartwrite(char *s, int n)
 {
   int i;
 
   if(!uart)
     return;
-  for(i = 0; i < 128 && !(inb(COM1+5) & 0x20); i++)
-    microdelay(10);
-  outb(COM1+0, c);
+  if(tx.sync){
+    for(i = 0; i < n; i++){
+      uartwait();
+      outb(COM1+0, s[i]);
+    }
+    return;
+  }
+
+  acquire(&tx.lock);
+  for(i = 0; i < n; i++){
+    if(tx.w - tx.r == UARTTXSIZE){
+      uartwait();
+      if(!(inb(COM1+5) & 0x20))
+        tx.r++;    // the line is stuck; drop the oldest byte
+      uartstart();
+    }
+    tx.buf[tx.w++ % UARTTXSIZE] = s[i];
+  }
+  uartstart();
+  release(&tx.lock);
+}
+
+void
+uartputc(int c)
+{
+  char ch = c;
+
+  uartwrite(&ch, 1);
+}
+
+// Stop using interrupts: write out what the ring holds now, and
+// everything later directly.  For panic(), which may interrupt
+// a CPU that holds tx.lock.
+void
+uartsync(void)
+{
+  if(!uart)
+    return;
+  tx.sync = 1;
+  outb(COM1+1, 0x01);
+  while(tx.r != tx.w){
+    uartwait();
+    outb(COM1+0, tx.buf[tx.r++ % UARTTXSIZE]);
+  }
 }
 
 static int
@@ -73,5 +162,8 @@ uartgetc(void)
 void
 uartintr(void)
 {
+  acquire(&tx.lock);
+  uartstart();
+  release(&tx.lock);
   consoleintr(uartgetc);
 }
@@ -0,0 +1,9 @@
+// Buffers for readv() and writev().
+// Shared by the kernel and user programs, like stat.h.
+
+#define UIO_MAXIOV 16   // most buffers in one call
+
+struct iovec {
+  void *base;
+  int len;
+};
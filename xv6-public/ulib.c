@@ -4,6 +4,48 @@
 #include "user.h"
 #include "x86.h"
 
+int _fork(void);
+int _exit(void) __attribute__((noreturn));
+int _exec(char*, char**);
+int _close(int);
+
+// Set by printf.c once it buffers output, to flush it before the
+// process goes away or changes (fd -1) or fd gets closed.  Programs
+// linked without printf.c, like forktest, leave it 0.
+void (*flushhook)(int);
+
+int
+fork(void)
+{
+  if(flushhook)
+    flushhook(-1);
+  return _fork();
+}
+
+int
+exit(void)
+{
+  if(flushhook)
+    flushhook(-1);
+  _exit();
+}
+
+int
+exec(char *path, char **argv)
+{
+  if(flushhook)
+    flushhook(-1);
+  return _exec(path, argv);
+}
+
+int
+close(int fd)
+{
+  if(flushhook)
+    flushhook(fd);
+  return _close(fd);
+}
+
 char*
 strcpy(char *s, const char *t)
 {
@@ -55,6 +97,9 @@ gets(char *buf, int max)
   int i, cc;
   char c;
 
+  // Show a prompt still in a buffer.
+  if(flushhook)
+    flushhook(-1);
   for(i=0; i+1 < max; ){
     cc = read(0, &c, 1);
     if(cc < 1)
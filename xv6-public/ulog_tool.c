@@ -1,46 +1,942 @@
 // User-space kernel log viewer tool
+//
+// usage: ulog_tool        print a snapshot of the most recent records
+//        ulog_tool -m     read every ring in place through klogmap()
+//        ulog_tool -s     print the records spilled to disk
+//        ulog_tool -d     take every buffered record out of the
+//                         rings (/dev/klogdrain) and print them
+//        ulog_tool -e     count the typed events in the rings
+//        ulog_tool -e event [pid]
+//                         print the events of one type (fork, open,
+//                         ...), only pid's if given; the kernel does
+//                         the selecting
+//        ulog_tool -p pid print pid's records, which the kernel
+//                         finds through its per-process index
+//        ulog_tool -r first [last]
+//                         print records first to last by sequence
+//                         number, reaching back into the disk spill
+//        ulog_tool -t secs
+//                         print the records of the last secs seconds,
+//                         the disk spill included
+//        ulog_tool -S     per-process wait time and per-CPU use
+//                         from the scheduler events in the rings
+//        ulog_tool -S on|off
+//                         start or stop recording scheduler events
+//        ulog_tool -l subsys level
+//                         record only level and above for subsys
+//                         (kernel, fs, proc, exec, user or all);
+//                         level is debug, info, warn, error or off
+//        ulog_tool -w level message...
+//                         log each message as a record, all in one
+//                         write() to /dev/klog
+//        ulog_tool -f [-b [file]] [-l level] [-p pid] [-c cpu]
+//                         print the records in the rings, then each
+//                         one as it is logged; -b writes them instead
+//                         as struct klog_entry, to file or stdout, for
+//                         offline processing.  -l keeps level and
+//                         above; the kernel applies -l, -p and -c.
+//        ulog_tool -b [file] [-l level] [-p pid] [-c cpu]
+//                         just write the records in the rings
 #include "types.h"
 #include "stat.h"
 #include "user.h"
+#include "fcntl.h"
+#include "klogpack.h"
+#include "klogev.h"
+
+#define RECMAX 152   // KLOG_RECMAX in klog.h
+#define MSGMAX 128   // KLOG_MSGMAX in klog.h
 
 static const char* level_names[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+static char* subsys_names[] = {"kernel", "fs", "proc", "exec", "user"};
+static char* level_args[] = {"debug", "info", "warn", "error", "off"};
+
+#define NELEM(x) (sizeof(x)/sizeof((x)[0]))
+
+// Divide the 64-bit number hi:lo by d < 65536 in 16-bit steps,
+// since there is no 64-bit division.  Returns the remainder.
+static uint
+div64(uint *hi, uint *lo, uint d)
+{
+  uint r, q, part[4];
+  int i;
+
+  part[0] = *hi >> 16;
+  part[1] = *hi & 0xFFFF;
+  part[2] = *lo >> 16;
+  part[3] = *lo & 0xFFFF;
+  r = 0;
+  for(i = 0; i < 4; i++){
+    q = (r << 16 | part[i]) / d;
+    r = (r << 16 | part[i]) % d;
+    part[i] = q;
+  }
+  *hi = part[0] << 16 | part[1];
+  *lo = part[2] << 16 | part[3];
+  return r;
+}
+
+// Print x as at least width digits, zero padded.
+static void
+print_padded(uint x, int width)
+{
+  char buf[12];
+  int i;
+
+  buf[i = sizeof(buf) - 1] = 0;
+  while(sizeof(buf) - 1 - i < width || x){
+    buf[--i] = '0' + x % 10;
+    x /= 10;
+  }
+  printf(1, "%s", buf + i);
+}
+
+// Timestamp of the previously printed record, for deltas.
+static uint last_hi, last_lo;
+
+// [seq] seconds.micros +delta_us LEVEL CPUc PIDp: msg
+static void
+print_rec(struct klog_rec *r, char *msg)
+{
+  const char *level;
+  uint hi, lo, us, dhi, dlo;
+
+  level = r->level < 4 ? level_names[r->level] : "?";
+
+  hi = r->timestamp_hi;
+  lo = r->timestamp_lo;
+  div64(&hi, &lo, 1000);        // ns -> us
+  us = div64(&hi, &lo, 1000);    // us -> ms
+  us += div64(&hi, &lo, 1000) * 1000;  // ms -> s
+  printf(1, "[%d] ", r->seq);
+  print_padded(lo, 1);
+  printf(1, ".");
+  print_padded(us, 6);
+
+  // Delta from the previous record, in microseconds; records
+  // from different CPUs may be a little out of order.
+  dlo = r->timestamp_lo - last_lo;
+  dhi = r->timestamp_hi - last_hi - (r->timestamp_lo < last_lo);
+  if((last_hi | last_lo) != 0 && (int)dhi >= 0){
+    div64(&dhi, &dlo, 1000);
+    if(dhi == 0)
+      printf(1, " +%d", dlo);
+  }
+  last_hi = r->timestamp_hi;
+  last_lo = r->timestamp_lo;
+
+  printf(1, " %s CPU%d PID%d: %s\n", level, r->cpu, r->pid, msg);
+}
+
+// Report records lost to full rings, per CPU.
+static void
+print_dropped(void)
+{
+  int cpu, n;
+
+  for(cpu = 0; (n = klogctl(KLOG_CTL_DROPPED, cpu)) >= 0; cpu++)
+    if(n > 0)
+      printf(1, "CPU%d dropped %d records\n", cpu, n);
+}
+
+// Append the digits of x in base to text[*i], mirroring the kernel's
+// snprintf_int/snprintf_hex.
+static void
+putnum(char *text, int *i, uint x, int base)
+{
+  static char digits[] = "0123456789abcdef";
+  char num[12], *s;
+
+  if(base == 10 && (int)x < 0){
+    text[(*i)++] = '-';
+    x = -x;
+  } else if(base == 16){
+    text[(*i)++] = '0';
+    text[(*i)++] = 'x';
+  }
+  s = num + sizeof(num);
+  *--s = 0;
+  do
+    *--s = digits[x % base];
+  while((x /= base) != 0);
+  for(; *s && *i < MSGMAX - 1; s++)
+    text[(*i)++] = *s;
+}
+
+// Render the message of a deferred record into text[MSGMAX] with its
+// format string from the mapped table, or a typed event as text,
+// mirroring rec_text() in the kernel.
+static void
+render(struct klog_map *m, struct klog_rec *r, char *text)
+{
+  struct klog_args *a;
+  struct klog_event *e;
+  char *fmt, *s;
+  int i, k;
+
+  if(r->level & KLOG_EVENT){
+    r->level &= ~KLOG_EVENT;
+    e = (struct klog_event*)r->msg;
+    klog_evtext(e, r->len - sizeof(*r) - 4, text, MSGMAX);
+    return;
+  }
+  if((r->level & KLOG_DEFERRED) == 0){
+    strcpy(text, r->msg);
+    return;
+  }
+  r->level &= ~KLOG_DEFERRED;
+  a = (struct klog_args*)r->msg;
+  if(a->fmt >= m->nfmt){
+    strcpy(text, "(bad deferred entry)");
+    return;
+  }
+  fmt = (char*)m + m->fmt_off + a->fmt * m->fmt_len;
+
+  i = 0;
+  k = 0;
+  for(; *fmt && i < MSGMAX - 14; fmt++){
+    if(*fmt != '%'){
+      text[i++] = *fmt;
+      continue;
+    }
+    if(*++fmt == 0)
+      break;
+    if(*fmt == 's'){
+      for(s = r->msg + a->arg[k++] % MSGMAX; *s && i < MSGMAX - 1; s++)
+        text[i++] = *s;
+    } else if(*fmt == 'd' || *fmt == 'x'){
+      putnum(text, &i, a->arg[k++], *fmt == 'd' ? 10 : 16);
+    } else {
+      text[i++] = '%';
+      if(*fmt != '%')
+        text[i++] = *fmt;
+    }
+  }
+  text[i] = 0;
+}
+
+// The half of ring cpu being written.
+static char*
+ringdata(struct klog_map *m, int cpu)
+{
+  return (char*)m + m->ring_off + cpu * m->ring_size +
+    m->ring[cpu].active * m->data_size;
+}
+
+// Copy of the record under each ring's cursor, checked against
+// the ring's claim counter.
+static union {
+  struct klog_rec r;
+  char b[RECMAX];
+} cur[8];
+static uint pos[8], end[8];
+
+// Load the next record of ring cpu at or after pos[cpu] into
+// cur[cpu].  Returns 0 once the ring has nothing more before end[cpu].
+// A record the writer lapped mid-copy sends the cursor to the tail.
+static int
+load(struct klog_map *m, int cpu)
+{
+  struct klog_ring *r = &m->ring[cpu];
+  char *data;
+  uint off, len;
+
+  while(pos[cpu] < end[cpu]){
+    data = ringdata(m, cpu);
+    off = pos[cpu] % m->data_size;
+    len = *(volatile ushort*)&data[off];
+    if(len < 4 || len > RECMAX || len % 4 || off + len > m->data_size)
+      len = 0;  // torn header
+    else
+      memmove(cur[cpu].b, &data[off], len);
+    if(len == 0 || r->claim - pos[cpu] > m->data_size){
+      // Overwritten under us: restart at the oldest record.
+      if(r->tail <= pos[cpu])
+        return 0;
+      pos[cpu] = r->tail;
+      continue;
+    }
+    if(cur[cpu].r.level != KLOG_PAD)
+      return 1;
+    pos[cpu] += len;
+  }
+  return 0;
+}
+
+static int live[8];
+
+// Map the rings and put a cursor on the oldest record of each.
+static struct klog_map*
+map_rings(void)
+{
+  struct klog_map *m;
+  int cpu;
+
+  m = klogmap();
+  if(m == (struct klog_map*)-1 || m->magic != 0x676f6c6b){
+    printf(2, "klogmap failed\n");
+    return 0;
+  }
+  if(m->ncpu > 8){
+    printf(2, "klogmap: too many rings\n");
+    return 0;
+  }
+  for(cpu = 0; cpu < m->ncpu; cpu++){
+    end[cpu] = m->ring[cpu].head;
+    pos[cpu] = m->ring[cpu].tail;
+    live[cpu] = load(m, cpu);
+  }
+  return m;
+}
+
+// Copy the next record in sequence order over all rings to out.
+// Returns 0 when every ring is exhausted.
+static int
+map_next(struct klog_map *m, struct klog_rec *out)
+{
+  int cpu, best;
+
+  best = -1;
+  for(cpu = 0; cpu < m->ncpu; cpu++)
+    if(live[cpu] && (best < 0 || cur[cpu].r.seq < cur[best].r.seq))
+      best = cpu;
+  if(best < 0)
+    return 0;
+
+  memmove(out, cur[best].b, cur[best].r.len);
+  pos[best] += cur[best].r.len;
+  live[best] = load(m, best);
+  return 1;
+}
+
+// Merge the mapped rings by sequence number, reading records
+// straight out of kernel memory.
+static int
+dump_mapped(void)
+{
+  struct klog_map *m;
+  union {
+    struct klog_rec r;
+    char b[RECMAX];
+  } rec;
+  char text[MSGMAX];
+  int count;
+
+  if((m = map_rings()) == 0)
+    return -1;
+
+  printf(1, "Kernel Log (mapped, %d rings):\n", m->ncpu);
+  printf(1, "----------------------------------------\n");
+
+  count = 0;
+  while(map_next(m, &rec.r)){
+    render(m, &rec.r, text);
+    print_rec(&rec.r, text);
+    count++;
+  }
+
+  printf(1, "(%d entries)\n", count);
+  print_dropped();
+  return 0;
+}
+
+// Microseconds from hi0:lo0 to hi1:lo1 nanoseconds, or 0 if negative.
+static uint
+elapsed_us(uint hi0, uint lo0, uint hi1, uint lo1)
+{
+  uint hi, lo;
+
+  lo = lo1 - lo0;
+  hi = hi1 - hi0 - (lo1 < lo0);
+  if((int)hi < 0)
+    return 0;
+  div64(&hi, &lo, 1000);
+  return hi ? 0xFFFFFFFF : lo;
+}
+
+// Replayed scheduler state.
+#define NPSTAT 64
+static struct {
+  int pid;
+  int ready;            // RUNNABLE since ready_hi:ready_lo
+  uint ready_hi, ready_lo;
+  uint nwait;           // Times it waited to run
+  uint wait_us;         // Total wait
+  uint max_us;          // Longest wait
+} pstat[NPSTAT];
+static struct {
+  int pid;              // Running, or 0 if idle
+  uint run_hi, run_lo;  // Since
+  uint nrun;            // Processes switched to
+  uint busy_us;         // Time not idle
+} cstat[8];
+
+static int
+pstat_slot(int pid)
+{
+  int i;
+
+  for(i = 0; i < NPSTAT; i++)
+    if(pstat[i].pid == pid)
+      return i;
+  for(i = 0; i < NPSTAT; i++)
+    if(pstat[i].pid == 0){
+      pstat[i].pid = pid;
+      return i;
+    }
+  return -1;
+}
+
+// The process on cpu stops running at r's time.
+static void
+run_end(struct klog_rec *r)
+{
+  int c = r->cpu;
+
+  if(cstat[c].pid == 0)
+    return;
+  cstat[c].busy_us += elapsed_us(cstat[c].run_hi, cstat[c].run_lo,
+                                 r->timestamp_hi, r->timestamp_lo);
+  cstat[c].pid = 0;
+}
+
+static void
+replay(struct klog_rec *r)
+{
+  struct klog_event *e = (struct klog_event*)r->msg;
+  int i, c = r->cpu;
+  uint us;
+
+  if(c >= 8 || e->type > KLOG_EV_EXIT || (i = pstat_slot(e->arg[0])) < 0)
+    return;
+  switch(e->type){
+  case KLOG_EV_YIELD:
+    run_end(r);
+    // fall through
+  case KLOG_EV_WAKEUP:
+    pstat[i].ready = 1;
+    pstat[i].ready_hi = r->timestamp_hi;
+    pstat[i].ready_lo = r->timestamp_lo;
+    break;
+  case KLOG_EV_RUN:
+    if(pstat[i].ready){
+      us = elapsed_us(pstat[i].ready_hi, pstat[i].ready_lo,
+                      r->timestamp_hi, r->timestamp_lo);
+      pstat[i].ready = 0;
+      pstat[i].nwait++;
+      pstat[i].wait_us += us;
+      if(us > pstat[i].max_us)
+        pstat[i].max_us = us;
+    }
+    run_end(r);
+    cstat[c].pid = e->arg[0];
+    cstat[c].run_hi = r->timestamp_hi;
+    cstat[c].run_lo = r->timestamp_lo;
+    cstat[c].nrun++;
+    break;
+  case KLOG_EV_SLEEP:
+  case KLOG_EV_EXIT:
+    run_end(r);
+    pstat[i].ready = 0;
+    break;
+  }
+}
+
+// ulog_tool -S: replay the scheduler events in the mapped rings.
+static int
+sched_report(void)
+{
+  struct klog_map *m;
+  union {
+    struct klog_rec r;
+    char b[RECMAX];
+  } rec;
+  uint first_hi, first_lo, span;
+  int i, n;
+
+  if((m = map_rings()) == 0)
+    return -1;
+
+  n = 0;
+  first_hi = first_lo = 0;
+  while(map_next(m, &rec.r)){
+    if((rec.r.level & KLOG_EVENT) == 0 ||
+       ((struct klog_event*)rec.r.msg)->type > KLOG_EV_EXIT)
+      continue;
+    if(n++ == 0){
+      first_hi = rec.r.timestamp_hi;
+      first_lo = rec.r.timestamp_lo;
+    }
+    replay(&rec.r);
+  }
+  if(n == 0){
+    printf(1, "no scheduler events; try ulog_tool -S on\n");
+    return 0;
+  }
+  // Charge processes still running up to the last event.
+  for(i = 0; i < m->ncpu; i++){
+    rec.r.cpu = i;
+    run_end(&rec.r);
+  }
+  span = elapsed_us(first_hi, first_lo,
+                    rec.r.timestamp_hi, rec.r.timestamp_lo);
+
+  printf(1, "%d scheduler events over %d us\n", n, span);
+  printf(1, "pid\twaits\tavg_us\tmax_us\n");
+  for(i = 0; i < NPSTAT; i++)
+    if(pstat[i].nwait)
+      printf(1, "%d\t%d\t%d\t%d\n", pstat[i].pid, pstat[i].nwait,
+             pstat[i].wait_us / pstat[i].nwait, pstat[i].max_us);
+  printf(1, "cpu\truns\tbusy%%\n");
+  for(i = 0; i < m->ncpu; i++)
+    printf(1, "%d\t%d\t%d\n", i, cstat[i].nrun,
+           span >= 100 ? cstat[i].busy_us / (span / 100) : 0);
+  return 0;
+}
+
+// ulog_tool -e: how many of each typed event the mapped rings hold.
+static int
+count_events(void)
+{
+  struct klog_map *m;
+  union {
+    struct klog_rec r;
+    char b[RECMAX];
+  } rec;
+  struct klog_evtype *t;
+  uint count[KLOG_NEV];
+  int i, type;
+
+  if((m = map_rings()) == 0)
+    return -1;
+  memset(count, 0, sizeof(count));
+  while(map_next(m, &rec.r)){
+    type = ((struct klog_event*)rec.r.msg)->type;
+    if((rec.r.level & KLOG_EVENT) && type < KLOG_NEV)
+      count[type]++;
+  }
+  printf(1, "event\t\tcount\n");
+  for(i = 0; i < KLOG_NEV; i++)
+    if(count[i] && (t = klog_evtype(i)) != 0)
+      printf(1, "%s\t%s%d\n", t->name, strlen(t->name) < 8 ? "\t" : "",
+             count[i]);
+  return 0;
+}
+
+// ulog_tool -e event [pid]: the kernel's own selection by event ID.
+static int
+query_events(char *name, int pid)
+{
+  static struct klog_entry e[32];
+  struct klog_query q;
+  struct klog_evtype *t;
+  int i, n, type;
+
+  for(type = 0; type < KLOG_NEV; type++)
+    if((t = klog_evtype(type)) != 0 && strcmp(t->name, name) == 0)
+      break;
+  if(type == KLOG_NEV){
+    printf(2, "ulog_tool: unknown event %s\n", name);
+    return -1;
+  }
+  memset(&q, 0, sizeof(q));
+  q.pid = pid;
+  q.cpu = -1;
+  q.max = NELEM(e);
+  q.events = 1 << type;
+  while((n = getklog2(&q, e)) > 0)
+    for(i = 0; i < n; i++)
+      printf(1, "[%d] CPU%d PID%d %s: %s\n", e[i].seq, e[i].cpu, e[i].pid,
+             e[i].level < 4 ? level_names[e[i].level] : "?", e[i].msg);
+  return n < 0 ? -1 : 0;
+}
+
+// Print what getklog2() returns for q, to the end.
+static int
+print_query(struct klog_query *q)
+{
+  static struct klog_entry e[32];
+  struct klog_rec r;
+  int i, n;
+
+  q->max = NELEM(e);
+  while((n = getklog2(q, e)) > 0)
+    for(i = 0; i < n; i++){
+      r.seq = e[i].seq;
+      r.timestamp_hi = e[i].timestamp_hi;
+      r.timestamp_lo = e[i].timestamp_lo;
+      r.level = e[i].level;
+      r.cpu = e[i].cpu;
+      r.pid = e[i].pid;
+      print_rec(&r, e[i].msg);
+    }
+  return n < 0 ? -1 : 0;
+}
+
+// ulog_tool -p pid: one process's timeline.
+static int
+pid_timeline(int pid)
+{
+  struct klog_query q;
+
+  memset(&q, 0, sizeof(q));
+  q.pid = pid;
+  q.cpu = -1;
+  return print_query(&q);
+}
+
+// ulog_tool -r first [last] and -t secs: a range of records, by
+// sequence number or by age, from the disk spill as well as the
+// rings.
+static int
+query_range(uint first, uint last, uint secs)
+{
+  struct klog_query q;
+  uint64 now;
+
+  memset(&q, 0, sizeof(q));
+  q.pid = -1;
+  q.cpu = -1;
+  q.minseq = first;
+  q.maxseq = last;
+  q.flags = KLOG_Q_ARCHIVE;
+  if(secs){
+    uptimens(&now);
+    q.mintime = now - secs * 1000000000ULL;
+    if(q.mintime > now)
+      q.mintime = 0;
+  }
+  klogctl(KLOG_CTL_FLUSH, 0);
+  return print_query(&q);
+}
+
+// Print every record read from device major, oldest first.  Each
+// read returns text records, or one packed run if packed is set.
+static int
+dump_dev(char *name, int major, char *what, int packed)
+{
+  union {
+    struct klog_rec r;
+    char b[RECMAX];
+  } t;
+  struct klogpack pk;
+  char *buf;
+  struct klog_rec *r;
+  int fd, n, off, len, count;
+
+  mknod(name, major, 0);
+  if((fd = open(name, O_RDONLY)) < 0){
+    printf(2, "ulog_tool: cannot open %s\n", name);
+    return -1;
+  }
+  if((buf = malloc(2048)) == 0){
+    printf(2, "malloc failed\n");
+    close(fd);
+    return -1;
+  }
+
+  printf(1, "Kernel Log (%s):\n", what);
+  printf(1, "----------------------------------------\n");
+  count = 0;
+  while((n = read(fd, buf, 2048)) > 0){
+    klogpack_reset(&pk);
+    for(off = 0; off < n; off += len){
+      if(packed){
+        if((len = klogpack_get(&pk, buf + off, n - off, &t.r)) == 0)
+          break;
+        r = &t.r;
+      } else {
+        r = (struct klog_rec*)(buf + off);
+        len = r->len;
+      }
+      print_rec(r, r->msg);
+      count++;
+    }
+  }
+  printf(1, "(%d entries)\n", count);
+
+  free(buf);
+  close(fd);
+  return 0;
+}
+
+// Print every record in the on-disk spill.
+static int
+dump_spill(void)
+{
+  klogctl(KLOG_CTL_FLUSH, 0);
+  return dump_dev("klogspill", KLOGSPILL, "spilled to disk", 1);
+}
+
+// ulog_tool -l subsys level
+static int
+set_level(char *subsys, char *level)
+{
+  int ss, lv;
+
+  ss = KLOG_SS_ALL;
+  if(strcmp(subsys, "all") != 0){
+    for(ss = 0; ss < NELEM(subsys_names); ss++)
+      if(strcmp(subsys, subsys_names[ss]) == 0)
+        break;
+    if(ss == NELEM(subsys_names)){
+      printf(2, "ulog_tool: unknown subsystem %s\n", subsys);
+      return -1;
+    }
+  }
+  for(lv = 0; lv < NELEM(level_args); lv++)
+    if(strcmp(level, level_args[lv]) == 0)
+      break;
+  if(lv == NELEM(level_args)){
+    printf(2, "ulog_tool: unknown level %s\n", level);
+    return -1;
+  }
+  if(klogctl(KLOG_CTL_LEVEL, ss << 8 | lv) < 0){
+    printf(2, "ulog_tool: klogctl failed\n");
+    return -1;
+  }
+  return 0;
+}
+
+// Log msgs[0..n-1] at level with a single write of records.
+static void
+write_recs(char *level, char **msgs, int n)
+{
+  static char buf[2048];
+  struct klog_rec *r;
+  int i, fd, lv, len, off;
+
+  for(lv = 0; lv < NELEM(level_names); lv++)
+    if(strcmp(level, level_args[lv]) == 0)
+      break;
+  if(lv == NELEM(level_names)){
+    printf(2, "ulog_tool: unknown level %s\n", level);
+    return;
+  }
+  off = 0;
+  for(i = 0; i < n; i++){
+    len = strlen(msgs[i]);
+    if(len > MSGMAX - 1)
+      len = MSGMAX - 1;
+    if(off + sizeof(*r) + len + 1 > sizeof(buf))
+      break;
+    r = (struct klog_rec*)(buf + off);
+    memset(r, 0, sizeof(*r));
+    r->len = sizeof(*r) + len + 1;
+    r->level = lv;
+    memmove(r->msg, msgs[i], len);
+    r->msg[len] = 0;
+    off += r->len;
+  }
+  mknod("klog", KLOG, 0);
+  if((fd = open("klog", O_WRONLY)) < 0){
+    printf(2, "ulog_tool: cannot open klog\n");
+    return;
+  }
+  if(write(fd, buf, off) != off)
+    printf(2, "ulog_tool: write to klog failed\n");
+  close(fd);
+}
+
+// ulog_tool -f and -b: pass the records that match the filters in
+// argv to stdout or a file, as text or binary, and with -f keep
+// doing so.  The kernel filters them with getklog2(), from where
+// the last batch ended; a read of /dev/klog blocks until anything
+// new is logged.
+static int
+collect(int argc, char *argv[])
+{
+  static struct klog_entry e[32];
+  struct klog_query q;
+  struct klog_rec r;
+  char *file;
+  int i, lv, n, fd, kfd, follow, binary;
+
+  memset(&q, 0, sizeof(q));
+  q.pid = -1;
+  q.cpu = -1;
+  q.max = NELEM(e);
+  follow = binary = 0;
+  file = 0;
+  for(i = 1; i < argc; i++){
+    if(strcmp(argv[i], "-f") == 0)
+      follow = 1;
+    else if(strcmp(argv[i], "-b") == 0){
+      binary = 1;
+      if(i + 1 < argc && argv[i+1][0] != '-')
+        file = argv[++i];
+    } else if(strcmp(argv[i], "-l") == 0 && i + 1 < argc){
+      for(lv = 0; lv < NELEM(level_names); lv++)
+        if(strcmp(argv[i+1], level_args[lv]) == 0)
+          break;
+      if(lv == NELEM(level_names)){
+        printf(2, "ulog_tool: unknown level %s\n", argv[i+1]);
+        return -1;
+      }
+      q.levels = ((1 << NELEM(level_names)) - 1) & ~((1 << lv) - 1);
+      i++;
+    } else if(strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+      q.pid = atoi(argv[++i]);
+    else if(strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+      q.cpu = atoi(argv[++i]);
+    else {
+      printf(2, "usage: ulog_tool -f|-b [file] [-l level] [-p pid] [-c cpu]\n");
+      return -1;
+    }
+  }
+
+  fd = 1;
+  if(file){
+    unlink(file);
+    if((fd = open(file, O_CREATE|O_WRONLY)) < 0){
+      printf(2, "ulog_tool: cannot create %s\n", file);
+      return -1;
+    }
+  }
+  kfd = -1;
+  if(follow){
+    mknod("klog", KLOG, 0);
+    if((kfd = open("klog", O_RDONLY)) < 0){
+      printf(2, "ulog_tool: cannot open klog\n");
+      return -1;
+    }
+  }
+
+  for(;;){
+    while((n = getklog2(&q, e)) > 0){
+      for(i = 0; i < n; i++){
+        if(binary){
+          bufwrite(fd, &e[i], sizeof(e[i]));
+          continue;
+        }
+        r.seq = e[i].seq;
+        r.timestamp_hi = e[i].timestamp_hi;
+        r.timestamp_lo = e[i].timestamp_lo;
+        r.level = e[i].level;
+        r.cpu = e[i].cpu;
+        r.pid = e[i].pid;
+        print_rec(&r, e[i].msg);
+      }
+      q.minseq = e[n-1].seq + 1;
+    }
+    if(n < 0 || !follow)
+      break;
+    // Out with what we have before waiting, even into a pipe.
+    bufflush(fd);
+    if(read(kfd, e, sizeof(e)) <= 0)
+      break;
+  }
+  if(file)
+    close(fd);
+  if(kfd >= 0)
+    close(kfd);
+  return n < 0 ? -1 : 0;
+}
 
 int
 main(int argc, char *argv[])
 {
-  struct klog_entry *entries;
-  int count, i;
-  const char *level;
-  
+  char *buf;
+  struct klog_rec *r;
+  int n, off, count;
+
+  if(argc > 1 && (strcmp(argv[1], "-f") == 0 || strcmp(argv[1], "-b") == 0)){
+    collect(argc, argv);
+    exit();
+  }
+  if(argc > 1 && strcmp(argv[1], "-m") == 0){
+    dump_mapped();
+    exit();
+  }
+  if(argc > 1 && strcmp(argv[1], "-s") == 0){
+    dump_spill();
+    exit();
+  }
+  if(argc > 1 && strcmp(argv[1], "-d") == 0){
+    dump_dev("klogdrain", KLOGDRAIN, "drained", 0);
+    exit();
+  }
+  if(argc > 1 && strcmp(argv[1], "-e") == 0){
+    if(argc > 2)
+      query_events(argv[2], argc > 3 ? atoi(argv[3]) : -1);
+    else
+      count_events();
+    exit();
+  }
+  if(argc > 1 && strcmp(argv[1], "-p") == 0){
+    if(argc != 3)
+      printf(2, "usage: ulog_tool -p pid\n");
+    else
+      pid_timeline(atoi(argv[2]));
+    exit();
+  }
+  if(argc > 1 && strcmp(argv[1], "-r") == 0){
+    if(argc < 3)
+      printf(2, "usage: ulog_tool -r first [last]\n");
+    else
+      query_range(atoi(argv[2]), argc > 3 ? atoi(argv[3]) : 0, 0);
+    exit();
+  }
+  if(argc > 1 && strcmp(argv[1], "-t") == 0){
+    if(argc < 3 || atoi(argv[2]) <= 0)
+      printf(2, "usage: ulog_tool -t secs\n");
+    else
+      query_range(0, 0, atoi(argv[2]));
+    exit();
+  }
+  if(argc > 1 && strcmp(argv[1], "-S") == 0){
+    if(argc > 2)
+      klogctl(KLOG_CTL_SCHEDTRACE, strcmp(argv[2], "on") == 0);
+    else
+      sched_report();
+    exit();
+  }
+  if(argc > 1 && strcmp(argv[1], "-l") == 0){
+    if(argc != 4)
+      printf(2, "usage: ulog_tool -l subsys level\n");
+    else
+      set_level(argv[2], argv[3]);
+    exit();
+  }
+  if(argc > 1 && strcmp(argv[1], "-w") == 0){
+    if(argc < 4)
+      printf(2, "usage: ulog_tool -w level message...\n");
+    else
+      write_recs(argv[2], argv + 3, argc - 3);
+    exit();
+  }
+
   // Allocate buffer on heap instead of stack
-  entries = (struct klog_entry*)malloc(64 * sizeof(struct klog_entry));
-  if(entries == 0){
+  buf = malloc(4096);
+  if(buf == 0){
     printf(2, "malloc failed\n");
     exit();
   }
-  
+
   // Get kernel log snapshot
-  count = getklog(entries, 64);
-  
-  if(count < 0){
-    printf(2, "getklog failed\n");
-    free(entries);
+  n = getklogrec(buf, 4096);
+
+  if(n < 0){
+    printf(2, "getklogrec failed\n");
+    free(buf);
     exit();
   }
-  
+
+  count = 0;
+  for(off = 0; off < n; off += r->len){
+    r = (struct klog_rec*)(buf + off);
+    count++;
+  }
+
   printf(1, "Kernel Log (%d entries):\n", count);
   printf(1, "----------------------------------------\n");
-  
-  for(i = 0; i < count; i++){
-    level = entries[i].level < 4 ? level_names[entries[i].level] : "?";
-    printf(1, "[%d] %s CPU%d PID%d: %s\n",
-           entries[i].seq,
-           level,
-           entries[i].cpu,
-           entries[i].pid,
-           entries[i].msg);
-  }
-  
-  free(entries);
+
+  for(off = 0; off < n; off += r->len){
+    r = (struct klog_rec*)(buf + off);
+    print_rec(r, r->msg);
+  }
+  print_dropped();
+
+  free(buf);
   exit();
 }
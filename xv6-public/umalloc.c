@@ -3,8 +3,13 @@
 #include "user.h"
 #include "param.h"
 
-// Memory allocator by Kernighan and Ritchie,
-// The C programming Language, 2nd ed.  Section 8.7.
+// Memory allocator.  Small requests come from free lists of
+// power-of-2 sized blocks, NCLASS classes from 16 to 1024 bytes
+// with the header; a list is refilled by carving up a CHUNK-byte
+// block, and freed blocks go back on it, so both take constant time.
+// Everything else, chunks included, comes from the first-fit list by
+// Kernighan and Ritchie, The C programming Language, 2nd ed.
+// Section 8.7, which coalesces neighbouring free blocks.
 
 typedef long Align;
 
@@ -18,11 +23,26 @@ union header {
 
 typedef union header Header;
 
+#define NCLASS    7
+#define MINSHIFT  4
+#define CHUNK     4096
+#define SMALL     0x80000000   // in s.size: a small block, class below
+
 static Header base;
 static Header *freep;
 
-void
-free(void *ap)
+static struct {
+  Header *free[NCLASS];
+  uint nalloc[NCLASS];   // small blocks handed out
+  uint nfree[NCLASS];    // and given back
+  uint nchunk;           // chunks carved up
+  uint nbig;             // large blocks handed out
+  uint nbigfree;
+  uint ncore;            // bytes got from sbrk()
+} sc;
+
+static void
+bigfree(void *ap)
 {
   Header *bp, *p;
 
@@ -54,14 +74,15 @@ morecore(uint nu)
   p = sbrk(nu * sizeof(Header));
   if(p == (char*)-1)
     return 0;
+  sc.ncore += nu * sizeof(Header);
   hp = (Header*)p;
   hp->s.size = nu;
-  free((void*)(hp + 1));
+  bigfree((void*)(hp + 1));
   return freep;
 }
 
-void*
-malloc(uint nbytes)
+static void*
+bigalloc(uint nbytes)
 {
   Header *p, *prevp;
   uint nunits;
@@ -88,3 +109,78 @@ malloc(uint nbytes)
         return 0;
   }
 }
+
+// Size class for a block of n bytes with its header, or -1.
+static int
+sizeclass(uint n)
+{
+  int c;
+
+  for(c = 0; c < NCLASS; c++)
+    if(n <= (1 << (c + MINSHIFT)))
+      return c;
+  return -1;
+}
+
+void*
+malloc(uint nbytes)
+{
+  Header *p, *q;
+  int c, size;
+
+  if(nbytes > (1 << (NCLASS - 1 + MINSHIFT)) ||
+     (c = sizeclass(nbytes + sizeof(Header))) < 0){
+    if((p = bigalloc(nbytes)) != 0)
+      sc.nbig++;
+    return p;
+  }
+  if((p = sc.free[c]) == 0){
+    // Carve a chunk into blocks of this class.
+    if((q = bigalloc(CHUNK - sizeof(Header))) == 0)
+      return 0;
+    sc.nchunk++;
+    size = 1 << (c + MINSHIFT);
+    for(p = q; (char*)p + size <= (char*)q + CHUNK - sizeof(Header);
+        p = (Header*)((char*)p + size)){
+      p->s.ptr = sc.free[c];
+      sc.free[c] = p;
+    }
+    p = sc.free[c];
+  }
+  sc.free[c] = p->s.ptr;
+  p->s.size = SMALL | c;
+  sc.nalloc[c]++;
+  return (void*)(p + 1);
+}
+
+void
+free(void *ap)
+{
+  Header *bp;
+  int c;
+
+  bp = (Header*)ap - 1;
+  if((bp->s.size & SMALL) == 0){
+    sc.nbigfree++;
+    bigfree(ap);
+    return;
+  }
+  c = bp->s.size & ~SMALL;
+  bp->s.ptr = sc.free[c];
+  sc.free[c] = bp;
+  sc.nfree[c]++;
+}
+
+// Print allocator counters to fd.
+void
+mallocstat(int fd)
+{
+  int c;
+
+  printf(fd, "class  size    alloc     free    inuse\n");
+  for(c = 0; c < NCLASS; c++)
+    printf(fd, "%d  %d  %d  %d  %d\n", c, 1 << (c + MINSHIFT),
+           sc.nalloc[c], sc.nfree[c], sc.nalloc[c] - sc.nfree[c]);
+  printf(fd, "chunks %d, large %d alloc %d free, sbrk %d bytes\n",
+         sc.nchunk, sc.nbig, sc.nbigfree, sc.ncore);
+}
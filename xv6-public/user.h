@@ -1,4 +1,5 @@
 struct stat;
+struct iovec;
 struct rtcdate;
 
 // system calls
@@ -23,6 +24,7 @@ int getpid(void);
 char* sbrk(int);
 int sleep(int);
 int uptime(void);
+int uptimens(uint64*);
 
 // Kernel logging
 struct klog_entry {
@@ -36,6 +38,112 @@ struct klog_entry {
 };
 int getklog(struct klog_entry*, int);
 
+// Query for getklog2(); must match klog.h.  levels has bit 1<<level
+// set for each level wanted (0 for all); pid and cpu -1 for any.
+struct klog_query {
+  unsigned int minseq;
+  unsigned int levels;
+  int pid;
+  int cpu;
+  int max;
+  unsigned int events;
+  unsigned int maxseq;
+  unsigned int flags;
+  uint64 mintime;
+  uint64 maxtime;
+};
+#define KLOG_Q_ARCHIVE 1   // must match klog.h
+int getklog2(struct klog_query*, struct klog_entry*);
+
+// Variable-length record; must match klog.h.  len covers the
+// header, the message and a trailing copy of the first word.
+struct klog_rec {
+  unsigned short len;
+  unsigned char level;
+  unsigned char cpu;
+  unsigned int seq;
+  unsigned int timestamp_hi;
+  unsigned int timestamp_lo;
+  unsigned int pid;
+  char msg[];
+};
+#define KLOG_PAD 0xff
+int getklogrec(void*, int);
+
+// klogctl() commands and policies; must match klog.h.
+#define KLOG_CTL_POLICY  1
+#define KLOG_CTL_DEFER   2
+#define KLOG_CTL_DROPPED 3
+#define KLOG_CTL_CLEAR   4
+#define KLOG_CTL_LEVEL   5   // arg = subsys<<8 | level
+#define KLOG_CTL_FLUSH   6
+#define KLOG_CTL_SYSTRACE 7  // arg = pid, -1 all, 0 off
+#define KLOG_CTL_SCHEDTRACE 8
+#define KLOG_CTL_BENCH   9   // arg = level<<24 | n; returns cycles/call
+#define KLOG_CTL_LOCKSTAT 10 // 1 clear and start, 0 stop
+#define KLOG_CTL_RATELIMIT 11 // arg = burst<<16 | tokens per tick (0 off)
+#define KLOG_CTL_TRACE   12  // arg = i<<1 | on; returns the old state
+#define KLOG_CTL_IRQSTAT 13  // 1 clear and start, 0 stop
+#define KLOG_CTL_AGG     14  // arg = i<<1 | on; returns the old state
+#define KLOG_SS_KERNEL 0
+#define KLOG_SS_FS     1
+#define KLOG_SS_PROC   2
+#define KLOG_SS_EXEC   3
+#define KLOG_SS_USER   4   // Records written to /dev/klog
+#define KLOG_SS_ALL    0xff
+#define KLOG_OVERWRITE 0
+#define KLOG_DROPNEW   1
+#define KLOG_DEBUG     0
+#define KLOG_INFO      1
+#define KLOG_WARN      2
+#define KLOG_ERROR     3
+int klogctl(int, int);
+int kstat(int, void*, int);
+int splice(int, int, int);
+int readv(int, struct iovec*, int);
+int writev(int, struct iovec*, int);
+struct ioring;
+struct ioring* iosetup(void);
+int ioenter(int, int);
+char* mmap(int, int, int);
+int munmap(char*, int);
+
+// Mapped records with KLOG_DEFERRED in level hold a klog_args in
+// msg: a format table index and raw arguments (%s as offsets in msg).
+#define KLOG_DEFERRED 0x80
+struct klog_args {
+  unsigned short fmt;
+  unsigned short nargs;
+  unsigned int arg[15];
+};
+
+// Mapped records with KLOG_EVENT in level hold a typed event;
+// include klogev.h for struct klog_event and the event table.
+
+// Layout of the klogmap() region; must match klog.h.  A copy of
+// the record at byte position p of ring i, taken from the half
+// m->ring[i].active, is good if m->ring[i].claim - p <= data_size
+// still holds after the copy.
+struct klog_ring {
+  volatile unsigned int head;
+  volatile unsigned int tail;
+  volatile unsigned int claim;
+  volatile unsigned int dropped;
+  volatile unsigned int active;
+};
+struct klog_map {
+  unsigned int magic;
+  unsigned int ncpu;
+  unsigned int data_size;
+  unsigned int ring_off;
+  unsigned int ring_size;
+  unsigned int fmt_off;
+  unsigned int nfmt;
+  unsigned int fmt_len;
+  struct klog_ring ring[8];
+};
+struct klog_map* klogmap(void);
+
 // ulib.c
 int stat(const char*, struct stat*);
 char* strcpy(char*, const char*);
@@ -43,9 +151,13 @@ void *memmove(void*, const void*, int);
 char* strchr(const char*, char c);
 int strcmp(const char*, const char*);
 void printf(int, const char*, ...);
+int bufwrite(int, const void*, int);
+void bufflush(int);
+extern void (*flushhook)(int);
 char* gets(char*, int max);
 uint strlen(const char*);
 void* memset(void*, int, uint);
 void* malloc(uint);
 void free(void*);
+void mallocstat(int);
 int atoi(const char*);
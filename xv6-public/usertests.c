@@ -7,6 +7,7 @@
 #include "syscall.h"
 #include "traps.h"
 #include "memlayout.h"
+#include "kstat.h"
 
 char buf[8192];
 char name[3];
@@ -184,6 +185,10 @@ writetest(void)
   printf(stdout, "small file test ok\n");
 }
 
+// Blocks in the big file: past the singly-indirect ones so that
+// the doubly-indirect block is used, yet small enough for the disk.
+#define BIGFILE (NDIRECT + NINDIRECT + 2*NINDIRECT)
+
 void
 writetest1(void)
 {
@@ -197,7 +202,7 @@ writetest1(void)
     exit();
   }
 
-  for(i = 0; i < MAXFILE; i++){
+  for(i = 0; i < BIGFILE; i++){
     ((int*)buf)[0] = i;
     if(write(fd, buf, 512) != 512){
       printf(stdout, "error: write big file failed\n", i);
@@ -217,7 +222,7 @@ writetest1(void)
   for(;;){
     i = read(fd, buf, 512);
     if(i == 0){
-      if(n == MAXFILE - 1){
+      if(n != BIGFILE){
         printf(stdout, "read only %d blocks from big", n);
         exit();
       }
@@ -1724,6 +1729,114 @@ uio()
   printf(1, "uio test done\n");
 }
 
+// A file read through mmap() matches what was written, pages
+// past the first included, and a write-only fd cannot be mapped.
+void
+mmaptest(void)
+{
+  char *p;
+  int fd, i;
+
+  printf(stdout, "mmap test\n");
+  fd = open("mmapfile", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf(stdout, "error: creat mmapfile failed\n");
+    exit();
+  }
+  for(i = 0; i < sizeof(buf); i++)
+    buf[i] = i;
+  for(i = 0; i < 10; i++)
+    if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+      printf(stdout, "error: write mmapfile failed\n");
+      exit();
+    }
+  close(fd);
+
+  fd = open("mmapfile", O_WRONLY);
+  if(mmap(fd, 0, 4096) != (char*)-1){
+    printf(stdout, "error: mmap of a write-only fd succeeded\n");
+    exit();
+  }
+  close(fd);
+
+  fd = open("mmapfile", O_RDONLY);
+  if((p = mmap(fd, 0, 10*sizeof(buf))) == (char*)-1){
+    printf(stdout, "error: mmap failed\n");
+    exit();
+  }
+  close(fd);
+  for(i = 0; i < 10*sizeof(buf); i++)
+    if(p[i] != (char)(i % sizeof(buf))){
+      printf(stdout, "error: mmap byte %d is %d\n", i, p[i]);
+      exit();
+    }
+  if(munmap(p, 10*sizeof(buf)) < 0){
+    printf(stdout, "error: munmap failed\n");
+    exit();
+  }
+  unlink("mmapfile");
+  printf(stdout, "mmap test ok\n");
+}
+
+// Run path with no standard output; return the text cache misses
+// it caused.
+int
+textrun(char *path)
+{
+  static struct kstat_mem st;
+  char *argv[] = { path, 0 };
+  uint miss;
+
+  kstat(KSTAT_MEM, &st, sizeof(st));
+  miss = st.textmiss;
+  if(fork() == 0){
+    close(1);
+    exec(path, argv);
+    exit();
+  }
+  wait();
+  kstat(KSTAT_MEM, &st, sizeof(st));
+  return st.textmiss - miss;
+}
+
+void
+textcachetest(void)
+{
+  int fd, in, n;
+
+  printf(stdout, "text cache test\n");
+  in = open("echo", O_RDONLY);
+  fd = open("textecho", O_CREATE|O_RDWR);
+  if(in < 0 || fd < 0){
+    printf(stdout, "error: creat textecho failed\n");
+    exit();
+  }
+  while((n = read(in, buf, sizeof(buf))) > 0)
+    write(fd, buf, n);
+  close(in);
+  close(fd);
+
+  if(textrun("textecho") == 0){
+    printf(stdout, "error: first exec found textecho cached\n");
+    exit();
+  }
+  if(textrun("textecho") != 0){
+    printf(stdout, "error: second exec read textecho again\n");
+    exit();
+  }
+  // Any write drops the file's pages, even one that changes nothing.
+  fd = open("textecho", O_RDWR);
+  buf[0] = 0x7f;     // The first byte of the ELF magic, as it was
+  write(fd, buf, 1);
+  close(fd);
+  if(textrun("textecho") == 0){
+    printf(stdout, "error: exec after a write used stale pages\n");
+    exit();
+  }
+  unlink("textecho");
+  printf(stdout, "text cache test ok\n");
+}
+
 void argptest()
 {
   int fd;
@@ -1796,6 +1909,8 @@ main(int argc, char *argv[])
   bigdir(); // slow
 
   uio();
+  mmaptest();
+  textcachetest();
 
   exectest();
 
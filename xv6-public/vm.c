@@ -21,12 +21,22 @@ seginit(void)
   // Cannot share a CODE descriptor for both kernel and user
   // because it would have to have DPL_USR, but the CPU forbids
   // an interrupt from CPL=0 to DPL=3.
-  c = &cpus[cpuid()];
+  for(c = cpus; c < &cpus[ncpu] && c->apicid != lapicid(); c++)
+    ;
+  if(c == &cpus[ncpu])
+    panic("unknown apicid");
   c->gdt[SEG_KCODE] = SEG(STA_X|STA_R, 0, 0xffffffff, 0);
   c->gdt[SEG_KDATA] = SEG(STA_W, 0, 0xffffffff, 0);
   c->gdt[SEG_UCODE] = SEG(STA_X|STA_R, 0, 0xffffffff, DPL_USER);
   c->gdt[SEG_UDATA] = SEG(STA_W, 0, 0xffffffff, DPL_USER);
+
+  // Map %gs to this CPU's struct cpu, so that mycpu() and myproc()
+  // are one load instead of a search by local APIC ID.  trapasm.S
+  // sets %gs again on every entry to the kernel.
+  c->self = c;
+  c->gdt[SEG_KCPU] = SEG(STA_W, c, sizeof(*c) - 1, 0);
   lgdt(c->gdt, sizeof(c->gdt));
+  loadgs(SEG_KCPU << 3);
 }
 
 // Return the address of the PTE in page table pgdir
@@ -57,7 +67,7 @@ walkpgdir(pde_t *pgdir, const void *va, int alloc)
 // Create PTEs for virtual addresses starting at va that refer to
 // physical addresses starting at pa. va and size might not
 // be page-aligned.
-static int
+int
 mappages(pde_t *pgdir, void *va, uint size, uint pa, int perm)
 {
   char *a, *last;
@@ -114,6 +124,39 @@ static struct kmap {
  { (void*)DEVSPACE, DEVSPACE,      0,         PTE_W}, // more devices
 };
 
+static int superpages;   // Map the kernel with 4MB pages where it can
+
+// Map the kernel range k into pgdir.  With superpages, each whole
+// aligned 4MB run is one PTE_PS directory entry: a page directory
+// then needs no page tables of its own for most of the direct map,
+// and the TLB one entry per 4MB.  freevm() leaves such entries be.
+static int
+kmappages(pde_t *pgdir, struct kmap *k)
+{
+  uint off, size, n;
+  char *va;
+  uint pa;
+
+  size = k->phys_end - k->phys_start;
+  for(off = 0; off < size; off += n){
+    va = (char*)k->virt + off;
+    pa = k->phys_start + off;
+    if(superpages && (uint)va % SUPERPGSIZE == 0 && pa % SUPERPGSIZE == 0 &&
+       size - off >= SUPERPGSIZE){
+      n = SUPERPGSIZE;
+      pgdir[PDX(va)] = pa | k->perm | PTE_P | PTE_PS;
+      continue;
+    }
+    // 4KB pages up to the next 4MB boundary.
+    n = SUPERPGSIZE - (uint)va % SUPERPGSIZE;
+    if(n > size - off)
+      n = size - off;
+    if(mappages(pgdir, va, n, pa, k->perm) < 0)
+      return -1;
+  }
+  return 0;
+}
+
 // Set up kernel part of a page table.
 pde_t*
 setupkvm(void)
@@ -127,8 +170,7 @@ setupkvm(void)
   if (P2V(PHYSTOP) > (void*)DEVSPACE)
     panic("PHYSTOP too high");
   for(k = kmap; k < &kmap[NELEM(kmap)]; k++)
-    if(mappages(pgdir, k->virt, k->phys_end - k->phys_start,
-                (uint)k->phys_start, k->perm) < 0) {
+    if(kmappages(pgdir, k) < 0) {
       freevm(pgdir);
       return 0;
     }
@@ -140,6 +182,9 @@ setupkvm(void)
 void
 kvmalloc(void)
 {
+  // entry.S turned on CR4_PSE for entrypgdir already; without the
+  // feature, fall back to 4KB pages.
+  superpages = (cpuidedx(1) & CPUID_PSE) != 0;
   kpgdir = setupkvm();
   switchkvm();
 }
@@ -164,16 +209,22 @@ switchuvm(struct proc *p)
     panic("switchuvm: no pgdir");
 
   pushcli();
-  mycpu()->gdt[SEG_TSS] = SEG16(STS_T32A, &mycpu()->ts,
-                                sizeof(mycpu()->ts)-1, 0);
-  mycpu()->gdt[SEG_TSS].s = 0;
-  mycpu()->ts.ss0 = SEG_KDATA << 3;
+  if(!mycpu()->tssready){
+    // Once per CPU: the descriptor never changes, and ltr marks
+    // it busy, so it could not be loaded again as it is anyway.
+    mycpu()->gdt[SEG_TSS] = SEG16(STS_T32A, &mycpu()->ts,
+                                  sizeof(mycpu()->ts)-1, 0);
+    mycpu()->gdt[SEG_TSS].s = 0;
+    mycpu()->ts.ss0 = SEG_KDATA << 3;
+    // setting IOPL=0 in eflags *and* iomb beyond the tss segment limit
+    // forbids I/O instructions (e.g., inb and outb) from user space
+    mycpu()->ts.iomb = (ushort) 0xFFFF;
+    ltr(SEG_TSS << 3);
+    mycpu()->tssready = 1;
+  }
   mycpu()->ts.esp0 = (uint)p->kstack + KSTACKSIZE;
-  // setting IOPL=0 in eflags *and* iomb beyond the tss segment limit
-  // forbids I/O instructions (e.g., inb and outb) from user space
-  mycpu()->ts.iomb = (ushort) 0xFFFF;
-  ltr(SEG_TSS << 3);
   lcr3(V2P(p->pgdir));  // switch to process's address space
+  mycpu()->pgdir = p->pgdir;
   popcli();
 }
 
@@ -224,7 +275,7 @@ allocuvm(pde_t *pgdir, uint oldsz, uint newsz)
   char *mem;
   uint a;
 
-  if(newsz >= KERNBASE)
+  if(newsz >= MMAPBASE)
     return 0;
   if(newsz < oldsz)
     return oldsz;
@@ -270,8 +321,10 @@ deallocuvm(pde_t *pgdir, uint oldsz, uint newsz)
       pa = PTE_ADDR(*pte);
       if(pa == 0)
         panic("kfree");
-      char *v = P2V(pa);
-      kfree(v);
+      if((*pte & PTE_SHARED) == 0){
+        char *v = P2V(pa);
+        kfree(v);
+      }
       *pte = 0;
     }
   }
@@ -283,13 +336,28 @@ deallocuvm(pde_t *pgdir, uint oldsz, uint newsz)
 void
 freevm(pde_t *pgdir)
 {
+  struct cpu *c;
   uint i;
 
   if(pgdir == 0)
     panic("freevm: no pgdir");
+  // A CPU whose scheduler() ran the process keeps its page table
+  // loaded until it picks another (see there): after a yield, the
+  // process may have moved on and exited or exec()ed.  Wait until
+  // it has.  That CPU may need any lock to get there, so the caller
+  // must hold none.
+  for(c = cpus; c < &cpus[ncpu]; c++)
+    if(c->pgdir == pgdir){
+      pushcli();
+      if(mycpu()->ncli > 1)
+        panic("freevm: holding locks");
+      popcli();
+      while(c->pgdir == pgdir)
+        ;
+    }
   deallocuvm(pgdir, KERNBASE, 0);
   for(i = 0; i < NPDENTRIES; i++){
-    if(pgdir[i] & PTE_P){
+    if((pgdir[i] & (PTE_P|PTE_PS)) == PTE_P){
       char * v = P2V(PTE_ADDR(pgdir[i]));
       kfree(v);
     }
@@ -323,54 +391,251 @@ copyuvm(pde_t *pgdir, uint sz)
   if((d = setupkvm()) == 0)
     return 0;
   for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walkpgdir(pgdir, (void *) i, 0)) == 0)
-      panic("copyuvm: pte should exist");
+    // Heap pages not touched yet are left for the child to fault in.
+    if((pte = walkpgdir(pgdir, (void *) i, 0)) == 0){
+      i = PGADDR(PDX(i) + 1, 0, 0) - PGSIZE;
+      continue;
+    }
     if(!(*pte & PTE_P))
-      panic("copyuvm: page not present");
+      continue;
+    // A writable private page has one reference unless uvmpin()
+    // pinned it; the parent's writes must keep reaching the pinned
+    // page, so the child gets a copy now.
+    if((*pte & (PTE_W|PTE_SHARED)) == PTE_W &&
+       kref_get(P2V(PTE_ADDR(*pte))) > 1){
+      if((mem = kalloc()) == 0)
+        goto bad;
+      memmove(mem, P2V(PTE_ADDR(*pte)), PGSIZE);
+      if(mappages(d, (void*)i, PGSIZE, V2P(mem), PTE_FLAGS(*pte)) < 0){
+        kfree(mem);
+        goto bad;
+      }
+      continue;
+    }
+    // Share the page; a write by either side gets a copy then.
+    if((*pte & (PTE_W|PTE_SHARED)) == PTE_W)
+      *pte = (*pte & ~PTE_W) | PTE_COW;
     pa = PTE_ADDR(*pte);
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
+    if(mappages(d, (void*)i, PGSIZE, pa, flags) < 0)
       goto bad;
-    memmove(mem, (char*)P2V(pa), PGSIZE);
-    if(mappages(d, (void*)i, PGSIZE, V2P(mem), flags) < 0) {
-      kfree(mem);
-      goto bad;
-    }
+    if((flags & PTE_SHARED) == 0)
+      kref_inc(P2V(pa));
   }
+  // pgdir lost write access to its pages.
+  lcr3(rcr3());
   return d;
 
 bad:
+  lcr3(rcr3());
   freevm(d);
   return 0;
 }
 
+// Give pgdir a private, writable copy of the copy-on-write page pte
+// maps, or just make it writable if nobody else maps it any more.
+static int
+cowcopy(pte_t *pte)
+{
+  uint pa;
+  char *mem;
+
+  pa = PTE_ADDR(*pte);
+  if(kref_get(P2V(pa)) > 1){
+    if((mem = kalloc()) == 0)
+      return -1;
+    memmove(mem, P2V(pa), PGSIZE);
+    *pte = V2P(mem) | PTE_FLAGS(*pte);
+    kfree(P2V(pa));
+  }
+  *pte = (*pte | PTE_W) & ~PTE_COW;
+  lcr3(rcr3());
+  return 0;
+}
+
+// Handle a fault on user address va of process p; write is set if
+// the access was a write.  Pages below p->sz may be missing because
+// sbrk() leaves them to be allocated here, zeroed, on first use.  A
+// write to a copy-on-write page gets a copy of it.  Pages of mmap()ed
+// files are read in (see mmap_fault).  Returns -1 if the access is
+// not allowed or memory ran out.
+int
+pagefault(struct proc *p, uint va, int write)
+{
+  pte_t *pte;
+  char *mem;
+
+  if(va >= MMAPBASE && va < UMAPBASE)
+    return mmap_fault(p, va, write);
+  if(va >= p->sz || va >= MMAPBASE)
+    return -1;
+  pte = walkpgdir(p->pgdir, (char*)va, 0);
+  if(pte && (*pte & PTE_P)){
+    if(write && (*pte & (PTE_U|PTE_COW)) == (PTE_U|PTE_COW))
+      return cowcopy(pte);
+    return -1;
+  }
+  if((mem = kalloc()) == 0)
+    return -1;
+  memset(mem, 0, PGSIZE);
+  if(mappages(p->pgdir, (char*)PGROUNDDOWN(va), PGSIZE, V2P(mem),
+              PTE_W|PTE_U) < 0){
+    kfree(mem);
+    return -1;
+  }
+  p->lazy--;
+  kreserve(-1);
+  return 0;
+}
+
+// Number of pages in [start, end) that pgdir does not map.
+int
+uvmlazy(pde_t *pgdir, uint start, uint end)
+{
+  pte_t *pte;
+  uint a, next;
+  int n;
+
+  n = 0;
+  end = PGROUNDUP(end);
+  for(a = PGROUNDUP(start); a < end; a += PGSIZE){
+    pte = walkpgdir(pgdir, (char*)a, 0);
+    if(pte == 0){
+      next = PGADDR(PDX(a) + 1, 0, 0);
+      if(next > end)
+        next = end;
+      n += (next - a) / PGSIZE;
+      a = next - PGSIZE;
+    } else if((*pte & PTE_P) == 0)
+      n++;
+  }
+  return n;
+}
+
+// Map the kernel memory [ka, ka+size) at user address va, for
+// kernel-owned data that user processes may read in place (see
+// klog_map), or also write if writable is set (see ioring_setup).
+// The pages are marked PTE_SHARED so deallocuvm() and freevm() never
+// free them.  ka and va must be page aligned.  Mapping an
+// already-mapped range again is a no-op.
+int
+mapkernel(pde_t *pgdir, uint va, void *ka, uint size, int writable)
+{
+  pte_t *pte;
+
+  if(va < UMAPBASE || va + size > KERNBASE || va + size < va)
+    return -1;
+  if((pte = walkpgdir(pgdir, (char*)va, 0)) != 0 && (*pte & PTE_P))
+    return 0;
+  return mappages(pgdir, (char*)va, size, V2P(ka),
+                  PTE_U|PTE_SHARED|(writable ? PTE_W : 0));
+}
+
+// Undo mapkernel(), before the kernel memory is freed.
+void
+unmapkernel(pde_t *pgdir, uint va, uint size)
+{
+  pte_t *pte;
+  uint a;
+
+  for(a = va; a < va + size; a += PGSIZE)
+    if((pte = walkpgdir(pgdir, (char*)a, 0)) != 0 && (*pte & PTE_SHARED))
+      *pte = 0;
+  if(myproc() && myproc()->pgdir == pgdir)
+    lcr3(V2P(pgdir));
+}
+
+// Fault in the pages of [va, va+len) of the current process as a
+// user access would, writable too if write is set, so that copyin()
+// and copyout() can reach them later from another process and the
+// kernel can write them without faulting.  Returns -1 if a user
+// access would fail.
+int
+uvmfault(uint va, uint len, int write)
+{
+  struct proc *p = myproc();
+  pte_t *pte;
+  uint a;
+
+  for(a = PGROUNDDOWN(va); a < va + len; a += PGSIZE){
+    pte = walkpgdir(p->pgdir, (char*)a, 0);
+    if((pte == 0 || (*pte & PTE_P) == 0 || (write && (*pte & PTE_COW))) &&
+       pagefault(p, a, write) < 0)
+      return -1;
+    pte = walkpgdir(p->pgdir, (char*)a, 0);
+    if(pte == 0 || (*pte & PTE_U) == 0 || (write && (*pte & PTE_W) == 0))
+      return -1;
+  }
+  return 0;
+}
+
+// Fault in [va, va+len) of the current process as uvmfault() does
+// and take a reference on each of its pages, at most max of them,
+// into pg[], so that they stay reachable whatever the process does
+// to its memory: a page sbrk() frees stays allocated, and fork()
+// gives the child a copy of a writable pinned page rather than
+// sharing it copy-on-write (see copyuvm).  Returns the number of
+// pages, to be kfree()d when done, or -1.
+int
+uvmpin(uint va, uint len, int write, char **pg, int max)
+{
+  struct proc *p = myproc();
+  pte_t *pte;
+  uint a;
+  int n;
+
+  if(uvmfault(va, len, write) < 0)
+    return -1;
+  n = 0;
+  for(a = PGROUNDDOWN(va); a < va + len; a += PGSIZE){
+    pte = walkpgdir(p->pgdir, (char*)a, 0);
+    if(n == max || pte == 0 || (*pte & PTE_P) == 0){
+      while(n > 0)
+        kfree(pg[--n]);
+      return -1;
+    }
+    pg[n] = P2V(PTE_ADDR(*pte));
+    kref_inc(pg[n++]);
+  }
+  return n;
+}
+
 //PAGEBREAK!
-// Map user virtual address to kernel address.
+// Map user virtual address to kernel address, if the user may
+// write there: a read-only page may be a shared program page.
 char*
 uva2ka(pde_t *pgdir, char *uva)
 {
   pte_t *pte;
 
   pte = walkpgdir(pgdir, uva, 0);
-  if((*pte & PTE_P) == 0)
+  if(pte == 0 || (*pte & PTE_P) == 0)
     return 0;
-  if((*pte & PTE_U) == 0)
+  if((*pte & (PTE_U|PTE_W)) != (PTE_U|PTE_W))
     return 0;
   return (char*)P2V(PTE_ADDR(*pte));
 }
 
 // Copy len bytes from p to user address va in page table pgdir.
 // Most useful when pgdir is not the current page table.
-// uva2ka ensures this only works for PTE_U pages.
+// uva2ka ensures this only works for writable PTE_U pages.
+// Writes through the kernel mapping take no page fault, so for the
+// current process pages not allocated yet and copy-on-write pages
+// are dealt with here first.
 int
 copyout(pde_t *pgdir, uint va, void *p, uint len)
 {
   char *buf, *pa0;
   uint n, va0;
+  pte_t *pte;
 
   buf = (char*)p;
   while(len > 0){
     va0 = (uint)PGROUNDDOWN(va);
+    pte = va0 < KERNBASE ? walkpgdir(pgdir, (char*)va0, 0) : 0;
+    if((pte == 0 || (*pte & PTE_P) == 0 || (*pte & PTE_COW)) &&
+       (pgdir != myproc()->pgdir || pagefault(myproc(), va0, 1) < 0))
+      return -1;
     pa0 = uva2ka(pgdir, (char*)va0);
     if(pa0 == 0)
       return -1;
@@ -385,6 +650,45 @@ copyout(pde_t *pgdir, uint va, void *p, uint len)
   return 0;
 }
 
+// Copy len bytes to p from user address va in page table pgdir,
+// as copyout() does the other way.  The pages must be present.
+int
+copyin(pde_t *pgdir, void *p, uint va, uint len)
+{
+  char *buf;
+  uint n, va0;
+  pte_t *pte;
+
+  buf = (char*)p;
+  while(len > 0){
+    va0 = (uint)PGROUNDDOWN(va);
+    pte = va0 < KERNBASE ? walkpgdir(pgdir, (char*)va0, 0) : 0;
+    if(pte == 0 || (*pte & (PTE_P|PTE_U)) != (PTE_P|PTE_U))
+      return -1;
+    n = PGSIZE - (va - va0);
+    if(n > len)
+      n = len;
+    memmove(buf, (char*)P2V(PTE_ADDR(*pte)) + (va - va0), n);
+    len -= n;
+    buf += n;
+    va = va0 + PGSIZE;
+  }
+  return 0;
+}
+
+// Copy len bytes from p to dst, which is either a user address of
+// the current process or, for reads done inside the kernel (see
+// filesplice), a kernel address.  Device read routines use it.
+int
+copyto(char *dst, void *p, uint len)
+{
+  if((uint)dst >= KERNBASE){
+    memmove(dst, p, len);
+    return 0;
+  }
+  return copyout(myproc()->pgdir, (uint)dst, p, len);
+}
+
 //PAGEBREAK!
 // Blank page.
 //PAGEBREAK!
@@ -24,6 +24,21 @@ outb(ushort port, uchar data)
   asm volatile("out %0,%1" : : "a" (data), "d" (port));
 }
 
+static inline uint
+inl(ushort port)
+{
+  uint data;
+
+  asm volatile("in %1,%0" : "=a" (data) : "d" (port));
+  return data;
+}
+
+static inline void
+outl(ushort port, uint data)
+{
+  asm volatile("out %0,%1" : : "a" (data), "d" (port));
+}
+
 static inline void
 outw(ushort port, ushort data)
 {
@@ -105,6 +120,15 @@ loadgs(ushort v)
   asm volatile("movw %0, %%gs" : : "r" (v));
 }
 
+static inline uint64
+rdtsc(void)
+{
+  uint lo, hi;
+
+  asm volatile("rdtsc" : "=a" (lo), "=d" (hi));
+  return ((uint64)hi << 32) | lo;
+}
+
 static inline void
 cli(void)
 {
@@ -117,6 +141,15 @@ sti(void)
   asm volatile("sti");
 }
 
+// Enable interrupts and halt until the next one.  sti takes effect
+// only after the following instruction, so an interrupt pending
+// now still ends the hlt.
+static inline void
+stihlt(void)
+{
+  asm volatile("sti; hlt");
+}
+
 static inline uint
 xchg(volatile uint *addr, uint newval)
 {
@@ -130,6 +163,57 @@ xchg(volatile uint *addr, uint newval)
   return result;
 }
 
+// Atomically add n to *addr; returns the old value.
+static inline ushort
+xaddw(volatile ushort *addr, ushort n)
+{
+  asm volatile("lock; xaddw %0, %1" :
+               "+r" (n), "+m" (*addr) :
+               :
+               "cc", "memory");
+  return n;
+}
+
+// Store new at addr if it holds old.  Returns what addr held.
+static inline uint
+cmpxchg(volatile uint *addr, uint old, uint new)
+{
+  uint prev;
+
+  asm volatile("lock; cmpxchgl %2, %1" :
+               "=a" (prev), "+m" (*addr) :
+               "r" (new), "0" (old) :
+               "cc", "memory");
+  return prev;
+}
+
+// Spin-wait hint.
+static inline void
+pause(void)
+{
+  asm volatile("pause" : : : "memory");
+}
+
+// Index of the most significant set bit; x must not be 0.
+static inline uint
+bsr(uint x)
+{
+  uint i;
+
+  asm volatile("bsrl %1,%0" : "=r" (i) : "rm" (x) : "cc");
+  return i;
+}
+
+// The feature flags CPUID leaf reports in EDX.
+static inline uint
+cpuidedx(uint leaf)
+{
+  uint a, b, c, d;
+
+  asm volatile("cpuid" : "=a" (a), "=b" (b), "=c" (c), "=d" (d) : "a" (leaf));
+  return d;
+}
+
 static inline uint
 rcr2(void)
 {
@@ -144,6 +228,14 @@ lcr3(uint val)
   asm volatile("movl %0,%%cr3" : : "r" (val));
 }
 
+static inline uint
+rcr3(void)
+{
+  uint val;
+  asm volatile("movl %%cr3,%0" : "=r" (val));
+  return val;
+}
+
 //PAGEBREAK: 36
 // Layout of the trap frame built on the stack by the
 // hardware and by trapasm.S, and passed to trap().